@@ -4,7 +4,11 @@
 // used in ceres-BA method
 
 #include <iostream>
+#include <type_traits>
 #include <ceres/ceres.h>
+#include "arena.h"
+#include "profiler.h"
+#include "projection.h"
 #include "rotation.h"
 
 class SnavelyReprojectionError {
@@ -16,6 +20,9 @@ public:
     bool operator() (const T *const camera,
                      const T *const point,
                      T *residuals) const {
+        // called with ceres::Jet when the Jacobians are wanted
+        Profiler::Count(kResidualEvaluations);
+        if (!std::is_same<T, double>::value) Profiler::Count(kJacobianEvaluations);
 
         T predictions[2];
         CamProjectionWithDistortion(camera, point, predictions);
@@ -84,16 +91,158 @@ public:
         return true;
     }
 
-    // use auto diff cost function
+    /**
+     * use auto diff cost function, or the hand-derived one (see below)
+     * With an arena the cost function is placed there and must not be owned
+     * by the ceres::Problem (Problem::Options::cost_function_ownership).
+     * precision other than double needs the analytic Jacobian.
+     * With use_quaternions the camera block is [q(4), t(3), f, k1, k2]
+     * (SnavelyQuaternionReprojectionError).
+     */
     static ceres::CostFunction *Create(const double observed_x,
-                                       const double observed_y) {
-        return (new ceres::AutoDiffCostFunction<SnavelyReprojectionError, 2, 9, 3>(
-                new SnavelyReprojectionError(observed_x, observed_y)));
+                                       const double observed_y,
+                                       const bool use_analytic_jacobian = false,
+                                       Arena *arena = NULL,
+                                       EvaluationPrecision precision = kDoublePrecision,
+                                       const bool use_quaternions = false);
+
+    // arena bytes of n cost functions of Create()
+    static size_t ArenaSizeFor(size_t n, bool use_analytic_jacobian, bool use_quaternions);
+
+private:
+    double observed_x;
+    double observed_y;
+};
+
+/**
+ * The same residual of a camera with a quaternion rotation
+ * camera: [q(4), t(3), f, k1, k2], q = [cos(theta/2), sin(theta/2) axis]
+ *
+ * The quaternion is normalized in QuaternionRotatePoint, so it is only
+ * defined up to scale and needs a manifold (QuaternionCameraManifold) to
+ * keep the update to the 3 degrees of freedom of the rotation.
+ */
+class SnavelyQuaternionReprojectionError {
+public:
+    SnavelyQuaternionReprojectionError(double observation_x, double observation_y) :
+        observed_x(observation_x), observed_y(observation_y) {}
+
+    template<typename T>
+    bool operator() (const T *const camera,
+                     const T *const point,
+                     T *residuals) const {
+        Profiler::Count(kResidualEvaluations);
+        if (!std::is_same<T, double>::value) Profiler::Count(kJacobianEvaluations);
+
+        // P = R(q) X + t, no trigonometric functions on the Jets
+        T p[3];
+        QuaternionRotatePoint(camera, point, p);
+        p[0] += camera[4];
+        p[1] += camera[5];
+        p[2] += camera[6];
+
+        T predictions[2];
+        DistortedProjectionJacobian(p, camera + 7, predictions, (T *) NULL, (T *) NULL);
+        residuals[0] = predictions[0] - T(observed_x);
+        residuals[1] = predictions[1] - T(observed_y);
+
+        return true;
+    }
+
+private:
+    double observed_x;
+    double observed_y;
+};
+
+/**
+ * Same residual as SnavelyReprojectionError (kCameraSize 9) or
+ * SnavelyQuaternionReprojectionError (10), with closed form Jacobians
+ * (CameraProjection) instead of evaluating the projection on
+ * ceres::Jet<double, 12>.
+ *
+ * With kMixedPrecision / kSinglePrecision the Jacobians / the Jacobians and
+ * residuals are computed in float, which is about as accurate as the
+ * linearization needs to be.
+ */
+template<int kCameraSize>
+class AnalyticReprojectionError : public ceres::SizedCostFunction<2, kCameraSize, 3> {
+public:
+    AnalyticReprojectionError(double observation_x, double observation_y,
+                              EvaluationPrecision evaluation_precision = kDoublePrecision) :
+        observed_x(observation_x), observed_y(observation_y), precision(evaluation_precision) {}
+
+    virtual bool Evaluate(double const *const *parameters,
+                          double *residuals,
+                          double **jacobians) const {
+        Profiler::Count(kResidualEvaluations);
+        if (jacobians != NULL) Profiler::Count(kJacobianEvaluations);
+        double *J_camera = jacobians != NULL ? jacobians[0] : NULL;
+        double *J_point = jacobians != NULL ? jacobians[1] : NULL;
+        double predictions[2];
+        if (precision == kSinglePrecision) {
+            CastCamProjectionWithDistortionJacobian<float, kCameraSize>(parameters[0], parameters[1], predictions,
+                                                                        J_camera, J_point);
+        } else if (precision == kMixedPrecision && (J_camera != NULL || J_point != NULL)) {
+            CastCamProjectionWithDistortionJacobian<float, kCameraSize>(parameters[0], parameters[1], predictions,
+                                                                        J_camera, J_point);
+            CameraProjection<kCameraSize>::Evaluate(parameters[0], parameters[1], predictions,
+                                                    (double *) NULL, (double *) NULL);
+        } else {
+            CameraProjection<kCameraSize>::Evaluate(parameters[0], parameters[1], predictions,
+                                                    J_camera, J_point);
+        }
+        residuals[0] = predictions[0] - observed_x;
+        residuals[1] = predictions[1] - observed_y;
+        return true;
     }
 
 private:
     double observed_x;
     double observed_y;
+    EvaluationPrecision precision;
 };
 
+typedef AnalyticReprojectionError<9> AnalyticSnavelyReprojectionError;
+typedef AnalyticReprojectionError<10> AnalyticQuaternionReprojectionError;
+typedef ceres::AutoDiffCostFunction<SnavelyQuaternionReprojectionError, 2, 10, 3> AutoDiffQuaternionCostFunction;
+
+inline ceres::CostFunction *SnavelyReprojectionError::Create(const double observed_x,
+                                                             const double observed_y,
+                                                             const bool use_analytic_jacobian,
+                                                             Arena *arena,
+                                                             EvaluationPrecision precision,
+                                                             const bool use_quaternions) {
+    typedef ceres::AutoDiffCostFunction<SnavelyReprojectionError, 2, 9, 3> AutoDiffCostFunction;
+    if (use_quaternions) {
+        if (use_analytic_jacobian) {
+            return arena != NULL ? arena->New<AnalyticQuaternionReprojectionError>(observed_x, observed_y, precision)
+                                 : new AnalyticQuaternionReprojectionError(observed_x, observed_y, precision);
+        }
+        SnavelyQuaternionReprojectionError *functor = new SnavelyQuaternionReprojectionError(observed_x, observed_y);
+        return arena != NULL ? arena->New<AutoDiffQuaternionCostFunction>(functor)
+                             : new AutoDiffQuaternionCostFunction(functor);
+    }
+    if (arena != NULL) {
+        if (use_analytic_jacobian) {
+            return arena->New<AnalyticSnavelyReprojectionError>(observed_x, observed_y, precision);
+        }
+        // the functor stays on the heap, AutoDiffCostFunction deletes it
+        return arena->New<AutoDiffCostFunction>(new SnavelyReprojectionError(observed_x, observed_y));
+    }
+    if (use_analytic_jacobian) {
+        return new AnalyticSnavelyReprojectionError(observed_x, observed_y, precision);
+    }
+    return (new ceres::AutoDiffCostFunction<SnavelyReprojectionError, 2, 9, 3>(
+            new SnavelyReprojectionError(observed_x, observed_y)));
+}
+
+inline size_t SnavelyReprojectionError::ArenaSizeFor(size_t n, bool use_analytic_jacobian, bool use_quaternions) {
+    if (use_quaternions) {
+        return use_analytic_jacobian ? Arena::SizeFor<AnalyticQuaternionReprojectionError>(n)
+                                     : Arena::SizeFor<AutoDiffQuaternionCostFunction>(n);
+    }
+    return use_analytic_jacobian ? Arena::SizeFor<AnalyticSnavelyReprojectionError>(n)
+                                 : Arena::SizeFor<ceres::AutoDiffCostFunction<SnavelyReprojectionError, 2, 9, 3> >(n);
+}
+
 #endif // SNAVELYREPROJECTIONERROR_H
\ No newline at end of file
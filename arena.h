@@ -0,0 +1,108 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// bump allocator for the many small, equally long living objects of a solve
+// (cost functions, vertices, edges, robust kernels)
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Memory is carved sequentially out of large blocks and only released all
+ * at once by the destructor, so an allocation is a pointer increment and
+ * objects allocated in a row are contiguous. Reserve() the total up front to
+ * get everything in one block.
+ *
+ * Not thread safe.
+ */
+class Arena {
+public:
+    explicit Arena(size_t block_size = 1 << 20)
+            : block_size_(block_size), current_(NULL), remaining_(0), bytes_allocated_(0) {}
+
+    ~Arena() {
+        for (size_t i = destructors_.size(); i > 0; --i) {
+            destructors_[i - 1].second(destructors_[i - 1].first);
+        }
+    }
+
+    // at least bytes more in the current block
+    void Reserve(size_t bytes) {
+        if (bytes > remaining_) {
+            NewBlock(bytes);
+        }
+    }
+
+    void *Allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        size_t padding = (alignment - reinterpret_cast<uintptr_t>(current_) % alignment) % alignment;
+        if (padding + size > remaining_) {
+            NewBlock(std::max(block_size_, size + alignment));
+            padding = (alignment - reinterpret_cast<uintptr_t>(current_) % alignment) % alignment;
+        }
+        char *ptr = current_ + padding;
+        current_ += padding + size;
+        remaining_ -= padding + size;
+        bytes_allocated_ += size;
+        return ptr;
+    }
+
+    // construct a T in the arena, destroyed together with the arena
+    template<typename T, typename... Args>
+    T *New(Args &&... args) {
+        T *object = new(Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            destructors_.push_back(std::make_pair(static_cast<void *>(object), &Destroy<T>));
+        }
+        return object;
+    }
+
+    // upper bound of the arena memory taken by n objects of type T allocated in a row, for Reserve()
+    template<typename T>
+    static size_t SizeFor(size_t n) {
+        return n * sizeof(T) + alignof(T);
+    }
+
+    size_t bytes_allocated() const {  return bytes_allocated_;  }
+
+private:
+    Arena(const Arena &);
+    Arena &operator=(const Arena &);
+
+    template<typename T>
+    static void Destroy(void *object) {
+        static_cast<T *>(object)->~T();
+    }
+
+    void NewBlock(size_t size) {
+        blocks_.push_back(std::unique_ptr<char[]>(new char[size]));
+        current_ = blocks_.back().get();
+        remaining_ = size;
+    }
+
+    size_t block_size_;
+    std::vector<std::unique_ptr<char[]> > blocks_;
+    char *current_;
+    size_t remaining_;
+    size_t bytes_allocated_;
+    std::vector<std::pair<void *, void (*)(void *)> > destructors_;
+};
+
+/**
+ * Class specific new / delete for objects which are deleted by their owner
+ * (g2o deletes vertices, edges and robust kernels): new(arena) T(...) takes
+ * the memory from the arena and delete only runs the destructor. The arena
+ * has to outlive the owner. Replaces EIGEN_MAKE_ALIGNED_OPERATOR_NEW, the
+ * alignment of the type is kept.
+ */
+#define ARENA_OPERATOR_NEW(Type) \
+    static void *operator new(size_t size, Arena *arena) {  return arena->Allocate(size, alignof(Type));  } \
+    static void operator delete(void *, Arena *) {} \
+    static void operator delete(void *) {}
+
+#endif // ARENA_H
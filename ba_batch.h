@@ -0,0 +1,236 @@
+#ifndef BA_BATCH_H
+#define BA_BATCH_H
+
+// --manifest: many BAL problems solved as one batch on a work stealing pool
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ba_graph.h"
+#include "ba_native.h"
+#include "ba_options.h"
+#include "ba_stats.h"
+#include "common.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "projection_kernel.h"
+
+struct BatchJob {
+    BAOptions ba_options; // --input is the problem
+    long file_size = 0; // bytes of the input, larger problems are started first
+};
+
+struct BatchResult {
+    bool ok = false;
+    int num_cameras = 0;
+    int num_points = 0;
+    int num_observations = 0;
+    double initial_rms = 0.0;
+    double final_rms = 0.0;
+    double load_time = 0.0; // load, normalize, perturb
+    double solve_time = 0.0;
+    double write_time = 0.0;
+};
+
+/**
+ * Read the jobs of a manifest, one problem per line: the input file followed
+ * by --flag=value options for it alone, # starts a comment. Every line starts
+ * from defaults.
+ */
+inline bool ReadManifest(const std::string &filename, const BAOptions &defaults, std::vector<BatchJob> *jobs) {
+    std::ifstream in(filename.c_str());
+    if (!in) {
+        std::cerr << "Error: unable to open manifest " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line)) {
+        ++line_number;
+        line = line.substr(0, line.find('#'));
+        std::stringstream words(line);
+        std::vector<std::string> args;
+        std::string word;
+        while (words >> word) {
+            args.push_back(word);
+        }
+        if (args.empty()) continue;
+
+        BatchJob job;
+        job.ba_options = defaults;
+        // args[0] takes the place of the program name
+        std::vector<char *> argv;
+        for (size_t i = 0; i < args.size(); ++i) {
+            argv.push_back(&args[i][0]);
+        }
+        if (!ParseBAOptions(static_cast<int>(argv.size()), argv.data(), &job.ba_options)) {
+            std::cerr << "Error: in line " << line_number << " of " << filename << std::endl;
+            return false;
+        }
+        if (job.ba_options.quaternions && job.ba_options.covariance) {
+            std::cerr << "Error: --covariance only has angle-axis cameras, not --quaternions, in line "
+                      << line_number << " of " << filename << std::endl;
+            return false;
+        }
+        job.ba_options.input = args[0];
+        std::ifstream file(args[0].c_str(), std::ios::binary | std::ios::ate);
+        job.file_size = file ? static_cast<long>(file.tellg()) : 0;
+        jobs->push_back(job);
+    }
+    return true;
+}
+
+/**
+ * Solve every problem of --manifest with solve, --num_threads problems at a
+ * time. Each problem is a chain of three tasks on a WorkStealingPool: load
+ * (with Normalize and Perturb), solve, write (--output, --final_ply). A task
+ * submits the next one of its chain to its own worker, which runs it next, so
+ * the problem stays on that thread while idle workers steal the loads waiting
+ * behind it, and the loading and writing of some problems overlap the solves
+ * of others. Up to two problems per thread are in flight, the largest input
+ * files first.
+ *
+ * The manifest lines start from ba_options with one solver thread, quiet and
+ * without output files; a line can give a problem more threads or its own
+ * --output and --final_ply (and with it --covariance). Returns the exit status, 1 if any problem failed.
+ */
+inline int RunBatch(const BAOptions &ba_options, const SolveFunction &solve) {
+    BAOptions defaults = ba_options;
+    defaults.num_threads = 1; // the problems run concurrently instead
+    defaults.verbose = false; // the progress of concurrent solves would interleave
+    defaults.initial_ply.clear();
+    defaults.final_ply.clear();
+    defaults.snapshot_ply.clear();
+    defaults.output.clear();
+    defaults.manifest.clear();
+    std::vector<BatchJob> jobs;
+    if (!ReadManifest(ba_options.manifest, defaults, &jobs)) {
+        return 1;
+    }
+    if (jobs.empty()) {
+        std::cerr << "Error: no problems in manifest " << ba_options.manifest << std::endl;
+        return 1;
+    }
+    std::vector<int> order(jobs.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = static_cast<int>(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return jobs[a].file_size > jobs[b].file_size;
+    });
+
+    const int num_jobs = static_cast<int>(jobs.size());
+    const bool profiling = Profiler::Get().enabled();
+    std::vector<BatchResult> results(num_jobs);
+    std::vector<std::unique_ptr<BALProblem> > problems(num_jobs);
+    std::atomic<int> next_job(0);
+    std::mutex output_mutex;
+    const double start = WallTimeInSeconds();
+    WorkStealingPool pool(std::min(num_jobs, ba_options.num_threads));
+
+    std::function<void()> start_next = [&]() {
+        const int k = next_job++;
+        if (k >= num_jobs) return;
+        const int j = order[k];
+        pool.Submit([&, j]() {
+            const BAOptions &options = jobs[j].ba_options;
+            BatchResult &result = results[j];
+            const double load_start = WallTimeInSeconds();
+            problems[j].reset(new BALProblem(options.input, options.quaternions));
+            BALProblem &bal_problem = *problems[j];
+            result.num_cameras = bal_problem.num_cameras();
+            result.num_points = bal_problem.num_points();
+            result.num_observations = bal_problem.num_observations();
+            if (bal_problem.num_observations() == 0) {
+                problems[j].reset();
+                {
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cout << "[" << j + 1 << "/" << num_jobs << "] " << options.input << ": failed to load"
+                              << std::endl;
+                }
+                start_next();
+                return;
+            }
+            bal_problem.Normalize(options.num_threads);
+            bal_problem.Perturb(options.rotation_sigma, options.translation_sigma, options.point_sigma, 1,
+                                options.num_threads);
+            result.initial_rms = RMSReprojectionError(bal_problem);
+            if (options.reorder) {
+                bal_problem.Reorder();
+            }
+            result.load_time = WallTimeInSeconds() - load_start;
+
+            pool.Submit([&, j]() {
+                const BAOptions &options = jobs[j].ba_options;
+                BatchResult &result = results[j];
+                BALProblem &bal_problem = *problems[j];
+                const double solve_start = WallTimeInSeconds();
+                SolveStats stats;
+                if (options.components) {
+                    SolveBAComponents(bal_problem, options, solve, profiling ? &stats : NULL);
+                } else {
+                    solve(bal_problem, options, profiling ? &stats : NULL);
+                }
+                Profiler::Get().AddSolveStats(stats);
+                bal_problem.RestoreOriginalOrder();
+                result.final_rms = RMSReprojectionError(bal_problem);
+                result.ok = !options.covariance || SaveCovariance(bal_problem, options);
+                result.solve_time = WallTimeInSeconds() - solve_start;
+
+                pool.Submit([&, j]() {
+                    const BAOptions &options = jobs[j].ba_options;
+                    BatchResult &result = results[j];
+                    const double write_start = WallTimeInSeconds();
+                    const BALProblem &bal_problem = *problems[j];
+                    if (!options.final_ply.empty()) {
+                        bal_problem.WriteToPLYFile(options.final_ply, options.binary_ply);
+                    }
+                    if (HasSuffix(options.output, ".balb")) {
+                        bal_problem.WriteToBinaryFile(options.output);
+                    } else if (!options.output.empty()) {
+                        bal_problem.WriteToFile(options.output, options.num_threads);
+                    }
+                    problems[j].reset();
+                    result.write_time = WallTimeInSeconds() - write_start;
+                    {
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        char times[128];
+                        snprintf(times, sizeof(times), "load %.3f s, solve %.3f s, write %.3f s",
+                                 result.load_time, result.solve_time, result.write_time);
+                        std::cout << "[" << j + 1 << "/" << num_jobs << "] " << options.input << ": "
+                                  << result.num_cameras << " cameras, " << result.num_points << " points, RMS "
+                                  << result.initial_rms << " -> " << result.final_rms << ", " << times << std::endl;
+                    }
+                    start_next();
+                });
+            });
+        });
+    };
+    for (int i = 0; i < 2 * pool.num_threads(); ++i) {
+        start_next();
+    }
+    pool.Wait();
+
+    int failed = 0;
+    double work_time = 0.0;
+    for (int j = 0; j < num_jobs; ++j) {
+        failed += results[j].ok ? 0 : 1;
+        work_time += results[j].load_time + results[j].solve_time + results[j].write_time;
+    }
+    const double wall_time = WallTimeInSeconds() - start;
+    char summary[160];
+    snprintf(summary, sizeof(summary), "%.3f s on %d threads, %.3f s of load, solve and write", wall_time,
+             pool.num_threads(), work_time);
+    std::cout << num_jobs - failed << " of " << num_jobs << " problems solved in " << summary << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+#endif // BA_BATCH_H
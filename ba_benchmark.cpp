@@ -0,0 +1,548 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ba_ceres.h"
+#ifdef BA_WITH_CUDA
+#include "ba_cuda.h"
+#endif
+#include "ba_g2o.h"
+#include "ba_native.h"
+#include "ba_options.h"
+#include "ba_stats.h"
+#include "common.h"
+#include "projection_kernel.h"
+
+/**
+ * Runs the SolveBA implementations (ceres, g2o, native, cuda) on a list of BAL problems with the same
+ * options and the same perturbation, and writes one record per run to CSV
+ * and/or JSON
+ *
+ * ba_benchmark [--flag=value ...] problem-49-7776-pre.txt.bz2 ...
+ *
+ * --configs runs every problem and backend once per line of a file of
+ * solver flags, e.g. SPARSE_SCHUR against ITERATIVE_SCHUR with different
+ * preconditioners (benchmark_configs.txt).
+ *
+ * Every run is forked off by default, so the peak RSS belongs to that run
+ * alone and a crash or abort only loses one record.
+ */
+
+struct BenchmarkOptions {
+    std::vector<std::string> problems;
+    std::vector<std::string> backends = {"ceres", "g2o", "native"};
+    std::string configs; // file of named solver flag sets, empty: the command line flags only
+    std::string csv = "../results/benchmark.csv"; // empty: not written
+    std::string json;
+    // time to cost is measured against (1 + cost_tolerance) * best final cost of the problem
+    double cost_tolerance = 0.01;
+    bool isolate = true;
+    unsigned seed = 1; // of Perturb, the seed the drivers use
+};
+
+// solver flags of one --configs line
+struct BenchmarkConfig {
+    std::string name;
+    BAOptions ba_options;
+};
+
+struct BenchmarkResult {
+    std::string problem;
+    std::string backend;
+    std::string config = "default";
+    std::string status = "failed"; // ok, failed, unsupported
+    int num_cameras = 0;
+    int num_points = 0;
+    int num_observations = 0;
+    double load_time = 0;
+    double initial_rms = 0;
+    double final_rms = 0;
+    double peak_rss_mb = 0;
+    double cost_threshold = 0;
+    double time_to_threshold = -1;
+    SolveStats stats;
+};
+
+void PrintBenchmarkUsage(const char *program, const BenchmarkOptions &defaults) {
+    std::cout << "Usage: " << program << " [--flag=value ...] problem ...\n"
+              << "  --problems=<file>  more problems, one path per line, # comments\n"
+              << "  --backends=ceres,g2o,native  and cuda when built with a CUDA compiler\n"
+              << "  --configs=<file>  one run per line \"name --flag=value ...\", on top of the flags below\n"
+              << "  --csv=" << defaults.csv << "  one row per run, empty: not written\n"
+              << "  --json=" << defaults.json << "  runs including every iteration, empty: not written\n"
+              << "  --cost_tolerance=" << defaults.cost_tolerance
+              << "  time to cost threshold is (1 + tolerance) * best final cost\n"
+              << "  --isolate=" << (defaults.isolate ? "true" : "false")
+              << "  fork a process per run, else the peak RSS only grows\n"
+              << "  --seed=" << defaults.seed << "  of the perturbation\n"
+              << "solver flags, applied to every run:\n";
+}
+
+bool ReadProblemList(const std::string &filename, std::vector<std::string> *problems) {
+    std::ifstream in(filename.c_str());
+    if (!in) {
+        std::cerr << "Error: unable to open problem list " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        const size_t begin = line.find_first_not_of(" \t\r");
+        if (begin == std::string::npos || line[begin] == '#') continue;
+        const size_t end = line.find_last_not_of(" \t\r");
+        problems->push_back(line.substr(begin, end - begin + 1));
+    }
+    return true;
+}
+
+/**
+ * Every line of filename is a config name followed by solver flags, which
+ * are applied on top of defaults. # starts a comment.
+ */
+bool ReadConfigs(const std::string &filename, const BAOptions &defaults, std::vector<BenchmarkConfig> *configs) {
+    std::ifstream in(filename.c_str());
+    if (!in) {
+        std::cerr << "Error: unable to open config list " << filename << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        std::stringstream words(line);
+        std::vector<std::string> args;
+        std::string word;
+        while (words >> word) {
+            args.push_back(word);
+        }
+        if (args.empty()) continue;
+
+        BenchmarkConfig config;
+        config.name = args[0];
+        config.ba_options = defaults;
+        // args[0] takes the place of the program name
+        std::vector<char *> argv;
+        for (size_t i = 0; i < args.size(); ++i) {
+            argv.push_back(&args[i][0]);
+        }
+        if (!ParseBAOptions(static_cast<int>(argv.size()), argv.data(), &config.ba_options)) {
+            std::cerr << "Error: in config " << config.name << " of " << filename << std::endl;
+            return false;
+        }
+        configs->push_back(config);
+    }
+    return true;
+}
+
+// the arguments ParseBAOptions left over
+bool ParseBenchmarkOptions(const std::vector<std::string> &args, BenchmarkOptions *options) {
+    for (size_t i = 0; i < args.size(); ++i) {
+        const std::string &arg = args[i];
+        const size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            options->problems.push_back(arg);
+            continue;
+        }
+        const std::string name = arg.substr(2, eq - 2);
+        const std::string value = arg.substr(eq + 1);
+
+        char *end = NULL;
+        bool ok = true;
+        if (name == "problems") {
+            if (!ReadProblemList(value, &options->problems)) return false;
+        } else if (name == "backends") {
+            options->backends.clear();
+            std::stringstream list(value);
+            std::string backend;
+            while (std::getline(list, backend, ',')) {
+                ok = ok && (backend == "ceres" || backend == "g2o" || backend == "native" || backend == "cuda");
+#ifndef BA_WITH_CUDA
+                ok = ok && backend != "cuda";
+#endif
+                options->backends.push_back(backend);
+            }
+            ok = ok && !options->backends.empty();
+        } else if (name == "configs") {
+            options->configs = value;
+        } else if (name == "csv") {
+            options->csv = value;
+        } else if (name == "json") {
+            options->json = value;
+        } else if (name == "cost_tolerance") {
+            options->cost_tolerance = strtod(value.c_str(), &end);
+            ok = !value.empty() && *end == '\0' && options->cost_tolerance >= 0;
+        } else if (name == "isolate") {
+            ok = (value == "true" || value == "false" || value == "1" || value == "0");
+            options->isolate = (value == "true" || value == "1");
+        } else if (name == "seed") {
+            options->seed = static_cast<unsigned>(strtoul(value.c_str(), &end, 10));
+            ok = !value.empty() && *end == '\0';
+        } else {
+            std::cerr << "Error: unknown flag --" << name << std::endl;
+            return false;
+        }
+
+        if (!ok) {
+            std::cerr << "Error: invalid value for --" << name << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// load, perturb and solve as the drivers do, timing every stage; false if the load or the solve failed
+bool RunBenchmark(const BAOptions &ba_options, unsigned seed, BenchmarkResult *result) {
+    const double load_start = WallTimeInSeconds();
+    BALProblem bal_problem(result->problem, ba_options.quaternions);
+    result->load_time = WallTimeInSeconds() - load_start;
+    if (bal_problem.num_observations() == 0) {
+        return false;
+    }
+    result->num_cameras = bal_problem.num_cameras();
+    result->num_points = bal_problem.num_points();
+    result->num_observations = bal_problem.num_observations();
+
+    bal_problem.Normalize(ba_options.num_threads);
+    // the same initial state for every backend
+    bal_problem.Perturb(ba_options.rotation_sigma, ba_options.translation_sigma, ba_options.point_sigma, seed,
+                        ba_options.num_threads);
+    result->initial_rms = RMSReprojectionError(bal_problem);
+    if (ba_options.reorder) {
+        bal_problem.Reorder();
+    }
+    bool solved;
+    if (result->backend == "ceres") {
+        solved = SolveBACeres(bal_problem, ba_options, &result->stats);
+    } else if (result->backend == "g2o") {
+        solved = SolveBAG2O(bal_problem, ba_options, &result->stats);
+#ifdef BA_WITH_CUDA
+    } else if (result->backend == "cuda") {
+        solved = SolveBACuda(bal_problem, ba_options, &result->stats);
+#endif
+    } else {
+        solved = SolveBANative(bal_problem, ba_options, &result->stats);
+    }
+    bal_problem.RestoreOriginalOrder();
+    result->final_rms = RMSReprojectionError(bal_problem);
+
+    // kilobytes on Linux
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    result->peak_rss_mb = usage.ru_maxrss / 1024.0;
+    result->status = solved ? "ok" : "failed";
+    return solved;
+}
+
+// measurements of a run, the child to parent message of RunIsolated()
+void SerializeResult(const BenchmarkResult &result, std::ostream &out) {
+    const SolveStats &stats = result.stats;
+    out << std::setprecision(17)
+        << result.num_cameras << " " << result.num_points << " " << result.num_observations << " "
+        << result.load_time << " " << result.initial_rms << " " << result.final_rms << " "
+        << result.peak_rss_mb << "\n"
+        << stats.setup_time << " " << stats.solve_time << " " << stats.linear_solver_time << " "
+        << stats.initial_cost << " " << stats.final_cost << " " << stats.iterations.size() << "\n";
+    for (size_t i = 0; i < stats.iterations.size(); ++i) {
+        const IterationStats &it = stats.iterations[i];
+        out << it.iteration << " " << it.cost << " " << it.time << " " << it.cumulative_time << "\n";
+    }
+}
+
+bool DeserializeResult(std::istream &in, BenchmarkResult *result) {
+    SolveStats &stats = result->stats;
+    size_t num_iterations = 0;
+    in >> result->num_cameras >> result->num_points >> result->num_observations
+       >> result->load_time >> result->initial_rms >> result->final_rms >> result->peak_rss_mb
+       >> stats.setup_time >> stats.solve_time >> stats.linear_solver_time
+       >> stats.initial_cost >> stats.final_cost >> num_iterations;
+    if (!in) return false;
+    stats.iterations.resize(num_iterations);
+    for (size_t i = 0; i < num_iterations; ++i) {
+        IterationStats &it = stats.iterations[i];
+        in >> it.iteration >> it.cost >> it.time >> it.cumulative_time;
+    }
+    return static_cast<bool>(in);
+}
+
+// RunBenchmark() in a child process, so that ru_maxrss is the peak of this run only
+bool RunIsolated(const BAOptions &ba_options, unsigned seed, BenchmarkResult *result) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return false;
+    }
+    std::cout.flush();
+    std::cerr.flush();
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        int status = 1;
+        if (RunBenchmark(ba_options, seed, result)) {
+            std::ostringstream out;
+            SerializeResult(*result, out);
+            const std::string message = out.str();
+            size_t written = 0;
+            while (written < message.size()) {
+                const ssize_t n = write(fds[1], message.data() + written, message.size() - written);
+                if (n <= 0) break;
+                written += n;
+            }
+            status = (written == message.size()) ? 0 : 1;
+        }
+        std::cout.flush();
+        close(fds[1]);
+        _exit(status);
+    }
+
+    close(fds[1]);
+    std::string message;
+    char buffer[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0) {
+        message.append(buffer, n);
+    }
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cerr << "Error: " << result->backend << " run on " << result->problem << " failed";
+        if (WIFSIGNALED(status)) std::cerr << " (signal " << WTERMSIG(status) << ")";
+        std::cerr << std::endl;
+        return false;
+    }
+    std::istringstream in(message);
+    if (!DeserializeResult(in, result)) {
+        return false;
+    }
+    result->status = "ok";
+    return true;
+}
+
+// time to reach (1 + tolerance) * the lowest final cost any backend found for the problem
+void ComputeTimeToThreshold(double cost_tolerance, std::vector<BenchmarkResult> *results) {
+    for (size_t i = 0; i < results->size(); ++i) {
+        BenchmarkResult &result = (*results)[i];
+        if (result.status != "ok") continue;
+        double best = std::numeric_limits<double>::infinity();
+        for (size_t j = 0; j < results->size(); ++j) {
+            const BenchmarkResult &other = (*results)[j];
+            if (other.status == "ok" && other.problem == result.problem) {
+                best = std::min(best, other.stats.final_cost);
+            }
+        }
+        result.cost_threshold = (1.0 + cost_tolerance) * best;
+        result.time_to_threshold = result.stats.TimeToCost(result.cost_threshold);
+    }
+}
+
+double MeanIterationTime(const SolveStats &stats) {
+    if (stats.iterations.size() < 2) return 0.0;
+    double sum = 0;
+    for (size_t i = 1; i < stats.iterations.size(); ++i) {
+        sum += stats.iterations[i].time;
+    }
+    return sum / (stats.iterations.size() - 1);
+}
+
+std::string JsonString(const std::string &value) {
+    std::string quoted = "\"";
+    for (size_t i = 0; i < value.size(); ++i) {
+        const char c = value[i];
+        if (c == '"' || c == '\\') quoted += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            quoted += escaped;
+        } else {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+bool WriteCSV(const std::string &filename, const std::vector<BenchmarkResult> &results) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return false;
+    }
+    out << "problem,backend,config,status,num_cameras,num_points,num_observations,"
+           "load_time,setup_time,solve_time,iterations,mean_iteration_time,linear_solver_time,"
+           "cost_threshold,time_to_threshold,peak_rss_mb,initial_cost,final_cost,initial_rms,final_rms\n";
+    out << std::setprecision(10);
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult &r = results[i];
+        const SolveStats &s = r.stats;
+        const int iterations = s.iterations.empty() ? 0 : static_cast<int>(s.iterations.size()) - 1;
+        out << r.problem << "," << r.backend << "," << r.config << "," << r.status << ","
+            << r.num_cameras << "," << r.num_points << "," << r.num_observations << ","
+            << r.load_time << "," << s.setup_time << "," << s.solve_time << ","
+            << iterations << "," << MeanIterationTime(s) << "," << s.linear_solver_time << ","
+            << r.cost_threshold << "," << r.time_to_threshold << "," << r.peak_rss_mb << ","
+            << s.initial_cost << "," << s.final_cost << "," << r.initial_rms << "," << r.final_rms << "\n";
+    }
+    return true;
+}
+
+bool WriteJSON(const std::string &filename, const BAOptions &ba_options,
+               const std::vector<BenchmarkResult> &results) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return false;
+    }
+    out << std::setprecision(10);
+    out << "{\n  \"options\": {"
+        << "\"linear_solver\": " << JsonString(ba_options.linear_solver)
+        << ", \"preconditioner\": " << JsonString(ba_options.preconditioner)
+        << ", \"robust_kernel\": " << JsonString(ba_options.robust_kernel)
+        << ", \"jacobian\": " << JsonString(ba_options.jacobian)
+        << ", \"num_threads\": " << ba_options.num_threads
+        << ", \"max_iterations\": " << ba_options.max_iterations << "},\n"
+        << "  \"runs\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult &r = results[i];
+        const SolveStats &s = r.stats;
+        out << (i == 0 ? "\n" : ",\n")
+            << "    {\"problem\": " << JsonString(r.problem)
+            << ", \"backend\": " << JsonString(r.backend)
+            << ", \"config\": " << JsonString(r.config)
+            << ", \"status\": " << JsonString(r.status)
+            << ", \"num_cameras\": " << r.num_cameras
+            << ", \"num_points\": " << r.num_points
+            << ", \"num_observations\": " << r.num_observations
+            << ",\n     \"load_time\": " << r.load_time
+            << ", \"setup_time\": " << s.setup_time
+            << ", \"solve_time\": " << s.solve_time
+            << ", \"linear_solver_time\": " << s.linear_solver_time
+            << ", \"cost_threshold\": " << r.cost_threshold
+            << ", \"time_to_threshold\": " << r.time_to_threshold
+            << ", \"peak_rss_mb\": " << r.peak_rss_mb
+            << ",\n     \"initial_cost\": " << s.initial_cost
+            << ", \"final_cost\": " << s.final_cost
+            << ", \"initial_rms\": " << r.initial_rms
+            << ", \"final_rms\": " << r.final_rms
+            << ",\n     \"iterations\": [";
+        for (size_t k = 0; k < s.iterations.size(); ++k) {
+            const IterationStats &it = s.iterations[k];
+            out << (k == 0 ? "" : ", ")
+                << "{\"iteration\": " << it.iteration << ", \"cost\": " << it.cost
+                << ", \"time\": " << it.time << ", \"cumulative_time\": " << it.cumulative_time << "}";
+        }
+        out << "]}";
+    }
+    out << "\n  ]\n}\n";
+    return true;
+}
+
+int main(int argc, char **argv) {
+    BAOptions ba_options;
+    ba_options.verbose = false;
+    BenchmarkOptions options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "--help" || arg == "-h") {
+            PrintBenchmarkUsage(argv[0], options);
+            PrintBAUsage(argv[0], ba_options);
+            return 0;
+        }
+    }
+
+    std::vector<std::string> args;
+    if (!ParseBAOptions(argc, argv, &ba_options, &args) ||
+        !ParseBenchmarkOptions(args, &options)) {
+        return 1;
+    }
+    if (options.problems.empty()) {
+        options.problems.push_back(ba_options.input);
+    }
+    std::vector<BenchmarkConfig> configs;
+    if (options.configs.empty()) {
+        BenchmarkConfig config;
+        config.name = "default";
+        config.ba_options = ba_options;
+        configs.push_back(config);
+    } else if (!ReadConfigs(options.configs, ba_options, &configs)) {
+        return 1;
+    }
+
+    std::vector<BenchmarkResult> results;
+    for (size_t p = 0; p < options.problems.size(); ++p) {
+        for (size_t c = 0; c < configs.size(); ++c) {
+            const BAOptions &config_options = configs[c].ba_options;
+            for (size_t b = 0; b < options.backends.size(); ++b) {
+                BenchmarkResult result;
+                result.problem = options.problems[p];
+                result.backend = options.backends[b];
+                result.config = configs[c].name;
+                // autodiff only exists for ceres, numeric only for g2o, cuda is double precision only and
+                // without outlier rounds, quaternion cameras only in ceres and g2o,
+                // the mixed precision SPARSE_SCHUR of ceres only with EIGEN_SPARSE
+                if ((result.backend == "ceres" && config_options.jacobian == "numeric") ||
+                    (result.backend == "ceres" && config_options.precision != "double" &&
+                     config_options.sparse_library != "AUTO" && config_options.sparse_library != "EIGEN_SPARSE" &&
+                     (config_options.linear_solver == "AUTO" || config_options.linear_solver == "SPARSE_SCHUR")) ||
+                    (config_options.quaternions && result.backend != "ceres" && result.backend != "g2o") ||
+                    (result.backend == "g2o" && config_options.jacobian == "autodiff") ||
+                    (result.backend == "native" && config_options.jacobian != "analytic") ||
+                    (result.backend == "cuda" && (config_options.jacobian != "analytic" ||
+                                                  config_options.precision != "double" ||
+                                                  config_options.outlier_rounds > 0))) {
+                    result.status = "unsupported";
+                    results.push_back(result);
+                    continue;
+                }
+
+                std::cout << result.problem << " " << result.backend << " " << result.config << " ..." << std::endl;
+                const bool ok = options.isolate ? RunIsolated(config_options, options.seed, &result)
+                                                : RunBenchmark(config_options, options.seed, &result);
+                if (!ok) {
+                    result.status = "failed"; // left out of ComputeTimeToThreshold()
+                }
+                results.push_back(result);
+            }
+        }
+    }
+    ComputeTimeToThreshold(options.cost_tolerance, &results);
+
+    std::cout << std::left << std::setw(40) << "problem" << " " << std::setw(7) << "backend"
+              << " " << std::setw(22) << "config"
+              << std::right << std::setw(10) << "load(s)" << std::setw(10) << "setup(s)"
+              << std::setw(10) << "solve(s)" << std::setw(7) << "iters" << std::setw(12) << "to_cost(s)"
+              << std::setw(10) << "rss(MB)" << std::setw(12) << "final_rms" << std::endl;
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchmarkResult &r = results[i];
+        std::cout << std::left << std::setw(40) << r.problem << " " << std::setw(7) << r.backend
+                  << " " << std::setw(22) << r.config << std::right;
+        if (r.status != "ok") {
+            std::cout << "   " << r.status << std::endl;
+            continue;
+        }
+        std::cout << std::fixed << std::setprecision(3)
+                  << std::setw(10) << r.load_time << std::setw(10) << r.stats.setup_time
+                  << std::setw(10) << r.stats.solve_time
+                  << std::setw(7) << static_cast<int>(r.stats.iterations.size()) - 1
+                  << std::setw(12) << r.time_to_threshold << std::setw(10) << r.peak_rss_mb
+                  << std::setw(12) << std::setprecision(6) << r.final_rms << std::endl;
+        std::cout.unsetf(std::ios::floatfield);
+    }
+
+    bool ok = true;
+    if (!options.csv.empty()) ok = WriteCSV(options.csv, results) && ok;
+    if (!options.json.empty()) ok = WriteJSON(options.json, ba_options, results) && ok;
+    return ok ? 0 : 1;
+}
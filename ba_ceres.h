@@ -0,0 +1,447 @@
+#ifndef BA_CERES_H
+#define BA_CERES_H
+
+// bundle adjustment of a BALProblem with ceres, shared by bundle_adjustment_ceres and ba_benchmark
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <ceres/ceres.h>
+#include "arena.h"
+#include "ba_options.h"
+#include "ba_outliers.h"
+#include "ba_planner.h"
+#include "ba_stats.h"
+#include "common.h"
+#include "profiler.h"
+#include "SnavelyReprojectionError.h"
+
+// robust kernel selected by --robust_kernel, NULL for plain least squares
+inline ceres::LossFunction *CreateLossFunction(const BAOptions &ba_options) {
+    if (ba_options.robust_kernel == "huber") {
+        return new ceres::HuberLoss(ba_options.robust_delta);
+    } else if (ba_options.robust_kernel == "cauchy") {
+        return new ceres::CauchyLoss(ba_options.robust_delta);
+    }
+    return NULL;
+}
+
+/**
+ * What this ceres build can run, for PlanBAOptions(): the sparse libraries
+ * compiled in, SuiteSparse first, and nested dissection with ceres >= 2.2.
+ */
+inline SolverCapabilities CeresCapabilities() {
+    SolverCapabilities capabilities;
+    capabilities.backend = "ceres";
+    const char *libraries[] = {"SUITE_SPARSE", "ACCELERATE_SPARSE", "EIGEN_SPARSE", "CX_SPARSE"};
+    for (const char *name : libraries) {
+        ceres::SparseLinearAlgebraLibraryType type;
+        if (ceres::StringToSparseLinearAlgebraLibraryType(name, &type) &&
+            ceres::IsSparseLinearAlgebraLibraryTypeAvailable(type)) {
+            capabilities.sparse_libraries.push_back(name);
+        }
+    }
+#if CERES_VERSION_MAJOR > 2 || (CERES_VERSION_MAJOR == 2 && CERES_VERSION_MINOR >= 2)
+    capabilities.nested_dissection = !capabilities.sparse_libraries.empty() &&
+                                     capabilities.sparse_libraries.front() == "SUITE_SPARSE";
+#endif
+    return capabilities;
+}
+
+// solver settings of ba_options, except the ordering
+inline void SetSolverOptions(const BAOptions &ba_options, ceres::Solver::Options *options) {
+    // how to solve H * dx = g, AUTO unless planned (BASession, the ADMM partitions) is the former default
+    ceres::StringToLinearSolverType(ba_options.linear_solver == "AUTO" ? "SPARSE_SCHUR" : ba_options.linear_solver,
+                                    &options->linear_solver_type);
+    if (ba_options.sparse_library != "AUTO") {
+        ceres::StringToSparseLinearAlgebraLibraryType(ba_options.sparse_library,
+                                                      &options->sparse_linear_algebra_library_type);
+    }
+#if CERES_VERSION_MAJOR > 2 || (CERES_VERSION_MAJOR == 2 && CERES_VERSION_MINOR >= 2)
+    if (ba_options.fill_ordering != "AUTO") {
+        ceres::Solver::Options ordered = *options;
+        ordered.linear_solver_ordering_type = ba_options.fill_ordering == "NESDIS" ? ceres::NESDIS : ceres::AMD;
+        std::string error;
+        if (ordered.IsValid(&error)) {
+            *options = ordered;
+        } else if (ba_options.verbose) {
+            std::cout << "no " << ba_options.fill_ordering << " ordering: " << error << std::endl;
+        }
+    }
+#endif
+    ceres::StringToPreconditionerType(ba_options.preconditioner, &options->preconditioner_type);
+    ceres::StringToVisibilityClusteringType(ba_options.visibility_clustering, &options->visibility_clustering_type);
+    // inexact Newton: the PCG of ITERATIVE_SCHUR only solves to eta
+    options->eta = ba_options.eta;
+    options->min_linear_solver_iterations = ba_options.min_linear_iterations;
+    options->max_linear_solver_iterations = ba_options.max_linear_iterations;
+    options->use_explicit_schur_complement = ba_options.explicit_schur;
+    options->minimizer_progress_to_stdout = ba_options.verbose; // output to cout
+    options->num_threads = ba_options.num_threads;
+    options->max_num_iterations = ba_options.max_iterations;
+    options->function_tolerance = ba_options.function_tolerance;
+    options->gradient_tolerance = ba_options.gradient_tolerance;
+    options->parameter_tolerance = ba_options.parameter_tolerance;
+#if CERES_VERSION_MAJOR > 2 || (CERES_VERSION_MAJOR == 2 && CERES_VERSION_MINOR >= 1)
+    if (ba_options.precision != "double") {
+        // factorize the reduced camera system in float, refined in double
+        ceres::Solver::Options mixed = *options;
+        mixed.use_mixed_precision_solves = true;
+        mixed.max_num_refinement_iterations = 3;
+        if (mixed.linear_solver_type == ceres::SPARSE_SCHUR) {
+            // bundle_adjustment_ceres rejects any other explicit --sparse_library, this overrides the plan
+            mixed.sparse_linear_algebra_library_type = ceres::EIGEN_SPARSE;
+        }
+        std::string error;
+        if (mixed.IsValid(&error)) {
+            *options = mixed;
+        } else if (ba_options.verbose) {
+            std::cout << "no mixed precision linear solves: " << error << std::endl;
+        }
+    }
+#endif
+}
+
+#if CERES_VERSION_MAJOR > 2 || (CERES_VERSION_MAJOR == 2 && CERES_VERSION_MINOR >= 1)
+#define BA_CERES_MANIFOLDS
+#endif
+
+/**
+ * Update of a quaternion camera [q(4), t(3), f, k1, k2] in its 9 degrees of
+ * freedom, as the angle-axis camera and VertexPoseAndIntrinsics of g2o:
+ *
+ *   q <- exp(delta_phi) * q, with exp(delta_phi) the quaternion of the angle-axis delta_phi
+ *   [t, f, k1, k2] <- [t, f, k1, k2] + delta
+ *
+ * A ceres::Manifold with ceres >= 2.1, a LocalParameterization before.
+ */
+#ifdef BA_CERES_MANIFOLDS
+class QuaternionCameraManifold : public ceres::Manifold {
+#else
+class QuaternionCameraManifold : public ceres::LocalParameterization {
+#endif
+public:
+    virtual bool Plus(const double *x, const double *delta, double *x_plus_delta) const override {
+        double q_delta[4];
+        AngleAxisToQuaternion(delta, q_delta);
+        QuaternionProduct(q_delta, x, x_plus_delta);
+        for (int i = 4; i < 10; ++i) {
+            x_plus_delta[i] = x[i] + delta[i - 1];
+        }
+        return true;
+    }
+
+    // 10x9 row major d(Plus(x, delta)) / d(delta) at delta = 0
+    virtual bool PlusJacobian(const double *x, double *jacobian) const {
+        std::fill(jacobian, jacobian + 90, 0.0);
+        // exp(delta_phi) = [1, delta_phi / 2] to first order
+        const double w = 0.5 * x[0], a = 0.5 * x[1], b = 0.5 * x[2], c = 0.5 * x[3];
+        const double rotation[12] = {-a, -b, -c,
+                                     w, c, -b,
+                                     -c, w, a,
+                                     b, -a, w};
+        for (int r = 0; r < 4; ++r) {
+            std::copy(rotation + 3 * r, rotation + 3 * r + 3, jacobian + 9 * r);
+        }
+        for (int i = 4; i < 10; ++i) {
+            jacobian[9 * i + i - 1] = 1.0;
+        }
+        return true;
+    }
+
+#ifdef BA_CERES_MANIFOLDS
+    virtual int AmbientSize() const override {  return 10;  }
+
+    virtual int TangentSize() const override {  return 9;  }
+
+    virtual bool Minus(const double *y, const double *x, double *y_minus_x) const override {
+        // delta_phi = log(y * x^-1)
+        const double x_inverse[4] = {x[0], -x[1], -x[2], -x[3]};
+        double q_delta[4];
+        QuaternionProduct(y, x_inverse, q_delta);
+        QuaternionToAngleAxis(q_delta, y_minus_x);
+        for (int i = 4; i < 10; ++i) {
+            y_minus_x[i - 1] = y[i] - x[i];
+        }
+        return true;
+    }
+
+    // 9x10, the inverse of PlusJacobian() on the tangent space: 4 times its transpose for the rotation
+    virtual bool MinusJacobian(const double *x, double *jacobian) const override {
+        double plus_jacobian[90];
+        PlusJacobian(x, plus_jacobian);
+        std::fill(jacobian, jacobian + 90, 0.0);
+        for (int r = 0; r < 4; ++r) {
+            for (int c = 0; c < 3; ++c) {
+                jacobian[10 * c + r] = 4.0 * plus_jacobian[9 * r + c];
+            }
+        }
+        for (int i = 4; i < 10; ++i) {
+            jacobian[10 * (i - 1) + i] = 1.0;
+        }
+        return true;
+    }
+#else
+    virtual bool ComputeJacobian(const double *x, double *jacobian) const override {
+        return PlusJacobian(x, jacobian);
+    }
+
+    virtual int GlobalSize() const override {  return 10;  }
+
+    virtual int LocalSize() const override {  return 9;  }
+#endif
+};
+
+/**
+ * --iteration_callback (and the deadline of --max_solver_time, see
+ * WithSolveControl()) for one ceres::Solve(): a cancel terminates the solve
+ * successfully, which keeps the parameters of the last accepted step.
+ */
+class CeresProgressCallback : public ceres::IterationCallback {
+public:
+    explicit CeresProgressCallback(const ::IterationCallback &callback) : callback_(callback) {}
+
+    // register with options if there is a callback, this has to outlive the solve
+    void AddTo(ceres::Solver::Options *options) {
+        if (callback_) {
+            options->callbacks.push_back(this);
+        }
+    }
+
+    virtual ceres::CallbackReturnType operator()(const ceres::IterationSummary &summary) override {
+        IterationProgress progress;
+        progress.iteration = summary.iteration;
+        progress.cost = summary.cost;
+        progress.cost_change = summary.step_is_successful ? summary.cost_change : 0.0;
+        progress.step_norm = summary.step_norm;
+        progress.time = summary.iteration_time_in_seconds;
+        progress.cumulative_time = summary.cumulative_time_in_seconds;
+        progress.step_accepted = summary.step_is_successful;
+        return callback_(progress) ? ceres::SOLVER_CONTINUE : ceres::SOLVER_TERMINATE_SUCCESSFULLY;
+    }
+
+private:
+    const ::IterationCallback callback_;
+};
+
+// timings and iteration costs of summary, setup_time is the time spent before ceres::Solve()
+inline void CollectSolveStats(const ceres::Solver::Summary &summary, double setup_time, SolveStats *stats) {
+    // the iteration times of ceres count from the call to Solve()
+    const double preprocessor_time = summary.preprocessor_time_in_seconds;
+    stats->setup_time = setup_time + preprocessor_time;
+    stats->solve_time = summary.minimizer_time_in_seconds;
+    stats->residual_evaluation_time = summary.residual_evaluation_time_in_seconds;
+    stats->jacobian_evaluation_time = summary.jacobian_evaluation_time_in_seconds;
+    stats->linear_solver_time = summary.linear_solver_time_in_seconds;
+    stats->initial_cost = summary.initial_cost;
+    stats->final_cost = summary.final_cost;
+    stats->iterations.clear();
+    for (size_t i = 0; i < summary.iterations.size(); ++i) {
+        const ceres::IterationSummary &iteration = summary.iterations[i];
+        IterationStats it;
+        it.iteration = iteration.iteration;
+        it.cost = iteration.cost;
+        it.time = iteration.iteration_time_in_seconds;
+        it.cumulative_time = iteration.cumulative_time_in_seconds - preprocessor_time;
+        stats->iterations.push_back(it);
+    }
+}
+
+/**
+ * One optimizer run of SolveBACeres() on the active observations of outliers
+ * (all if NULL), see there. False if it was cancelled; *failed is set when
+ * ceres reports a FAILURE.
+ */
+inline bool SolveBACeresPass(BALProblem &bal_problem, const BAOptions &ba_options, OutlierFilter *outliers,
+                             SolveStats *stats, bool *failed) {
+    const double setup_start = WallTimeInSeconds();
+    const int point_block_size = bal_problem.point_block_size();
+    const int camera_block_size = bal_problem.camera_block_size();
+    double *points = bal_problem.mutable_points();
+    double *cameras = bal_problem.mutable_cameras();
+
+    /**
+     * Observations is 2 * num_observations long array observations
+     * [u_1, u_2, ..., u_n], where each u_i is two dimensional, the x
+     * and y position of the observation.
+     */
+    const double *observations = bal_problem.observations();
+
+    /**
+     * The cost functions are laid out back to back in one arena block and all
+     * residuals share one loss function, instead of two small allocations per
+     * residual. The problem owns neither, so both outlive it.
+     */
+    const bool use_analytic_jacobian = (ba_options.jacobian == "analytic");
+    // [q(4), t(3), f, k1, k2] cameras, all updated by one QuaternionCameraManifold
+    const bool use_quaternions = (camera_block_size == 10);
+    Arena arena;
+    arena.Reserve(SnavelyReprojectionError::ArenaSizeFor(bal_problem.num_observations(), use_analytic_jacobian,
+                                                         use_quaternions));
+    std::unique_ptr<ceres::LossFunction> loss_function(CreateLossFunction(ba_options));
+    std::unique_ptr<QuaternionCameraManifold> camera_manifold(use_quaternions ? new QuaternionCameraManifold : NULL);
+
+    ceres::Problem::Options problem_options;
+    problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+#ifdef BA_CERES_MANIFOLDS
+    problem_options.manifold_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+#else
+    problem_options.local_parameterization_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+#endif
+    // outlier rounds remove residual blocks
+    problem_options.enable_fast_removal = outliers != NULL;
+    ceres::Problem problem(problem_options);
+    std::vector<ceres::ResidualBlockId> residual_blocks(bal_problem.num_observations(), NULL);
+
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        if (outliers != NULL && !outliers->active(i)) {
+            continue; // dropped by an earlier pass
+        }
+        ceres::CostFunction *cost_function;
+
+        // step 1: define parameter blocks (P137)
+        double *camera = cameras + camera_block_size * bal_problem.camera_index()[i];
+        double *point = points + point_block_size * bal_problem.point_index()[i];
+
+        /**
+         * step 2: define cost function (residual block computing method, P137)
+         *
+         * Each Residual block (Cost function) takes a point and a camera as input
+         * and outputs a 2-dimensional Residual
+         *
+         * AutoDiffCostFunction<>() or AnalyticSnavelyReprojectionError
+         */
+        cost_function = SnavelyReprojectionError::Create(observations[2 * i + 0],
+                                                         observations[2 * i + 1],
+                                                         use_analytic_jacobian, &arena,
+                                                         EvaluationPrecisionOf(ba_options), use_quaternions);
+
+        /**
+         * step 3: define loss function (kernel function, P137 -> details in P251)
+         * If enabled use Huber's loss function, shared by all residuals (see above)
+         */
+
+        /**
+         * step 4: add residual block to the problems (P137)
+         *
+         * Each observation corresponds to a pair of a camera and a point
+         * which are identidied by camera_index()[i] and point_index[i] respectively
+         */
+        residual_blocks[i] = problem.AddResidualBlock(cost_function,
+                                                      loss_function.get(),
+                                                      camera, point // estimated parameters
+                                                      );
+    }
+    for (int i = 0; use_quaternions && i < bal_problem.num_cameras(); ++i) {
+        double *camera = cameras + camera_block_size * i;
+        if (!problem.HasParameterBlock(camera)) continue; // all its observations dropped
+#ifdef BA_CERES_MANIFOLDS
+        problem.SetManifold(camera, camera_manifold.get());
+#else
+        problem.SetParameterization(camera, camera_manifold.get());
+#endif
+    }
+
+    const double setup_time = WallTimeInSeconds() - setup_start;
+    Profiler::Get().Record("ceres setup", setup_start, setup_start + setup_time);
+
+    // show some information here
+    if (ba_options.verbose) {
+        std::cout << "bal problem file loaded..." << std::endl;
+        std::cout << "bal problem have " << bal_problem.num_cameras() << " cameras and "
+                  << bal_problem.num_points() << " points. " << std::endl;
+        std::cout << "Forming " << bal_problem.num_observations() << " observations. " << std::endl;
+
+        // configure solver
+        std::cout << "Solving ceres BA ... " << std::endl;
+    }
+    ceres::Solver::Options options; // many options
+    SetSolverOptions(ba_options, &options);
+    // the preprocessor of ceres prunes the ordering to the blocks of the solve, so every solve gets its own
+    auto set_ordering = [&]() {
+        if (ba_options.ordering != "schur") return;
+        // eliminate the points first, then solve the reduced camera system; blocks whose observations were
+        // all dropped are not in the problem, and ceres rejects an ordering naming them
+        auto *ordering = new ceres::ParameterBlockOrdering;
+        for (int i = 0; i < bal_problem.num_points(); ++i) {
+            double *point = points + point_block_size * i;
+            if (problem.HasParameterBlock(point)) ordering->AddElementToGroup(point, 0);
+        }
+        for (int i = 0; i < bal_problem.num_cameras(); ++i) {
+            double *camera = cameras + camera_block_size * i;
+            if (problem.HasParameterBlock(camera)) ordering->AddElementToGroup(camera, 1);
+        }
+        options.linear_solver_ordering.reset(ordering);
+    };
+    set_ordering();
+    CeresProgressCallback progress_callback(ba_options.iteration_callback);
+    progress_callback.AddTo(&options);
+    ceres::Solver::Summary summary; // optimization information
+    {
+        ScopedTimer timer("ceres solve");
+        ceres::Solve(options, &problem, &summary); // start optimization
+    }
+    *failed = *failed || summary.termination_type == ceres::FAILURE;
+    if (ba_options.verbose) {
+        std::cout << summary.FullReport() << "\n"; // output result
+    }
+
+    if (stats != NULL) {
+        CollectSolveStats(summary, setup_time, stats);
+    }
+
+    // warm started on the same problem: ceres drops the points and cameras left without residuals
+    std::vector<int> dropped;
+    while (summary.termination_type != ceres::USER_SUCCESS && outliers != NULL &&
+           outliers->NextRound(bal_problem, &dropped)) {
+        for (size_t k = 0; k < dropped.size(); ++k) {
+            problem.RemoveResidualBlock(residual_blocks[dropped[k]]);
+        }
+        set_ordering();
+        {
+            ScopedTimer timer("ceres solve");
+            ceres::Solve(options, &problem, &summary);
+        }
+        *failed = *failed || summary.termination_type == ceres::FAILURE;
+        if (ba_options.verbose) {
+            std::cout << summary.BriefReport() << "\n";
+        }
+        if (stats != NULL) {
+            SolveStats round_stats;
+            CollectSolveStats(summary, 0, &round_stats);
+            stats->Append(round_stats);
+        }
+    }
+    return summary.termination_type != ceres::USER_SUCCESS; // only the callback ends a solve so
+}
+
+/**
+ * Optimize bal_problem in place with ceres, --linear_solver=AUTO planned
+ * for bal_problem (ba_planner.h).
+ * stats, if not NULL, receives the timings and the cost of every iteration.
+ * A --precision=float solution is finished with --refinement_iterations in
+ * double precision. --outlier_rounds drop outliers after the (first) solve.
+ * False if a solve failed, a cancelled one has not.
+ */
+inline bool SolveBACeres(BALProblem &bal_problem, const BAOptions &options, SolveStats *stats = NULL) {
+    const BAOptions ba_options = WithSolveControl(PlanBAOptions(bal_problem, options, CeresCapabilities()));
+    std::unique_ptr<OutlierFilter> outliers(ba_options.outlier_rounds > 0 ? new OutlierFilter(bal_problem, ba_options)
+                                                                          : NULL);
+    bool failed = false;
+    const bool finished = SolveBACeresPass(bal_problem, ba_options, outliers.get(), stats, &failed);
+    if (finished && ba_options.precision == "float" && ba_options.refinement_iterations > 0) {
+        BAOptions refinement = ba_options;
+        refinement.precision = "double";
+        refinement.max_iterations = ba_options.refinement_iterations;
+        SolveStats refinement_stats;
+        SolveBACeresPass(bal_problem, refinement, outliers.get(), stats != NULL ? &refinement_stats : NULL,
+                         &failed);
+        if (stats != NULL) {
+            stats->Append(refinement_stats);
+        }
+    }
+    return !failed;
+}
+
+#endif // BA_CERES_H
@@ -0,0 +1,149 @@
+#ifndef BA_COVARIANCE_H
+#define BA_COVARIANCE_H
+
+// --covariance: marginal covariances of cameras and points from an LDLT of the reduced camera system
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/SparseCore>
+#include <Eigen/StdVector>
+
+#include "common.h"
+
+/**
+ * The entries of A^-1 on the pattern of the factor of a (Simplicial) LDLT
+ * A = P^T L D L^T P, without forming the dense inverse. With Z = (L D L^T)^-1,
+ * Z = D^-1 L^-1 + (I - L^T) Z gives column i from the columns after it
+ * (Takahashi recursion), summing only over the rows R(i) of column i of L:
+ *
+ *   Z(j, i) = -sum_{k in R(i)} L(k, i) Z(j, k)   (j in R(i))
+ *   Z(i, i) = 1 / d_i - sum_{k in R(i)} L(k, i) Z(k, i)
+ *
+ * Every Z(j, k) needed lies on the pattern of L, which is closed under
+ * elimination (j, k in R(i) makes (max(j, k), min(j, k)) an entry of L), so
+ * this costs about sum |R(i)|^2 per inverse, that of a factorization. The
+ * pattern covers that of A, e.g. every block of the reduced camera matrix.
+ */
+class SparseInverse {
+public:
+    // ldlt: a factorized Eigen::SimplicialLDLT, false if its D is not positive
+    template<typename LDLT>
+    bool Compute(const LDLT &ldlt) {
+        const Eigen::SparseMatrix<double> &L = ldlt.matrixL().nestedExpression(); // strictly lower, rows sorted
+        const Eigen::VectorXd d = ldlt.vectorD();
+        const int n = static_cast<int>(L.cols());
+        permutation_.resize(n);
+        for (int i = 0; i < n; ++i) {
+            permutation_[i] = ldlt.permutationP().size() > 0 ? ldlt.permutationP().indices()[i] : i;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (!(d[i] > 0)) return false;
+        }
+
+        offsets_.assign(L.outerIndexPtr(), L.outerIndexPtr() + n + 1);
+        rows_.assign(L.innerIndexPtr(), L.innerIndexPtr() + L.nonZeros());
+        lower_.assign(L.nonZeros(), 0.0);
+        diagonal_.assign(n, 0.0);
+        const double *values = L.valuePtr();
+        for (int i = n - 1; i >= 0; --i) {
+            for (int p = offsets_[i]; p < offsets_[i + 1]; ++p) {
+                const int j = rows_[p];
+                double sum = 0.0;
+                for (int q = offsets_[i]; q < offsets_[i + 1]; ++q) {
+                    sum += values[q] * Z(j, rows_[q]);
+                }
+                lower_[p] = -sum;
+            }
+            double sum = 0.0;
+            for (int p = offsets_[i]; p < offsets_[i + 1]; ++p) {
+                sum += values[p] * lower_[p];
+            }
+            diagonal_[i] = 1.0 / d[i] - sum;
+        }
+        return true;
+    }
+
+    // (A^-1)(i, j), 0 off the pattern of L
+    double operator()(int i, int j) const {
+        return Z(permutation_[i], permutation_[j]);
+    }
+
+private:
+    double Z(int i, int j) const {
+        if (i == j) return diagonal_[i];
+        if (i < j) std::swap(i, j);
+        const std::vector<int>::const_iterator begin = rows_.begin() + offsets_[j];
+        const std::vector<int>::const_iterator end = rows_.begin() + offsets_[j + 1];
+        const std::vector<int>::const_iterator row = std::lower_bound(begin, end, i);
+        return row != end && *row == i ? lower_[row - rows_.begin()] : 0.0;
+    }
+
+    std::vector<int> permutation_;
+    std::vector<int> offsets_, rows_; // pattern of L
+    std::vector<double> lower_; // Z below the diagonal, on the pattern of L
+    std::vector<double> diagonal_;
+};
+
+/**
+ * Marginal covariances of the camera (angle axis, t, f, k1, k2) and point
+ * blocks for observations of unit variance (pixels^2), in the coordinates of
+ * the solved problem (normalized as the PLY files). The gauge is fixed by
+ * holding the rotation and translation of camera 0 and one translation
+ * coordinate of gauge_camera constant, so these have zero covariance.
+ */
+struct BACovariance {
+    std::vector<Eigen::Matrix<double, 9, 9>, Eigen::aligned_allocator<Eigen::Matrix<double, 9, 9> > > cameras;
+    std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > points;
+    int gauge_camera = -1;
+    int gauge_coordinate = -1; // of the translation of gauge_camera, fixing the scale
+};
+
+// final.ply -> final_covariance.txt, next to the PLY file
+inline std::string CovarianceFileFor(const std::string &ply) {
+    const std::string stem = HasSuffix(ply, ".ply") ? ply.substr(0, ply.size() - 4) : ply;
+    return stem + "_covariance.txt";
+}
+
+/**
+ * Text file of the covariances: a header, one line of the 81 entries (row
+ * major) per camera, then one line of the 9 entries per point.
+ */
+inline bool WriteCovariance(const std::string &filename, const BACovariance &covariance) {
+    FILE *fptr = fopen(filename.c_str(), "w");
+    if (fptr == NULL) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return false;
+    }
+    fprintf(fptr, "# row major covariances of %d cameras (9x9) and %d points (3x3), unit pixel noise\n",
+            static_cast<int>(covariance.cameras.size()), static_cast<int>(covariance.points.size()));
+    fprintf(fptr, "# gauge: rotation and translation of camera 0, translation %d of camera %d fixed\n",
+            covariance.gauge_coordinate, covariance.gauge_camera);
+    fprintf(fptr, "%d %d\n", static_cast<int>(covariance.cameras.size()),
+            static_cast<int>(covariance.points.size()));
+    for (size_t c = 0; c < covariance.cameras.size(); ++c) {
+        const Eigen::Matrix<double, 9, 9> &block = covariance.cameras[c];
+        for (int r = 0; r < 9; ++r) {
+            for (int k = 0; k < 9; ++k) {
+                fprintf(fptr, r + k == 0 ? "%.9g" : " %.9g", block(r, k));
+            }
+        }
+        fprintf(fptr, "\n");
+    }
+    for (size_t j = 0; j < covariance.points.size(); ++j) {
+        const Eigen::Matrix3d &block = covariance.points[j];
+        fprintf(fptr, "%.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g %.9g\n", block(0, 0), block(0, 1), block(0, 2),
+                block(1, 0), block(1, 1), block(1, 2), block(2, 0), block(2, 1), block(2, 2));
+    }
+    const bool ok = ferror(fptr) == 0;
+    fclose(fptr);
+    if (!ok) {
+        std::cerr << "Error: writing " << filename << " failed" << std::endl;
+    }
+    return ok;
+}
+
+#endif // BA_COVARIANCE_H
@@ -0,0 +1,794 @@
+// bundle adjustment on a CUDA device: Levenberg-Marquardt, the points eliminated, PCG on the reduced camera system
+
+#include <cuda_runtime.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include "ba_cuda.h"
+#include "projection.h"
+
+namespace {
+
+const int kBlockSize = 256;
+const int kMaxReduceBlocks = 64; // a reduction adds up kMaxReduceBlocks * kBlockSize partial sums atomically
+
+inline int NumBlocks(int n) {
+    return std::max(1, (n + kBlockSize - 1) / kBlockSize);
+}
+
+inline int NumReduceBlocks(int n) {
+    return std::min(kMaxReduceBlocks, NumBlocks(n));
+}
+
+bool CudaOk(cudaError_t status, const char *what) {
+    if (status != cudaSuccess) {
+        std::cerr << "Error: " << what << ": " << cudaGetErrorString(status) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// n elements of device memory, freed with the object
+template<typename T>
+class DeviceArray {
+public:
+    DeviceArray() : data_(NULL), size_(0) {}
+
+    ~DeviceArray() {
+        if (data_ != NULL) cudaFree(data_);
+    }
+
+    bool Allocate(size_t n) {
+        size_ = n;
+        return CudaOk(cudaMalloc(reinterpret_cast<void **>(&data_), std::max<size_t>(1, n) * sizeof(T)),
+                      "cudaMalloc");
+    }
+
+    bool Upload(const T *host) {
+        return CudaOk(cudaMemcpy(data_, host, size_ * sizeof(T), cudaMemcpyHostToDevice), "cudaMemcpy");
+    }
+
+    bool Download(T *host) const {
+        return CudaOk(cudaMemcpy(host, data_, size_ * sizeof(T), cudaMemcpyDeviceToHost), "cudaMemcpy");
+    }
+
+    bool Zero() {
+        return CudaOk(cudaMemset(data_, 0, size_ * sizeof(T)), "cudaMemset");
+    }
+
+    // exchange the buffers, the accepted candidate becomes the parameters
+    void Swap(DeviceArray &other) {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+    }
+
+    T *data() const {  return data_;  }
+
+    size_t size() const {  return size_;  }
+
+private:
+    DeviceArray(const DeviceArray &);
+    DeviceArray &operator=(const DeviceArray &);
+
+    T *data_;
+    size_t size_;
+};
+
+// --robust_kernel on the device
+struct DeviceLoss {
+    enum Type { kNone = 0, kHuber, kCauchy };
+    int type;
+    double delta;
+};
+
+// rho(s) and rho'(s) as EvaluateLoss() of ba_native.h
+__device__ inline void EvaluateLoss(const DeviceLoss &loss, double s, double *rho, double *rho_prime) {
+    const double b = loss.delta * loss.delta;
+    if (loss.type == DeviceLoss::kHuber && s > b) {
+        const double r = sqrt(s);
+        *rho = 2.0 * loss.delta * r - b;
+        *rho_prime = loss.delta / r;
+    } else if (loss.type == DeviceLoss::kCauchy) {
+        const double sum = 1.0 + s / b;
+        *rho = b * log(sum);
+        *rho_prime = 1.0 / sum;
+    } else {
+        *rho = s;
+        *rho_prime = 1.0;
+    }
+}
+
+// ceres clamps diag(J^T J) to [1e-6, 1e32] for the damping
+__device__ inline double Damping(double diagonal) {
+    return fmin(fmax(diagonal, 1e-6), 1e32);
+}
+
+// entry (a, b) of a symmetric 9x9 block of which only the upper triangle is accumulated
+__device__ inline double Symmetric9(const double *block, int a, int b) {
+    return a <= b ? block[9 * a + b] : block[9 * b + a];
+}
+
+// double atomicMax of non-negative values: their bit patterns order as unsigned integers
+__device__ inline void AtomicMaxNonNegative(double *address, double value) {
+    atomicMax(reinterpret_cast<unsigned long long *>(address), static_cast<unsigned long long>(
+            __double_as_longlong(value)));
+}
+
+// cost 0.5 rho of every observation at parameters (cameras, then points)
+__global__ void CostKernel(int num_observations, int num_cameras, const double *parameters,
+                           const int *camera_index, const int *point_index, const double *observations,
+                           DeviceLoss loss, double *costs) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_observations) return;
+    const double *camera = parameters + 9 * camera_index[i];
+    const double *point = parameters + 9 * num_cameras + 3 * point_index[i];
+    double prediction[2];
+    CamProjectionWithDistortionJacobian(camera, point, prediction, (double *) NULL, (double *) NULL);
+    const double r0 = prediction[0] - observations[2 * i + 0];
+    const double r1 = prediction[1] - observations[2 * i + 1];
+    double rho, rho_prime;
+    EvaluateLoss(loss, r0 * r0 + r1 * r1, &rho, &rho_prime);
+    costs[i] = 0.5 * rho;
+}
+
+// cost, residual and 2x9 / 2x3 Jacobians of every observation, the latter two scaled by sqrt(rho')
+__global__ void LinearizeKernel(int num_observations, int num_cameras, const double *parameters,
+                                const int *camera_index, const int *point_index, const double *observations,
+                                DeviceLoss loss, double *costs, double *residuals, double *J_cameras,
+                                double *J_points) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_observations) return;
+    const double *camera = parameters + 9 * camera_index[i];
+    const double *point = parameters + 9 * num_cameras + 3 * point_index[i];
+    double prediction[2];
+    double *J_camera = J_cameras + 18 * i;
+    double *J_point = J_points + 6 * i;
+    CamProjectionWithDistortionJacobian(camera, point, prediction, J_camera, J_point);
+    const double r0 = prediction[0] - observations[2 * i + 0];
+    const double r1 = prediction[1] - observations[2 * i + 1];
+    double rho, rho_prime;
+    EvaluateLoss(loss, r0 * r0 + r1 * r1, &rho, &rho_prime);
+    costs[i] = 0.5 * rho;
+    const double scale = sqrt(rho_prime);
+    residuals[2 * i + 0] = scale * r0;
+    residuals[2 * i + 1] = scale * r1;
+    for (int k = 0; k < 18; ++k) J_camera[k] *= scale;
+    for (int k = 0; k < 6; ++k) J_point[k] *= scale;
+}
+
+// B_c += J_c^T J_c (upper triangle) and g_c += J_c^T r, B and g zeroed before
+__global__ void CameraNormalEquationsKernel(int num_observations, const int *camera_index, const double *residuals,
+                                            const double *J_cameras, double *B, double *g_cameras) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_observations) return;
+    const double *J = J_cameras + 18 * i;
+    const double *r = residuals + 2 * i;
+    double *block = B + 81 * camera_index[i];
+    double *g = g_cameras + 9 * camera_index[i];
+    for (int a = 0; a < 9; ++a) {
+        for (int b = a; b < 9; ++b) {
+            atomicAdd(block + 9 * a + b, J[a] * J[b] + J[9 + a] * J[9 + b]);
+        }
+        atomicAdd(g + a, J[a] * r[0] + J[9 + a] * r[1]);
+    }
+}
+
+// C_j = sum J_p^T J_p and g_p = sum J_p^T r over the observations of every point, no atomics needed
+__global__ void PointNormalEquationsKernel(int num_points, const int *point_offsets, const int *point_observations,
+                                           const double *residuals, const double *J_points, double *C,
+                                           double *g_points) {
+    const int j = blockIdx.x * blockDim.x + threadIdx.x;
+    if (j >= num_points) return;
+    double block[9] = {0, 0, 0, 0, 0, 0, 0, 0, 0};
+    double g[3] = {0, 0, 0};
+    for (int o = point_offsets[j]; o < point_offsets[j + 1]; ++o) {
+        const int i = point_observations[o];
+        const double *J = J_points + 6 * i;
+        const double *r = residuals + 2 * i;
+        for (int a = 0; a < 3; ++a) {
+            for (int b = 0; b < 3; ++b) {
+                block[3 * a + b] += J[a] * J[b] + J[3 + a] * J[3 + b];
+            }
+            g[a] += J[a] * r[0] + J[3 + a] * r[1];
+        }
+    }
+    for (int k = 0; k < 9; ++k) C[9 * j + k] = block[k];
+    for (int k = 0; k < 3; ++k) g_points[3 * j + k] = g[k];
+}
+
+// (C_j + mu D_j)^-1 of every point and v_j = (C_j + mu D_j)^-1 g_p
+__global__ void PointInverseKernel(int num_points, double mu, const double *C, const double *g_points,
+                                   double *C_inverse, double *v) {
+    const int j = blockIdx.x * blockDim.x + threadIdx.x;
+    if (j >= num_points) return;
+    double m[9];
+    for (int k = 0; k < 9; ++k) m[k] = C[9 * j + k];
+    for (int a = 0; a < 3; ++a) m[4 * a] += mu * Damping(m[4 * a]);
+    // adjugate / determinant
+    double inverse[9] = {m[4] * m[8] - m[5] * m[7], m[2] * m[7] - m[1] * m[8], m[1] * m[5] - m[2] * m[4],
+                         m[5] * m[6] - m[3] * m[8], m[0] * m[8] - m[2] * m[6], m[2] * m[3] - m[0] * m[5],
+                         m[3] * m[7] - m[4] * m[6], m[1] * m[6] - m[0] * m[7], m[0] * m[4] - m[1] * m[3]};
+    const double inverse_determinant = 1.0 / (m[0] * inverse[0] + m[1] * inverse[3] + m[2] * inverse[6]);
+    const double *g = g_points + 3 * j;
+    for (int a = 0; a < 3; ++a) {
+        double sum = 0;
+        for (int b = 0; b < 3; ++b) {
+            inverse[3 * a + b] *= inverse_determinant;
+            C_inverse[9 * j + 3 * a + b] = inverse[3 * a + b];
+            sum += inverse[3 * a + b] * g[b];
+        }
+        v[3 * j + a] = sum;
+    }
+}
+
+// rhs = -g_c and P = B + mu D (upper triangle), before the terms of the points
+__global__ void CameraInitKernel(int num_cameras, double mu, const double *B, const double *g_cameras,
+                                 double *rhs, double *P) {
+    const int c = blockIdx.x * blockDim.x + threadIdx.x;
+    if (c >= num_cameras) return;
+    for (int k = 0; k < 81; ++k) P[81 * c + k] = B[81 * c + k];
+    for (int a = 0; a < 9; ++a) {
+        P[81 * c + 10 * a] += mu * Damping(B[81 * c + 10 * a]);
+        rhs[9 * c + a] = -g_cameras[9 * c + a];
+    }
+}
+
+/**
+ * The point terms of every observation: rhs_c += J_c^T J_p v_j, and the
+ * diagonal block of S of its camera, P_c -= J_c^T (J_p C_j^-1 J_p^T) J_c.
+ */
+__global__ void ReducedSystemKernel(int num_observations, const int *camera_index, const int *point_index,
+                                    const double *J_cameras, const double *J_points, const double *C_inverse,
+                                    const double *v, double *rhs, double *P) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_observations) return;
+    const double *Jc = J_cameras + 18 * i;
+    const double *Jp = J_points + 6 * i;
+    const double *Ci = C_inverse + 9 * point_index[i];
+    const double *vj = v + 3 * point_index[i];
+
+    // J_p C^-1, 2x3, then M = J_p C^-1 J_p^T, 2x2
+    double JpCi[6];
+    for (int r = 0; r < 2; ++r) {
+        for (int b = 0; b < 3; ++b) {
+            JpCi[3 * r + b] = Jp[3 * r + 0] * Ci[b] + Jp[3 * r + 1] * Ci[3 + b] + Jp[3 * r + 2] * Ci[6 + b];
+        }
+    }
+    double M[4];
+    for (int r = 0; r < 2; ++r) {
+        for (int s = 0; s < 2; ++s) {
+            M[2 * r + s] = JpCi[3 * r + 0] * Jp[3 * s + 0] + JpCi[3 * r + 1] * Jp[3 * s + 1] +
+                           JpCi[3 * r + 2] * Jp[3 * s + 2];
+        }
+    }
+    // K = M J_c, 2x9
+    double K[18];
+    for (int b = 0; b < 9; ++b) {
+        K[b] = M[0] * Jc[b] + M[1] * Jc[9 + b];
+        K[9 + b] = M[2] * Jc[b] + M[3] * Jc[9 + b];
+    }
+    const double u[2] = {Jp[0] * vj[0] + Jp[1] * vj[1] + Jp[2] * vj[2],
+                         Jp[3] * vj[0] + Jp[4] * vj[1] + Jp[5] * vj[2]};
+
+    double *block = P + 81 * camera_index[i];
+    double *rhs_c = rhs + 9 * camera_index[i];
+    for (int a = 0; a < 9; ++a) {
+        for (int b = a; b < 9; ++b) {
+            atomicAdd(block + 9 * a + b, -(Jc[a] * K[b] + Jc[9 + a] * K[9 + b]));
+        }
+        atomicAdd(rhs_c + a, Jc[a] * u[0] + Jc[9 + a] * u[1]);
+    }
+}
+
+/**
+ * The inverse of every diagonal block of S (upper triangle in P) through its
+ * Cholesky factor, as the SCHUR_JACOBI preconditioner. A block which is not
+ * numerically positive definite falls back to the inverse of its diagonal.
+ */
+__global__ void CameraInverseKernel(int num_cameras, const double *P, double *P_inverse) {
+    const int c = blockIdx.x * blockDim.x + threadIdx.x;
+    if (c >= num_cameras) return;
+    const double *block = P + 81 * c;
+    double *inverse = P_inverse + 81 * c;
+    double L[81];
+    bool positive = true;
+    for (int a = 0; a < 9 && positive; ++a) {
+        for (int b = 0; b <= a; ++b) {
+            double sum = Symmetric9(block, a, b);
+            for (int k = 0; k < b; ++k) sum -= L[9 * a + k] * L[9 * b + k];
+            if (a == b) {
+                positive = sum > 0;
+                L[9 * a + a] = sqrt(fmax(sum, 0.0));
+            } else {
+                L[9 * a + b] = sum / L[9 * b + b];
+            }
+        }
+    }
+    if (!positive) {
+        for (int k = 0; k < 81; ++k) inverse[k] = 0;
+        for (int a = 0; a < 9; ++a) inverse[10 * a] = 1.0 / Damping(block[10 * a]);
+        return;
+    }
+    // column e of L^-T L^-1
+    for (int e = 0; e < 9; ++e) {
+        double y[9];
+        for (int a = 0; a < 9; ++a) {
+            double sum = a == e ? 1.0 : 0.0;
+            for (int k = 0; k < a; ++k) sum -= L[9 * a + k] * y[k];
+            y[a] = sum / L[9 * a + a];
+        }
+        for (int a = 8; a >= 0; --a) {
+            double sum = y[a];
+            for (int k = a + 1; k < 9; ++k) sum -= L[9 * k + a] * inverse[9 * k + e];
+            inverse[9 * a + e] = sum / L[9 * a + a];
+        }
+    }
+}
+
+// z_c = P_c^-1 r_c
+__global__ void PreconditionKernel(int num_cameras, const double *P_inverse, const double *r, double *z) {
+    const int c = blockIdx.x * blockDim.x + threadIdx.x;
+    if (c >= num_cameras) return;
+    const double *inverse = P_inverse + 81 * c;
+    for (int a = 0; a < 9; ++a) {
+        double sum = 0;
+        for (int b = 0; b < 9; ++b) sum += inverse[9 * a + b] * r[9 * c + b];
+        z[9 * c + a] = sum;
+    }
+}
+
+// w_j = C_j^-1 sum J_p^T J_c x_c over the observations of every point, E^T x premultiplied by C^-1
+__global__ void SchurPointKernel(int num_points, const int *point_offsets, const int *point_observations,
+                                 const int *camera_index, const double *J_cameras, const double *J_points,
+                                 const double *C_inverse, const double *x, double *w) {
+    const int j = blockIdx.x * blockDim.x + threadIdx.x;
+    if (j >= num_points) return;
+    double sum[3] = {0, 0, 0};
+    for (int o = point_offsets[j]; o < point_offsets[j + 1]; ++o) {
+        const int i = point_observations[o];
+        const double *Jc = J_cameras + 18 * i;
+        const double *Jp = J_points + 6 * i;
+        const double *xc = x + 9 * camera_index[i];
+        double t[2] = {0, 0};
+        for (int a = 0; a < 9; ++a) {
+            t[0] += Jc[a] * xc[a];
+            t[1] += Jc[9 + a] * xc[a];
+        }
+        for (int a = 0; a < 3; ++a) sum[a] += Jp[a] * t[0] + Jp[3 + a] * t[1];
+    }
+    const double *Ci = C_inverse + 9 * j;
+    for (int a = 0; a < 3; ++a) {
+        w[3 * j + a] = Ci[3 * a + 0] * sum[0] + Ci[3 * a + 1] * sum[1] + Ci[3 * a + 2] * sum[2];
+    }
+}
+
+// y = mu D x, the damping part of S x
+__global__ void SchurCameraInitKernel(int num_cameras, double mu, const double *B, const double *x, double *y) {
+    const int c = blockIdx.x * blockDim.x + threadIdx.x;
+    if (c >= num_cameras) return;
+    for (int a = 0; a < 9; ++a) {
+        y[9 * c + a] = mu * Damping(B[81 * c + 10 * a]) * x[9 * c + a];
+    }
+}
+
+// y_c += J_c^T (J_c x_c - J_p w_j): (B - E C^-1 E^T) x one observation at a time, w from SchurPointKernel
+__global__ void SchurObservationKernel(int num_observations, const int *camera_index, const int *point_index,
+                                       const double *J_cameras, const double *J_points, const double *x,
+                                       const double *w, double *y) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_observations) return;
+    const double *Jc = J_cameras + 18 * i;
+    const double *Jp = J_points + 6 * i;
+    const double *xc = x + 9 * camera_index[i];
+    const double *wj = w + 3 * point_index[i];
+    double t[2] = {0, 0};
+    for (int a = 0; a < 9; ++a) {
+        t[0] += Jc[a] * xc[a];
+        t[1] += Jc[9 + a] * xc[a];
+    }
+    for (int a = 0; a < 3; ++a) {
+        t[0] -= Jp[a] * wj[a];
+        t[1] -= Jp[3 + a] * wj[a];
+    }
+    double *yc = y + 9 * camera_index[i];
+    for (int a = 0; a < 9; ++a) {
+        atomicAdd(yc + a, Jc[a] * t[0] + Jc[9 + a] * t[1]);
+    }
+}
+
+// dx_p = -(v + w) = -C^-1 (g_p + E^T dx_c)
+__global__ void BackSubstitutionKernel(int n, const double *v, const double *w, double *dx_points) {
+    const int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k >= n) return;
+    dx_points[k] = -(v[k] + w[k]);
+}
+
+// -(r^T J dx + 0.5 |J dx|^2) of every observation, the decrease of the linearized cost
+__global__ void ModelDecreaseKernel(int num_observations, int num_cameras, const int *camera_index,
+                                    const int *point_index, const double *residuals, const double *J_cameras,
+                                    const double *J_points, const double *dx, double *values) {
+    const int i = blockIdx.x * blockDim.x + threadIdx.x;
+    if (i >= num_observations) return;
+    const double *Jc = J_cameras + 18 * i;
+    const double *Jp = J_points + 6 * i;
+    const double *dc = dx + 9 * camera_index[i];
+    const double *dp = dx + 9 * num_cameras + 3 * point_index[i];
+    double f[2] = {0, 0};
+    for (int a = 0; a < 9; ++a) {
+        f[0] += Jc[a] * dc[a];
+        f[1] += Jc[9 + a] * dc[a];
+    }
+    for (int a = 0; a < 3; ++a) {
+        f[0] += Jp[a] * dp[a];
+        f[1] += Jp[3 + a] * dp[a];
+    }
+    const double *r = residuals + 2 * i;
+    values[i] = -(r[0] * f[0] + r[1] * f[1] + 0.5 * (f[0] * f[0] + f[1] * f[1]));
+}
+
+// y += alpha x
+__global__ void AxpyKernel(int n, double alpha, const double *x, double *y) {
+    const int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k < n) y[k] += alpha * x[k];
+}
+
+// y = x + beta y
+__global__ void XpbyKernel(int n, const double *x, double beta, double *y) {
+    const int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k < n) y[k] = x[k] + beta * y[k];
+}
+
+// out = x + y
+__global__ void AddKernel(int n, const double *x, const double *y, double *out) {
+    const int k = blockIdx.x * blockDim.x + threadIdx.x;
+    if (k < n) out[k] = x[k] + y[k];
+}
+
+// *result += sum x[k] y[k] (x alone with y NULL), a grid stride partial sum per thread
+__global__ void DotKernel(int n, const double *x, const double *y, double *result) {
+    double sum = 0;
+    for (int k = blockIdx.x * blockDim.x + threadIdx.x; k < n; k += gridDim.x * blockDim.x) {
+        sum += y != NULL ? x[k] * y[k] : x[k];
+    }
+    atomicAdd(result, sum);
+}
+
+// *result = max(*result, max |x[k]|)
+__global__ void MaxAbsKernel(int n, const double *x, double *result) {
+    double norm = 0;
+    for (int k = blockIdx.x * blockDim.x + threadIdx.x; k < n; k += gridDim.x * blockDim.x) {
+        norm = fmax(norm, fabs(x[k]));
+    }
+    AtomicMaxNonNegative(result, norm);
+}
+
+/**
+ * The device state of SolveBACudaArrays(). Host code only drives the
+ * iteration: every kernel runs on the default stream, and each scalar the
+ * trust region needs (costs, dot products of the PCG) is one reduction
+ * copied back.
+ */
+class CudaBASolver {
+public:
+    CudaBASolver(const CudaBAProblem &problem, const BAOptions &ba_options)
+            : problem_(problem), options_(ba_options), num_cameras_(problem.num_cameras),
+              num_points_(problem.num_points), num_observations_(problem.num_observations),
+              num_parameters_(9 * problem.num_cameras + 3 * problem.num_points), linear_iterations_(0) {
+        loss_.type = ba_options.robust_kernel == "huber" ? DeviceLoss::kHuber :
+                     ba_options.robust_kernel == "cauchy" ? DeviceLoss::kCauchy : DeviceLoss::kNone;
+        loss_.delta = ba_options.robust_delta;
+    }
+
+    // upload the problem and allocate everything a solve needs
+    bool Setup() {
+        // observations of every point, for the per point kernels
+        std::vector<int> point_offsets(num_points_ + 1, 0), point_observations(num_observations_);
+        for (int i = 0; i < num_observations_; ++i) {
+            ++point_offsets[problem_.point_index[i] + 1];
+        }
+        for (int j = 0; j < num_points_; ++j) {
+            point_offsets[j + 1] += point_offsets[j];
+        }
+        std::vector<int> fill(point_offsets.begin(), point_offsets.end() - 1);
+        for (int i = 0; i < num_observations_; ++i) {
+            point_observations[fill[problem_.point_index[i]]++] = i;
+        }
+
+        return camera_index_.Allocate(num_observations_) && camera_index_.Upload(problem_.camera_index) &&
+               point_index_.Allocate(num_observations_) && point_index_.Upload(problem_.point_index) &&
+               observations_.Allocate(2 * num_observations_) && observations_.Upload(problem_.observations) &&
+               point_offsets_.Allocate(num_points_ + 1) && point_offsets_.Upload(point_offsets.data()) &&
+               point_observations_.Allocate(num_observations_) &&
+               point_observations_.Upload(point_observations.data()) &&
+               parameters_.Allocate(num_parameters_) && parameters_.Upload(problem_.parameters) &&
+               candidate_.Allocate(num_parameters_) && dx_.Allocate(num_parameters_) &&
+               gradient_.Allocate(num_parameters_) &&
+               costs_.Allocate(num_observations_) && residuals_.Allocate(2 * num_observations_) &&
+               J_cameras_.Allocate(18 * num_observations_) && J_points_.Allocate(6 * num_observations_) &&
+               B_.Allocate(81 * num_cameras_) && P_.Allocate(81 * num_cameras_) &&
+               P_inverse_.Allocate(81 * num_cameras_) && C_.Allocate(9 * num_points_) &&
+               C_inverse_.Allocate(9 * num_points_) && v_.Allocate(3 * num_points_) &&
+               w_.Allocate(3 * num_points_) && rhs_.Allocate(9 * num_cameras_) &&
+               r_.Allocate(9 * num_cameras_) && z_.Allocate(9 * num_cameras_) &&
+               p_.Allocate(9 * num_cameras_) && q_.Allocate(9 * num_cameras_) && scalar_.Allocate(1);
+    }
+
+    bool Solve(SolveStats *stats) {
+        const double solve_start = WallTimeInSeconds();
+        double radius = 1e4; // ceres initial_trust_region_radius
+        double decrease_factor = 2.0;
+        double cost, gradient_norm;
+        if (!Linearize(parameters_.data(), stats, &cost) || !MaxAbs(gradient_.data(), num_parameters_,
+                                                                      &gradient_norm)) {
+            return false;
+        }
+        stats->initial_cost = cost;
+        IterationStats initial;
+        initial.cost = cost;
+        initial.cumulative_time = WallTimeInSeconds() - solve_start;
+        stats->iterations.push_back(initial);
+        if (options_.verbose) {
+            printf("iter      cost      cost_change  |gradient|   |step|    tr_ratio  tr_radius\n");
+            printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", 0, cost, 0.0,
+                   gradient_norm, 0.0, 0.0, radius);
+        }
+
+        const char *termination = "maximum number of iterations";
+        const bool go_on = ContinueSolve(options_, initial, 0.0, 0.0, true, &termination);
+        for (int iteration = 1; go_on && iteration <= options_.max_iterations; ++iteration) {
+            const double iteration_start = WallTimeInSeconds();
+            if (gradient_norm <= options_.gradient_tolerance) {
+                termination = "gradient tolerance";
+                break;
+            }
+
+            const double mu = 1.0 / radius;
+            double step_norm = 0, x_norm = 0, model_decrease = 0, new_cost = cost, ratio = 0;
+            if (!SolveDampedSystem(mu, stats) ||
+                !Dot(dx_.data(), dx_.data(), num_parameters_, &step_norm) ||
+                !Dot(parameters_.data(), parameters_.data(), num_parameters_, &x_norm)) {
+                return false;
+            }
+            step_norm = std::sqrt(step_norm);
+            x_norm = std::sqrt(x_norm);
+            bool accepted = false;
+            if (std::isfinite(step_norm)) {
+                if (step_norm <= options_.parameter_tolerance * (x_norm + options_.parameter_tolerance)) {
+                    termination = "parameter tolerance";
+                    break;
+                }
+                const double evaluation_start = WallTimeInSeconds();
+                AddKernel<<<NumBlocks(num_parameters_), kBlockSize>>>(num_parameters_, parameters_.data(),
+                                                                      dx_.data(), candidate_.data());
+                CostKernel<<<NumBlocks(num_observations_), kBlockSize>>>(
+                        num_observations_, num_cameras_, candidate_.data(), camera_index_.data(),
+                        point_index_.data(), observations_.data(), loss_, costs_.data());
+                if (!Sum(costs_.data(), num_observations_, &new_cost)) return false;
+                stats->residual_evaluation_time += WallTimeInSeconds() - evaluation_start;
+
+                ModelDecreaseKernel<<<NumBlocks(num_observations_), kBlockSize>>>(
+                        num_observations_, num_cameras_, camera_index_.data(), point_index_.data(),
+                        residuals_.data(), J_cameras_.data(), J_points_.data(), dx_.data(), costs_.data());
+                if (!Sum(costs_.data(), num_observations_, &model_decrease)) return false;
+                ratio = (cost - new_cost) / model_decrease;
+                accepted = std::isfinite(new_cost) && model_decrease > 0 && ratio > 1e-3;
+            }
+
+            if (accepted) {
+                // ceres: radius / max(1/3, 1 - (2 ratio - 1)^3)
+                radius = std::min(1e16, radius / std::max(1.0 / 3.0, 1.0 - std::pow(2.0 * ratio - 1.0, 3)));
+                decrease_factor = 2.0;
+                parameters_.Swap(candidate_);
+                const double cost_change = cost - new_cost;
+                if (!Linearize(parameters_.data(), stats, &cost) ||
+                    !MaxAbs(gradient_.data(), num_parameters_, &gradient_norm)) {
+                    return false;
+                }
+                RecordIteration(stats, iteration, cost, iteration_start, solve_start);
+                if (options_.verbose) {
+                    printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", iteration, cost,
+                           cost_change, gradient_norm, step_norm, ratio, radius);
+                }
+                if (cost_change <= options_.function_tolerance * cost) {
+                    termination = "function tolerance";
+                    break;
+                }
+                if (!ContinueSolve(options_, stats->iterations.back(), cost_change, step_norm, true, &termination)) {
+                    break;
+                }
+            } else {
+                radius /= decrease_factor;
+                decrease_factor *= 2.0;
+                RecordIteration(stats, iteration, cost, iteration_start, solve_start);
+                if (options_.verbose) {
+                    printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", iteration, cost,
+                           0.0, gradient_norm, step_norm, ratio, radius);
+                }
+                if (radius < 1e-32) {
+                    termination = "trust region radius below minimum";
+                    break;
+                }
+                if (!ContinueSolve(options_, stats->iterations.back(), 0.0, step_norm, false, &termination)) {
+                    break;
+                }
+            }
+        }
+
+        stats->final_cost = cost;
+        stats->solve_time = WallTimeInSeconds() - solve_start;
+        if (options_.verbose) {
+            std::cout << "cuda BA: " << stats->iterations.size() - 1 << " iterations, " << linear_iterations_
+                      << " PCG iterations, cost " << stats->initial_cost << " -> " << stats->final_cost << ", "
+                      << termination << std::endl;
+        }
+        return parameters_.Download(problem_.parameters);
+    }
+
+private:
+    CudaBASolver(const CudaBASolver &);
+    CudaBASolver &operator=(const CudaBASolver &);
+
+    // residuals, Jacobians, gradient and the blocks B, C of J^T J at parameters, cost the sum of the costs
+    bool Linearize(const double *parameters, SolveStats *stats, double *cost) {
+        const double start = WallTimeInSeconds();
+        LinearizeKernel<<<NumBlocks(num_observations_), kBlockSize>>>(
+                num_observations_, num_cameras_, parameters, camera_index_.data(), point_index_.data(),
+                observations_.data(), loss_, costs_.data(), residuals_.data(), J_cameras_.data(), J_points_.data());
+        if (!B_.Zero() || !gradient_.Zero()) return false;
+        CameraNormalEquationsKernel<<<NumBlocks(num_observations_), kBlockSize>>>(
+                num_observations_, camera_index_.data(), residuals_.data(), J_cameras_.data(), B_.data(),
+                gradient_.data());
+        PointNormalEquationsKernel<<<NumBlocks(num_points_), kBlockSize>>>(
+                num_points_, point_offsets_.data(), point_observations_.data(), residuals_.data(), J_points_.data(),
+                C_.data(), gradient_.data() + 9 * num_cameras_);
+        const bool ok = Sum(costs_.data(), num_observations_, cost);
+        stats->jacobian_evaluation_time += WallTimeInSeconds() - start;
+        return ok;
+    }
+
+    // S x into y, S = B + mu D - E C^-1 E^T of the damped C, without forming it
+    void SchurProduct(double mu, const double *x, double *y) {
+        SchurPointKernel<<<NumBlocks(num_points_), kBlockSize>>>(
+                num_points_, point_offsets_.data(), point_observations_.data(), camera_index_.data(),
+                J_cameras_.data(), J_points_.data(), C_inverse_.data(), x, w_.data());
+        SchurCameraInitKernel<<<NumBlocks(num_cameras_), kBlockSize>>>(num_cameras_, mu, B_.data(), x, y);
+        SchurObservationKernel<<<NumBlocks(num_observations_), kBlockSize>>>(
+                num_observations_, camera_index_.data(), point_index_.data(), J_cameras_.data(), J_points_.data(),
+                x, w_.data(), y);
+    }
+
+    /**
+     * (J^T J + mu D) dx = -g into dx_: the reduced camera system by PCG to
+     * |r| <= eta |rhs| (at most --max_linear_iterations), then the points.
+     */
+    bool SolveDampedSystem(double mu, SolveStats *stats) {
+        const double linear_start = WallTimeInSeconds();
+        const int n = 9 * num_cameras_;
+        double *dx_cameras = dx_.data();
+
+        PointInverseKernel<<<NumBlocks(num_points_), kBlockSize>>>(
+                num_points_, mu, C_.data(), gradient_.data() + n, C_inverse_.data(), v_.data());
+        CameraInitKernel<<<NumBlocks(num_cameras_), kBlockSize>>>(num_cameras_, mu, B_.data(), gradient_.data(),
+                                                                  rhs_.data(), P_.data());
+        ReducedSystemKernel<<<NumBlocks(num_observations_), kBlockSize>>>(
+                num_observations_, camera_index_.data(), point_index_.data(), J_cameras_.data(), J_points_.data(),
+                C_inverse_.data(), v_.data(), rhs_.data(), P_.data());
+        CameraInverseKernel<<<NumBlocks(num_cameras_), kBlockSize>>>(num_cameras_, P_.data(), P_inverse_.data());
+
+        // PCG from dx_c = 0
+        double rhs_norm, rz;
+        if (!CudaOk(cudaMemset(dx_cameras, 0, n * sizeof(double)), "cudaMemset") ||
+            !CudaOk(cudaMemcpy(r_.data(), rhs_.data(), n * sizeof(double), cudaMemcpyDeviceToDevice),
+                    "cudaMemcpy") ||
+            !Dot(rhs_.data(), rhs_.data(), n, &rhs_norm)) {
+            return false;
+        }
+        rhs_norm = std::sqrt(rhs_norm);
+        PreconditionKernel<<<NumBlocks(num_cameras_), kBlockSize>>>(num_cameras_, P_inverse_.data(), r_.data(),
+                                                                    p_.data());
+        if (!Dot(r_.data(), p_.data(), n, &rz)) return false;
+        for (int k = 0; k < options_.max_linear_iterations && rhs_norm > 0; ++k) {
+            ++linear_iterations_;
+            SchurProduct(mu, p_.data(), q_.data());
+            double pq, r_norm;
+            if (!Dot(p_.data(), q_.data(), n, &pq)) return false;
+            if (!(pq > 0)) break; // S is positive definite, only rounding gets here
+            const double alpha = rz / pq;
+            AxpyKernel<<<NumBlocks(n), kBlockSize>>>(n, alpha, p_.data(), dx_cameras);
+            AxpyKernel<<<NumBlocks(n), kBlockSize>>>(n, -alpha, q_.data(), r_.data());
+            if (!Dot(r_.data(), r_.data(), n, &r_norm)) return false;
+            if (std::sqrt(r_norm) <= options_.eta * rhs_norm) break;
+
+            PreconditionKernel<<<NumBlocks(num_cameras_), kBlockSize>>>(num_cameras_, P_inverse_.data(),
+                                                                        r_.data(), z_.data());
+            double rz_next;
+            if (!Dot(r_.data(), z_.data(), n, &rz_next)) return false;
+            XpbyKernel<<<NumBlocks(n), kBlockSize>>>(n, z_.data(), rz_next / rz, p_.data());
+            rz = rz_next;
+        }
+
+        // dx_p = -C^-1 (g_p + E^T dx_c)
+        SchurPointKernel<<<NumBlocks(num_points_), kBlockSize>>>(
+                num_points_, point_offsets_.data(), point_observations_.data(), camera_index_.data(),
+                J_cameras_.data(), J_points_.data(), C_inverse_.data(), dx_cameras, w_.data());
+        BackSubstitutionKernel<<<NumBlocks(3 * num_points_), kBlockSize>>>(3 * num_points_, v_.data(), w_.data(),
+                                                                            dx_cameras + n);
+        const bool ok = CudaOk(cudaDeviceSynchronize(), "linear solver");
+        stats->linear_solver_time += WallTimeInSeconds() - linear_start;
+        return ok;
+    }
+
+    // *result = x . y, or the sum of x with y NULL, copied back
+    bool Dot(const double *x, const double *y, int n, double *result) {
+        if (!scalar_.Zero()) return false;
+        DotKernel<<<NumReduceBlocks(n), kBlockSize>>>(n, x, y, scalar_.data());
+        return CudaOk(cudaGetLastError(), "reduction") && scalar_.Download(result);
+    }
+
+    bool Sum(const double *x, int n, double *result) {
+        return Dot(x, NULL, n, result);
+    }
+
+    bool MaxAbs(const double *x, int n, double *result) {
+        if (!scalar_.Zero()) return false;
+        MaxAbsKernel<<<NumReduceBlocks(n), kBlockSize>>>(n, x, scalar_.data());
+        return CudaOk(cudaGetLastError(), "reduction") && scalar_.Download(result);
+    }
+
+    void RecordIteration(SolveStats *stats, int iteration, double cost, double iteration_start, double solve_start) {
+        IterationStats it;
+        it.iteration = iteration;
+        it.cost = cost;
+        it.time = WallTimeInSeconds() - iteration_start;
+        it.cumulative_time = WallTimeInSeconds() - solve_start;
+        stats->iterations.push_back(it);
+    }
+
+    const CudaBAProblem &problem_;
+    const BAOptions &options_;
+    const int num_cameras_;
+    const int num_points_;
+    const int num_observations_;
+    const int num_parameters_;
+    DeviceLoss loss_;
+    long linear_iterations_;
+
+    // the problem, uploaded once; parameters are cameras then points, as in BALProblem
+    DeviceArray<int> camera_index_, point_index_, point_offsets_, point_observations_;
+    DeviceArray<double> observations_, parameters_, candidate_;
+
+    // per linearization
+    DeviceArray<double> costs_, residuals_, J_cameras_, J_points_, gradient_, B_, C_;
+
+    // per damped system
+    DeviceArray<double> C_inverse_, v_, w_, P_, P_inverse_, rhs_, dx_;
+    DeviceArray<double> r_, z_, p_, q_; // PCG
+    DeviceArray<double> scalar_;
+};
+
+} // namespace
+
+bool SolveBACudaArrays(const CudaBAProblem &problem, const BAOptions &ba_options, SolveStats *stats) {
+    const double setup_start = WallTimeInSeconds();
+    SolveStats local_stats;
+    if (stats == NULL) stats = &local_stats;
+    *stats = SolveStats();
+    if (ba_options.verbose) {
+        cudaDeviceProp properties;
+        int device = 0;
+        if (CudaOk(cudaGetDevice(&device), "cudaGetDevice") &&
+            CudaOk(cudaGetDeviceProperties(&properties, device), "cudaGetDeviceProperties")) {
+            std::cout << "Solving cuda BA on " << properties.name << " ..." << std::endl;
+        }
+    }
+    const BAOptions options = WithSolveControl(ba_options);
+    CudaBASolver solver(problem, options);
+    if (!solver.Setup()) {
+        return false;
+    }
+    stats->setup_time = WallTimeInSeconds() - setup_start;
+    return solver.Solve(stats);
+}
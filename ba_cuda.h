@@ -0,0 +1,59 @@
+#ifndef BA_CUDA_H
+#define BA_CUDA_H
+
+// bundle adjustment on a CUDA device (ba_cuda.cu), built with BA_WITH_CUDA when CMake finds a CUDA compiler
+
+#include "ba_options.h"
+#include "ba_stats.h"
+
+/**
+ * The arrays of a BALProblem with angle-axis cameras, what ba_cuda.cu sees
+ * of it: common.h defines BALProblem outside the class, so only one
+ * translation unit of a program may include it.
+ */
+struct CudaBAProblem {
+    int num_cameras;
+    int num_points;
+    int num_observations;
+    const int *camera_index;
+    const int *point_index;
+    const double *observations;
+    double *parameters; // 9 per camera, then 3 per point, updated in place
+};
+
+/**
+ * Levenberg-Marquardt on the device, as NativeBASolver on the host: the
+ * problem is uploaded once, residuals, Jacobians and the normal equations of
+ * the points are evaluated in kernels, the reduced camera system is solved by
+ * PCG on implicit Schur complement products (preconditioned by the 9x9
+ * diagonal blocks of S, SCHUR_JACOBI), and only the optimized parameters are
+ * copied back. Returns false on CUDA errors, the parameters are then left as
+ * they were.
+ */
+bool SolveBACudaArrays(const CudaBAProblem &problem, const BAOptions &ba_options, SolveStats *stats);
+
+#ifndef __CUDACC__
+#include <iostream>
+#include "common.h"
+#include "profiler.h"
+
+// optimize bal_problem in place on the device, see SolveBACudaArrays()
+inline bool SolveBACuda(BALProblem &bal_problem, const BAOptions &ba_options, SolveStats *stats = NULL) {
+    if (bal_problem.camera_block_size() != 9) {
+        std::cerr << "Error: the CUDA backend only has angle-axis cameras" << std::endl;
+        return false;
+    }
+    CudaBAProblem problem;
+    problem.num_cameras = bal_problem.num_cameras();
+    problem.num_points = bal_problem.num_points();
+    problem.num_observations = bal_problem.num_observations();
+    problem.camera_index = bal_problem.camera_index();
+    problem.point_index = bal_problem.point_index();
+    problem.observations = bal_problem.observations();
+    problem.parameters = bal_problem.mutable_cameras();
+    ScopedTimer timer("cuda solve");
+    return SolveBACudaArrays(problem, ba_options, stats);
+}
+#endif
+
+#endif // BA_CUDA_H
@@ -0,0 +1,350 @@
+#ifndef BA_DISTRIBUTED_H
+#define BA_DISTRIBUTED_H
+
+// bundle adjustment split over the ranks of a Communicator, consensus on the shared points by ADMM
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <vector>
+#include <ceres/ceres.h>
+#include "ba_ceres.h"
+#include "ba_graph.h"
+#include "ba_options.h"
+#include "ba_stats.h"
+#include "common.h"
+#include "communicator.h"
+#include "profiler.h"
+#include "SnavelyReprojectionError.h"
+
+/**
+ * The cameras of one rank, all points they observe and their observations,
+ * in local indices. A point observed from several partitions is shared, every
+ * partition holding it keeps its own copy and the copies are pulled together
+ * by the consensus term.
+ */
+struct BALPartition {
+    std::vector<int> cameras; // BAL camera index of every local camera
+    std::vector<int> points; // BAL point index of every local point
+    std::vector<double> camera_parameters;
+    std::vector<double> point_parameters;
+    std::vector<int> camera_index; // local camera and point of every observation
+    std::vector<int> point_index;
+    std::vector<double> observations;
+    std::vector<int> shared; // index of every local point among the shared points, -1 if not shared
+    std::vector<char> owned; // the local copy of the point is the one written back
+};
+
+/**
+ * Partition of every camera: contiguous ranges of camera indices with about
+ * the same number of observations each. BAL cameras are mostly in capture
+ * order, so neighbouring cameras see the same points and few points end up
+ * shared.
+ */
+inline std::vector<int> PartitionCameras(const BALProblem &bal_problem, int num_partitions) {
+    std::vector<long> observations(bal_problem.num_cameras() + 1, 0);
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        ++observations[bal_problem.camera_index()[i] + 1];
+    }
+    for (int c = 0; c < bal_problem.num_cameras(); ++c) {
+        observations[c + 1] += observations[c];
+    }
+    std::vector<int> camera_partition(bal_problem.num_cameras());
+    for (int c = 0; c < bal_problem.num_cameras(); ++c) {
+        // partition of the middle of the camera's observations
+        const long middle = (observations[c] + observations[c + 1]) / 2;
+        camera_partition[c] = static_cast<int>(std::min<long>(
+                num_partitions - 1, middle * num_partitions / std::max<long>(1, observations.back())));
+    }
+    return camera_partition;
+}
+
+/**
+ * Copy partition p of camera_partition out of bal_problem. Every rank
+ * computes the same numbering of the shared points, returns how many there
+ * are in total.
+ */
+inline int ExtractPartition(const BALProblem &bal_problem, const std::vector<int> &camera_partition, int p,
+                            BALPartition *partition) {
+    const int *camera_index = bal_problem.camera_index();
+    const int *point_index = bal_problem.point_index();
+
+    // the partition of the first observation of a point owns it
+    std::vector<int> owner(bal_problem.num_points(), -1);
+    std::vector<char> is_shared(bal_problem.num_points(), 0);
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        const int q = camera_partition[camera_index[i]];
+        int &first = owner[point_index[i]];
+        if (first < 0) {
+            first = q;
+        } else if (first != q) {
+            is_shared[point_index[i]] = 1;
+        }
+    }
+    std::vector<int> shared_index(bal_problem.num_points(), -1);
+    int num_shared = 0;
+    for (int j = 0; j < bal_problem.num_points(); ++j) {
+        if (is_shared[j]) shared_index[j] = num_shared++;
+    }
+
+    const int camera_block_size = bal_problem.camera_block_size();
+    const int point_block_size = bal_problem.point_block_size();
+    std::vector<int> local_camera(bal_problem.num_cameras(), -1);
+    for (int c = 0; c < bal_problem.num_cameras(); ++c) {
+        if (camera_partition[c] != p) continue;
+        local_camera[c] = static_cast<int>(partition->cameras.size());
+        partition->cameras.push_back(c);
+        const double *camera = bal_problem.cameras() + camera_block_size * c;
+        partition->camera_parameters.insert(partition->camera_parameters.end(),
+                                            camera, camera + camera_block_size);
+    }
+    std::vector<int> local_point(bal_problem.num_points(), -1);
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        const int c = camera_index[i];
+        if (local_camera[c] < 0) continue;
+        const int j = point_index[i];
+        if (local_point[j] < 0) {
+            local_point[j] = static_cast<int>(partition->points.size());
+            partition->points.push_back(j);
+            const double *point = bal_problem.points() + point_block_size * j;
+            partition->point_parameters.insert(partition->point_parameters.end(),
+                                               point, point + point_block_size);
+            partition->shared.push_back(shared_index[j]);
+            partition->owned.push_back(owner[j] == p);
+        }
+        partition->camera_index.push_back(local_camera[c]);
+        partition->point_index.push_back(local_point[j]);
+        partition->observations.push_back(bal_problem.observations()[2 * i + 0]);
+        partition->observations.push_back(bal_problem.observations()[2 * i + 1]);
+    }
+    return num_shared;
+}
+
+/**
+ * 0.5 * rho * |x - (z - u)|^2, the augmented Lagrangian term of a shared
+ * point: z is the consensus, u the scaled dual variable of this copy. Both
+ * and rho are read at every evaluation, so they can change between solves.
+ */
+class ConsensusPrior : public ceres::SizedCostFunction<3, 3> {
+public:
+    ConsensusPrior(const double *target, const double *sqrt_rho) : target_(target), sqrt_rho_(sqrt_rho) {}
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const {
+        const double sqrt_rho = *sqrt_rho_;
+        for (int k = 0; k < 3; ++k) {
+            residuals[k] = sqrt_rho * (parameters[0][k] - target_[k]);
+        }
+        if (jacobians != NULL && jacobians[0] != NULL) {
+            std::fill(jacobians[0], jacobians[0] + 9, 0.0);
+            jacobians[0][0] = jacobians[0][4] = jacobians[0][8] = sqrt_rho;
+        }
+        return true;
+    }
+
+private:
+    const double *target_;
+    const double *sqrt_rho_;
+};
+
+// robustified reprojection cost of the observations of partition, without the consensus terms
+inline double PartitionCost(const BALPartition &partition, const ceres::LossFunction *loss_function) {
+    double cost = 0;
+    for (size_t i = 0; i < partition.camera_index.size(); ++i) {
+        const SnavelyReprojectionError error(partition.observations[2 * i + 0], partition.observations[2 * i + 1]);
+        double residuals[2];
+        error(&partition.camera_parameters[9 * partition.camera_index[i]],
+              &partition.point_parameters[3 * partition.point_index[i]], residuals);
+        const double s = residuals[0] * residuals[0] + residuals[1] * residuals[1];
+        double rho[3] = {s, 1.0, 0.0};
+        if (loss_function != NULL) loss_function->Evaluate(s, rho);
+        cost += 0.5 * rho[0];
+    }
+    return cost;
+}
+
+/**
+ * Consensus ADMM over the cameras of bal_problem split into one partition
+ * per rank of communicator. Every rank loads the same bal_problem and calls
+ * this with the same ba_options; each optimizes its cameras and the points
+ * they observe with ceres, shared points x_k in partition k are tied to their
+ * consensus z by the scaled augmented Lagrangian:
+ *
+ *   x_k = argmin f_k(x_k) + rho/2 |x_k - z + u_k|^2     (--admm_local_iterations LM steps)
+ *   z   = mean over k of (x_k + u_k)                    (one AllReduceSum)
+ *   u_k = u_k + x_k - z
+ *
+ * until the RMS primal |x_k - z| and dual rho |z - z_prev| residuals drop below
+ * --admm_tolerance. rho is rebalanced when one residual is 10x the other.
+ * The result is written back on rank 0, the only one filling stats.
+ */
+inline void SolveBADistributed(BALProblem &bal_problem, const BAOptions &ba_options, Communicator *communicator,
+                               SolveStats *stats = NULL) {
+    const double setup_start = WallTimeInSeconds();
+    const int rank = communicator->rank();
+    const bool root = rank == 0;
+    const int num_partitions = communicator->size();
+    const std::vector<int> camera_partition =
+            ba_options.partitioning == "graph" ? ClusterCameras(bal_problem, num_partitions, ba_options.num_threads)
+                                               : PartitionCameras(bal_problem, num_partitions);
+    BALPartition partition;
+    const int num_shared = ExtractPartition(bal_problem, camera_partition, rank, &partition);
+
+    std::unique_ptr<ceres::LossFunction> loss_function(CreateLossFunction(ba_options));
+    ceres::Problem::Options problem_options;
+    problem_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+    ceres::Problem problem(problem_options);
+    const bool analytic = ba_options.jacobian == "analytic";
+    for (size_t i = 0; i < partition.camera_index.size(); ++i) {
+        ceres::CostFunction *cost_function = SnavelyReprojectionError::Create(
+                partition.observations[2 * i + 0], partition.observations[2 * i + 1], analytic, NULL,
+                EvaluationPrecisionOf(ba_options));
+        problem.AddResidualBlock(cost_function, loss_function.get(),
+                                 &partition.camera_parameters[9 * partition.camera_index[i]],
+                                 &partition.point_parameters[3 * partition.point_index[i]]);
+    }
+
+    // consensus z, dual u and z - u of the local shared points, all copies start out equal
+    std::vector<int> shared_points;
+    for (size_t j = 0; j < partition.points.size(); ++j) {
+        if (partition.shared[j] >= 0) shared_points.push_back(static_cast<int>(j));
+    }
+    const int num_local_shared = static_cast<int>(shared_points.size());
+    std::vector<double> z(3 * num_local_shared), u(3 * num_local_shared, 0.0), target(3 * num_local_shared);
+    for (int s = 0; s < num_local_shared; ++s) {
+        std::copy(&partition.point_parameters[3 * shared_points[s]],
+                  &partition.point_parameters[3 * shared_points[s]] + 3, &z[3 * s]);
+    }
+    double rho = ba_options.admm_rho;
+    double sqrt_rho = std::sqrt(rho);
+    for (int s = 0; s < num_local_shared; ++s) {
+        problem.AddResidualBlock(new ConsensusPrior(&target[3 * s], &sqrt_rho), NULL,
+                                 &partition.point_parameters[3 * shared_points[s]]);
+    }
+
+    ceres::Solver::Options options;
+    SetSolverOptions(ba_options, &options);
+    options.minimizer_progress_to_stdout = false;
+    options.max_num_iterations = ba_options.admm_local_iterations;
+
+    double totals[4] = {PartitionCost(partition, loss_function.get()), 0.0, 0.0, 0.0};
+    communicator->AllReduceSum(totals, 1);
+    if (stats != NULL) {
+        stats->setup_time = WallTimeInSeconds() - setup_start;
+        stats->initial_cost = totals[0];
+        stats->iterations.assign(1, IterationStats());
+        stats->iterations[0].cost = totals[0];
+    }
+    if (root && ba_options.verbose) {
+        std::cout << communicator->size() << " partitions, " << num_shared << " shared points" << std::endl;
+        std::cout << "iter      cost      primal      dual       rho    iter_time" << std::endl;
+    }
+
+    const double solve_start = WallTimeInSeconds();
+    std::vector<double> consensus(4 * num_shared);
+    double final_cost = totals[0];
+    for (int iteration = 1; iteration <= ba_options.admm_iterations; ++iteration) {
+        const double iteration_start = WallTimeInSeconds();
+        for (int k = 0; k < 3 * num_local_shared; ++k) {
+            target[k] = z[k] - u[k];
+        }
+        ceres::Solver::Summary summary;
+        ceres::Solve(options, &problem, &summary);
+        if (stats != NULL) {
+            stats->residual_evaluation_time += summary.residual_evaluation_time_in_seconds;
+            stats->jacobian_evaluation_time += summary.jacobian_evaluation_time_in_seconds;
+            stats->linear_solver_time += summary.linear_solver_time_in_seconds;
+        }
+
+        // z = mean of x + u over the copies
+        std::fill(consensus.begin(), consensus.end(), 0.0);
+        for (int s = 0; s < num_local_shared; ++s) {
+            const int j = shared_points[s];
+            double *sum = &consensus[4 * partition.shared[j]];
+            for (int k = 0; k < 3; ++k) {
+                sum[k] += partition.point_parameters[3 * j + k] + u[3 * s + k];
+            }
+            sum[3] += 1.0;
+        }
+        communicator->AllReduceSum(consensus.data(), static_cast<int>(consensus.size()));
+
+        double primal = 0, dual = 0;
+        for (int s = 0; s < num_local_shared; ++s) {
+            const int j = shared_points[s];
+            const double *sum = &consensus[4 * partition.shared[j]];
+            for (int k = 0; k < 3; ++k) {
+                const double z_next = sum[k] / sum[3];
+                const double x = partition.point_parameters[3 * j + k];
+                dual += (z_next - z[3 * s + k]) * (z_next - z[3 * s + k]);
+                primal += (x - z_next) * (x - z_next);
+                u[3 * s + k] += x - z_next;
+                z[3 * s + k] = z_next;
+            }
+        }
+        totals[0] = PartitionCost(partition, loss_function.get());
+        totals[1] = primal;
+        totals[2] = dual;
+        totals[3] = num_local_shared;
+        communicator->AllReduceSum(totals, 4);
+        const double copies = std::max(1.0, 3.0 * totals[3]);
+        const double primal_rms = std::sqrt(totals[1] / copies);
+        const double dual_rms = rho * std::sqrt(totals[2] / copies);
+        final_cost = totals[0];
+
+        const double now = WallTimeInSeconds();
+        if (stats != NULL) {
+            IterationStats it;
+            it.iteration = iteration;
+            it.cost = totals[0];
+            it.time = now - iteration_start;
+            it.cumulative_time = now - solve_start;
+            stats->iterations.push_back(it);
+        }
+        if (root && ba_options.verbose) {
+            std::cout << std::setw(4) << iteration << std::scientific << std::setprecision(6)
+                      << std::setw(14) << totals[0] << std::setprecision(2) << std::setw(10) << primal_rms
+                      << std::setw(10) << dual_rms << std::setw(10) << rho << std::setw(11)
+                      << now - iteration_start << std::defaultfloat << std::endl;
+        }
+        if (primal_rms < ba_options.admm_tolerance && dual_rms < ba_options.admm_tolerance) {
+            break;
+        }
+
+        // residual balancing, u = y / rho scales with 1 / rho
+        if (primal_rms > 10.0 * dual_rms) {
+            rho *= 2.0;
+            for (size_t k = 0; k < u.size(); ++k) u[k] *= 0.5;
+        } else if (dual_rms > 10.0 * primal_rms) {
+            rho *= 0.5;
+            for (size_t k = 0; k < u.size(); ++k) u[k] *= 2.0;
+        }
+        sqrt_rho = std::sqrt(rho);
+    }
+
+    // gather the cameras and the owned copies of the points, shared ones at their consensus
+    for (int s = 0; s < num_local_shared; ++s) {
+        std::copy(&z[3 * s], &z[3 * s] + 3, &partition.point_parameters[3 * shared_points[s]]);
+    }
+    std::vector<double> parameters(bal_problem.num_parameters(), 0.0);
+    for (size_t c = 0; c < partition.cameras.size(); ++c) {
+        std::copy(&partition.camera_parameters[9 * c], &partition.camera_parameters[9 * c] + 9,
+                  &parameters[9 * partition.cameras[c]]);
+    }
+    const int point_offset = 9 * bal_problem.num_cameras();
+    for (size_t j = 0; j < partition.points.size(); ++j) {
+        if (!partition.owned[j]) continue;
+        std::copy(&partition.point_parameters[3 * j], &partition.point_parameters[3 * j] + 3,
+                  &parameters[point_offset + 3 * partition.points[j]]);
+    }
+    communicator->AllReduceSum(parameters.data(), static_cast<int>(parameters.size()));
+    if (root) {
+        std::copy(parameters.begin(), parameters.end(), bal_problem.mutable_cameras());
+    }
+    if (stats != NULL) {
+        stats->solve_time = WallTimeInSeconds() - solve_start;
+        stats->final_cost = final_cost;
+    }
+}
+
+#endif // BA_DISTRIBUTED_H
@@ -0,0 +1,869 @@
+#ifndef BA_G2O_H
+#define BA_G2O_H
+
+// bundle adjustment of a BALProblem with g2o, shared by bundle_adjustment_g2o and ba_benchmark
+
+#include <g2o/core/base_vertex.h>
+#include <g2o/core/base_binary_edge.h>
+#include <g2o/core/block_solver.h>
+#include <g2o/core/optimization_algorithm_levenberg.h>
+#include <g2o/solvers/csparse/linear_solver_csparse.h>
+#include <g2o/solvers/dense/linear_solver_dense.h>
+#include <g2o/solvers/eigen/linear_solver_eigen.h>
+#include <g2o/solvers/pcg/linear_solver_pcg.h>
+#include <g2o/core/robust_kernel_impl.h>
+#include <g2o/core/hyper_graph_action.h>
+#include <g2o/core/sparse_optimizer.h>
+#include <g2o/core/batch_stats.h>
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <sophus/se3.hpp>
+#include "arena.h"
+#include "ba_options.h"
+#include "ba_outliers.h"
+#include "ba_planner.h"
+#include "ba_stats.h"
+#include "common.h"
+#include "profiler.h"
+#include "projection.h"
+#include "projection_kernel.h"
+#include "parallel.h"
+
+/**
+ * Backup of n <= D parameters for BaseVertex::push() / pop(). The vertices
+ * below keep their estimate in BALProblem memory, so the default push() (a
+ * copy of the estimate) would only save the address. The first level, which
+ * is all LM uses, is stored inline.
+ */
+template<int D>
+class ParameterBackup {
+public:
+    ParameterBackup() : size_(0) {}
+
+    void Push(const double *data, int n = D) {
+        assert(n <= D);
+        if (size_ == 0) {
+            std::copy(data, data + n, first_);
+        } else {
+            more_.insert(more_.end(), data, data + n);
+        }
+        ++size_;
+    }
+
+    void Pop(double *data, int n = D) {
+        assert(size_ > 0);
+        --size_;
+        if (size_ == 0) {
+            std::copy(first_, first_ + n, data);
+        } else {
+            std::copy(more_.end() - n, more_.end(), data);
+            more_.resize(more_.size() - n);
+        }
+    }
+
+    void Discard(int n = D) {
+        assert(size_ > 0);
+        --size_;
+        if (size_ > 0) more_.resize(more_.size() - n);
+    }
+
+    int size() const {  return size_;  }
+
+private:
+    double first_[D];
+    std::vector<double> more_;
+    int size_;
+};
+
+/**
+ * camera pose and intrinsics
+ * View of one camera block of BALProblem, [phi(3), t(3), f, k1, k2] or with
+ * --quaternions [q(4), t(3), f, k1, k2], which is optimized in place.
+ * R = exp(phi^) or R(q) is cached.
+ */
+struct PoseAndIntrinsics {
+    PoseAndIntrinsics() : data(NULL), quaternion(false) {}
+
+    // view of given address, a quaternion camera block if use_quaternion
+    explicit PoseAndIntrinsics(double *data_addr, bool use_quaternion = false)
+            : data(data_addr), quaternion(use_quaternion) {
+        update_rotation();
+    }
+
+    // R from data, after data changed
+    void update_rotation() {
+        if (quaternion) {
+            rotation = Sophus::SO3d(Eigen::Quaterniond(data[0], data[1], data[2], data[3]));
+        } else {
+            rotation = Sophus::SO3d::exp(Eigen::Vector3d(data[0], data[1], data[2]));
+        }
+    }
+
+    // data from R, after R changed: a quaternion is copied, an angle-axis needs log()
+    void store_rotation() {
+        if (quaternion) {
+            const Eigen::Quaterniond &q = rotation.unit_quaternion();
+            data[0] = q.w();
+            data[1] = q.x();
+            data[2] = q.y();
+            data[3] = q.z();
+        } else {
+            Eigen::Map<Eigen::Vector3d> angle_axis(data);
+            angle_axis = rotation.log();
+        }
+    }
+
+    // number of parameters of the block, 9 or 10
+    int size() const {  return quaternion ? 10 : 9;  }
+
+    // t, f, k1, k2, after the rotation
+    double *translation_data() const {  return data + (quaternion ? 4 : 3);  }
+
+    Eigen::Map<const Eigen::Vector3d> translation() const {
+        return Eigen::Map<const Eigen::Vector3d>(translation_data());
+    }
+
+    double focal() const {  return translation_data()[3];  }
+
+    double k1() const {  return translation_data()[4];  }
+
+    double k2() const {  return translation_data()[5];  }
+
+    double *data;
+    bool quaternion;
+    Sophus::SO3d rotation;
+};
+
+// set vertex of camera pose and intrinsics, 9 degrees of freedom in either rotation
+class VertexPoseAndIntrinsics : public g2o::BaseVertex<9, PoseAndIntrinsics> {
+public:
+    ARENA_OPERATOR_NEW(VertexPoseAndIntrinsics)
+
+    VertexPoseAndIntrinsics() {}
+
+    virtual void setToOriginImpl() override {
+        std::fill(_estimate.data, _estimate.data + _estimate.size(), 0.0);
+        if (_estimate.quaternion) _estimate.data[0] = 1.0;
+        _estimate.update_rotation();
+    }
+
+    // update, R <- exp(dphi) * R for both rotations
+    virtual void oplusImpl(const double *update) override {
+        _estimate.rotation = Sophus::SO3d::exp(
+                Eigen::Vector3d(update[0], update[1], update[2])) * _estimate.rotation;
+        _estimate.store_rotation();
+        double *rest = _estimate.translation_data();
+        for (int i = 3; i < 9; ++i) rest[i - 3] += update[i];
+    }
+
+    virtual void push() override {  _parameter_backup.Push(_estimate.data, _estimate.size());  }
+
+    virtual void pop() override {
+        _parameter_backup.Pop(_estimate.data, _estimate.size());
+        _estimate.update_rotation();
+    }
+
+    virtual void discardTop() override {  _parameter_backup.Discard(_estimate.size());  }
+
+    virtual int stackSize() const override {  return _parameter_backup.size();  }
+
+    // reprojection
+    Eigen::Vector2d project(const Eigen::Vector3d &point) const {
+        // p_c = Rp + t
+        Eigen::Vector3d pc = _estimate.rotation * point + _estimate.translation();
+        pc = -pc / pc[2]; // normalize, [X/Z, Y/Z, 1]
+        // undistort, r^2 = x^2 + y^2 as in the BAL camera model
+        double r2 = pc.head<2>().squaredNorm();
+        double distortion = 1.0 + r2 * (_estimate.k1() + _estimate.k2() * r2);
+        return Eigen::Vector2d(_estimate.focal() * distortion * pc[0], // undistorted u
+                               _estimate.focal() * distortion * pc[1]); // undistorted v
+    }
+
+    // the same in float, see EdgeProjection::precision
+    Eigen::Vector2f projectFloat(const Eigen::Vector3f &point) const {
+        Eigen::Vector3f pc = _estimate.rotation.matrix().cast<float>() * point +
+                             _estimate.translation().cast<float>();
+        pc = -pc / pc[2];
+        const float r2 = pc.head<2>().squaredNorm();
+        const float distortion = 1.0f + r2 * (float(_estimate.k1()) + float(_estimate.k2()) * r2);
+        return float(_estimate.focal()) * distortion * pc.head<2>();
+    }
+
+    virtual bool read(std::istream &in) {}
+
+    virtual bool write(std::ostream &out) const {}
+
+private:
+    ParameterBackup<10> _parameter_backup;
+};
+
+// view of one point block of BALProblem, optimized in place
+struct PointView {
+    PointView() : data(NULL) {}
+
+    explicit PointView(double *data_addr) : data(data_addr) {}
+
+    Eigen::Map<const Eigen::Vector3d> position() const {
+        return Eigen::Map<const Eigen::Vector3d>(data);
+    }
+
+    double *data;
+};
+
+class VertexPoint : public g2o::BaseVertex<3, PointView> {
+public:
+    ARENA_OPERATOR_NEW(VertexPoint)
+
+    VertexPoint() {}
+
+    virtual void setToOriginImpl() override {
+        std::fill(_estimate.data, _estimate.data + 3, 0.0);
+    }
+
+    // update
+    virtual void oplusImpl(const double *update) override {
+        _estimate.data[0] += update[0];
+        _estimate.data[1] += update[1];
+        _estimate.data[2] += update[2];
+    }
+
+    virtual void push() override {  _parameter_backup.Push(_estimate.data);  }
+
+    virtual void pop() override {  _parameter_backup.Pop(_estimate.data);  }
+
+    virtual void discardTop() override {  _parameter_backup.Discard();  }
+
+    virtual int stackSize() const override {  return _parameter_backup.size();  }
+
+    Eigen::Map<const Eigen::Vector3d> position() const {  return _estimate.position();  }
+
+    virtual bool read(std::istream &in) {}
+
+    virtual bool write(std::ostream &out) const {}
+
+private:
+    ParameterBackup<3> _parameter_backup;
+};
+
+class EdgeProjection : public g2o::BaseBinaryEdge<2, Eigen::Vector2d, VertexPoseAndIntrinsics, VertexPoint> {
+public:
+    ARENA_OPERATOR_NEW(EdgeProjection)
+
+    explicit EdgeProjection(bool numeric_jacobian = false, EvaluationPrecision evaluation_precision = kDoublePrecision)
+            : use_numeric_jacobian(numeric_jacobian), precision(evaluation_precision), observation(-1),
+              _error_precomputed(false), _jacobians_precomputed(false) {}
+
+    virtual void computeError() override {
+        // already evaluated by ParallelComputeErrorAction
+        if (_error_precomputed) {
+            _error_precomputed = false;
+            return;
+        }
+        Profiler::Count(kResidualEvaluations);
+        auto v0 = (VertexPoseAndIntrinsics *) _vertices[0];
+        auto v1 = (VertexPoint *) _vertices[1];
+        if (precision == kSinglePrecision) {
+            auto proj = v0->projectFloat(v1->position().cast<float>());
+            _error = (proj - _measurement.cast<float>()).cast<double>();
+            return;
+        }
+        auto proj = v0->project(v1->position());
+        _error = proj - _measurement;
+    }
+
+    // analytic Jacobians, consistent with the left perturbation R <- exp(dphi) * R in oplusImpl
+    virtual void linearizeOplus() override {
+        if (use_numeric_jacobian) {
+            // use numeric derivatives
+            Profiler::Count(kJacobianEvaluations);
+            g2o::BaseBinaryEdge<2, Eigen::Vector2d, VertexPoseAndIntrinsics, VertexPoint>::linearizeOplus();
+            return;
+        }
+
+        // unless already evaluated by ParallelBlockSolver
+        if (!_jacobians_precomputed) {
+            precomputeJacobians();
+        }
+        _jacobians_precomputed = false;
+        _jacobianOplusXi = _jacobian_xi;
+        _jacobianOplusXj = _jacobian_xj;
+    }
+
+    /**
+     * Thread safe evaluation ahead of the serial loops of g2o: the
+     * results are kept in the edge and picked up by the next
+     * computeError() / linearizeOplus() call.
+     */
+    void precomputeError() {
+        _error_precomputed = false;
+        computeError();
+        _error_precomputed = true;
+    }
+
+    // the same with the error evaluated elsewhere, by the batched kernel
+    void setPrecomputedError(double u, double v) {
+        _error = Eigen::Vector2d(u, v);
+        _error_precomputed = true;
+    }
+
+    void precomputeJacobians() {
+        if (use_numeric_jacobian) {
+            return; // needs the workspace of the optimizer
+        }
+        Profiler::Count(kJacobianEvaluations);
+
+        if (precision == kDoublePrecision) {
+            computeJacobians<double>();
+        } else {
+            computeJacobians<float>();
+        }
+        _jacobians_precomputed = true;
+    }
+
+    // numeric Jacobians instead of linearizeOplus(), for validation
+    bool use_numeric_jacobian;
+
+    // float Jacobians (kMixedPrecision), also float errors (kSinglePrecision)
+    EvaluationPrecision precision;
+
+    // index of the observation in the BALProblem
+    int observation;
+
+    virtual bool read(std::istream &in) {}
+
+    virtual bool write(std::ostream &out) const {}
+
+private:
+    template<typename Scalar>
+    void computeJacobians() {
+        typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+        auto v0 = (VertexPoseAndIntrinsics *) _vertices[0];
+        auto v1 = (VertexPoint *) _vertices[1];
+        const PoseAndIntrinsics &camera = v0->estimate();
+
+        // P = RX + t
+        const Eigen::Matrix<Scalar, 3, 3> R = camera.rotation.matrix().template cast<Scalar>();
+        const Vector3 RX = R * v1->position().template cast<Scalar>();
+        const Vector3 P = RX + camera.translation().template cast<Scalar>();
+        const Scalar intrinsics[3] = {Scalar(camera.focal()), Scalar(camera.k1()), Scalar(camera.k2())};
+
+        Scalar prediction[2];
+        Eigen::Matrix<Scalar, 2, 3, Eigen::RowMajor> J_P, J_intrinsics;
+        DistortedProjectionJacobian(P.data(), intrinsics, prediction, J_P.data(), J_intrinsics.data());
+
+        // d(exp(dphi) R X) / d(dphi) = -hat(RX), d(P) / d(t) = I
+        _jacobian_xi.block<2, 3>(0, 0) = (-J_P * Sophus::SO3<Scalar>::hat(RX)).template cast<double>();
+        _jacobian_xi.block<2, 3>(0, 3) = J_P.template cast<double>();
+        _jacobian_xi.block<2, 3>(0, 6) = J_intrinsics.template cast<double>();
+
+        // d(P) / d(X) = R
+        _jacobian_xj = (J_P * R).template cast<double>();
+    }
+
+    bool _error_precomputed;
+    bool _jacobians_precomputed;
+    Eigen::Matrix<double, 2, 9> _jacobian_xi;
+    Eigen::Matrix<double, 2, 3> _jacobian_xj;
+};
+
+/**
+ * Every edge deletes its robust kernel, so the edges cannot point to one
+ * kernel directly. Each gets this small forwarder out of the arena instead,
+ * and they all evaluate the same kernel.
+ */
+class SharedRobustKernel : public g2o::RobustKernel {
+public:
+    ARENA_OPERATOR_NEW(SharedRobustKernel)
+
+    explicit SharedRobustKernel(const g2o::RobustKernel *kernel) : kernel_(kernel) {
+        setDelta(kernel->delta());
+    }
+
+    virtual void robustify(double squared_error, Eigen::Vector3d &rho) const override {
+        kernel_->robustify(squared_error, rho);
+    }
+
+private:
+    const g2o::RobustKernel *kernel_;
+};
+
+/**
+ * Evaluates the errors of all active edges on the pool, right before the
+ * serial loop of SparseOptimizer::computeActiveErrors(). The vertices are
+ * views of the parameters of bal_problem, so errors in double go through
+ * the batched kernel (ObservationBlocks), one camera at a time, and are
+ * handed to the edges of the observations; float errors edge by edge.
+ */
+class ParallelComputeErrorAction : public g2o::HyperGraphAction {
+public:
+    ParallelComputeErrorAction(ThreadPool *pool, const BALProblem &bal_problem, EvaluationPrecision precision)
+            : pool_(pool), problem_(bal_problem),
+              blocks_(precision != kSinglePrecision ? new ObservationBlocks(bal_problem) : NULL) {}
+
+    virtual g2o::HyperGraphAction *operator()(const g2o::HyperGraph *graph,
+                                              g2o::HyperGraphAction::Parameters *parameters = 0) override {
+        const g2o::SparseOptimizer *optimizer = static_cast<const g2o::SparseOptimizer *>(graph);
+        const g2o::OptimizableGraph::EdgeContainer &edges = optimizer->activeEdges();
+        if (!blocks_) {
+            pool_->ParallelFor(static_cast<int>(edges.size()), [&](int begin, int end) {
+                for (int i = begin; i < end; ++i) {
+                    static_cast<EdgeProjection *>(edges[i])->precomputeError();
+                }
+            });
+            return this;
+        }
+        pool_->ParallelFor(blocks_->num_cameras(), [&](int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                blocks_->EvaluateCamera(problem_, c);
+            }
+        }, 1);
+        const double *ru = blocks_->residuals_u();
+        const double *rv = blocks_->residuals_v();
+        pool_->ParallelFor(static_cast<int>(edges.size()), [&](int begin, int end) {
+            Profiler::Count(kResidualEvaluations, end - begin);
+            for (int i = begin; i < end; ++i) {
+                EdgeProjection *edge = static_cast<EdgeProjection *>(edges[i]);
+                const int k = blocks_->position(edge->observation);
+                edge->setPrecomputedError(ru[k], rv[k]);
+            }
+        });
+        return this;
+    }
+
+private:
+    ThreadPool *pool_;
+    const BALProblem &problem_;
+    std::unique_ptr<ObservationBlocks> blocks_; // NULL for float errors
+};
+
+// linearizes all active edges on the pool before building the system as usual
+template<typename Traits>
+class ParallelBlockSolver : public g2o::BlockSolver<Traits> {
+public:
+    ParallelBlockSolver(std::unique_ptr<typename g2o::BlockSolver<Traits>::LinearSolverType> linear_solver,
+                        ThreadPool *pool)
+            : g2o::BlockSolver<Traits>(std::move(linear_solver)), pool_(pool) {}
+
+    virtual bool buildSystem() override {
+        const g2o::OptimizableGraph::EdgeContainer &edges = this->_optimizer->activeEdges();
+        pool_->ParallelFor(static_cast<int>(edges.size()), [&](int begin, int end) {
+            for (int i = begin; i < end; ++i) {
+                static_cast<EdgeProjection *>(edges[i])->precomputeJacobians();
+            }
+        });
+        return g2o::BlockSolver<Traits>::buildSystem();
+    }
+
+private:
+    ThreadPool *pool_;
+};
+
+// the iteration a post-iteration action is run for, 0 being the initial state
+inline int PostIteration(g2o::HyperGraphAction::Parameters *parameters, int previous) {
+    auto *iteration = dynamic_cast<g2o::HyperGraphAction::ParametersIteration *>(parameters);
+    return iteration != NULL ? iteration->iteration + 1 : previous + 1;
+}
+
+/**
+ * The cost after every iteration, shared by the actions below, and the
+ * stopping rule g2o's LM does not have: --function_tolerance, as ceres and
+ * the native solver (stop once an iteration decreases the cost by less than
+ * that fraction). It owns the force stop flag of the optimizer, checked
+ * before the next iteration.
+ *
+ * Only the initial cost is evaluated. A g2o iteration ends on an accepted
+ * step, whose trial errors are those of the current estimate, or on rejected
+ * ones, after LM popped the parameters back; their trial costs are not lower,
+ * so the activeRobustChi2() of the last trial is the new cost if it is lower
+ * and the cost stays otherwise. g2o keeps its actions in a set, so readers
+ * ask At() for their iteration instead of relying on the order.
+ */
+class IterationCostAction : public g2o::HyperGraphAction {
+public:
+    IterationCostAction(g2o::SparseOptimizer *optimizer, double function_tolerance)
+            : optimizer_(optimizer), function_tolerance_(function_tolerance), stop_(false), iteration_(0),
+              cost_(0), cost_change_(0) {}
+
+    // before optimize(): the flag, and the cost of iteration 0
+    void Start() {
+        stop_ = false;
+        iteration_ = 0;
+        optimizer_->setForceStopFlag(&stop_);
+        optimizer_->computeActiveErrors();
+        cost_ = 0.5 * optimizer_->activeRobustChi2();
+        cost_change_ = 0;
+    }
+
+    // after optimize(), the flag points here
+    void Finish() {
+        optimizer_->setForceStopFlag(NULL);
+    }
+
+    // ends the solve before the next iteration
+    void Stop() {  stop_ = true;  }
+
+    // the cost after iteration and its decrease, 0 for a rejected step
+    double At(int iteration, double *cost_change = NULL) {
+        if (iteration != iteration_) {
+            const double cost = 0.5 * optimizer_->activeRobustChi2();
+            cost_change_ = cost < cost_ ? cost_ - cost : 0.0;
+            cost_ = std::min(cost_, cost);
+            iteration_ = iteration;
+        }
+        if (cost_change != NULL) *cost_change = cost_change_;
+        return cost_;
+    }
+
+    virtual g2o::HyperGraphAction *operator()(const g2o::HyperGraph *graph,
+                                              g2o::HyperGraphAction::Parameters *parameters = 0) override {
+        double cost_change;
+        const double cost = At(PostIteration(parameters, iteration_), &cost_change);
+        if (cost_change > 0 && cost_change <= function_tolerance_ * cost) {
+            stop_ = true;
+        }
+        return this;
+    }
+
+private:
+    g2o::SparseOptimizer *optimizer_;
+    double function_tolerance_;
+    bool stop_;
+    int iteration_;
+    double cost_;
+    double cost_change_;
+};
+
+// cost and wall time of every iteration for SolveStats, interchangeable with ceres' IterationSummary
+class IterationStatsAction : public g2o::HyperGraphAction {
+public:
+    IterationStatsAction(IterationCostAction *cost, SolveStats *stats) : cost_(cost), stats_(stats), last_(0) {}
+
+    // iteration 0, the initial state, after IterationCostAction::Start()
+    void Start() {
+        stats_->iterations.assign(1, IterationStats());
+        stats_->iterations[0].cost = cost_->At(0);
+        last_ = WallTimeInSeconds();
+    }
+
+    virtual g2o::HyperGraphAction *operator()(const g2o::HyperGraph *graph,
+                                              g2o::HyperGraphAction::Parameters *parameters = 0) override {
+        const double now = WallTimeInSeconds();
+        IterationStats it;
+        it.iteration = PostIteration(parameters, stats_->iterations.back().iteration);
+        it.cost = cost_->At(it.iteration);
+        it.time = now - last_;
+        it.cumulative_time = stats_->iterations.back().cumulative_time + it.time;
+        stats_->iterations.push_back(it);
+        last_ = WallTimeInSeconds();
+        return this;
+    }
+
+private:
+    IterationCostAction *cost_;
+    SolveStats *stats_;
+    double last_;
+};
+
+/**
+ * --iteration_callback with the deadline of --max_solver_time (see
+ * WithSolveControl()), registered only when either is set; a cancel stops
+ * the solve through IterationCostAction.
+ */
+class SolveControlAction : public g2o::HyperGraphAction {
+public:
+    SolveControlAction(IterationCostAction *cost, g2o::OptimizationAlgorithmWithHessian *algorithm,
+                       const BAOptions &ba_options)
+            : cost_(cost), algorithm_(algorithm), options_(ba_options), cancelled_(false), iteration_(0),
+              start_(0), last_(0) {}
+
+    // iteration 0 for the callback, after IterationCostAction::Start()
+    void Start() {
+        iteration_ = 0;
+        start_ = last_ = WallTimeInSeconds();
+        IterationStats it;
+        it.cost = cost_->At(0);
+        const char *termination;
+        cancelled_ = !ContinueSolve(options_, it, 0.0, 0.0, true, &termination);
+        if (cancelled_) cost_->Stop();
+    }
+
+    // whether --iteration_callback (or --max_solver_time) ended the last run
+    bool cancelled() const {  return cancelled_;  }
+
+    virtual g2o::HyperGraphAction *operator()(const g2o::HyperGraph *graph,
+                                              g2o::HyperGraphAction::Parameters *parameters = 0) override {
+        const double now = WallTimeInSeconds();
+        IterationStats it;
+        it.iteration = iteration_ = PostIteration(parameters, iteration_);
+        double cost_change;
+        it.cost = cost_->At(it.iteration, &cost_change);
+        it.time = now - last_;
+        it.cumulative_time = now - start_;
+        g2o::Solver &solver = algorithm_->solver();
+        const double step_norm = solver.x() != NULL ?
+                                 Eigen::Map<const Eigen::VectorXd>(solver.x(), solver.vectorSize()).norm() : 0.0;
+        const char *termination;
+        cancelled_ = !ContinueSolve(options_, it, cost_change, step_norm, cost_change > 0, &termination);
+        if (cancelled_) cost_->Stop();
+        last_ = WallTimeInSeconds();
+        return this;
+    }
+
+private:
+    IterationCostAction *cost_;
+    g2o::OptimizationAlgorithmWithHessian *algorithm_;
+    const BAOptions &options_;
+    bool cancelled_;
+    int iteration_;
+    double start_;
+    double last_;
+};
+
+// 9d virables, and 3d error
+// pose is 9, landmark is 3
+typedef ParallelBlockSolver<g2o::BlockSolverTraits<9, 3>> BlockSolverType;
+
+/**
+ * What CreateLinearSolver() offers, for PlanBAOptions(): CSparse and Eigen's
+ * simplicial LDLT, both with an AMD ordering of the camera blocks, and PCG.
+ */
+inline SolverCapabilities G2OCapabilities() {
+    SolverCapabilities capabilities;
+    capabilities.backend = "g2o";
+    capabilities.sparse_libraries.push_back("CX_SPARSE");
+    capabilities.sparse_libraries.push_back("EIGEN_SPARSE");
+    return capabilities;
+}
+
+// solver of the reduced camera system selected by --linear_solver and --sparse_library
+inline std::unique_ptr<BlockSolverType::LinearSolverType> CreateLinearSolver(const BAOptions &ba_options) {
+    typedef BlockSolverType::PoseMatrixType PoseMatrixType;
+    if (ba_options.linear_solver == "DENSE_SCHUR") {
+        return g2o::make_unique<g2o::LinearSolverDense<PoseMatrixType>>();
+    } else if (ba_options.linear_solver == "ITERATIVE_SCHUR") {
+        // g2o's PCG always uses a block Jacobi preconditioner, and compares the
+        // squared (preconditioned) residual with tolerance * its initial value
+        auto pcg = g2o::make_unique<g2o::LinearSolverPCG<PoseMatrixType>>();
+        pcg->setTolerance(ba_options.eta * ba_options.eta);
+        pcg->setMaxIterations(ba_options.max_linear_iterations);
+        return std::move(pcg);
+    } else if (ba_options.sparse_library == "EIGEN_SPARSE") {
+        auto eigen = g2o::make_unique<g2o::LinearSolverEigen<PoseMatrixType>>();
+        eigen->setBlockOrdering(true);
+        return std::move(eigen);
+    }
+    auto csparse = g2o::make_unique<g2o::LinearSolverCSparse<PoseMatrixType>>();
+    csparse->setBlockOrdering(true); // AMD on the camera blocks, then expanded
+    return std::move(csparse);
+}
+
+// robust kernel selected by --robust_kernel, NULL for plain least squares
+inline g2o::RobustKernel *CreateRobustKernel(const BAOptions &ba_options) {
+    g2o::RobustKernel *kernel = NULL;
+    if (ba_options.robust_kernel == "huber") {
+        kernel = new g2o::RobustKernelHuber();
+    } else if (ba_options.robust_kernel == "cauchy") {
+        kernel = new g2o::RobustKernelCauchy();
+    }
+    if (kernel != NULL) {
+        kernel->setDelta(ba_options.robust_delta);
+    }
+    return kernel;
+}
+
+/**
+ * One optimizer run of SolveBAG2O() on the active observations of outliers
+ * (all if NULL), see there. False if it was cancelled; *failed is set when
+ * optimize() fails.
+ */
+inline bool SolveBAG2OPass(BALProblem &bal_problem, const BAOptions &ba_options, OutlierFilter *outliers,
+                           SolveStats *stats, bool *failed) {
+    const double setup_start = WallTimeInSeconds();
+    const bool numeric_jacobian = (ba_options.jacobian == "numeric");
+    const EvaluationPrecision precision = EvaluationPrecisionOf(ba_options);
+    const int point_block_size = bal_problem.point_block_size();
+    const int camera_block_size = bal_problem.camera_block_size();
+    double *points = bal_problem.mutable_points();
+    double *cameras = bal_problem.mutable_cameras();
+
+    // construct graph optimizatioin
+    // set g2o
+    // edges are evaluated and linearized in parallel
+    ThreadPool pool(ba_options.num_threads);
+    ParallelComputeErrorAction compute_error_action(&pool, bal_problem, precision);
+
+    /**
+     * Vertices, edges and kernel forwarders go back to back into one arena
+     * block, each kind in a row of its own so that only the first of a row
+     * is padded for alignment (see Arena::SizeFor()). The optimizer still
+     * deletes them, which only runs the destructors, so the arena and the
+     * kernel are declared first and outlive it.
+     */
+    Arena arena;
+    arena.Reserve(Arena::SizeFor<VertexPoseAndIntrinsics>(bal_problem.num_cameras()) +
+                  Arena::SizeFor<VertexPoint>(bal_problem.num_points()) +
+                  Arena::SizeFor<EdgeProjection>(bal_problem.num_observations()) +
+                  Arena::SizeFor<SharedRobustKernel>(bal_problem.num_observations()));
+    std::unique_ptr<g2o::RobustKernel> robust_kernel(CreateRobustKernel(ba_options));
+
+    // gradient descent, use LM
+    auto solver = new g2o::OptimizationAlgorithmLevenberg(
+            g2o::make_unique<BlockSolverType>(CreateLinearSolver(ba_options), &pool));
+    g2o::SparseOptimizer optimizer; // graph model
+    optimizer.setAlgorithm(solver); // set solver
+    optimizer.setVerbose(ba_options.verbose); // open debug
+    optimizer.addComputeErrorAction(&compute_error_action);
+
+    // build g2o problems
+    const double *observations = bal_problem.observations();
+    // vertex
+    std::vector<VertexPoseAndIntrinsics *> vertex_pose_intrinsics;
+    std::vector<VertexPoint *> vertex_points;
+    // many cameras, so use for() {}
+    for (int i = 0; i < bal_problem.num_cameras(); ++i) {
+        VertexPoseAndIntrinsics *v = new(&arena) VertexPoseAndIntrinsics();
+        double *camera = cameras + camera_block_size * i;
+        v->setId(i);
+        v->setEstimate(PoseAndIntrinsics(camera, camera_block_size == 10));
+        optimizer.addVertex(v);
+        vertex_pose_intrinsics.push_back(v);
+    }
+
+    for (int i = 0; i < bal_problem.num_points(); ++i) {
+        VertexPoint *v = new(&arena) VertexPoint();
+        double *point = points + point_block_size * i;
+        v->setId(i + bal_problem.num_cameras());
+        v->setEstimate(PointView(point));
+        // set Margin manually
+        v->setMarginalized(true);
+        optimizer.addVertex(v);
+        vertex_points.push_back(v);
+    }
+
+    // edge, outliers on level 1 which initializeOptimization(0) leaves out
+    std::vector<EdgeProjection *> edges;
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        EdgeProjection *edge = new(&arena) EdgeProjection(numeric_jacobian, precision);
+        edge->observation = i;
+        edge->setLevel(outliers != NULL && !outliers->active(i) ? 1 : 0);
+        edge->setVertex(0, vertex_pose_intrinsics[bal_problem.camera_index()[i]]);
+        edge->setVertex(1, vertex_points[bal_problem.point_index()[i]]);
+        edge->setMeasurement(Eigen::Vector2d(observations[2 * i + 0], observations[2 * i + 1]));
+        edge->setInformation(Eigen::Matrix2d::Identity());
+        optimizer.addEdge(edge);
+        edges.push_back(edge);
+    }
+    for (size_t i = 0; robust_kernel && i < edges.size(); ++i) {
+        edges[i]->setRobustKernel(new(&arena) SharedRobustKernel(robust_kernel.get()));
+    }
+
+    optimizer.initializeOptimization(0);
+    const double setup_time = WallTimeInSeconds() - setup_start;
+    Profiler::Get().Record("g2o setup", setup_start, setup_start + setup_time);
+
+    // one optimize() with its stats, run_setup_time spent before it, false if cancelled
+    auto optimize = [&](double run_setup_time, SolveStats *run_stats) {
+        IterationCostAction iteration_cost_action(&optimizer, ba_options.function_tolerance);
+        optimizer.addPostIterationAction(&iteration_cost_action);
+        iteration_cost_action.Start();
+        IterationStatsAction iteration_stats_action(&iteration_cost_action, run_stats);
+        if (run_stats != NULL) {
+            optimizer.setComputeBatchStatistics(true);
+            optimizer.addPostIterationAction(&iteration_stats_action);
+            iteration_stats_action.Start();
+        }
+        // set by --iteration_callback or --max_solver_time, see WithSolveControl()
+        const bool control = static_cast<bool>(ba_options.iteration_callback);
+        SolveControlAction solve_control_action(&iteration_cost_action, solver, ba_options);
+        if (control) {
+            optimizer.addPostIterationAction(&solve_control_action);
+        }
+        const double solve_start = WallTimeInSeconds();
+        {
+            ScopedTimer timer("g2o solve");
+            if (control) {
+                solve_control_action.Start();
+            }
+            // 0 iterations after a failed linear solve, unless cancelled before the first
+            const int iterations = optimizer.optimize(ba_options.max_iterations);
+            iteration_cost_action.Finish();
+            *failed = *failed || iterations < 0 ||
+                      (iterations == 0 && ba_options.max_iterations > 0 && !solve_control_action.cancelled());
+        }
+        if (control) {
+            optimizer.removePostIterationAction(&solve_control_action);
+        }
+        optimizer.removePostIterationAction(&iteration_cost_action);
+        const bool finished = !solve_control_action.cancelled();
+        if (run_stats == NULL) {
+            return finished;
+        }
+        run_stats->setup_time = run_setup_time;
+        run_stats->solve_time = WallTimeInSeconds() - solve_start;
+        run_stats->residual_evaluation_time = 0;
+        run_stats->jacobian_evaluation_time = 0;
+        run_stats->linear_solver_time = 0;
+        const g2o::BatchStatisticsContainer &batch_statistics = optimizer.batchStatistics();
+        for (size_t i = 0; i < batch_statistics.size(); ++i) {
+            run_stats->residual_evaluation_time += batch_statistics[i].timeResiduals;
+            run_stats->jacobian_evaluation_time += batch_statistics[i].timeLinearize;
+            run_stats->linear_solver_time += batch_statistics[i].timeLinearSolution;
+        }
+        run_stats->initial_cost = run_stats->iterations.front().cost;
+        run_stats->final_cost = run_stats->iterations.back().cost;
+        optimizer.removePostIterationAction(&iteration_stats_action);
+        optimizer.setComputeBatchStatistics(false);
+        return finished;
+    };
+    bool finished = optimize(setup_time, stats);
+
+    // the vertices optimized bal_problem in place, so the rounds see the current estimate; warm started
+    std::vector<int> dropped;
+    while (finished && outliers != NULL && outliers->NextRound(bal_problem, &dropped)) {
+        const double round_start = WallTimeInSeconds();
+        for (size_t k = 0; k < dropped.size(); ++k) {
+            edges[dropped[k]]->setLevel(1);
+        }
+        optimizer.initializeOptimization(0);
+        SolveStats round_stats;
+        finished = optimize(WallTimeInSeconds() - round_start, stats != NULL ? &round_stats : NULL);
+        if (stats != NULL) {
+            stats->Append(round_stats);
+        }
+    }
+    return finished;
+}
+
+/**
+ * Optimize bal_problem in place with g2o, --linear_solver=AUTO planned for
+ * bal_problem (ba_planner.h).
+ * stats, if not NULL, receives the timings and the cost of every iteration.
+ * A --precision=float solution is finished with --refinement_iterations in
+ * double precision. --outlier_rounds drop outliers after the (first) solve.
+ * False if a solve failed, a cancelled one has not.
+ */
+inline bool SolveBAG2O(BALProblem &bal_problem, const BAOptions &options, SolveStats *stats = NULL) {
+    const BAOptions ba_options = WithSolveControl(PlanBAOptions(bal_problem, options, G2OCapabilities()));
+    std::unique_ptr<OutlierFilter> outliers(ba_options.outlier_rounds > 0 ? new OutlierFilter(bal_problem, ba_options)
+                                                                          : NULL);
+    bool failed = false;
+    const bool finished = SolveBAG2OPass(bal_problem, ba_options, outliers.get(), stats, &failed);
+    if (finished && ba_options.precision == "float" && ba_options.refinement_iterations > 0) {
+        BAOptions refinement = ba_options;
+        refinement.precision = "double";
+        refinement.max_iterations = ba_options.refinement_iterations;
+        SolveStats refinement_stats;
+        SolveBAG2OPass(bal_problem, refinement, outliers.get(), stats != NULL ? &refinement_stats : NULL,
+                       &failed);
+        if (stats != NULL) {
+            stats->Append(refinement_stats);
+        }
+    }
+    return !failed;
+}
+
+#endif // BA_G2O_H
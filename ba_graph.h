@@ -0,0 +1,368 @@
+#ifndef BA_GRAPH_H
+#define BA_GRAPH_H
+
+// the camera - point visibility graph of a BALProblem: connected components, camera clusters and statistics
+
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <numeric>
+#include <vector>
+#include "ba_options.h"
+#include "ba_stats.h"
+#include "common.h"
+#include "parallel.h"
+#include "profiler.h"
+
+/**
+ * Connected components of the bipartite graph of cameras and points, one edge
+ * per observation. Components are numbered in the order of their lowest
+ * camera; cameras and points without observations are in none (-1).
+ */
+struct VisibilityComponents {
+    int num_components = 0;
+    std::vector<int> camera_component;
+    std::vector<int> point_component;
+};
+
+inline int FindRoot(std::vector<int> *parent, int x) {
+    while ((*parent)[x] != x) {
+        (*parent)[x] = (*parent)[(*parent)[x]]; // path halving
+        x = (*parent)[x];
+    }
+    return x;
+}
+
+inline void FindComponents(const BALProblem &bal_problem, VisibilityComponents *components) {
+    const int num_cameras = bal_problem.num_cameras();
+    const int num_points = bal_problem.num_points();
+    // union find over the cameras [0, num_cameras) and the points after them
+    std::vector<int> parent(num_cameras + num_points);
+    std::iota(parent.begin(), parent.end(), 0);
+    std::vector<char> observed(num_cameras + num_points, 0);
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        const int c = bal_problem.camera_index()[i];
+        const int p = num_cameras + bal_problem.point_index()[i];
+        observed[c] = observed[p] = 1;
+        const int a = FindRoot(&parent, c);
+        const int b = FindRoot(&parent, p);
+        if (a != b) parent[std::max(a, b)] = std::min(a, b);
+    }
+
+    std::vector<int> component_of_root(num_cameras + num_points, -1);
+    components->num_components = 0;
+    components->camera_component.assign(num_cameras, -1);
+    components->point_component.assign(num_points, -1);
+    for (int x = 0; x < num_cameras + num_points; ++x) {
+        if (!observed[x]) continue;
+        int &component = component_of_root[FindRoot(&parent, x)];
+        if (component < 0) component = components->num_components++;
+        if (x < num_cameras) {
+            components->camera_component[x] = component;
+        } else {
+            components->point_component[x - num_cameras] = component;
+        }
+    }
+}
+
+/**
+ * Covisibility graph of the cameras, the off-diagonal blocks of the reduced
+ * camera matrix: the neighbours of camera c are
+ * neighbours[offsets[c], offsets[c + 1]), sorted.
+ */
+inline void CameraNeighbours(const BALProblem &bal_problem, std::vector<int> *offsets, std::vector<int> *neighbours,
+                             int num_threads = DefaultNumThreads()) {
+    const int num_cameras = bal_problem.num_cameras();
+    const int num_points = bal_problem.num_points();
+    const int num_observations = bal_problem.num_observations();
+    // cameras of every point and points of every camera, CSR
+    std::vector<int> point_offsets(num_points + 1, 0), camera_offsets(num_cameras + 1, 0);
+    for (int i = 0; i < num_observations; ++i) {
+        ++point_offsets[bal_problem.point_index()[i] + 1];
+        ++camera_offsets[bal_problem.camera_index()[i] + 1];
+    }
+    std::partial_sum(point_offsets.begin(), point_offsets.end(), point_offsets.begin());
+    std::partial_sum(camera_offsets.begin(), camera_offsets.end(), camera_offsets.begin());
+    std::vector<int> point_cameras(num_observations), camera_points(num_observations);
+    std::vector<int> point_next(point_offsets.begin(), point_offsets.end() - 1);
+    std::vector<int> camera_next(camera_offsets.begin(), camera_offsets.end() - 1);
+    for (int i = 0; i < num_observations; ++i) {
+        point_cameras[point_next[bal_problem.point_index()[i]]++] = bal_problem.camera_index()[i];
+        camera_points[camera_next[bal_problem.camera_index()[i]]++] = bal_problem.point_index()[i];
+    }
+
+    std::vector<std::vector<int> > lists(num_cameras);
+    ThreadPool pool(num_threads);
+    pool.ParallelFor(num_cameras, [&](int begin, int end) {
+        std::vector<int> seen_by(num_cameras, -1); // camera last found next to which camera
+        for (int c = begin; c < end; ++c) {
+            for (int k = camera_offsets[c]; k < camera_offsets[c + 1]; ++k) {
+                const int j = camera_points[k];
+                for (int l = point_offsets[j]; l < point_offsets[j + 1]; ++l) {
+                    const int other = point_cameras[l];
+                    if (other != c && seen_by[other] != c) {
+                        seen_by[other] = c;
+                        lists[c].push_back(other);
+                    }
+                }
+            }
+            std::sort(lists[c].begin(), lists[c].end());
+        }
+    }, 16);
+
+    offsets->assign(num_cameras + 1, 0);
+    for (int c = 0; c < num_cameras; ++c) {
+        (*offsets)[c + 1] = (*offsets)[c] + static_cast<int>(lists[c].size());
+    }
+    neighbours->resize(offsets->back());
+    for (int c = 0; c < num_cameras; ++c) {
+        std::copy(lists[c].begin(), lists[c].end(), neighbours->begin() + (*offsets)[c]);
+    }
+}
+
+/**
+ * Split the cameras into num_clusters clusters of cameras seeing the same
+ * points: the cameras in breadth first order of the covisibility graph, cut
+ * into ranges of about the same number of observations, as PartitionCameras()
+ * does with the camera indices. Fewer points are shared between clusters when
+ * the cameras are not in capture order.
+ */
+inline std::vector<int> ClusterCameras(const BALProblem &bal_problem, int num_clusters,
+                                       int num_threads = DefaultNumThreads()) {
+    const int num_cameras = bal_problem.num_cameras();
+    std::vector<int> offsets, neighbours;
+    CameraNeighbours(bal_problem, &offsets, &neighbours, num_threads);
+
+    std::vector<int> order;
+    order.reserve(num_cameras);
+    std::vector<char> visited(num_cameras, 0);
+    for (int start = 0; start < num_cameras; ++start) {
+        if (visited[start]) continue;
+        visited[start] = 1;
+        order.push_back(start);
+        for (size_t next = order.size() - 1; next < order.size(); ++next) {
+            const int c = order[next];
+            for (int k = offsets[c]; k < offsets[c + 1]; ++k) {
+                if (!visited[neighbours[k]]) {
+                    visited[neighbours[k]] = 1;
+                    order.push_back(neighbours[k]);
+                }
+            }
+        }
+    }
+
+    std::vector<long> observations(num_cameras, 0);
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        ++observations[bal_problem.camera_index()[i]];
+    }
+    const long total = std::max<long>(1, bal_problem.num_observations());
+    std::vector<int> camera_cluster(num_cameras);
+    long before = 0;
+    for (int k = 0; k < num_cameras; ++k) {
+        const int c = order[k];
+        // cluster of the middle of the camera's observations
+        const long middle = before + observations[c] / 2;
+        camera_cluster[c] = static_cast<int>(std::min<long>(num_clusters - 1, middle * num_clusters / total));
+        before += observations[c];
+    }
+    return camera_cluster;
+}
+
+// minimum, median, mean and maximum of a count per camera / point
+struct CountSummary {
+    int min = 0;
+    int median = 0;
+    double mean = 0;
+    int max = 0;
+};
+
+inline CountSummary SummarizeCounts(std::vector<int> counts) {
+    CountSummary summary;
+    if (counts.empty()) return summary;
+    summary.min = *std::min_element(counts.begin(), counts.end());
+    summary.max = *std::max_element(counts.begin(), counts.end());
+    summary.mean = std::accumulate(counts.begin(), counts.end(), 0.0) / counts.size();
+    std::nth_element(counts.begin(), counts.begin() + counts.size() / 2, counts.end());
+    summary.median = counts[counts.size() / 2];
+    return summary;
+}
+
+struct VisibilityGraphStats {
+    int num_cameras = 0;
+    int num_points = 0;
+    int num_observations = 0;
+    int num_components = 0;
+    int largest_component_cameras = 0; // of the component with the most cameras
+    int largest_component_points = 0;
+    CountSummary camera_observations; // observations per camera
+    CountSummary point_observations; // track length
+    CountSummary camera_neighbours; // covisible cameras per camera
+    long num_camera_pairs = 0; // covisible camera pairs, off-diagonal blocks of the upper reduced camera matrix
+    // nonzero 9x9 blocks of the reduced camera matrix / num_cameras^2, about 1 calls for DENSE_SCHUR
+    double reduced_camera_fill = 0;
+};
+
+inline VisibilityGraphStats ComputeGraphStats(const BALProblem &bal_problem, int num_threads = DefaultNumThreads()) {
+    ScopedTimer timer("graph statistics");
+    VisibilityGraphStats stats;
+    stats.num_cameras = bal_problem.num_cameras();
+    stats.num_points = bal_problem.num_points();
+    stats.num_observations = bal_problem.num_observations();
+
+    VisibilityComponents components;
+    FindComponents(bal_problem, &components);
+    stats.num_components = components.num_components;
+    std::vector<int> component_cameras(components.num_components, 0), component_points(components.num_components, 0);
+    for (int c = 0; c < stats.num_cameras; ++c) {
+        if (components.camera_component[c] >= 0) ++component_cameras[components.camera_component[c]];
+    }
+    for (int j = 0; j < stats.num_points; ++j) {
+        if (components.point_component[j] >= 0) ++component_points[components.point_component[j]];
+    }
+    if (components.num_components > 0) {
+        const int largest = std::max_element(component_cameras.begin(), component_cameras.end()) -
+                            component_cameras.begin();
+        stats.largest_component_cameras = component_cameras[largest];
+        stats.largest_component_points = component_points[largest];
+    }
+
+    std::vector<int> camera_observations(stats.num_cameras, 0), point_observations(stats.num_points, 0);
+    for (int i = 0; i < stats.num_observations; ++i) {
+        ++camera_observations[bal_problem.camera_index()[i]];
+        ++point_observations[bal_problem.point_index()[i]];
+    }
+    stats.camera_observations = SummarizeCounts(camera_observations);
+    stats.point_observations = SummarizeCounts(point_observations);
+
+    std::vector<int> offsets, neighbours;
+    CameraNeighbours(bal_problem, &offsets, &neighbours, num_threads);
+    std::vector<int> camera_neighbours(stats.num_cameras);
+    for (int c = 0; c < stats.num_cameras; ++c) {
+        camera_neighbours[c] = offsets[c + 1] - offsets[c];
+    }
+    stats.camera_neighbours = SummarizeCounts(camera_neighbours);
+    stats.num_camera_pairs = static_cast<long>(neighbours.size()) / 2;
+    if (stats.num_cameras > 0) {
+        stats.reduced_camera_fill = (stats.num_cameras + 2.0 * stats.num_camera_pairs) /
+                                    (static_cast<double>(stats.num_cameras) * stats.num_cameras);
+    }
+    return stats;
+}
+
+inline void PrintGraphStats(const VisibilityGraphStats &stats, std::ostream &out) {
+    char line[256];
+    snprintf(line, sizeof(line), "visibility graph: %d cameras, %d points, %d observations, %d components "
+                                 "(largest %d cameras, %d points)\n", stats.num_cameras, stats.num_points,
+             stats.num_observations, stats.num_components, stats.largest_component_cameras,
+             stats.largest_component_points);
+    out << line;
+    const CountSummary *summaries[3] = {&stats.camera_observations, &stats.point_observations,
+                                        &stats.camera_neighbours};
+    const char *names[3] = {"observations per camera", "observations per point", "covisible cameras"};
+    for (int k = 0; k < 3; ++k) {
+        snprintf(line, sizeof(line), "  %-24s min %d, median %d, mean %.1f, max %d\n", names[k],
+                 summaries[k]->min, summaries[k]->median, summaries[k]->mean, summaries[k]->max);
+        out << line;
+    }
+    snprintf(line, sizeof(line), "  reduced camera matrix: %d x %d blocks, %ld camera pairs, fill %.3g\n",
+             stats.num_cameras, stats.num_cameras, stats.num_camera_pairs, stats.reduced_camera_fill);
+    out << line;
+}
+
+typedef std::function<void(BALProblem &, const BAOptions &, SolveStats *)> SolveFunction;
+
+/**
+ * Solve the connected components of bal_problem one by one with solve (e.g.
+ * SolveBACeres), concurrently on --num_threads threads split between the
+ * components in progress, largest first. The components share no parameter,
+ * so this is the same least squares problem as one solve of everything, with
+ * smaller linear systems. The parameters are written back to bal_problem.
+ * stats, if not NULL, get the summed costs and evaluation times, and the wall
+ * times of setup and solve; its iterations are only the initial and final
+ * cost. One --max_solver_time deadline and --iteration_callback (see
+ * WithSolveControl()) cover all components. Returns the number of components.
+ */
+inline int SolveBAComponents(BALProblem &bal_problem, const BAOptions &ba_options, const SolveFunction &solve,
+                             SolveStats *stats = NULL) {
+    const double setup_start = WallTimeInSeconds();
+    // the deadline counts from here, not from the start of every component
+    const BAOptions controlled_options = WithSolveControl(ba_options);
+    VisibilityComponents components;
+    FindComponents(bal_problem, &components);
+    if (components.num_components <= 1) {
+        solve(bal_problem, controlled_options, stats);
+        return components.num_components;
+    }
+
+    const int num_components = components.num_components;
+    std::vector<std::vector<int> > observations(num_components), cameras(num_components), points(num_components);
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        observations[components.camera_component[bal_problem.camera_index()[i]]].push_back(i);
+    }
+    for (int c = 0; c < bal_problem.num_cameras(); ++c) {
+        if (components.camera_component[c] >= 0) cameras[components.camera_component[c]].push_back(c);
+    }
+    for (int j = 0; j < bal_problem.num_points(); ++j) {
+        if (components.point_component[j] >= 0) points[components.point_component[j]].push_back(j);
+    }
+    std::vector<int> order(num_components);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return observations[a].size() > observations[b].size();
+    });
+    if (ba_options.verbose) {
+        std::cout << "Solving " << num_components << " independent components, the largest with "
+                  << cameras[order[0]].size() << " cameras and " << points[order[0]].size() << " points"
+                  << std::endl;
+    }
+
+    const int concurrency = std::min(num_components, ba_options.num_threads);
+    BAOptions component_options = controlled_options;
+    component_options.num_threads = std::max(1, ba_options.num_threads / concurrency);
+    component_options.verbose = false; // the progress of concurrent solves would interleave
+    component_options.snapshot_ply.clear(); // a snapshot would only show one component
+    std::vector<SolveStats> component_stats(num_components);
+    const double solve_start = WallTimeInSeconds();
+    ThreadPool pool(concurrency);
+    pool.ParallelFor(num_components, [&](int begin, int end) {
+        for (int k = begin; k < end; ++k) {
+            const int component = order[k];
+            BALProblem subproblem(bal_problem, observations[component], cameras[component], points[component]);
+            solve(subproblem, component_options, stats != NULL ? &component_stats[component] : NULL);
+
+            const int camera_size = bal_problem.camera_block_size();
+            for (size_t l = 0; l < cameras[component].size(); ++l) {
+                std::copy(subproblem.cameras() + camera_size * l, subproblem.cameras() + camera_size * (l + 1),
+                          bal_problem.mutable_cameras() + camera_size * cameras[component][l]);
+            }
+            for (size_t l = 0; l < points[component].size(); ++l) {
+                std::copy(subproblem.points() + 3 * l, subproblem.points() + 3 * (l + 1),
+                          bal_problem.mutable_points() + 3 * points[component][l]);
+            }
+        }
+    }, 1);
+
+    if (stats != NULL) {
+        *stats = SolveStats();
+        stats->setup_time = solve_start - setup_start;
+        stats->solve_time = WallTimeInSeconds() - solve_start;
+        for (int k = 0; k < num_components; ++k) {
+            stats->residual_evaluation_time += component_stats[k].residual_evaluation_time;
+            stats->jacobian_evaluation_time += component_stats[k].jacobian_evaluation_time;
+            stats->linear_solver_time += component_stats[k].linear_solver_time;
+            stats->initial_cost += component_stats[k].initial_cost;
+            stats->final_cost += component_stats[k].final_cost;
+        }
+        IterationStats initial, final;
+        initial.cost = stats->initial_cost;
+        final.iteration = 1;
+        final.cost = stats->final_cost;
+        final.time = final.cumulative_time = stats->solve_time;
+        stats->iterations.push_back(initial);
+        stats->iterations.push_back(final);
+    }
+    return num_components;
+}
+
+#endif // BA_GRAPH_H
@@ -0,0 +1,1051 @@
+#ifndef BA_NATIVE_H
+#define BA_NATIVE_H
+
+// Levenberg-Marquardt for BAL problems without a solver framework, used by bundle_adjustment_native
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <Eigen/SparseCholesky>
+#include <Eigen/StdVector>
+
+#include "ba_covariance.h"
+#include "ba_options.h"
+#include "ba_outliers.h"
+#include "ba_planner.h"
+#include "ba_stats.h"
+#include "common.h"
+#include "parallel.h"
+#include "profiler.h"
+#include "projection.h"
+#include "projection_kernel.h"
+#include "rotation.h"
+
+typedef Eigen::Matrix<double, 9, 9> Matrix9d;
+typedef Eigen::Matrix<double, 9, 3> Matrix93d;
+typedef Eigen::Matrix<double, 9, 1> Vector9d;
+typedef Eigen::Matrix<double, 2, 9, Eigen::RowMajor> Matrix29d;
+typedef Eigen::Matrix<double, 2, 3, Eigen::RowMajor> Matrix23d;
+
+template<typename T>
+using AlignedVector = std::vector<T, Eigen::aligned_allocator<T> >;
+
+/**
+ * Robust loss rho(s) of a squared norm s and rho'(s), as ceres::HuberLoss
+ * and ceres::CauchyLoss.
+ */
+inline void EvaluateLoss(const BAOptions &ba_options, double s, double *rho, double *rho_prime) {
+    const double b = ba_options.robust_delta * ba_options.robust_delta;
+    if (ba_options.robust_kernel == "huber" && s > b) {
+        const double r = std::sqrt(s);
+        *rho = 2.0 * ba_options.robust_delta * r - b;
+        *rho_prime = ba_options.robust_delta / r;
+    } else if (ba_options.robust_kernel == "cauchy") {
+        const double sum = 1.0 + s / b;
+        *rho = b * std::log(sum);
+        *rho_prime = 1.0 / sum;
+    } else {
+        *rho = s;
+        *rho_prime = 1.0;
+    }
+}
+
+/**
+ * Cost 0.5 * rho(|r|^2) of the residual r of one observation. When residual
+ * is given it becomes r, and J_camera / J_point (if given) the Jacobians of
+ * r, scaled by sqrt(rho').
+ */
+inline double RobustifyObservation(const BAOptions &ba_options, const Eigen::Vector2d &r,
+                                   Eigen::Vector2d *residual, Matrix29d *J_camera, Matrix23d *J_point) {
+    double rho, rho_prime;
+    EvaluateLoss(ba_options, r.squaredNorm(), &rho, &rho_prime);
+    if (residual != NULL) {
+        const double scale = std::sqrt(rho_prime);
+        *residual = scale * r;
+        if (J_camera != NULL) *J_camera *= scale;
+        if (J_point != NULL) *J_point *= scale;
+    }
+    return 0.5 * rho;
+}
+
+/**
+ * Cost 0.5 * rho(|r|^2) of one observation, with the residual r and, when
+ * J_camera / J_point are given, the Jacobians, both scaled by sqrt(rho').
+ */
+inline double EvaluateObservation(const BAOptions &ba_options, EvaluationPrecision precision,
+                                  const double *camera, const double *point, const double *observation,
+                                  Eigen::Vector2d *residual, Matrix29d *J_camera, Matrix23d *J_point) {
+    double prediction[2];
+    double *J_camera_data = J_camera != NULL ? J_camera->data() : NULL;
+    double *J_point_data = J_point != NULL ? J_point->data() : NULL;
+    if (precision == kDoublePrecision) {
+        CamProjectionWithDistortionJacobian(camera, point, prediction, J_camera_data, J_point_data);
+    } else {
+        CastCamProjectionWithDistortionJacobian<float>(camera, point, prediction, J_camera_data, J_point_data);
+        if (precision == kMixedPrecision) {
+            CamProjectionWithDistortionJacobian(camera, point, prediction, (double *) NULL, (double *) NULL);
+        }
+    }
+    const Eigen::Vector2d r(prediction[0] - observation[0], prediction[1] - observation[1]);
+    return RobustifyObservation(ba_options, r, residual, J_camera, J_point);
+}
+
+// ceres clamps diag(J^T J) to [1e-6, 1e32] for the damping
+template<int N>
+inline Eigen::Matrix<double, N, 1> Damping(const Eigen::Matrix<double, N, N> &block) {
+    return block.diagonal().cwiseMax(1e-6).cwiseMin(1e32);
+}
+
+/**
+ * Block structure of the reduced camera system S: for every block column k
+ * the block rows i <= k, ascending, so the diagonal comes last. columns holds
+ * the rows i < k sharing a point with camera k, in any order and repeated.
+ */
+inline void BuildBlockColumns(std::vector<std::vector<int> > *columns,
+                              std::vector<int> *column_offsets, std::vector<int> *block_rows) {
+    const int num_cameras = static_cast<int>(columns->size());
+    column_offsets->assign(num_cameras + 1, 0);
+    for (int k = 0; k < num_cameras; ++k) {
+        std::vector<int> &column = (*columns)[k];
+        column.push_back(k);
+        std::sort(column.begin(), column.end());
+        column.erase(std::unique(column.begin(), column.end()), column.end());
+        (*column_offsets)[k + 1] = (*column_offsets)[k] + static_cast<int>(column.size());
+    }
+    block_rows->resize(column_offsets->back());
+    for (int k = 0; k < num_cameras; ++k) {
+        std::copy((*columns)[k].begin(), (*columns)[k].end(), block_rows->begin() + (*column_offsets)[k]);
+    }
+}
+
+// index of the S block (i, k) in the block columns
+inline int FindBlock(const std::vector<int> &column_offsets, const std::vector<int> &block_rows, int i, int k) {
+    if (i > k) std::swap(i, k);
+    return static_cast<int>(std::lower_bound(block_rows.begin() + column_offsets[k],
+                                             block_rows.begin() + column_offsets[k + 1], i) -
+                            block_rows.begin());
+}
+
+// scalar pattern of the block upper triangle, column major as the blocks
+inline void BuildReducedCameraPattern(const std::vector<int> &column_offsets, const std::vector<int> &block_rows,
+                                      Eigen::SparseMatrix<double> *S) {
+    const int num_cameras = static_cast<int>(column_offsets.size()) - 1;
+    const int n = 9 * num_cameras;
+    S->resize(n, n);
+    Eigen::VectorXi nonzeros(n);
+    for (int k = 0; k < num_cameras; ++k) {
+        const int off_diagonal = column_offsets[k + 1] - column_offsets[k] - 1;
+        for (int c = 0; c < 9; ++c) {
+            nonzeros[9 * k + c] = 9 * off_diagonal + c + 1;
+        }
+    }
+    S->reserve(nonzeros);
+    for (int k = 0; k < num_cameras; ++k) {
+        for (int c = 0; c < 9; ++c) {
+            for (int p = column_offsets[k]; p < column_offsets[k + 1]; ++p) {
+                const int i = block_rows[p];
+                for (int r = 0; r < (i == k ? c + 1 : 9); ++r) {
+                    S->insert(9 * i + r, 9 * k + c) = 0.0;
+                }
+            }
+        }
+    }
+    S->makeCompressed();
+}
+
+// the blocks of column k into the values of the pattern of BuildReducedCameraPattern()
+inline void CopyBlockColumn(const std::vector<int> &column_offsets, const std::vector<int> &block_rows,
+                            const AlignedVector<Matrix9d> &blocks, int k, Eigen::SparseMatrix<double> *S) {
+    double *values = S->valuePtr() + S->outerIndexPtr()[9 * k];
+    for (int c = 0; c < 9; ++c) {
+        for (int block = column_offsets[k]; block < column_offsets[k + 1]; ++block) {
+            const int rows = block_rows[block] == k ? c + 1 : 9;
+            const double *column = blocks[block].data() + 9 * c;
+            values = std::copy(column, column + rows, values);
+        }
+    }
+}
+
+/**
+ * Levenberg-Marquardt on a BALProblem with everything sized at compile time:
+ * 2x9 / 2x3 Jacobians, 9x9 camera, 3x3 point and 9x3 camera-point blocks of
+ * J^T J. Each step eliminates the points,
+ *
+ * S = B - E C^-1 E^T,  S dx_c = -g_c + E C^-1 g_p,
+ *
+ * with S assembled block by block (upper triangle, one 9x9 block per camera
+ * pair sharing a point) into a sparse matrix whose pattern never changes, so
+ * SimplicialLDLT analyzes it once and afterwards only factorizes
+ * (--linear_solver=DENSE_SCHUR: a dense LDLT of it, for few cameras). Then
+ * dx_p = -C^-1 (g_p + E^T dx_c).
+ *
+ * The elimination runs on the thread pool without locks: the points are cut
+ * into contiguous ranges (balanced by observation pairs), and every range
+ * accumulates into its own buffer of just the S blocks its points touch. A
+ * parallel reduction over the S blocks then adds up the buffers, always in the
+ * same order. The ranges follow from the problem size alone, not from
+ * --num_threads, so the result is the same for every thread count.
+ *
+ * Robust losses rescale residual and Jacobian by sqrt(rho'), which is what
+ * ceres does for losses with rho'' <= 0 (Huber, Cauchy) as well. The
+ * trust region follows ceres (LEVENBERG_MARQUARDT): damping 1 / radius times
+ * diag(J^T J), the same termination tolerances and every step, accepted or
+ * not, is an iteration. The camera update is additive in the angle axis.
+ *
+ * Deactivate() takes observations out (--outlier_rounds) without touching the
+ * structure: their residuals and Jacobians are zero, so the pattern of S and
+ * its symbolic analysis stay valid for the next Solve().
+ */
+class NativeBASolver {
+public:
+    NativeBASolver(BALProblem &bal_problem, const BAOptions &ba_options)
+            : problem_(bal_problem), options_(ba_options), pool_(ba_options.num_threads),
+              num_cameras_(bal_problem.num_cameras()), num_points_(bal_problem.num_points()),
+              num_observations_(bal_problem.num_observations()), blocks_(bal_problem),
+              dense_(ba_options.linear_solver == "DENSE_SCHUR"), cancelled_(false), final_cost_(0) {
+        if (!ba_options.snapshot_ply.empty() && ba_options.async_output) {
+            snapshot_writer_.reset(new AsyncWriter());
+        }
+        BuildStructure();
+    }
+
+    // optimize the parameters of the problem in place
+    void Solve(SolveStats *stats) {
+        const double solve_start = WallTimeInSeconds();
+        SolveStats local_stats;
+        if (stats == NULL) stats = &local_stats;
+        stats->setup_time = setup_time_;
+        stats->iterations.clear();
+
+        double *parameters = problem_.mutable_cameras(); // cameras, then points
+        const int num_parameters = 9 * num_cameras_ + 3 * num_points_;
+        std::vector<double> candidate(num_parameters);
+        dx_.resize(num_parameters);
+
+        double radius = 1e4; // ceres initial_trust_region_radius
+        double decrease_factor = 2.0;
+        double cost = Linearize(parameters, stats);
+        stats->initial_cost = cost;
+        IterationStats initial;
+        initial.cost = cost;
+        initial.cumulative_time = WallTimeInSeconds() - solve_start;
+        stats->iterations.push_back(initial);
+        if (options_.verbose) {
+            printf("iter      cost      cost_change  |gradient|   |step|    tr_ratio  tr_radius\n");
+            printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", 0, cost, 0.0,
+                   GradientMaxNorm(), 0.0, 0.0, radius);
+        }
+
+        const char *termination = "maximum number of iterations";
+        cancelled_ = !ContinueSolve(options_, initial, 0.0, 0.0, true, &termination);
+        for (int iteration = 1; !cancelled_ && iteration <= options_.max_iterations; ++iteration) {
+            const double iteration_start = WallTimeInSeconds();
+            if (GradientMaxNorm() <= options_.gradient_tolerance) {
+                termination = "gradient tolerance";
+                break;
+            }
+
+            const double mu = 1.0 / radius;
+            const bool solved = SolveDampedSystem(mu, stats);
+            double step_norm = 0, ratio = 0, new_cost = cost;
+            bool accepted = false;
+            if (solved) {
+                step_norm = Eigen::Map<const Eigen::VectorXd>(dx_.data(), num_parameters).norm();
+                const double x_norm = Eigen::Map<const Eigen::VectorXd>(parameters, num_parameters).norm();
+                if (step_norm <= options_.parameter_tolerance * (x_norm + options_.parameter_tolerance)) {
+                    termination = "parameter tolerance";
+                    break;
+                }
+
+                for (int i = 0; i < num_parameters; ++i) {
+                    candidate[i] = parameters[i] + dx_[i];
+                }
+                const double evaluation_start = WallTimeInSeconds();
+                new_cost = Evaluate(candidate.data(), false);
+                stats->residual_evaluation_time += WallTimeInSeconds() - evaluation_start;
+                ratio = (cost - new_cost) / ModelCostDecrease(mu);
+                accepted = std::isfinite(new_cost) && ratio > 1e-3;
+            }
+
+            if (accepted) {
+                // ceres: radius / max(1/3, 1 - (2 ratio - 1)^3)
+                radius = std::min(1e16, radius / std::max(1.0 / 3.0, 1.0 - std::pow(2.0 * ratio - 1.0, 3)));
+                decrease_factor = 2.0;
+                std::copy(candidate.begin(), candidate.end(), parameters);
+                if (!options_.snapshot_ply.empty()) {
+                    char suffix[16];
+                    snprintf(suffix, sizeof(suffix), "%03d.ply", iteration);
+                    WriteToPLYFileAsync(problem_, options_.snapshot_ply + suffix, options_.binary_ply,
+                                        snapshot_writer_.get());
+                }
+                const double cost_change = cost - new_cost;
+                cost = Linearize(parameters, stats);
+                RecordIteration(stats, iteration, cost, iteration_start, solve_start);
+                if (options_.verbose) {
+                    printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", iteration, cost,
+                           cost_change, GradientMaxNorm(), step_norm, ratio, radius);
+                }
+                if (cost_change <= options_.function_tolerance * cost) {
+                    termination = "function tolerance";
+                    break;
+                }
+                if (!ContinueSolve(options_, stats->iterations.back(), cost_change, step_norm, true, &termination)) {
+                    cancelled_ = true;
+                    break;
+                }
+            } else {
+                radius /= decrease_factor;
+                decrease_factor *= 2.0;
+                RecordIteration(stats, iteration, cost, iteration_start, solve_start);
+                if (options_.verbose) {
+                    printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", iteration, cost,
+                           0.0, GradientMaxNorm(), step_norm, ratio, radius);
+                }
+                if (radius < 1e-32) {
+                    termination = "trust region radius below minimum";
+                    break;
+                }
+                if (!ContinueSolve(options_, stats->iterations.back(), 0.0, step_norm, false, &termination)) {
+                    cancelled_ = true;
+                    break;
+                }
+            }
+        }
+
+        stats->final_cost = final_cost_ = cost;
+        stats->solve_time = WallTimeInSeconds() - solve_start;
+        if (options_.verbose) {
+            std::cout << "native BA: " << stats->iterations.size() - 1 << " iterations, cost "
+                      << stats->initial_cost << " -> " << stats->final_cost << ", " << termination << std::endl;
+        }
+    }
+
+    // whether the last Solve() was cancelled by --iteration_callback (or --max_solver_time)
+    bool cancelled() const {  return cancelled_;  }
+
+    // whether the last Solve() ended on a cost which is not finite
+    bool failed() const {  return !std::isfinite(final_cost_);  }
+
+    // zero weight for these observations in every later Solve()
+    void Deactivate(const std::vector<int> &observations) {
+        for (size_t k = 0; k < observations.size(); ++k) {
+            active_[observations[k]] = 0;
+        }
+    }
+
+    /**
+     * Marginal covariances at the current parameters, see BACovariance. The
+     * reduced camera system of J^T J (undamped) with the gauge parameters
+     * replaced by identity rows is factorized on the pattern of the solve and
+     * inverted on the pattern of its factor (SparseInverse), which holds the
+     * camera blocks and those of every camera pair sharing a point. The point
+     * blocks C^-1 + C^-1 E^T Sigma_cc E C^-1 follow in parallel. False if the
+     * system is singular, e.g. for a visibility graph of several components.
+     */
+    bool ComputeCovariance(BACovariance *covariance) {
+        ScopedTimer timer("native covariance");
+        SolveStats stats;
+        Linearize(problem_.cameras(), &stats);
+        FormReducedSystem(0.0);
+
+        // rotation and translation of camera 0, and the scale: the translation coordinate moving most when
+        // scaling about the center of camera 0, t - R R_0^T t_0
+        const int n = 9 * num_cameras_;
+        std::vector<char> fixed(n, 0);
+        std::fill(fixed.begin(), fixed.begin() + 6, 1);
+        const double *cameras = problem_.cameras();
+        const double inverse_rotation[3] = {-cameras[0], -cameras[1], -cameras[2]};
+        double center_term[3]; // R_0^T t_0 = -center of camera 0
+        AngleAxisRotatePoint(inverse_rotation, cameras + 3, center_term);
+        covariance->gauge_camera = -1;
+        covariance->gauge_coordinate = -1;
+        double largest = 0.0;
+        for (int c = 1; c < num_cameras_; ++c) {
+            double rotated[3];
+            AngleAxisRotatePoint(cameras + 9 * c, center_term, rotated);
+            for (int r = 0; r < 3; ++r) {
+                const double distance = std::abs(cameras[9 * c + 3 + r] - rotated[r]);
+                if (distance > largest) {
+                    largest = distance;
+                    covariance->gauge_camera = c;
+                    covariance->gauge_coordinate = r;
+                }
+            }
+        }
+        if (covariance->gauge_camera >= 0) {
+            fixed[9 * covariance->gauge_camera + 3 + covariance->gauge_coordinate] = 1;
+        }
+        for (int k = 0; k < n; ++k) {
+            for (Eigen::SparseMatrix<double>::InnerIterator it(S_, k); it; ++it) {
+                if (fixed[it.row()] || fixed[k]) it.valueRef() = it.row() == k ? 1.0 : 0.0;
+            }
+        }
+
+        SparseInverse inverse;
+        Eigen::MatrixXd dense_inverse;
+        bool ok;
+        if (dense_) {
+            dense_ldlt_.compute(Eigen::MatrixXd(S_));
+            ok = dense_ldlt_.info() == Eigen::Success && (dense_ldlt_.vectorD().array() > 0).all();
+            if (ok) dense_inverse = dense_ldlt_.solve(Eigen::MatrixXd::Identity(n, n));
+        } else {
+            ldlt_.factorize(S_);
+            ok = ldlt_.info() == Eigen::Success && inverse.Compute(ldlt_);
+        }
+        if (!ok) {
+            std::cerr << "Error: the reduced camera matrix is singular, no covariance" << std::endl;
+            return false;
+        }
+
+        // Sigma_cc on the blocks of S, zero for the gauge
+        AlignedVector<Matrix9d> sigma(column_offsets_.back());
+        pool_.ParallelFor(num_cameras_, [&](int begin, int end) {
+            for (int k = begin; k < end; ++k) {
+                for (int block = column_offsets_[k]; block < column_offsets_[k + 1]; ++block) {
+                    const int i = block_rows_[block];
+                    for (int c = 0; c < 9; ++c) {
+                        for (int r = 0; r < 9; ++r) {
+                            const int row = 9 * i + r, col = 9 * k + c;
+                            sigma[block](r, c) = fixed[row] || fixed[col] ? 0.0
+                                               : dense_ ? dense_inverse(row, col) : inverse(row, col);
+                        }
+                    }
+                }
+            }
+        }, 4);
+        covariance->cameras.resize(num_cameras_);
+        for (int k = 0; k < num_cameras_; ++k) {
+            covariance->cameras[k] = sigma[column_offsets_[k + 1] - 1];
+        }
+
+        covariance->points.resize(num_points_);
+        pool_.ParallelFor(num_points_, [&](int begin, int end) {
+            for (int j = begin; j < end; ++j) {
+                // E^T Sigma_cc E over the observation pairs a <= b, ascending cameras as the S blocks
+                Eigen::Matrix3d sum = Eigen::Matrix3d::Zero();
+                int pair = pair_offsets_[j];
+                for (int a = point_offsets_[j]; a < point_offsets_[j + 1]; ++a) {
+                    const Matrix93d &E_a = E_[point_observations_[a]];
+                    for (int b = a; b < point_offsets_[j + 1]; ++b, ++pair) {
+                        const Eigen::Matrix3d product =
+                                E_a.transpose() * sigma[pair_blocks_[pair]] * E_[point_observations_[b]];
+                        sum += b == a ? product : Eigen::Matrix3d(product + product.transpose());
+                    }
+                }
+                covariance->points[j] = C_inverse_[j] + C_inverse_[j] * sum * C_inverse_[j];
+            }
+        }, 256);
+        return true;
+    }
+
+private:
+    NativeBASolver(const NativeBASolver &);
+    NativeBASolver &operator=(const NativeBASolver &);
+
+    // observations by point and the blocks of S they update, see the class comment
+    void BuildStructure() {
+        const double setup_start = WallTimeInSeconds();
+        const int *camera_index = problem_.camera_index();
+        const int *point_index = problem_.point_index();
+
+        // observations of every point, by ascending camera
+        point_offsets_.assign(num_points_ + 1, 0);
+        for (int i = 0; i < num_observations_; ++i) {
+            ++point_offsets_[point_index[i] + 1];
+        }
+        for (int j = 0; j < num_points_; ++j) {
+            point_offsets_[j + 1] += point_offsets_[j];
+        }
+        point_observations_.resize(num_observations_);
+        std::vector<int> fill(point_offsets_.begin(), point_offsets_.end() - 1);
+        for (int i = 0; i < num_observations_; ++i) {
+            point_observations_[fill[point_index[i]]++] = i;
+        }
+        for (int j = 0; j < num_points_; ++j) {
+            std::sort(point_observations_.begin() + point_offsets_[j],
+                      point_observations_.begin() + point_offsets_[j + 1],
+                      [camera_index](int a, int b) {  return camera_index[a] < camera_index[b];  });
+        }
+
+        // observations of every camera
+        camera_offsets_.assign(num_cameras_ + 1, 0);
+        for (int i = 0; i < num_observations_; ++i) {
+            ++camera_offsets_[camera_index[i] + 1];
+        }
+        for (int c = 0; c < num_cameras_; ++c) {
+            camera_offsets_[c + 1] += camera_offsets_[c];
+        }
+        camera_observations_.resize(num_observations_);
+        fill.assign(camera_offsets_.begin(), camera_offsets_.end() - 1);
+        for (int i = 0; i < num_observations_; ++i) {
+            camera_observations_[fill[camera_index[i]]++] = i;
+        }
+
+        // block rows i <= k of every block column k, the diagonal last
+        std::vector<std::vector<int> > columns(num_cameras_);
+        for (int j = 0; j < num_points_; ++j) {
+            for (int a = point_offsets_[j]; a < point_offsets_[j + 1]; ++a) {
+                for (int b = a + 1; b < point_offsets_[j + 1]; ++b) {
+                    const int ci = camera_index[point_observations_[a]];
+                    const int ck = camera_index[point_observations_[b]];
+                    if (ci != ck) columns[ck].push_back(ci);
+                }
+            }
+        }
+        BuildBlockColumns(&columns, &column_offsets_, &block_rows_);
+
+        // the S block of every observation pair (a <= b) of a point
+        pair_offsets_.assign(num_points_ + 1, 0);
+        for (int j = 0; j < num_points_; ++j) {
+            const int n = point_offsets_[j + 1] - point_offsets_[j];
+            pair_offsets_[j + 1] = pair_offsets_[j] + n * (n + 1) / 2;
+        }
+        pair_blocks_.resize(pair_offsets_.back());
+        for (int j = 0; j < num_points_; ++j) {
+            int pair = pair_offsets_[j];
+            for (int a = point_offsets_[j]; a < point_offsets_[j + 1]; ++a) {
+                for (int b = a; b < point_offsets_[j + 1]; ++b) {
+                    pair_blocks_[pair++] = Block(camera_index[point_observations_[a]],
+                                                 camera_index[point_observations_[b]]);
+                }
+            }
+        }
+        BuildPartitions();
+
+        const int n = 9 * num_cameras_;
+        BuildReducedCameraPattern(column_offsets_, block_rows_, &S_);
+        if (!dense_) {
+            ldlt_.analyzePattern(S_);
+        }
+
+        const int num_blocks = column_offsets_.back();
+        S_blocks_.resize(num_blocks);
+        B_.resize(num_cameras_);
+        C_.resize(num_points_);
+        C_inverse_.resize(num_points_);
+        E_.resize(num_observations_);
+        g_cameras_.resize(num_cameras_);
+        g_points_.resize(num_points_);
+        rhs_.resize(n);
+        J_cameras_.resize(num_observations_);
+        J_points_.resize(num_observations_);
+        residuals_.resize(num_observations_);
+        costs_.resize(num_observations_);
+        active_.assign(num_observations_, 1);
+        if (EvaluationPrecisionOf(options_) == kDoublePrecision) {
+            blocks_.AllocateJacobians();
+        }
+        setup_time_ = WallTimeInSeconds() - setup_start;
+        Profiler::Get().Record("native setup", setup_start, setup_start + setup_time_);
+    }
+
+    /**
+     * Point ranges of the parallel elimination, each with the S blocks it
+     * updates (pair_blocks_ of its points renumbered into its own buffer), and
+     * for every S block the buffer entries which add up to it. One range per
+     * kPairsPerPartition observation pairs, at most kMaxPartitions: the
+     * grouping of the sums, and so the rounding, must not depend on the threads.
+     */
+    void BuildPartitions() {
+        static const long kPairsPerPartition = 1 << 14;
+        static const long kMaxPartitions = 32;
+        const long num_pairs = pair_offsets_.back();
+        const int num_partitions = static_cast<int>(std::max(1L, std::min(
+                std::min(kMaxPartitions, num_pairs / kPairsPerPartition), static_cast<long>(num_points_))));
+        partition_offsets_.assign(num_partitions + 1, num_points_);
+        partition_offsets_[0] = 0;
+        for (int p = 1; p < num_partitions; ++p) {
+            const long target = num_pairs * p / num_partitions;
+            partition_offsets_[p] = static_cast<int>(
+                    std::lower_bound(pair_offsets_.begin(), pair_offsets_.end(), target) - pair_offsets_.begin());
+        }
+        partition_buffers_.assign(num_partitions, AlignedVector<Matrix9d>());
+        partition_rhs_.assign(num_partitions, Eigen::VectorXd());
+        if (num_partitions == 1) {
+            // a single range writes S directly
+            return;
+        }
+
+        const int num_blocks = column_offsets_.back();
+        pair_local_blocks_.resize(pair_blocks_.size());
+        std::vector<int> local(num_blocks, -1);
+        std::vector<std::vector<std::pair<int, int> > > contributions(num_blocks);
+        for (int p = 0; p < num_partitions; ++p) {
+            const int pair_begin = pair_offsets_[partition_offsets_[p]];
+            const int pair_end = pair_offsets_[partition_offsets_[p + 1]];
+            int num_local = 0;
+            for (int pair = pair_begin; pair < pair_end; ++pair) {
+                const int block = pair_blocks_[pair];
+                if (local[block] < 0) {
+                    local[block] = num_local++;
+                    contributions[block].push_back(std::make_pair(p, local[block]));
+                }
+                pair_local_blocks_[pair] = local[block];
+            }
+            for (int pair = pair_begin; pair < pair_end; ++pair) {
+                local[pair_blocks_[pair]] = -1;
+            }
+            partition_buffers_[p].resize(num_local);
+            partition_rhs_[p].resize(9 * num_cameras_);
+        }
+        contribution_offsets_.assign(num_blocks + 1, 0);
+        contributions_.clear();
+        for (int block = 0; block < num_blocks; ++block) {
+            contributions_.insert(contributions_.end(), contributions[block].begin(), contributions[block].end());
+            contribution_offsets_[block + 1] = static_cast<int>(contributions_.size());
+        }
+    }
+
+    // index of the S block (i, k), i <= k
+    int Block(int i, int k) const {
+        return FindBlock(column_offsets_, block_rows_, i, k);
+    }
+
+    /**
+     * Cost 0.5 * sum rho(|r|^2) at parameters (cameras, then points), with
+     * the robustified residuals and Jacobians when jacobians is set. At
+     * double precision the observations of a camera go through the batched
+     * kernel (ObservationBlocks) at once, float ones one by one.
+     */
+    double Evaluate(const double *parameters, bool jacobians) {
+        ScopedTimer timer(jacobians ? "native jacobian evaluation" : "native residual evaluation");
+        const double *cameras = parameters;
+        const double *points = parameters + 9 * num_cameras_;
+        const EvaluationPrecision precision = jacobians ? EvaluationPrecisionOf(options_) :
+                                              (options_.precision == "float" ? kSinglePrecision : kDoublePrecision);
+        if (precision == kDoublePrecision) {
+            pool_.ParallelFor(num_cameras_, [&](int begin, int end) {
+                for (int c = begin; c < end; ++c) {
+                    const int offset = blocks_.offset(c), n = blocks_.size(c);
+                    Profiler::Count(kResidualEvaluations, n);
+                    if (jacobians) Profiler::Count(kJacobianEvaluations, n);
+                    blocks_.EvaluateCamera(cameras, points, c, jacobians);
+                    for (int k = offset; k < offset + n; ++k) {
+                        const int i = blocks_.order()[k];
+                        if (!active_[i]) {
+                            ClearObservation(i, jacobians);
+                            continue;
+                        }
+                        const Eigen::Vector2d r(blocks_.residuals_u()[k], blocks_.residuals_v()[k]);
+                        if (!jacobians) {
+                            costs_[i] = RobustifyObservation(options_, r, NULL, NULL, NULL);
+                            continue;
+                        }
+                        for (int e = 0; e < 18; ++e) {
+                            J_cameras_[i].data()[e] = blocks_.jacobian(e)[k];
+                        }
+                        for (int e = 0; e < 6; ++e) {
+                            J_points_[i].data()[e] = blocks_.jacobian(18 + e)[k];
+                        }
+                        costs_[i] = RobustifyObservation(options_, r, &residuals_[i], &J_cameras_[i], &J_points_[i]);
+                    }
+                }
+            }, 1);
+        } else {
+            const int *camera_index = problem_.camera_index();
+            const int *point_index = problem_.point_index();
+            const double *observations = problem_.observations();
+            pool_.ParallelFor(num_observations_, [&](int begin, int end) {
+                Profiler::Count(kResidualEvaluations, end - begin);
+                if (jacobians) Profiler::Count(kJacobianEvaluations, end - begin);
+                for (int i = begin; i < end; ++i) {
+                    if (!active_[i]) {
+                        ClearObservation(i, jacobians);
+                        continue;
+                    }
+                    costs_[i] = EvaluateObservation(options_, precision, cameras + 9 * camera_index[i],
+                                                    points + 3 * point_index[i], observations + 2 * i,
+                                                    jacobians ? &residuals_[i] : NULL,
+                                                    jacobians ? &J_cameras_[i] : NULL,
+                                                    jacobians ? &J_points_[i] : NULL);
+                }
+            }, 256);
+        }
+
+        double cost = 0;
+        for (int i = 0; i < num_observations_; ++i) {
+            cost += costs_[i];
+        }
+        return cost;
+    }
+
+    // an observation taken out by Deactivate()
+    void ClearObservation(int i, bool jacobians) {
+        costs_[i] = 0;
+        if (jacobians) {
+            residuals_[i].setZero();
+            J_cameras_[i].setZero();
+            J_points_[i].setZero();
+        }
+    }
+
+    // evaluate with Jacobians and form the blocks of J^T J and the gradient
+    double Linearize(const double *parameters, SolveStats *stats) {
+        const double evaluation_start = WallTimeInSeconds();
+        const double cost = Evaluate(parameters, true);
+        stats->jacobian_evaluation_time += WallTimeInSeconds() - evaluation_start;
+
+        // by camera and by point, so that every block has one writer
+        pool_.ParallelFor(num_cameras_, [&](int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                B_[c].setZero();
+                g_cameras_[c].setZero();
+                for (int o = camera_offsets_[c]; o < camera_offsets_[c + 1]; ++o) {
+                    const int i = camera_observations_[o];
+                    B_[c].noalias() += J_cameras_[i].transpose() * J_cameras_[i];
+                    g_cameras_[c].noalias() += J_cameras_[i].transpose() * residuals_[i];
+                }
+            }
+        }, 4);
+        pool_.ParallelFor(num_points_, [&](int begin, int end) {
+            for (int j = begin; j < end; ++j) {
+                C_[j].setZero();
+                g_points_[j].setZero();
+                for (int o = point_offsets_[j]; o < point_offsets_[j + 1]; ++o) {
+                    const int i = point_observations_[o];
+                    C_[j].noalias() += J_points_[i].transpose() * J_points_[i];
+                    g_points_[j].noalias() += J_points_[i].transpose() * residuals_[i];
+                    E_[i].noalias() = J_cameras_[i].transpose() * J_points_[i];
+                }
+            }
+        }, 256);
+        return cost;
+    }
+
+    double GradientMaxNorm() const {
+        double norm = 0;
+        for (int c = 0; c < num_cameras_; ++c) {
+            norm = std::max(norm, g_cameras_[c].cwiseAbs().maxCoeff());
+        }
+        for (int j = 0; j < num_points_; ++j) {
+            norm = std::max(norm, g_points_[j].cwiseAbs().maxCoeff());
+        }
+        return norm;
+    }
+
+    /**
+     * (J^T J + mu D) dx = -g through the Schur complement of the points,
+     * false if the reduced camera system cannot be factorized.
+     */
+    bool SolveDampedSystem(double mu, SolveStats *stats) {
+        ScopedTimer timer("native linear solver");
+        const double linear_start = WallTimeInSeconds();
+        const int *camera_index = problem_.camera_index();
+        FormReducedSystem(mu);
+
+        bool ok;
+        if (dense_) {
+            dense_ldlt_.compute(Eigen::MatrixXd(S_));
+            ok = dense_ldlt_.info() == Eigen::Success;
+        } else {
+            ldlt_.factorize(S_);
+            ok = ldlt_.info() == Eigen::Success;
+        }
+        if (ok) {
+            Eigen::Map<Eigen::VectorXd>(dx_.data(), 9 * num_cameras_) =
+                    dense_ ? Eigen::VectorXd(dense_ldlt_.solve(rhs_)) : Eigen::VectorXd(ldlt_.solve(rhs_));
+
+            // dx_p = -C^-1 (g_p + E^T dx_c)
+            double *dx_points = dx_.data() + 9 * num_cameras_;
+            pool_.ParallelFor(num_points_, [&](int begin, int end) {
+                for (int j = begin; j < end; ++j) {
+                    Eigen::Vector3d sum = g_points_[j];
+                    for (int a = point_offsets_[j]; a < point_offsets_[j + 1]; ++a) {
+                        const int observation = point_observations_[a];
+                        sum.noalias() += E_[observation].transpose() *
+                                         Eigen::Map<const Vector9d>(dx_.data() + 9 * camera_index[observation]);
+                    }
+                    Eigen::Map<Eigen::Vector3d>(dx_points + 3 * j) = -C_inverse_[j] * sum;
+                }
+            }, 256);
+            ok = Eigen::Map<const Eigen::VectorXd>(dx_.data(), dx_.size()).allFinite();
+        }
+        stats->linear_solver_time += WallTimeInSeconds() - linear_start;
+        return ok;
+    }
+
+    // S = B + mu D - E (C + mu D)^-1 E^T into S_, rhs_ and C_inverse_
+    void FormReducedSystem(double mu) {
+        const bool direct = partition_buffers_.size() == 1;
+        pool_.ParallelFor(static_cast<int>(partition_buffers_.size()), [&](int begin, int end) {
+            for (int p = begin; p < end; ++p) {
+                EliminatePoints(mu, p, direct);
+            }
+        }, 1);
+
+        // S = B + mu D - sum of the buffers, rhs = -g_c + sum of the buffers
+        pool_.ParallelFor(num_cameras_, [&](int begin, int end) {
+            for (int k = begin; k < end; ++k) {
+                for (int block = column_offsets_[k]; block < column_offsets_[k + 1]; ++block) {
+                    Matrix9d &S = S_blocks_[block];
+                    if (!direct) {
+                        S.setZero();
+                        for (int c = contribution_offsets_[block]; c < contribution_offsets_[block + 1]; ++c) {
+                            S += partition_buffers_[contributions_[c].first][contributions_[c].second];
+                        }
+                    }
+                    if (block_rows_[block] == k) {
+                        S += B_[k];
+                        S.diagonal() += mu * Damping<9>(B_[k]);
+                    }
+                }
+                Eigen::Map<Vector9d> rhs(rhs_.data() + 9 * k);
+                if (!direct) {
+                    rhs.setZero();
+                    for (size_t p = 0; p < partition_rhs_.size(); ++p) {
+                        rhs += partition_rhs_[p].segment<9>(9 * k);
+                    }
+                }
+                rhs -= g_cameras_[k];
+
+                CopyBlockColumn(column_offsets_, block_rows_, S_blocks_, k, &S_);
+            }
+        }, 4);
+    }
+
+    /**
+     * -E C^-1 E^T and E C^-1 g_p of the points of partition p, into its
+     * buffers, or straight into S_blocks_ / rhs_ (zeroed here) when direct.
+     */
+    void EliminatePoints(double mu, int p, bool direct) {
+        const int *camera_index = problem_.camera_index();
+        AlignedVector<Matrix9d> &blocks = direct ? S_blocks_ : partition_buffers_[p];
+        const std::vector<int> &block_index = direct ? pair_blocks_ : pair_local_blocks_;
+        double *rhs = direct ? rhs_.data() : partition_rhs_[p].data();
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            blocks[b].setZero();
+        }
+        Eigen::Map<Eigen::VectorXd>(rhs, 9 * num_cameras_).setZero();
+
+        for (int j = partition_offsets_[p]; j < partition_offsets_[p + 1]; ++j) {
+            Eigen::Matrix3d C = C_[j];
+            C.diagonal() += mu * Damping<3>(C_[j]);
+            C_inverse_[j] = C.inverse();
+            const Eigen::Vector3d C_inverse_g = C_inverse_[j] * g_points_[j];
+
+            int pair = pair_offsets_[j];
+            for (int a = point_offsets_[j]; a < point_offsets_[j + 1]; ++a) {
+                const int observation_a = point_observations_[a];
+                const Matrix93d E_C_inverse = E_[observation_a] * C_inverse_[j];
+                Eigen::Map<Vector9d>(rhs + 9 * camera_index[observation_a]).noalias() +=
+                        E_[observation_a] * C_inverse_g;
+                for (int b = a; b < point_offsets_[j + 1]; ++b, ++pair) {
+                    const int observation_b = point_observations_[b];
+                    Matrix9d &block = blocks[block_index[pair]];
+                    if (b == a) {
+                        block.noalias() -= E_C_inverse * E_[observation_a].transpose();
+                    } else if (camera_index[observation_a] == camera_index[observation_b]) {
+                        // the same camera twice, both orders land on the diagonal
+                        const Matrix9d product = E_C_inverse * E_[observation_b].transpose();
+                        block -= product + product.transpose();
+                    } else {
+                        block.noalias() -= E_C_inverse * E_[observation_b].transpose();
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Decrease of the quadratic model J^T J, g at dx_, which solved the damped
+     * system: -g^T dx - 0.5 dx^T J^T J dx = 0.5 (mu dx^T D dx - g^T dx)
+     */
+    double ModelCostDecrease(double mu) const {
+        double g_dx = 0, dx_D_dx = 0;
+        for (int c = 0; c < num_cameras_; ++c) {
+            const Eigen::Map<const Vector9d> dx(dx_.data() + 9 * c);
+            g_dx += g_cameras_[c].dot(dx);
+            dx_D_dx += dx.cwiseAbs2().dot(Damping<9>(B_[c]));
+        }
+        const double *dx_points = dx_.data() + 9 * num_cameras_;
+        for (int j = 0; j < num_points_; ++j) {
+            const Eigen::Map<const Eigen::Vector3d> dx(dx_points + 3 * j);
+            g_dx += g_points_[j].dot(dx);
+            dx_D_dx += dx.cwiseAbs2().dot(Damping<3>(C_[j]));
+        }
+        return 0.5 * (mu * dx_D_dx - g_dx);
+    }
+
+    static void RecordIteration(SolveStats *stats, int iteration, double cost,
+                                double iteration_start, double solve_start) {
+        const double now = WallTimeInSeconds();
+        IterationStats it;
+        it.iteration = iteration;
+        it.cost = cost;
+        it.time = now - iteration_start;
+        it.cumulative_time = now - solve_start;
+        stats->iterations.push_back(it);
+    }
+
+    BALProblem &problem_;
+    const BAOptions options_;
+    ThreadPool pool_;
+    std::unique_ptr<AsyncWriter> snapshot_writer_; // --snapshot_ply with --async_output
+    const int num_cameras_;
+    const int num_points_;
+    const int num_observations_;
+    double setup_time_;
+
+    // structure
+    std::vector<int> point_offsets_, point_observations_;
+    std::vector<int> column_offsets_, block_rows_;
+    std::vector<int> camera_offsets_, camera_observations_;
+    std::vector<int> pair_offsets_, pair_blocks_;
+    ObservationBlocks blocks_; // the observations by camera for the batched evaluation at double precision
+
+    // parallel elimination, see BuildPartitions()
+    std::vector<int> partition_offsets_;
+    std::vector<int> pair_local_blocks_;
+    std::vector<int> contribution_offsets_;
+    std::vector<std::pair<int, int> > contributions_; // (partition, buffer entry)
+    std::vector<AlignedVector<Matrix9d> > partition_buffers_;
+    std::vector<Eigen::VectorXd> partition_rhs_;
+    Eigen::SparseMatrix<double> S_;
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Upper> ldlt_;
+    const bool dense_;
+    Eigen::LDLT<Eigen::MatrixXd, Eigen::Upper> dense_ldlt_;
+    bool cancelled_;
+    double final_cost_;
+
+    // per iteration
+    AlignedVector<Matrix29d> J_cameras_;
+    AlignedVector<Matrix23d> J_points_;
+    AlignedVector<Eigen::Vector2d> residuals_;
+    std::vector<double> costs_;
+    std::vector<char> active_; // see Deactivate()
+    AlignedVector<Matrix9d> B_, S_blocks_;
+    AlignedVector<Eigen::Matrix3d> C_, C_inverse_;
+    AlignedVector<Matrix93d> E_;
+    AlignedVector<Vector9d> g_cameras_;
+    AlignedVector<Eigen::Vector3d> g_points_;
+    Eigen::VectorXd rhs_;
+    std::vector<double> dx_;
+};
+
+// for PlanBAOptions(): Eigen's SimplicialLDLT (AMD ordering) or a dense LDLT of S, no iterative solver
+inline SolverCapabilities NativeCapabilities() {
+    SolverCapabilities capabilities;
+    capabilities.backend = "native";
+    capabilities.sparse_libraries.push_back("EIGEN_SPARSE");
+    capabilities.iterative = false;
+    return capabilities;
+}
+
+/**
+ * One solver run of SolveBANative() on the active observations of outliers
+ * (all if NULL), see there. False if it was cancelled; *failed is set when
+ * a cost is not finite.
+ */
+inline bool SolveBANativePass(BALProblem &bal_problem, const BAOptions &ba_options, OutlierFilter *outliers,
+                              SolveStats *stats, bool *failed) {
+    if (ba_options.verbose) {
+        std::cout << "Solving native BA ... " << std::endl;
+    }
+    NativeBASolver solver(bal_problem, ba_options);
+    ScopedTimer timer("native solve");
+    std::vector<int> dropped;
+    if (outliers != NULL) {
+        for (int i = 0; i < bal_problem.num_observations(); ++i) {
+            if (!outliers->active(i)) dropped.push_back(i);
+        }
+        solver.Deactivate(dropped);
+    }
+    solver.Solve(stats);
+    *failed = *failed || solver.failed();
+    // warm started on the same solver, the structure is built once
+    while (!solver.cancelled() && outliers != NULL && outliers->NextRound(bal_problem, &dropped)) {
+        solver.Deactivate(dropped);
+        SolveStats round_stats;
+        solver.Solve(stats != NULL ? &round_stats : NULL);
+        *failed = *failed || solver.failed();
+        if (stats != NULL) {
+            round_stats.setup_time = 0;
+            stats->Append(round_stats);
+        }
+    }
+    return !solver.cancelled();
+}
+
+/**
+ * Optimize bal_problem in place with NativeBASolver, --linear_solver=AUTO
+ * planned for bal_problem (ba_planner.h): DENSE_SCHUR or SPARSE_SCHUR.
+ * stats, if not NULL, receives the timings and the cost of every iteration.
+ * A --precision=float solution is finished with --refinement_iterations in
+ * double precision. --outlier_rounds drop outliers after the (first) solve.
+ * False if a solve failed, a cancelled one has not.
+ */
+inline bool SolveBANative(BALProblem &bal_problem, const BAOptions &options, SolveStats *stats = NULL) {
+    if (bal_problem.camera_block_size() != 9) {
+        std::cerr << "Error: the native solver only has angle-axis cameras" << std::endl;
+        return false;
+    }
+    const BAOptions ba_options = WithSolveControl(PlanBAOptions(bal_problem, options, NativeCapabilities()));
+    std::unique_ptr<OutlierFilter> outliers(ba_options.outlier_rounds > 0 ? new OutlierFilter(bal_problem, ba_options)
+                                                                          : NULL);
+    bool failed = false;
+    const bool finished = SolveBANativePass(bal_problem, ba_options, outliers.get(), stats, &failed);
+    if (finished && ba_options.precision == "float" && ba_options.refinement_iterations > 0) {
+        BAOptions refinement = ba_options;
+        refinement.precision = "double";
+        refinement.max_iterations = ba_options.refinement_iterations;
+        SolveStats refinement_stats;
+        SolveBANativePass(bal_problem, refinement, outliers.get(), stats != NULL ? &refinement_stats : NULL,
+                          &failed);
+        if (stats != NULL) {
+            stats->Append(refinement_stats);
+        }
+    }
+    return !failed;
+}
+
+/**
+ * Marginal covariances of the cameras and points of bal_problem at its
+ * current parameters (BACovariance), for the robust loss of ba_options and,
+ * with --outlier_rounds, without the observations above --outlier_threshold.
+ * Angle axis cameras only, false after printing why.
+ */
+inline bool EstimateCovarianceNative(BALProblem &bal_problem, const BAOptions &ba_options,
+                                     BACovariance *covariance) {
+    if (bal_problem.camera_block_size() != 9) {
+        std::cerr << "Error: --covariance only has angle-axis cameras" << std::endl;
+        return false;
+    }
+    NativeBASolver solver(bal_problem, ba_options);
+    if (ba_options.outlier_rounds > 0) {
+        BAOptions round = ba_options;
+        round.outlier_rounds = 1;
+        round.verbose = false;
+        OutlierFilter outliers(bal_problem, round);
+        std::vector<int> dropped;
+        outliers.NextRound(bal_problem, &dropped);
+        solver.Deactivate(dropped);
+    }
+    return solver.ComputeCovariance(covariance);
+}
+
+// --covariance of the drivers: EstimateCovarianceNative() into CovarianceFileFor(--final_ply)
+inline bool SaveCovariance(BALProblem &bal_problem, const BAOptions &ba_options) {
+    if (ba_options.final_ply.empty()) {
+        std::cerr << "Error: --covariance is written next to --final_ply, which is not set" << std::endl;
+        return false;
+    }
+    BACovariance covariance;
+    const std::string filename = CovarianceFileFor(ba_options.final_ply);
+    if (!EstimateCovarianceNative(bal_problem, ba_options, &covariance) || !WriteCovariance(filename, covariance)) {
+        return false;
+    }
+    if (ba_options.verbose) {
+        std::cout << "covariances of " << covariance.cameras.size() << " cameras and " << covariance.points.size()
+                  << " points written to " << filename << std::endl;
+    }
+    return true;
+}
+
+#endif // BA_NATIVE_H
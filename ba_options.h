@@ -0,0 +1,394 @@
+#ifndef BA_OPTIONS_H
+#define BA_OPTIONS_H
+
+// command line configuration shared by the bundle adjustment drivers
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ba_stats.h"
+#include "parallel.h"
+#include "projection.h"
+
+struct BAOptions {
+    // input / output
+    std::string input = "../data/problem-16-22106-pre.txt";
+    std::string initial_ply; // empty: not written
+    std::string final_ply;
+    std::string output; // optimized problem, .balb for binary, empty: not written
+    std::string profile; // JSON report of phase times and counters, empty: not written
+    std::string trace; // Chrome trace of the phases, empty: not written
+    bool binary_ply = true; // binary_little_endian PLY files, ASCII otherwise
+    bool async_output = true; // PLY files are written on a background thread
+    std::string snapshot_ply; // (native) PLY of every accepted iteration, <snapshot_ply><iteration>.ply
+
+    // preprocessing
+    double rotation_sigma = 0.1;
+    double translation_sigma = 0.5;
+    double point_sigma = 0.5;
+    bool reorder = true;
+
+    // residuals
+    std::string robust_kernel = "huber"; // huber, cauchy, none
+    double robust_delta = 1.0;
+    std::string jacobian = "analytic"; // analytic, autodiff (ceres), numeric (g2o)
+    std::string precision = "double"; // double, mixed (float Jacobians), float (then refined in double)
+    int refinement_iterations = 5; // double precision iterations after --precision=float
+    int outlier_rounds = 0; // > 0: after the solve, drop the observations above --outlier_threshold and solve on
+    double outlier_threshold = 4.0; // reprojection error in pixels
+    bool quaternions = false; // (ceres, g2o) cameras as [q(4), t(3), f, k1, k2], updated on the rotation manifold
+    bool covariance = false; // write the marginal covariances of the solution next to --final_ply (ba_covariance.h)
+
+    // solver
+    std::string linear_solver = "AUTO"; // AUTO (see ba_planner.h), SPARSE_SCHUR, DENSE_SCHUR, ITERATIVE_SCHUR
+    std::string sparse_library = "AUTO"; // of SPARSE_SCHUR: SUITE_SPARSE, EIGEN_SPARSE, CX_SPARSE, ACCELERATE_SPARSE
+    std::string fill_ordering = "AUTO"; // of SPARSE_SCHUR: AMD, NESDIS (ceres >= 2.2)
+    std::string preconditioner = "SCHUR_JACOBI"; // for ITERATIVE_SCHUR
+    std::string visibility_clustering = "CANONICAL_VIEWS"; // for the CLUSTER_ preconditioners
+    double eta = 0.1; // ITERATIVE_SCHUR stops at |residual| <= eta * |rhs| (inexact Newton)
+    int min_linear_iterations = 0; // ITERATIVE_SCHUR (ceres)
+    int max_linear_iterations = 500; // ITERATIVE_SCHUR
+    bool explicit_schur = false; // ITERATIVE_SCHUR forms S instead of products with E C^-1 E^T (ceres)
+    std::string ordering = "automatic"; // automatic, schur (points eliminated first)
+    int num_threads = DefaultNumThreads();
+    int max_iterations = 40;
+    double function_tolerance = 1e-6;
+    double gradient_tolerance = 1e-10;
+    double parameter_tolerance = 1e-8;
+    double max_solver_time = 0; // > 0: wall clock budget of a solve in seconds, ends after the iteration exceeding it
+    IterationCallback iteration_callback; // not a flag: progress of every iteration, can cancel the solve
+    int incremental_cameras = 0; // > 0: stream the cameras into a BASession this many at a time (ceres)
+    int window_cameras = 0; // > 0: only the last cameras of --incremental_cameras are optimized
+    bool marginalize = false; // cameras leaving the window are marginalized instead of held constant
+    int point_chunk = 0; // > 0: bundle_adjustment_native streams the points from a .balp file, this many at a time
+    std::string point_file; // .balp file of --point_chunk, default <input>.balp
+    bool components = false; // solve the connected components of the visibility graph separately, concurrently
+    bool graph_stats = false; // print the statistics of the visibility graph before solving
+    std::string manifest; // file of problems, one "input --flag=value ..." per line, solved as one batch
+    int partitions = 4; // camera partitions of bundle_adjustment_distributed without MPI (one thread each)
+    std::string partitioning = "contiguous"; // contiguous (camera index ranges), graph (covisibility clusters)
+    int admm_iterations = 50;
+    int admm_local_iterations = 5; // LM iterations of every partition per ADMM iteration
+    double admm_rho = 1.0; // initial penalty of the consensus terms, rebalanced as ADMM goes
+    double admm_tolerance = 1e-3; // RMS primal and dual residual of the shared points
+    bool verbose = true;
+};
+
+inline void PrintBAUsage(const char *program, const BAOptions &defaults) {
+    std::cout << "Usage: " << program << " [--flag=value ...]\n"
+              << "  --input=" << defaults.input << "  BAL problem (.txt, .bz2, .gz, .zst or .balb)\n"
+              << "  --initial_ply=" << defaults.initial_ply << "\n"
+              << "  --final_ply=" << defaults.final_ply << "\n"
+              << "  --output=" << defaults.output << "  optimized problem, BAL text or .balb\n"
+              << "  --profile=" << defaults.profile << "  JSON report of phase times and counters\n"
+              << "  --trace=" << defaults.trace << "  Chrome trace (chrome://tracing) of the phases\n"
+              << "  --binary_ply=" << (defaults.binary_ply ? "true" : "false")
+              << "  binary_little_endian or ASCII PLY\n"
+              << "  --async_output=" << (defaults.async_output ? "true" : "false")
+              << "  write the PLY files on a background thread\n"
+              << "  --snapshot_ply=" << defaults.snapshot_ply
+              << "  (native) prefix of a PLY file per accepted iteration\n"
+              << "  --rotation_sigma=" << defaults.rotation_sigma << "\n"
+              << "  --translation_sigma=" << defaults.translation_sigma << "\n"
+              << "  --point_sigma=" << defaults.point_sigma << "\n"
+              << "  --reorder=" << (defaults.reorder ? "true" : "false") << "  camera sorted observations\n"
+              << "  --robust_kernel=" << defaults.robust_kernel << "  huber, cauchy or none\n"
+              << "  --robust_delta=" << defaults.robust_delta << "\n"
+              << "  --jacobian=" << defaults.jacobian << "  analytic, autodiff (ceres) or numeric (g2o)\n"
+              << "  --precision=" << defaults.precision
+              << "  double, mixed (float Jacobians) or float (float residuals and Jacobians)\n"
+              << "  --refinement_iterations=" << defaults.refinement_iterations
+              << "  double precision iterations after --precision=float\n"
+              << "  --outlier_rounds=" << defaults.outlier_rounds
+              << "  rounds of dropping outliers and solving on, warm started (ceres, g2o, native)\n"
+              << "  --outlier_threshold=" << defaults.outlier_threshold << "  outlier reprojection error in pixels\n"
+              << "  --quaternions=" << (defaults.quaternions ? "true" : "false")
+              << "  (ceres, g2o) quaternion instead of angle-axis camera rotations\n"
+              << "  --covariance=" << (defaults.covariance ? "true" : "false")
+              << "  camera and point covariances of the solution into <final_ply>_covariance.txt\n"
+              << "  --linear_solver=" << defaults.linear_solver
+              << "  AUTO (from the problem structure), SPARSE_SCHUR, DENSE_SCHUR or ITERATIVE_SCHUR\n"
+              << "  --sparse_library=" << defaults.sparse_library
+              << "  SUITE_SPARSE, EIGEN_SPARSE, CX_SPARSE, ACCELERATE_SPARSE (ceres), CX_SPARSE, EIGEN_SPARSE (g2o)\n"
+              << "  --fill_ordering=" << defaults.fill_ordering << "  AMD or NESDIS (ceres >= 2.2)\n"
+              << "  --preconditioner=" << defaults.preconditioner
+              << "  JACOBI, SCHUR_JACOBI, CLUSTER_JACOBI or CLUSTER_TRIDIAGONAL\n"
+              << "  --visibility_clustering=" << defaults.visibility_clustering
+              << "  CANONICAL_VIEWS or SINGLE_LINKAGE (ceres)\n"
+              << "  --eta=" << defaults.eta << "  relative residual of the iterative linear solves\n"
+              << "  --min_linear_iterations=" << defaults.min_linear_iterations << "  (ceres)\n"
+              << "  --max_linear_iterations=" << defaults.max_linear_iterations << "\n"
+              << "  --explicit_schur=" << (defaults.explicit_schur ? "true" : "false")
+              << "  ITERATIVE_SCHUR on the explicit reduced camera matrix (ceres)\n"
+              << "  --ordering=" << defaults.ordering << "  automatic or schur (ceres, g2o always eliminates points)\n"
+              << "  --num_threads=" << defaults.num_threads << "\n"
+              << "  --max_iterations=" << defaults.max_iterations << "\n"
+              << "  --max_solver_time=" << defaults.max_solver_time << "  wall clock seconds per solve, 0: none\n"
+              << "  --function_tolerance=" << defaults.function_tolerance
+              << "  stop once an accepted step decreases the cost by less than this fraction\n"
+              << "  --gradient_tolerance=" << defaults.gradient_tolerance << "  (ceres)\n"
+              << "  --parameter_tolerance=" << defaults.parameter_tolerance << "  (ceres)\n"
+              << "  --incremental_cameras=" << defaults.incremental_cameras
+              << "  (ceres) add this many cameras per solve of a persistent session, 0: one batch solve\n"
+              << "  --window_cameras=" << defaults.window_cameras
+              << "  sliding window size of --incremental_cameras, 0: all cameras\n"
+              << "  --marginalize=" << (defaults.marginalize ? "true" : "false")
+              << "  marginalize cameras leaving the window into a prior instead of fixing them\n"
+              << "  --point_chunk=" << defaults.point_chunk
+              << "  (native) > 0: out-of-core solve, streaming this many points at a time from a .balp file\n"
+              << "  --point_file=" << defaults.point_file
+              << "  (native) .balp file of --point_chunk, default <input>.balp\n"
+              << "  --components=" << (defaults.components ? "true" : "false")
+              << "  solve the connected components of the visibility graph separately\n"
+              << "  --graph_stats=" << (defaults.graph_stats ? "true" : "false")
+              << "  print observations per camera / point, components and reduced camera matrix fill\n"
+              << "  --manifest=" << defaults.manifest
+              << "  (ceres, g2o, native) solve the problems of this file, one per line, on --num_threads threads\n"
+              << "  --partitions=" << defaults.partitions
+              << "  (distributed) camera partitions solved by threads, MPI runs one per process\n"
+              << "  --partitioning=" << defaults.partitioning
+              << "  (distributed) contiguous camera ranges or graph (covisibility clusters)\n"
+              << "  --admm_iterations=" << defaults.admm_iterations << "  (distributed)\n"
+              << "  --admm_local_iterations=" << defaults.admm_local_iterations
+              << "  (distributed) LM iterations per partition and ADMM iteration\n"
+              << "  --admm_rho=" << defaults.admm_rho << "  (distributed) initial consensus penalty\n"
+              << "  --admm_tolerance=" << defaults.admm_tolerance
+              << "  (distributed) RMS primal and dual residual of the shared points\n"
+              << "  --verbose=" << (defaults.verbose ? "true" : "false") << "\n";
+}
+
+/**
+ * Parse --flag=value arguments into options, which hold the defaults.
+ * Returns false (after printing why) on unknown flags, bad values and --help.
+ * With unparsed given, unknown flags and other arguments are collected there
+ * for the caller instead.
+ */
+inline bool ParseBAOptions(int argc, char **argv, BAOptions *options,
+                           std::vector<std::string> *unparsed = NULL) {
+    const BAOptions defaults = *options;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg(argv[i]);
+        if (arg == "--help" || arg == "-h") {
+            PrintBAUsage(argv[0], defaults);
+            return false;
+        }
+
+        const size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+            if (unparsed != NULL) {
+                unparsed->push_back(arg);
+                continue;
+            }
+            std::cerr << "Error: expected --flag=value, got " << arg << std::endl;
+            return false;
+        }
+        const std::string name = arg.substr(2, eq - 2);
+        const std::string value = arg.substr(eq + 1);
+
+        char *end = NULL;
+        bool ok = true;
+        auto to_double = [&](double *out) {
+            *out = strtod(value.c_str(), &end);
+            ok = !value.empty() && *end == '\0';
+        };
+        auto to_int = [&](int *out) {
+            *out = static_cast<int>(strtol(value.c_str(), &end, 10));
+            ok = !value.empty() && *end == '\0';
+        };
+        auto to_bool = [&](bool *out) {
+            ok = (value == "true" || value == "false" || value == "1" || value == "0");
+            *out = (value == "true" || value == "1");
+        };
+
+        if (name == "input") options->input = value;
+        else if (name == "initial_ply") options->initial_ply = value;
+        else if (name == "final_ply") options->final_ply = value;
+        else if (name == "output") options->output = value;
+        else if (name == "profile") options->profile = value;
+        else if (name == "trace") options->trace = value;
+        else if (name == "binary_ply") to_bool(&options->binary_ply);
+        else if (name == "async_output") to_bool(&options->async_output);
+        else if (name == "snapshot_ply") options->snapshot_ply = value;
+        else if (name == "rotation_sigma") to_double(&options->rotation_sigma);
+        else if (name == "translation_sigma") to_double(&options->translation_sigma);
+        else if (name == "point_sigma") to_double(&options->point_sigma);
+        else if (name == "reorder") to_bool(&options->reorder);
+        else if (name == "robust_kernel") {
+            options->robust_kernel = value;
+            ok = (value == "huber" || value == "cauchy" || value == "none");
+        } else if (name == "robust_delta") to_double(&options->robust_delta);
+        else if (name == "jacobian") {
+            options->jacobian = value;
+            ok = (value == "analytic" || value == "autodiff" || value == "numeric");
+        } else if (name == "precision") {
+            options->precision = value;
+            ok = (value == "double" || value == "mixed" || value == "float");
+        } else if (name == "refinement_iterations") {
+            to_int(&options->refinement_iterations);
+            ok = ok && options->refinement_iterations >= 0;
+        } else if (name == "outlier_rounds") {
+            to_int(&options->outlier_rounds);
+            ok = ok && options->outlier_rounds >= 0;
+        } else if (name == "outlier_threshold") {
+            to_double(&options->outlier_threshold);
+            ok = ok && options->outlier_threshold > 0;
+        } else if (name == "quaternions") to_bool(&options->quaternions);
+        else if (name == "covariance") to_bool(&options->covariance);
+        else if (name == "linear_solver") {
+            options->linear_solver = value;
+            ok = (value == "AUTO" || value == "SPARSE_SCHUR" || value == "DENSE_SCHUR" || value == "ITERATIVE_SCHUR");
+        } else if (name == "sparse_library") {
+            options->sparse_library = value;
+            ok = (value == "AUTO" || value == "SUITE_SPARSE" || value == "EIGEN_SPARSE" || value == "CX_SPARSE" ||
+                  value == "ACCELERATE_SPARSE");
+        } else if (name == "fill_ordering") {
+            options->fill_ordering = value;
+            ok = (value == "AUTO" || value == "AMD" || value == "NESDIS");
+        } else if (name == "preconditioner") {
+            options->preconditioner = value;
+            ok = (value == "JACOBI" || value == "SCHUR_JACOBI" ||
+                  value == "CLUSTER_JACOBI" || value == "CLUSTER_TRIDIAGONAL");
+        } else if (name == "visibility_clustering") {
+            options->visibility_clustering = value;
+            ok = (value == "CANONICAL_VIEWS" || value == "SINGLE_LINKAGE");
+        } else if (name == "eta") {
+            to_double(&options->eta);
+            ok = ok && options->eta > 0;
+        } else if (name == "min_linear_iterations") {
+            to_int(&options->min_linear_iterations);
+            ok = ok && options->min_linear_iterations >= 0;
+        } else if (name == "max_linear_iterations") {
+            to_int(&options->max_linear_iterations);
+            ok = ok && options->max_linear_iterations > 0;
+        } else if (name == "explicit_schur") to_bool(&options->explicit_schur);
+        else if (name == "ordering") {
+            options->ordering = value;
+            ok = (value == "automatic" || value == "schur");
+        } else if (name == "num_threads") {
+            to_int(&options->num_threads);
+            ok = ok && options->num_threads > 0;
+        } else if (name == "max_iterations") to_int(&options->max_iterations);
+        else if (name == "function_tolerance") to_double(&options->function_tolerance);
+        else if (name == "max_solver_time") {
+            to_double(&options->max_solver_time);
+            ok = ok && options->max_solver_time >= 0;
+        } else if (name == "gradient_tolerance") to_double(&options->gradient_tolerance);
+        else if (name == "parameter_tolerance") to_double(&options->parameter_tolerance);
+        else if (name == "incremental_cameras") {
+            to_int(&options->incremental_cameras);
+            ok = ok && options->incremental_cameras >= 0;
+        } else if (name == "window_cameras") {
+            to_int(&options->window_cameras);
+            ok = ok && options->window_cameras >= 0;
+        } else if (name == "marginalize") to_bool(&options->marginalize);
+        else if (name == "point_chunk") {
+            to_int(&options->point_chunk);
+            ok = ok && options->point_chunk >= 0;
+        } else if (name == "point_file") options->point_file = value;
+        else if (name == "components") to_bool(&options->components);
+        else if (name == "graph_stats") to_bool(&options->graph_stats);
+        else if (name == "manifest") options->manifest = value;
+        else if (name == "partitions") {
+            to_int(&options->partitions);
+            ok = ok && options->partitions > 0;
+        } else if (name == "partitioning") {
+            options->partitioning = value;
+            ok = (value == "contiguous" || value == "graph");
+        } else if (name == "admm_iterations") {
+            to_int(&options->admm_iterations);
+            ok = ok && options->admm_iterations >= 0;
+        } else if (name == "admm_local_iterations") {
+            to_int(&options->admm_local_iterations);
+            ok = ok && options->admm_local_iterations > 0;
+        } else if (name == "admm_rho") {
+            to_double(&options->admm_rho);
+            ok = ok && options->admm_rho > 0;
+        } else if (name == "admm_tolerance") to_double(&options->admm_tolerance);
+        else if (name == "verbose") to_bool(&options->verbose);
+        else if (unparsed != NULL) {
+            unparsed->push_back(arg);
+        } else {
+            std::cerr << "Error: unknown flag --" << name << std::endl;
+            PrintBAUsage(argv[0], defaults);
+            return false;
+        }
+
+        if (!ok) {
+            std::cerr << "Error: invalid value for --" << name << ": " << value << std::endl;
+            return false;
+        }
+    }
+    if (options->explicit_schur &&
+        (options->linear_solver != "ITERATIVE_SCHUR" || options->preconditioner != "SCHUR_JACOBI")) {
+        std::cerr << "Error: --explicit_schur needs --linear_solver=ITERATIVE_SCHUR --preconditioner=SCHUR_JACOBI"
+                  << std::endl;
+        return false;
+    }
+    if (options->precision != "double" && options->jacobian != "analytic") {
+        std::cerr << "Error: --precision=" << options->precision << " needs --jacobian=analytic" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+inline EvaluationPrecision EvaluationPrecisionOf(const BAOptions &options) {
+    if (options.precision == "mixed") return kMixedPrecision;
+    if (options.precision == "float") return kSinglePrecision;
+    return kDoublePrecision;
+}
+
+/**
+ * ba_options for the optimizer runs of one SolveBA call (--precision=float
+ * refinement, --outlier_rounds) or of all components of one
+ * SolveBAComponents call: --max_solver_time becomes a deadline from now
+ * checked by the iteration callback, and once the callback has cancelled (or
+ * the deadline has passed) it keeps returning false, so every later run ends
+ * at its first iteration. The concurrent component solves share the callback.
+ */
+inline BAOptions WithSolveControl(const BAOptions &ba_options) {
+    if (!ba_options.iteration_callback && ba_options.max_solver_time <= 0) {
+        return ba_options;
+    }
+    BAOptions controlled = ba_options;
+    const IterationCallback callback = ba_options.iteration_callback;
+    const double deadline = ba_options.max_solver_time > 0 ? WallTimeInSeconds() + ba_options.max_solver_time : 0;
+    std::shared_ptr<std::atomic<bool> > cancelled = std::make_shared<std::atomic<bool> >(false);
+    controlled.iteration_callback = [callback, deadline, cancelled](const IterationProgress &progress) {
+        if (!*cancelled && callback && !callback(progress)) *cancelled = true;
+        if (deadline > 0 && WallTimeInSeconds() >= deadline) *cancelled = true;
+        return !*cancelled;
+    };
+    controlled.max_solver_time = 0; // in the callback now
+    return controlled;
+}
+
+/**
+ * Report iteration it of a solve to --iteration_callback, for the backends
+ * with their own iteration loop. False, with the reason in *termination,
+ * when the solve has to end here.
+ */
+inline bool ContinueSolve(const BAOptions &ba_options, const IterationStats &it, double cost_change,
+                          double step_norm, bool step_accepted, const char **termination) {
+    if (!ba_options.iteration_callback) {
+        return true;
+    }
+    IterationProgress progress;
+    progress.iteration = it.iteration;
+    progress.cost = it.cost;
+    progress.cost_change = cost_change;
+    progress.step_norm = step_norm;
+    progress.time = it.time;
+    progress.cumulative_time = it.cumulative_time;
+    progress.step_accepted = step_accepted;
+    if (ba_options.iteration_callback(progress)) {
+        return true;
+    }
+    *termination = "cancelled (iteration callback or --max_solver_time)";
+    return false;
+}
+
+#endif // BA_OPTIONS_H
@@ -0,0 +1,749 @@
+#ifndef BA_OUT_OF_CORE_H
+#define BA_OUT_OF_CORE_H
+
+// Levenberg-Marquardt streaming the points of a .balp file through memory, for problems larger than RAM
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <Eigen/SparseCholesky>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ba_native.h"
+#include "ba_options.h"
+#include "ba_stats.h"
+#include "bal_io.h"
+#include "common.h"
+#include "parallel.h"
+#include "profiler.h"
+
+// pread / pwrite access to the arrays of a .balp file, see BALPointFileHeader
+class PointFile {
+public:
+    PointFile() : fd_(-1) {
+        memset(&header_, 0, sizeof(header_));
+    }
+
+    ~PointFile() {  Close();  }
+
+    bool Open(const std::string &filename) {
+        Close();
+        fd_ = open(filename.c_str(), O_RDWR);
+        if (fd_ < 0) {
+            std::cerr << "Error: unable to open file " << filename << std::endl;
+            return false;
+        }
+        if (!Read(0, &header_, sizeof(header_)) || memcmp(header_.magic, kBALPointFileMagic, 4) != 0 ||
+            header_.version != kBALPointFileVersion || (header_.point_slot != 0 && header_.point_slot != 1)) {
+            std::cerr << "Error: " << filename << " is not a .balp file" << std::endl;
+            Close();
+            return false;
+        }
+        const off_t size = lseek(fd_, 0, SEEK_END);
+        if (size < 0 || static_cast<size_t>(size) < BALPointFileLayout(header_).total_size) {
+            std::cerr << "Error: " << filename << " is truncated" << std::endl;
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    void Close() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+        fd_ = -1;
+    }
+
+    const BALPointFileHeader &header() const {  return header_;  }
+
+    // first observation of the points begin ... end (end + 1 - begin values)
+    bool ReadPointOffsets(int begin, int end, int64_t *offsets) const {
+        return Read(BALPointFileLayout(header_).point_offsets + begin * sizeof(int64_t), offsets,
+                    (end + 1 - begin) * sizeof(int64_t));
+    }
+
+    // observations [begin, end)
+    bool ReadObservations(int64_t begin, int64_t end, int32_t *camera_index, double *observations) const {
+        const BALPointFileLayout layout(header_);
+        return Read(layout.camera_index + begin * sizeof(int32_t), camera_index, (end - begin) * sizeof(int32_t)) &&
+               Read(layout.observations + 2 * begin * sizeof(double), observations,
+                    2 * (end - begin) * sizeof(double));
+    }
+
+    bool ReadCameras(double *cameras) const {
+        return Read(BALPointFileLayout(header_).cameras, cameras, 9 * header_.num_cameras * sizeof(double));
+    }
+
+    bool WriteCameras(const double *cameras) {
+        return Write(BALPointFileLayout(header_).cameras, cameras, 9 * header_.num_cameras * sizeof(double));
+    }
+
+    // points [begin, end) of slot
+    bool ReadPoints(int slot, int begin, int end, double *points) const {
+        return Read(BALPointFileLayout(header_).points[slot] + 3 * begin * sizeof(double), points,
+                    3 * (end - begin) * sizeof(double));
+    }
+
+    bool WritePoints(int slot, int begin, int end, const double *points) {
+        return Write(BALPointFileLayout(header_).points[slot] + 3 * begin * sizeof(double), points,
+                     3 * (end - begin) * sizeof(double));
+    }
+
+    // make slot the current points
+    bool SetPointSlot(int slot) {
+        header_.point_slot = slot;
+        return Write(0, &header_, sizeof(header_));
+    }
+
+private:
+    PointFile(const PointFile &);
+    PointFile &operator=(const PointFile &);
+
+    bool Read(size_t offset, void *data, size_t size) const {
+        char *p = static_cast<char *>(data);
+        while (size > 0) {
+            const ssize_t n = pread(fd_, p, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            offset += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    bool Write(size_t offset, const void *data, size_t size) {
+        const char *p = static_cast<const char *>(data);
+        while (size > 0) {
+            const ssize_t n = pwrite(fd_, p, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            p += n;
+            offset += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    int fd_;
+    BALPointFileHeader header_;
+};
+
+/**
+ * Save bal_problem as a .balp file, the observations of every point by
+ * ascending camera. Needs the problem in memory once, e.g. on a bigger
+ * machine; the solve then only keeps camera sized state.
+ */
+inline bool WritePointFile(const BALProblem &bal_problem, const std::string &filename) {
+    ScopedTimer timer("write balp");
+    if (bal_problem.camera_block_size() != 9) {
+        std::cerr << "Error: .balp files store angle-axis cameras" << std::endl;
+        return false;
+    }
+    FILE *fptr = fopen(filename.c_str(), "wb");
+    if (fptr == NULL) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return false;
+    }
+
+    BALPointFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kBALPointFileMagic, 4);
+    header.version = kBALPointFileVersion;
+    header.num_cameras = bal_problem.num_cameras();
+    header.num_points = bal_problem.num_points();
+    header.num_observations = bal_problem.num_observations();
+    const BALPointFileLayout layout(header);
+
+    // observations by point, then by camera
+    const int *camera_index = bal_problem.camera_index();
+    const int *point_index = bal_problem.point_index();
+    std::vector<int64_t> offsets(header.num_points + 1, 0);
+    for (int i = 0; i < header.num_observations; ++i) {
+        ++offsets[point_index[i] + 1];
+    }
+    for (int j = 0; j < header.num_points; ++j) {
+        offsets[j + 1] += offsets[j];
+    }
+    std::vector<int> order(header.num_observations);
+    std::vector<int64_t> fill(offsets.begin(), offsets.end() - 1);
+    for (int i = 0; i < header.num_observations; ++i) {
+        order[fill[point_index[i]]++] = i;
+    }
+    for (int j = 0; j < header.num_points; ++j) {
+        std::sort(order.begin() + offsets[j], order.begin() + offsets[j + 1],
+                  [camera_index](int a, int b) {  return camera_index[a] < camera_index[b];  });
+    }
+    std::vector<int32_t> cameras(header.num_observations);
+    std::vector<double> observations(2 * static_cast<size_t>(header.num_observations));
+    for (int i = 0; i < header.num_observations; ++i) {
+        cameras[i] = camera_index[order[i]];
+        observations[2 * i + 0] = bal_problem.observations()[2 * order[i] + 0];
+        observations[2 * i + 1] = bal_problem.observations()[2 * order[i] + 1];
+    }
+
+    const char padding[8] = {0};
+    const size_t points_size = 3 * static_cast<size_t>(header.num_points);
+    bool ok = fwrite(&header, sizeof(header), 1, fptr) == 1 &&
+              fwrite(offsets.data(), sizeof(int64_t), offsets.size(), fptr) == offsets.size() &&
+              fwrite(cameras.data(), sizeof(int32_t), cameras.size(), fptr) == cameras.size() &&
+              fwrite(padding, 1, layout.observations - (layout.camera_index + cameras.size() * sizeof(int32_t)),
+                     fptr) == layout.observations - (layout.camera_index + cameras.size() * sizeof(int32_t)) &&
+              fwrite(observations.data(), sizeof(double), observations.size(), fptr) == observations.size() &&
+              fwrite(bal_problem.cameras(), sizeof(double), 9 * header.num_cameras, fptr) ==
+              static_cast<size_t>(9 * header.num_cameras);
+    for (int slot = 0; ok && slot < 2; ++slot) {
+        ok = fwrite(bal_problem.points(), sizeof(double), points_size, fptr) == points_size;
+    }
+    ok = fclose(fptr) == 0 && ok;
+    if (!ok) {
+        std::cerr << "Error: unable to write " << filename << std::endl;
+    }
+    return ok;
+}
+
+// cameras and current points of a .balp file back into the problem it was written from
+inline bool ReadPointFileParameters(const std::string &filename, BALProblem *bal_problem) {
+    PointFile file;
+    if (!file.Open(filename)) return false;
+    if (file.header().num_cameras != bal_problem->num_cameras() ||
+        file.header().num_points != bal_problem->num_points()) {
+        std::cerr << "Error: " << filename << " does not match the problem" << std::endl;
+        return false;
+    }
+    return file.ReadCameras(bal_problem->mutable_cameras()) &&
+           file.ReadPoints(file.header().point_slot, 0, bal_problem->num_points(), bal_problem->mutable_points());
+}
+
+/**
+ * NativeBASolver for problems whose observations and points do not fit into
+ * memory. Only camera sized state is resident: the cameras, the camera blocks
+ * of J^T J and the gradient and the reduced camera system S with its sparse
+ * LDLT. The points are streamed from a PointFile in chunks of --point_chunk
+ * points with all their observations, and every chunk adds its part of
+ *
+ * S = B - E C^-1 E^T,  S dx_c = -g_c + E C^-1 g_p
+ *
+ * before the next one is read. Every trial step takes two passes over the
+ * file: the elimination above, and after S is solved the back substitution
+ * dx_p = -C^-1 (g_p + E^T dx_c) with the cost of the trial point, which goes
+ * into the second point slot of the file. Both passes linearize the chunk
+ * again instead of keeping the point blocks.
+ *
+ * The trust region, termination and output are those of NativeBASolver; the
+ * gradient printed for a step is the one it was computed from.
+ */
+class OutOfCoreBASolver {
+public:
+    OutOfCoreBASolver(PointFile *file, const BAOptions &ba_options)
+            : file_(file), options_(WithSolveControl(ba_options)), pool_(ba_options.num_threads),
+              num_cameras_(file->header().num_cameras), num_points_(file->header().num_points),
+              num_observations_(file->header().num_observations), slot_(file->header().point_slot),
+              failed_(false) {
+        BuildStructure();
+    }
+
+    /**
+     * Optimize the cameras and points of the file in place. Every accepted
+     * step is committed to the file before the next one: its cameras, then the
+     * header switched to the slot of its points (the trial points of a step go
+     * to the other slot). False if the file could not be read or written; it
+     * then still holds the last accepted cameras and points, unless the
+     * failure fell between those two writes of a step, which leaves the new
+     * cameras with the points before them.
+     */
+    bool Solve(SolveStats *stats) {
+        const double solve_start = WallTimeInSeconds();
+        SolveStats local_stats;
+        if (stats == NULL) stats = &local_stats;
+        stats->setup_time = setup_time_;
+        stats->iterations.clear();
+        if (failed_) return false;
+
+        std::vector<double> candidate(9 * num_cameras_);
+        double radius = 1e4;
+        double decrease_factor = 2.0;
+        double cost = 0;
+        if (!EliminationPass(1.0 / radius, &cost, stats)) return false;
+        stats->initial_cost = cost;
+        IterationStats initial;
+        initial.cost = cost;
+        initial.cumulative_time = WallTimeInSeconds() - solve_start;
+        stats->iterations.push_back(initial);
+        if (options_.verbose) {
+            printf("iter      cost      cost_change  |gradient|   |step|    tr_ratio  tr_radius\n");
+            printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", 0, cost, 0.0,
+                   gradient_norm_, 0.0, 0.0, radius);
+        }
+
+        const char *termination = "maximum number of iterations";
+        const bool go_on = ContinueSolve(options_, initial, 0.0, 0.0, true, &termination);
+        bool eliminated = true; // S of the current radius is ready
+        for (int iteration = 1; go_on && iteration <= options_.max_iterations; ++iteration) {
+            const double iteration_start = WallTimeInSeconds();
+            const double mu = 1.0 / radius;
+            double linearization_cost = cost;
+            if (!eliminated && !EliminationPass(mu, &linearization_cost, stats)) {
+                termination = "I/O error";
+                failed_ = true;
+                break;
+            }
+            eliminated = false;
+            if (gradient_norm_ <= options_.gradient_tolerance) {
+                termination = "gradient tolerance";
+                break;
+            }
+
+            const double linear_start = WallTimeInSeconds();
+            ldlt_.factorize(S_);
+            bool solved = ldlt_.info() == Eigen::Success;
+            if (solved) {
+                dx_cameras_ = ldlt_.solve(rhs_);
+                solved = dx_cameras_.allFinite();
+            }
+            stats->linear_solver_time += WallTimeInSeconds() - linear_start;
+
+            StepResult step;
+            double step_norm = 0, ratio = 0;
+            bool accepted = false;
+            if (solved) {
+                const Eigen::Map<const Eigen::VectorXd> cameras(cameras_.data(), cameras_.size());
+                for (int k = 0; k < 9 * num_cameras_; ++k) {
+                    candidate[k] = cameras_[k] + dx_cameras_[k];
+                }
+                if (!StepPass(mu, candidate, &step, stats)) {
+                    termination = "I/O error";
+                    failed_ = true;
+                    break;
+                }
+                step_norm = std::sqrt(dx_cameras_.squaredNorm() + step.step_norm2);
+                const double x_norm = std::sqrt(cameras.squaredNorm() + step.x_norm2);
+                if (step_norm <= options_.parameter_tolerance * (x_norm + options_.parameter_tolerance)) {
+                    termination = "parameter tolerance";
+                    break;
+                }
+
+                // 0.5 (mu dx^T D dx - g^T dx) as NativeBASolver::ModelCostDecrease()
+                double g_dx = step.g_dx, dx_D_dx = step.dx_D_dx;
+                for (int c = 0; c < num_cameras_; ++c) {
+                    const Vector9d dx = dx_cameras_.segment<9>(9 * c);
+                    g_dx += g_cameras_[c].dot(dx);
+                    dx_D_dx += dx.cwiseAbs2().dot(Damping<9>(B_[c]));
+                }
+                ratio = (cost - step.cost) / (0.5 * (mu * dx_D_dx - g_dx));
+                accepted = std::isfinite(step.cost) && ratio > 1e-3;
+            }
+
+            if (accepted) {
+                radius = std::min(1e16, radius / std::max(1.0 / 3.0, 1.0 - std::pow(2.0 * ratio - 1.0, 3)));
+                decrease_factor = 2.0;
+                cameras_ = candidate;
+                slot_ = 1 - slot_;
+                if (!file_->WriteCameras(cameras_.data()) || !file_->SetPointSlot(slot_)) {
+                    termination = "I/O error";
+                    failed_ = true;
+                    break;
+                }
+                const double cost_change = cost - step.cost;
+                cost = step.cost;
+                RecordIteration(stats, iteration, cost, iteration_start, solve_start);
+                if (options_.verbose) {
+                    printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", iteration, cost,
+                           cost_change, gradient_norm_, step_norm, ratio, radius);
+                }
+                if (cost_change <= options_.function_tolerance * cost) {
+                    termination = "function tolerance";
+                    break;
+                }
+                if (!ContinueSolve(options_, stats->iterations.back(), cost_change, step_norm, true, &termination)) {
+                    break;
+                }
+            } else {
+                radius /= decrease_factor;
+                decrease_factor *= 2.0;
+                RecordIteration(stats, iteration, cost, iteration_start, solve_start);
+                if (options_.verbose) {
+                    printf("%4d % 8e   % 3.2e   % 3.2e   % 3.2e   % 3.2e   % 3.2e\n", iteration, cost,
+                           0.0, gradient_norm_, step_norm, ratio, radius);
+                }
+                if (radius < 1e-32) {
+                    termination = "trust region radius below minimum";
+                    break;
+                }
+                if (!ContinueSolve(options_, stats->iterations.back(), 0.0, step_norm, false, &termination)) {
+                    break;
+                }
+            }
+        }
+
+        stats->final_cost = cost;
+        stats->solve_time = WallTimeInSeconds() - solve_start;
+        if (options_.verbose) {
+            std::cout << "out-of-core BA: " << stats->iterations.size() - 1 << " iterations, cost "
+                      << stats->initial_cost << " -> " << stats->final_cost << ", " << termination << std::endl;
+        }
+        return !failed_;
+    }
+
+    // RMS reprojection error in pixels of the cameras and current points of the file, -1 on I/O errors
+    double RMSReprojectionError() {
+        double sum = 0;
+        for (int chunk = 0; chunk < NumChunks(); ++chunk) {
+            if (!ReadChunk(chunk)) return -1.0;
+            for (size_t i = 0; i < chunk_.camera_index.size(); ++i) {
+                double prediction[2];
+                CamProjectionWithDistortionJacobian(&cameras_[9 * chunk_.camera_index[i]],
+                                                    &chunk_.points[3 * chunk_.observation_point[i]], prediction,
+                                                    (double *) NULL, (double *) NULL);
+                const double du = prediction[0] - chunk_.observations[2 * i + 0];
+                const double dv = prediction[1] - chunk_.observations[2 * i + 1];
+                sum += du * du + dv * dv;
+            }
+        }
+        return num_observations_ > 0 ? std::sqrt(sum / num_observations_) : 0.0;
+    }
+
+private:
+    OutOfCoreBASolver(const OutOfCoreBASolver &);
+    OutOfCoreBASolver &operator=(const OutOfCoreBASolver &);
+
+    // the points of one chunk with their observations, linearized
+    struct Chunk {
+        int begin, end; // points
+        std::vector<int64_t> offsets; // first observation of every point, from the chunk start
+        std::vector<int32_t> camera_index;
+        std::vector<int> observation_point; // chunk local point of every observation
+        std::vector<double> observations;
+        std::vector<double> points, candidate_points;
+        AlignedVector<Matrix29d> J_cameras;
+        AlignedVector<Matrix23d> J_points;
+        AlignedVector<Eigen::Vector2d> residuals;
+        AlignedVector<Matrix93d> E;
+        AlignedVector<Eigen::Matrix3d> C;
+        AlignedVector<Eigen::Vector3d> g_points;
+        std::vector<double> costs; // per point
+    };
+
+    // what the back substitution pass adds up over the points
+    struct StepResult {
+        StepResult() : cost(0), g_dx(0), dx_D_dx(0), step_norm2(0), x_norm2(0) {}
+
+        double cost; // at the trial step
+        double g_dx, dx_D_dx; // point parts of the model cost decrease
+        double step_norm2, x_norm2;
+    };
+
+    int NumChunks() const {
+        return (num_points_ + options_.point_chunk - 1) / options_.point_chunk;
+    }
+
+    // points of the current slot and observations of chunk into chunk_
+    bool ReadChunk(int chunk) {
+        ScopedTimer timer("out-of-core read");
+        chunk_.begin = chunk * options_.point_chunk;
+        chunk_.end = std::min(num_points_, chunk_.begin + options_.point_chunk);
+        const int num_points = chunk_.end - chunk_.begin;
+        chunk_.offsets.resize(num_points + 1);
+        if (!file_->ReadPointOffsets(chunk_.begin, chunk_.end, chunk_.offsets.data())) return false;
+        const int64_t first = chunk_.offsets[0];
+        const int64_t num_observations = chunk_.offsets[num_points] - first;
+        for (int j = 0; j <= num_points; ++j) {
+            chunk_.offsets[j] -= first;
+        }
+        chunk_.camera_index.resize(num_observations);
+        chunk_.observations.resize(2 * num_observations);
+        chunk_.points.resize(3 * num_points);
+        if (!file_->ReadObservations(first, first + num_observations, chunk_.camera_index.data(),
+                                     chunk_.observations.data()) ||
+            !file_->ReadPoints(slot_, chunk_.begin, chunk_.end, chunk_.points.data())) {
+            return false;
+        }
+        chunk_.observation_point.resize(num_observations);
+        for (int j = 0; j < num_points; ++j) {
+            std::fill(chunk_.observation_point.begin() + chunk_.offsets[j],
+                      chunk_.observation_point.begin() + chunk_.offsets[j + 1], j);
+        }
+        return true;
+    }
+
+    // residuals, Jacobians and the point blocks C, g_p, E of chunk_ at cameras_, returns its cost
+    double LinearizeChunk() {
+        ScopedTimer timer("out-of-core linearization");
+        const int num_points = chunk_.end - chunk_.begin;
+        const size_t num_observations = chunk_.camera_index.size();
+        chunk_.J_cameras.resize(num_observations);
+        chunk_.J_points.resize(num_observations);
+        chunk_.residuals.resize(num_observations);
+        chunk_.E.resize(num_observations);
+        chunk_.C.resize(num_points);
+        chunk_.g_points.resize(num_points);
+        chunk_.costs.resize(num_points);
+        const EvaluationPrecision precision = EvaluationPrecisionOf(options_);
+        pool_.ParallelFor(num_points, [&](int begin, int end) {
+            Profiler::Count(kResidualEvaluations, chunk_.offsets[end] - chunk_.offsets[begin]);
+            Profiler::Count(kJacobianEvaluations, chunk_.offsets[end] - chunk_.offsets[begin]);
+            for (int j = begin; j < end; ++j) {
+                chunk_.C[j].setZero();
+                chunk_.g_points[j].setZero();
+                chunk_.costs[j] = 0;
+                for (int64_t i = chunk_.offsets[j]; i < chunk_.offsets[j + 1]; ++i) {
+                    chunk_.costs[j] += EvaluateObservation(options_, precision, &cameras_[9 * chunk_.camera_index[i]],
+                                                           &chunk_.points[3 * j], &chunk_.observations[2 * i],
+                                                           &chunk_.residuals[i], &chunk_.J_cameras[i],
+                                                           &chunk_.J_points[i]);
+                    chunk_.C[j].noalias() += chunk_.J_points[i].transpose() * chunk_.J_points[i];
+                    chunk_.g_points[j].noalias() += chunk_.J_points[i].transpose() * chunk_.residuals[i];
+                    chunk_.E[i].noalias() = chunk_.J_cameras[i].transpose() * chunk_.J_points[i];
+                }
+            }
+        }, 64);
+        double cost = 0;
+        for (int j = 0; j < num_points; ++j) {
+            cost += chunk_.costs[j];
+        }
+        return cost;
+    }
+
+    // sparsity of S from the observations of every chunk, camera pairs sharing a point
+    void BuildStructure() {
+        const double setup_start = WallTimeInSeconds();
+        cameras_.resize(9 * num_cameras_);
+        if (options_.point_chunk <= 0 || !file_->ReadCameras(cameras_.data())) {
+            failed_ = true;
+            return;
+        }
+        std::vector<std::vector<int> > columns(num_cameras_);
+        std::vector<int64_t> offsets;
+        std::vector<int32_t> camera_index;
+        std::vector<double> observations;
+        for (int chunk = 0; chunk < NumChunks() && !failed_; ++chunk) {
+            const int begin = chunk * options_.point_chunk;
+            const int end = std::min(num_points_, begin + options_.point_chunk);
+            offsets.resize(end - begin + 1);
+            failed_ = !file_->ReadPointOffsets(begin, end, offsets.data());
+            if (failed_) break;
+            camera_index.resize(offsets.back() - offsets.front());
+            observations.resize(2 * camera_index.size());
+            failed_ = !file_->ReadObservations(offsets.front(), offsets.back(), camera_index.data(),
+                                               observations.data());
+            for (int j = 0; !failed_ && j < end - begin; ++j) {
+                for (int64_t a = offsets[j]; a < offsets[j + 1]; ++a) {
+                    for (int64_t b = a + 1; b < offsets[j + 1]; ++b) {
+                        const int ca = camera_index[a - offsets.front()];
+                        const int cb = camera_index[b - offsets.front()];
+                        if (ca != cb) columns[std::max(ca, cb)].push_back(std::min(ca, cb));
+                    }
+                }
+            }
+            // keep the columns short while streaming
+            for (int k = 0; k < num_cameras_; ++k) {
+                std::sort(columns[k].begin(), columns[k].end());
+                columns[k].erase(std::unique(columns[k].begin(), columns[k].end()), columns[k].end());
+            }
+        }
+        if (failed_) {
+            std::cerr << "Error: unable to read the point file" << std::endl;
+            return;
+        }
+        BuildBlockColumns(&columns, &column_offsets_, &block_rows_);
+        BuildReducedCameraPattern(column_offsets_, block_rows_, &S_);
+        ldlt_.analyzePattern(S_);
+
+        S_blocks_.resize(column_offsets_.back());
+        B_.resize(num_cameras_);
+        g_cameras_.resize(num_cameras_);
+        rhs_.resize(9 * num_cameras_);
+        setup_time_ = WallTimeInSeconds() - setup_start;
+        Profiler::Get().Record("out-of-core setup", setup_start, setup_start + setup_time_);
+    }
+
+    /**
+     * S and rhs for the damping mu at the current state, chunk by chunk, with
+     * B_, g_cameras_, the cost and the max norm of the gradient on the way.
+     */
+    bool EliminationPass(double mu, double *cost, SolveStats *stats) {
+        ScopedTimer timer("out-of-core elimination");
+        for (size_t b = 0; b < S_blocks_.size(); ++b) {
+            S_blocks_[b].setZero();
+        }
+        for (int c = 0; c < num_cameras_; ++c) {
+            B_[c].setZero();
+            g_cameras_[c].setZero();
+        }
+        rhs_.setZero();
+        *cost = 0;
+        gradient_norm_ = 0;
+
+        for (int chunk = 0; chunk < NumChunks(); ++chunk) {
+            if (!ReadChunk(chunk)) return false;
+            const double evaluation_start = WallTimeInSeconds();
+            *cost += LinearizeChunk();
+            stats->jacobian_evaluation_time += WallTimeInSeconds() - evaluation_start;
+
+            const double linear_start = WallTimeInSeconds();
+            for (int j = 0; j < chunk_.end - chunk_.begin; ++j) {
+                gradient_norm_ = std::max(gradient_norm_, chunk_.g_points[j].cwiseAbs().maxCoeff());
+                Eigen::Matrix3d C = chunk_.C[j];
+                C.diagonal() += mu * Damping<3>(chunk_.C[j]);
+                const Eigen::Matrix3d C_inverse = C.inverse();
+                const Eigen::Vector3d C_inverse_g = C_inverse * chunk_.g_points[j];
+                for (int64_t a = chunk_.offsets[j]; a < chunk_.offsets[j + 1]; ++a) {
+                    const int ca = chunk_.camera_index[a];
+                    B_[ca].noalias() += chunk_.J_cameras[a].transpose() * chunk_.J_cameras[a];
+                    g_cameras_[ca].noalias() += chunk_.J_cameras[a].transpose() * chunk_.residuals[a];
+                    rhs_.segment<9>(9 * ca).noalias() += chunk_.E[a] * C_inverse_g;
+                    const Matrix93d E_C_inverse = chunk_.E[a] * C_inverse;
+                    for (int64_t b = a; b < chunk_.offsets[j + 1]; ++b) {
+                        const int cb = chunk_.camera_index[b];
+                        Matrix9d &block = S_blocks_[FindBlock(column_offsets_, block_rows_, ca, cb)];
+                        const Matrix9d product = E_C_inverse * chunk_.E[b].transpose();
+                        if (b == a) {
+                            block -= product;
+                        } else if (ca == cb) {
+                            block -= product + product.transpose();
+                        } else if (ca < cb) {
+                            block -= product;
+                        } else {
+                            block -= product.transpose();
+                        }
+                    }
+                }
+            }
+            stats->linear_solver_time += WallTimeInSeconds() - linear_start;
+        }
+
+        for (int k = 0; k < num_cameras_; ++k) {
+            gradient_norm_ = std::max(gradient_norm_, g_cameras_[k].cwiseAbs().maxCoeff());
+            Matrix9d &diagonal = S_blocks_[column_offsets_[k + 1] - 1];
+            diagonal += B_[k];
+            diagonal.diagonal() += mu * Damping<9>(B_[k]);
+            rhs_.segment<9>(9 * k) -= g_cameras_[k];
+            CopyBlockColumn(column_offsets_, block_rows_, S_blocks_, k, &S_);
+        }
+        return true;
+    }
+
+    /**
+     * Back substitution of dx_cameras_ chunk by chunk: the trial points go
+     * into the other slot of the file, with their cost at the trial cameras.
+     */
+    bool StepPass(double mu, const std::vector<double> &candidate_cameras, StepResult *step, SolveStats *stats) {
+        ScopedTimer timer("out-of-core back substitution");
+        const EvaluationPrecision precision = options_.precision == "float" ? kSinglePrecision : kDoublePrecision;
+        std::vector<StepResult> point_steps;
+        for (int chunk = 0; chunk < NumChunks(); ++chunk) {
+            if (!ReadChunk(chunk)) return false;
+            const double evaluation_start = WallTimeInSeconds();
+            LinearizeChunk();
+            stats->jacobian_evaluation_time += WallTimeInSeconds() - evaluation_start;
+
+            const int num_points = chunk_.end - chunk_.begin;
+            chunk_.candidate_points.resize(3 * num_points);
+            point_steps.assign(num_points, StepResult());
+            const double residual_start = WallTimeInSeconds();
+            pool_.ParallelFor(num_points, [&](int begin, int end) {
+                Profiler::Count(kResidualEvaluations, chunk_.offsets[end] - chunk_.offsets[begin]);
+                for (int j = begin; j < end; ++j) {
+                    Eigen::Matrix3d C = chunk_.C[j];
+                    const Eigen::Vector3d D = Damping<3>(chunk_.C[j]);
+                    C.diagonal() += mu * D;
+                    Eigen::Vector3d sum = chunk_.g_points[j];
+                    for (int64_t a = chunk_.offsets[j]; a < chunk_.offsets[j + 1]; ++a) {
+                        sum.noalias() += chunk_.E[a].transpose() * dx_cameras_.segment<9>(9 * chunk_.camera_index[a]);
+                    }
+                    const Eigen::Vector3d dx = -C.inverse() * sum;
+                    const Eigen::Map<const Eigen::Vector3d> x(&chunk_.points[3 * j]);
+                    Eigen::Map<Eigen::Vector3d>(&chunk_.candidate_points[3 * j]) = x + dx;
+
+                    StepResult &point_step = point_steps[j];
+                    point_step.g_dx = chunk_.g_points[j].dot(dx);
+                    point_step.dx_D_dx = dx.cwiseAbs2().dot(D);
+                    point_step.step_norm2 = dx.squaredNorm();
+                    point_step.x_norm2 = x.squaredNorm();
+                    for (int64_t a = chunk_.offsets[j]; a < chunk_.offsets[j + 1]; ++a) {
+                        point_step.cost += EvaluateObservation(options_, precision,
+                                                               &candidate_cameras[9 * chunk_.camera_index[a]],
+                                                               &chunk_.candidate_points[3 * j],
+                                                               &chunk_.observations[2 * a], NULL, NULL, NULL);
+                    }
+                }
+            }, 64);
+            for (int j = 0; j < num_points; ++j) {
+                step->cost += point_steps[j].cost;
+                step->g_dx += point_steps[j].g_dx;
+                step->dx_D_dx += point_steps[j].dx_D_dx;
+                step->step_norm2 += point_steps[j].step_norm2;
+                step->x_norm2 += point_steps[j].x_norm2;
+            }
+            stats->residual_evaluation_time += WallTimeInSeconds() - residual_start;
+            ScopedTimer write_timer("out-of-core write");
+            if (!file_->WritePoints(1 - slot_, chunk_.begin, chunk_.end, chunk_.candidate_points.data())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static void RecordIteration(SolveStats *stats, int iteration, double cost,
+                                double iteration_start, double solve_start) {
+        const double now = WallTimeInSeconds();
+        IterationStats it;
+        it.iteration = iteration;
+        it.cost = cost;
+        it.time = now - iteration_start;
+        it.cumulative_time = now - solve_start;
+        stats->iterations.push_back(it);
+    }
+
+    PointFile *file_;
+    const BAOptions options_;
+    ThreadPool pool_;
+    const int num_cameras_;
+    const int num_points_;
+    const int num_observations_;
+    int slot_; // point slot of the file holding the current points
+    bool failed_;
+    double setup_time_ = 0;
+
+    // camera sized, resident
+    std::vector<double> cameras_;
+    std::vector<int> column_offsets_, block_rows_;
+    AlignedVector<Matrix9d> B_, S_blocks_;
+    AlignedVector<Vector9d> g_cameras_;
+    double gradient_norm_ = 0;
+    Eigen::SparseMatrix<double> S_;
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Upper> ldlt_;
+    Eigen::VectorXd rhs_, dx_cameras_;
+
+    // point sized, one chunk at a time
+    Chunk chunk_;
+};
+
+/**
+ * Optimize the problem in the .balp file at filename in place with
+ * OutOfCoreBASolver. stats, if not NULL, receives the timings and the cost of
+ * every iteration. False on I/O errors.
+ */
+inline bool SolveBAOutOfCore(const std::string &filename, const BAOptions &ba_options, SolveStats *stats = NULL) {
+    if (ba_options.verbose) {
+        std::cout << "Solving out-of-core BA ... " << std::endl;
+    }
+    PointFile file;
+    if (!file.Open(filename)) return false;
+    OutOfCoreBASolver solver(&file, ba_options);
+    ScopedTimer timer("out-of-core solve");
+    return solver.Solve(stats);
+}
+
+#endif // BA_OUT_OF_CORE_H
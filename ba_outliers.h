@@ -0,0 +1,89 @@
+#ifndef BA_OUTLIERS_H
+#define BA_OUTLIERS_H
+
+// --outlier_rounds: observations above --outlier_threshold dropped between warm started solves
+
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include "ba_options.h"
+#include "common.h"
+#include "parallel.h"
+#include "projection_kernel.h"
+
+/**
+ * Which observations of a BALProblem are still in the solve. Every backend
+ * starts with all of them, calls NextRound() after its solve and, while that
+ * returns true, takes the dropped observations out of the problem it already
+ * has (ceres RemoveResidualBlock, g2o setLevel, a zero weight in
+ * NativeBASolver) and solves on from the current parameters.
+ *
+ * The errors of a round are one batched pass over the cameras
+ * (ObservationBlocks) on the thread pool. Dropped observations stay dropped,
+ * also for a later pass of the same SolveBA (--precision=float refinement).
+ */
+class OutlierFilter {
+public:
+    OutlierFilter(const BALProblem &problem, const BAOptions &ba_options)
+            : threshold_(ba_options.outlier_threshold), rounds_(ba_options.outlier_rounds),
+              verbose_(ba_options.verbose), blocks_(problem), pool_(ba_options.num_threads),
+              active_(problem.num_observations(), 1), num_active_(problem.num_observations()), round_(0),
+              finished_(ba_options.outlier_rounds == 0) {}
+
+    bool active(int observation) const {  return active_[observation] != 0;  }
+
+    int num_active() const {  return num_active_;  }
+
+    /**
+     * Evaluate the reprojection errors at the current parameters of problem
+     * and deactivate the active observations above the threshold into
+     * dropped, printing the round with --verbose. False when there is nothing
+     * to solve again: all rounds done, or a round which dropped nothing.
+     */
+    bool NextRound(const BALProblem &problem, std::vector<int> *dropped) {
+        dropped->clear();
+        if (finished_) return false;
+        ++round_;
+        pool_.ParallelFor(blocks_.num_cameras(), [&](int begin, int end) {
+            for (int c = begin; c < end; ++c) {
+                blocks_.EvaluateCamera(problem, c);
+            }
+        }, 1);
+        blocks_.SquaredErrors(&squared_errors_);
+
+        const double threshold2 = threshold_ * threshold_;
+        double inlier_sum = 0;
+        for (size_t i = 0; i < active_.size(); ++i) {
+            if (!active_[i]) continue;
+            if (squared_errors_[i] > threshold2) {
+                active_[i] = 0;
+                dropped->push_back(static_cast<int>(i));
+            } else {
+                inlier_sum += squared_errors_[i];
+            }
+        }
+        num_active_ -= static_cast<int>(dropped->size());
+        if (verbose_) {
+            std::cout << "outlier round " << round_ << ": " << dropped->size() << " observations above "
+                      << threshold_ << " px dropped, " << num_active_ << " of " << active_.size()
+                      << " left, inlier RMS " << (num_active_ > 0 ? std::sqrt(inlier_sum / num_active_) : 0.0)
+                      << std::endl;
+        }
+        finished_ = dropped->empty() || round_ >= rounds_ || num_active_ == 0;
+        return !dropped->empty() && num_active_ > 0;
+    }
+
+private:
+    const double threshold_;
+    const int rounds_;
+    const bool verbose_;
+    ObservationBlocks blocks_;
+    ThreadPool pool_;
+    std::vector<char> active_;
+    int num_active_;
+    int round_;
+    bool finished_;
+    std::vector<double> squared_errors_;
+};
+
+#endif // BA_OUTLIERS_H
@@ -0,0 +1,103 @@
+#ifndef BA_PLANNER_H
+#define BA_PLANNER_H
+
+// --linear_solver=AUTO: linear solver, preconditioner, sparse library and ordering from the problem structure
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "ba_graph.h"
+#include "ba_options.h"
+#include "common.h"
+
+// what a backend can run, sparse libraries in order of preference (ceres names)
+struct SolverCapabilities {
+    std::string backend;
+    std::vector<std::string> sparse_libraries;
+    bool iterative = true; // ITERATIVE_SCHUR
+    bool nested_dissection = false; // NESDIS fill reducing ordering of the sparse factorization
+};
+
+struct SolverPlan {
+    std::string linear_solver;
+    std::string preconditioner; // ITERATIVE_SCHUR only
+    std::string sparse_library; // SPARSE_SCHUR only
+    std::string fill_ordering; // AMD or NESDIS, SPARSE_SCHUR only
+    std::vector<std::string> reasons;
+};
+
+/**
+ * Choose how to solve the reduced camera system S dx_c = rhs, 9 num_cameras
+ * square:
+ *
+ *   DENSE_SCHUR      up to 100 cameras, or 1000 with a fill of S of 25% and
+ *                    more: a dense factorization is then about as cheap as a
+ *                    sparse one and has no symbolic analysis
+ *   ITERATIVE_SCHUR  beyond 10000 cameras, or no sparse library: the sparse
+ *                    factor would not fit, PCG with SCHUR_JACOBI only needs
+ *                    the 9x9 diagonal blocks of S
+ *   SPARSE_SCHUR     otherwise, with the preferred sparse library, nested
+ *                    dissection from 2000 cameras where available, AMD below
+ *
+ * The points are always eliminated first (--ordering=schur). Every choice
+ * comes with the sentence of reasons the verbose drivers print.
+ */
+inline SolverPlan PlanSolver(const VisibilityGraphStats &stats, const SolverCapabilities &capabilities) {
+    SolverPlan plan;
+    const int n = stats.num_cameras;
+    std::ostringstream size;
+    size << n << " cameras, reduced camera matrix " << 9 * n << " x " << 9 * n << " with fill "
+         << stats.reduced_camera_fill;
+    const bool has_sparse = !capabilities.sparse_libraries.empty();
+
+    if (n <= 100 || (n <= 1000 && stats.reduced_camera_fill >= 0.25)) {
+        plan.linear_solver = "DENSE_SCHUR";
+        plan.reasons.push_back(size.str() + ": small or dense enough for a dense factorization");
+    } else if (capabilities.iterative && (n > 10000 || !has_sparse)) {
+        plan.linear_solver = "ITERATIVE_SCHUR";
+        plan.preconditioner = "SCHUR_JACOBI";
+        plan.reasons.push_back(size.str() + (has_sparse ? ": too large to factorize" : ": no sparse library") +
+                               ", PCG preconditioned with the block diagonal of S");
+    } else if (has_sparse) {
+        plan.linear_solver = "SPARSE_SCHUR";
+        plan.sparse_library = capabilities.sparse_libraries.front();
+        plan.fill_ordering = capabilities.nested_dissection && n >= 2000 ? "NESDIS" : "AMD";
+        plan.reasons.push_back(size.str() + ": sparse factorization with " + plan.sparse_library + ", " +
+                               plan.fill_ordering + " ordering");
+    } else {
+        plan.linear_solver = "DENSE_SCHUR";
+        plan.reasons.push_back(size.str() + ": the only solver of " + capabilities.backend);
+    }
+    plan.reasons.push_back(std::to_string(stats.num_points) + " points eliminated first");
+    return plan;
+}
+
+/**
+ * ba_options with --linear_solver=AUTO replaced by the plan for bal_problem,
+ * unchanged otherwise. The plan is printed with --verbose.
+ */
+inline BAOptions PlanBAOptions(const BALProblem &bal_problem, const BAOptions &ba_options,
+                               const SolverCapabilities &capabilities) {
+    if (ba_options.linear_solver != "AUTO") {
+        return ba_options;
+    }
+    const SolverPlan plan = PlanSolver(ComputeGraphStats(bal_problem, ba_options.num_threads), capabilities);
+    BAOptions planned = ba_options;
+    planned.linear_solver = plan.linear_solver;
+    if (!plan.preconditioner.empty()) planned.preconditioner = plan.preconditioner;
+    if (planned.sparse_library == "AUTO" && !plan.sparse_library.empty()) planned.sparse_library = plan.sparse_library;
+    if (planned.fill_ordering == "AUTO" && !plan.fill_ordering.empty()) planned.fill_ordering = plan.fill_ordering;
+    planned.ordering = "schur";
+    if (ba_options.verbose) {
+        std::cout << capabilities.backend << " solver plan: " << plan.linear_solver;
+        if (!plan.preconditioner.empty()) std::cout << " + " << plan.preconditioner;
+        std::cout << std::endl;
+        for (size_t i = 0; i < plan.reasons.size(); ++i) {
+            std::cout << "  " << plan.reasons[i] << std::endl;
+        }
+    }
+    return planned;
+}
+
+#endif // BA_PLANNER_H
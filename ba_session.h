@@ -0,0 +1,459 @@
+#ifndef BA_SESSION_H
+#define BA_SESSION_H
+
+// persistent ceres problem for streaming cameras, points and observations into
+
+#include <algorithm>
+#include <cassert>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+#include <ceres/ceres.h>
+#include "ba_ceres.h"
+#include "ba_options.h"
+#include "ba_stats.h"
+#include "marginalization.h"
+#include "profiler.h"
+#include "SnavelyReprojectionError.h"
+
+/**
+ * Bundle adjustment problem which lives across solves, for a SLAM front end
+ * which keeps appending keyframes.
+ *
+ * The session owns the camera and point parameters, so a camera / point id
+ * stays valid (and its parameters stay at the same address) until it is
+ * removed. Every Solve() starts from the estimate of the previous one, and
+ * only the residual blocks of new observations are built: the ceres::Problem
+ * uses enable_fast_removal, and the points-first elimination ordering is kept
+ * up to date on every add / remove instead of being recomputed by ceres.
+ *
+ * Observations are always 9 parameter (angle axis) BAL cameras.
+ *
+ * For a sliding window, cameras which leave the window are either held
+ * constant (SetCameraConstant) or marginalized (MarginalizeCamera).
+ */
+class BASession {
+public:
+    explicit BASession(const BAOptions &ba_options)
+            : ba_options_(ba_options), loss_function_(CreateLossFunction(ba_options)),
+              problem_(ProblemOptions()), ordering_(new ceres::ParameterBlockOrdering),
+              num_active_cameras_(0), num_active_points_(0), num_active_observations_(0) {}
+
+    // camera: 9 BAL parameters, copied. Returns the camera id.
+    int AddCamera(const double *camera) {
+        cameras_.push_back(Block<9>(camera));
+        double *parameters = cameras_.back().parameters;
+        problem_.AddParameterBlock(parameters, 9);
+        ordering_->AddElementToGroup(parameters, 1);
+        ++num_active_cameras_;
+        return static_cast<int>(cameras_.size()) - 1;
+    }
+
+    // point: 3 coordinates, copied. Returns the point id.
+    int AddPoint(const double *point) {
+        points_.push_back(Block<3>(point));
+        double *parameters = points_.back().parameters;
+        problem_.AddParameterBlock(parameters, 3);
+        ordering_->AddElementToGroup(parameters, 0);
+        ++num_active_points_;
+        return static_cast<int>(points_.size()) - 1;
+    }
+
+    // observation (x, y) of point_id in camera_id. Returns the observation id.
+    int AddObservation(int camera_id, int point_id, double x, double y) {
+        Block<9> &camera = cameras_[camera_id];
+        Block<3> &point = points_[point_id];
+        assert(camera.active && point.active);
+
+        Observation observation;
+        observation.camera_id = camera_id;
+        observation.point_id = point_id;
+        observation.residual_block = problem_.AddResidualBlock(
+                SnavelyReprojectionError::Create(x, y, ba_options_.jacobian == "analytic", NULL,
+                                                 EvaluationPrecisionOf(ba_options_)),
+                loss_function_.get(), camera.parameters, point.parameters);
+        observations_.push_back(observation);
+
+        const int observation_id = static_cast<int>(observations_.size()) - 1;
+        camera.observations.push_back(observation_id);
+        point.observations.push_back(observation_id);
+        ++num_active_observations_;
+        return observation_id;
+    }
+
+    void RemoveObservation(int observation_id) {
+        Observation &observation = observations_[observation_id];
+        if (observation.residual_block == NULL) return;
+        problem_.RemoveResidualBlock(observation.residual_block);
+        observation.residual_block = NULL;
+        Erase(&cameras_[observation.camera_id].observations, observation_id);
+        Erase(&points_[observation.point_id].observations, observation_id);
+        --num_active_observations_;
+    }
+
+    // also removes the observations of the camera, and forgets the priors on it
+    void RemoveCamera(int camera_id) {
+        Block<9> &camera = cameras_[camera_id];
+        if (!camera.active) return;
+        const std::vector<int> camera_observations = camera.observations;
+        for (size_t i = 0; i < camera_observations.size(); ++i) {
+            RemoveObservation(camera_observations[i]);
+        }
+        RemovePriors(camera.parameters);
+        ordering_->Remove(camera.parameters);
+        problem_.RemoveParameterBlock(camera.parameters);
+        camera.active = false;
+        --num_active_cameras_;
+    }
+
+    // also removes the observations of the point, and forgets the priors on it
+    void RemovePoint(int point_id) {
+        Block<3> &point = points_[point_id];
+        if (!point.active) return;
+        const std::vector<int> point_observations = point.observations;
+        for (size_t i = 0; i < point_observations.size(); ++i) {
+            RemoveObservation(point_observations[i]);
+        }
+        RemovePriors(point.parameters);
+        ordering_->Remove(point.parameters);
+        problem_.RemoveParameterBlock(point.parameters);
+        point.active = false;
+        --num_active_points_;
+    }
+
+    // a constant camera is not optimized, e.g. to fix the gauge
+    void SetCameraConstant(int camera_id, bool constant) {
+        if (constant) {
+            problem_.SetParameterBlockConstant(cameras_[camera_id].parameters);
+        } else {
+            problem_.SetParameterBlockVariable(cameras_[camera_id].parameters);
+        }
+    }
+
+    void SetPointConstant(int point_id, bool constant) {
+        if (constant) {
+            problem_.SetParameterBlockConstant(points_[point_id].parameters);
+        } else {
+            problem_.SetParameterBlockVariable(points_[point_id].parameters);
+        }
+    }
+
+    bool camera_constant(int camera_id) const {
+        return problem_.IsParameterBlockConstant(cameras_[camera_id].parameters);
+    }
+
+    bool point_constant(int point_id) const {
+        return problem_.IsParameterBlockConstant(points_[point_id].parameters);
+    }
+
+    /**
+     * Remove camera_id and the points observed by no other camera, but keep
+     * what their observations (and the earlier priors on them) say about the
+     * remaining cameras and points: the Gauss-Newton system of those residuals,
+     * linearized at the current estimate, with the removed blocks eliminated
+     * by the Schur complement, is added back as one LinearPrior.
+     *
+     * The prior is dense over the points the camera shares with the rest of
+     * the problem (and the blocks of the priors it is merged with), constant
+     * blocks are conditioned on. Its points are eliminated with the cameras
+     * until the prior is removed.
+     */
+    void MarginalizeCamera(int camera_id) {
+        Block<9> &camera = cameras_[camera_id];
+        if (!camera.active) return;
+
+        // the camera and its points without other observations go first
+        std::vector<int> marginalized_points;
+        for (size_t i = 0; i < camera.observations.size(); ++i) {
+            const int point_id = observations_[camera.observations[i]].point_id;
+            const std::vector<int> &point_observations = points_[point_id].observations;
+            bool exclusive = true;
+            for (size_t j = 0; j < point_observations.size(); ++j) {
+                exclusive = exclusive && observations_[point_observations[j]].camera_id == camera_id;
+            }
+            if (exclusive && std::find(marginalized_points.begin(), marginalized_points.end(),
+                                       point_id) == marginalized_points.end()) {
+                marginalized_points.push_back(point_id);
+            }
+        }
+
+        LinearSystem system;
+        system.AddBlock(problem_, camera.parameters, 9);
+        for (size_t i = 0; i < marginalized_points.size(); ++i) {
+            system.AddBlock(problem_, points_[marginalized_points[i]].parameters, 3);
+        }
+        const int num_marginalized = system.size;
+
+        // the residuals on the marginalized blocks: the camera's observations and the priors
+        std::vector<int> merged_priors;
+        for (size_t i = 0; i < priors_.size(); ++i) {
+            const Prior &prior = priors_[i];
+            bool touched = false;
+            for (size_t b = 0; b < prior.blocks.size(); ++b) {
+                touched = touched || system.Marginalizes(prior.blocks[b], num_marginalized);
+            }
+            if (prior.residual_block != NULL && touched) {
+                merged_priors.push_back(static_cast<int>(i));
+                for (size_t b = 0; b < prior.blocks.size(); ++b) {
+                    system.AddBlock(problem_, prior.blocks[b], prior.block_sizes[b]);
+                }
+            }
+        }
+        for (size_t i = 0; i < camera.observations.size(); ++i) {
+            system.AddBlock(problem_, points_[observations_[camera.observations[i]].point_id].parameters, 3);
+        }
+
+        system.Allocate();
+        for (size_t i = 0; i < camera.observations.size(); ++i) {
+            const Observation &observation = observations_[camera.observations[i]];
+            double *blocks[2] = {camera.parameters, points_[observation.point_id].parameters};
+            const int block_sizes[2] = {9, 3};
+            system.Linearize(problem_, observation.residual_block, 2, blocks, block_sizes, 2);
+        }
+        for (size_t i = 0; i < merged_priors.size(); ++i) {
+            const Prior &prior = priors_[merged_priors[i]];
+            system.Linearize(problem_, prior.residual_block, static_cast<int>(prior.blocks.size()),
+                             prior.blocks.data(), prior.block_sizes.data(), prior.num_residuals);
+        }
+
+        RowMajorMatrix J;
+        Eigen::VectorXd r0;
+        const bool has_prior = system.size > num_marginalized &&
+                               MarginalizeLinearSystem(system.H, system.g, num_marginalized, &J, &r0);
+
+        // the linearization point of the prior, before the blocks go away
+        Prior prior;
+        Eigen::VectorXd x0(system.size - num_marginalized);
+        for (size_t b = 0; b < system.blocks.size(); ++b) {
+            const int offset = system.offsets[system.blocks[b]];
+            if (offset >= num_marginalized) {
+                prior.blocks.push_back(system.blocks[b]);
+                prior.block_sizes.push_back(system.block_sizes[b]);
+                x0.segment(offset - num_marginalized, system.block_sizes[b]) =
+                        Eigen::Map<const Eigen::VectorXd>(system.blocks[b], system.block_sizes[b]);
+            }
+        }
+
+        for (size_t i = 0; i < merged_priors.size(); ++i) {
+            RemovePrior(&priors_[merged_priors[i]]);
+        }
+        RemoveCamera(camera_id);
+        for (size_t i = 0; i < marginalized_points.size(); ++i) {
+            RemovePoint(marginalized_points[i]);
+        }
+
+        if (has_prior) {
+            prior.num_residuals = static_cast<int>(r0.size());
+            prior.residual_block = problem_.AddResidualBlock(
+                    new LinearPrior(prior.block_sizes, x0, J, r0), NULL, prior.blocks);
+            // the prior couples its points, group 0 of the ordering has to stay an independent set
+            for (size_t b = 0; b < prior.blocks.size(); ++b) {
+                if (prior.block_sizes[b] == 3) {
+                    ordering_->AddElementToGroup(prior.blocks[b], 1);
+                }
+            }
+            priors_.push_back(prior);
+        }
+    }
+
+    /**
+     * Optimize all active cameras and points, starting from the current
+     * estimate. stats, if not NULL, receives the timings and the cost of
+     * every iteration, setup_time is the ceres preprocessing only. False if
+     * ceres failed, e.g. on an invalid ordering.
+     */
+    bool Solve(SolveStats *stats = NULL) {
+        ceres::Solver::Options options;
+        SetSolverOptions(ba_options_, &options);
+        // a copy, the preprocessor of ceres prunes constant blocks from it, which may be variable again next time
+        options.linear_solver_ordering.reset(new ceres::ParameterBlockOrdering(*ordering_));
+        // --max_solver_time counts from here
+        CeresProgressCallback progress_callback(WithSolveControl(ba_options_).iteration_callback);
+        progress_callback.AddTo(&options);
+
+        ceres::Solver::Summary summary;
+        {
+            ScopedTimer timer("session solve");
+            ceres::Solve(options, &problem_, &summary);
+        }
+        if (ba_options_.verbose) {
+            std::cout << summary.BriefReport() << std::endl;
+        }
+        if (stats != NULL) {
+            CollectSolveStats(summary, 0.0, stats);
+        }
+        return summary.termination_type != ceres::FAILURE;
+    }
+
+    const double *camera(int camera_id) const {  return cameras_[camera_id].parameters;  }
+
+    const double *point(int point_id) const {  return points_[point_id].parameters;  }
+
+    bool camera_active(int camera_id) const {  return cameras_[camera_id].active;  }
+
+    bool point_active(int point_id) const {  return points_[point_id].active;  }
+
+    int observation_camera(int observation_id) const {  return observations_[observation_id].camera_id;  }
+
+    int observation_point(int observation_id) const {  return observations_[observation_id].point_id;  }
+
+    // observation ids of a camera / point, in the order they were added
+    const std::vector<int> &camera_observations(int camera_id) const {  return cameras_[camera_id].observations;  }
+
+    const std::vector<int> &point_observations(int point_id) const {  return points_[point_id].observations;  }
+
+    int num_cameras() const {  return num_active_cameras_;  }
+
+    int num_points() const {  return num_active_points_;  }
+
+    int num_observations() const {  return num_active_observations_;  }
+
+private:
+    BASession(const BASession &);
+    BASession &operator=(const BASession &);
+
+    // parameters of a camera / point, deque elements do not move on push_back
+    template<int N>
+    struct Block {
+        explicit Block(const double *values) : active(true) {
+            std::copy(values, values + N, parameters);
+        }
+
+        double parameters[N];
+        bool active;
+        std::vector<int> observations;
+    };
+
+    struct Observation {
+        int camera_id;
+        int point_id;
+        ceres::ResidualBlockId residual_block; // NULL once removed
+    };
+
+    // marginalization prior over some of the blocks, see MarginalizeCamera()
+    struct Prior {
+        std::vector<double *> blocks;
+        std::vector<int> block_sizes;
+        int num_residuals;
+        ceres::ResidualBlockId residual_block; // NULL once merged into a newer prior or removed
+    };
+
+    /**
+     * Dense Gauss-Newton system H dx = -g of some residual blocks over the
+     * variable blocks they touch, in the order the blocks were added.
+     */
+    struct LinearSystem {
+        LinearSystem() : size(0) {}
+
+        // constant blocks are no variables
+        void AddBlock(const ceres::Problem &problem, double *block, int block_size) {
+            if (problem.IsParameterBlockConstant(block) || offsets.count(block) != 0) return;
+            offsets[block] = size;
+            blocks.push_back(block);
+            block_sizes.push_back(block_size);
+            size += block_size;
+        }
+
+        // block is among the first num_marginalized variables
+        bool Marginalizes(double *block, int num_marginalized) const {
+            auto it = offsets.find(block);
+            return it != offsets.end() && it->second < num_marginalized;
+        }
+
+        void Allocate() {
+            H.setZero(size, size);
+            g.setZero(size);
+        }
+
+        // add J^T J and J^T r of a residual block, robustified as in the solve
+        void Linearize(const ceres::Problem &problem, ceres::ResidualBlockId residual_block, int num_blocks,
+                       double *const *parameter_blocks, const int *parameter_block_sizes, int num_residuals) {
+            Eigen::VectorXd residuals(num_residuals);
+            std::vector<RowMajorMatrix> jacobians(num_blocks);
+            std::vector<double *> jacobian_pointers(num_blocks, NULL);
+            for (int b = 0; b < num_blocks; ++b) {
+                if (offsets.count(parameter_blocks[b]) != 0) {
+                    jacobians[b].resize(num_residuals, parameter_block_sizes[b]);
+                    jacobian_pointers[b] = jacobians[b].data();
+                }
+            }
+            double cost;
+            problem.EvaluateResidualBlock(residual_block, true, &cost, residuals.data(), jacobian_pointers.data());
+
+            for (int a = 0; a < num_blocks; ++a) {
+                if (jacobian_pointers[a] == NULL) continue;
+                const int offset_a = offsets[parameter_blocks[a]];
+                g.segment(offset_a, parameter_block_sizes[a]) += jacobians[a].transpose() * residuals;
+                for (int b = 0; b < num_blocks; ++b) {
+                    if (jacobian_pointers[b] == NULL) continue;
+                    H.block(offset_a, offsets[parameter_blocks[b]], parameter_block_sizes[a], parameter_block_sizes[b]) +=
+                            jacobians[a].transpose() * jacobians[b];
+                }
+            }
+        }
+
+        std::unordered_map<double *, int> offsets;
+        std::vector<double *> blocks;
+        std::vector<int> block_sizes;
+        int size;
+        Eigen::MatrixXd H;
+        Eigen::VectorXd g;
+    };
+
+    // the priors on block are dropped without being marginalized
+    void RemovePriors(const double *block) {
+        for (size_t i = 0; i < priors_.size(); ++i) {
+            Prior &prior = priors_[i];
+            if (prior.residual_block != NULL &&
+                std::find(prior.blocks.begin(), prior.blocks.end(), block) != prior.blocks.end()) {
+                RemovePrior(&prior);
+            }
+        }
+    }
+
+    // its points without another prior are eliminated first again
+    void RemovePrior(Prior *prior) {
+        problem_.RemoveResidualBlock(prior->residual_block);
+        prior->residual_block = NULL;
+        for (size_t b = 0; b < prior->blocks.size(); ++b) {
+            if (prior->block_sizes[b] != 3) continue;
+            bool coupled = false;
+            for (size_t i = 0; i < priors_.size(); ++i) {
+                coupled = coupled || (priors_[i].residual_block != NULL &&
+                                      std::find(priors_[i].blocks.begin(), priors_[i].blocks.end(),
+                                                prior->blocks[b]) != priors_[i].blocks.end());
+            }
+            if (!coupled) {
+                ordering_->AddElementToGroup(prior->blocks[b], 0);
+            }
+        }
+    }
+
+    // the problem owns the cost functions, the session the shared loss function
+    static ceres::Problem::Options ProblemOptions() {
+        ceres::Problem::Options options;
+        options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        options.enable_fast_removal = true;
+        return options;
+    }
+
+    static void Erase(std::vector<int> *ids, int id) {
+        ids->erase(std::find(ids->begin(), ids->end(), id));
+    }
+
+    const BAOptions ba_options_;
+    std::deque<Block<9> > cameras_;
+    std::deque<Block<3> > points_;
+    std::vector<Observation> observations_;
+    std::vector<Prior> priors_;
+    std::unique_ptr<ceres::LossFunction> loss_function_; // outlives problem_
+    ceres::Problem problem_;
+    std::shared_ptr<ceres::ParameterBlockOrdering> ordering_; // points eliminated first
+    int num_active_cameras_;
+    int num_active_points_;
+    int num_active_observations_;
+};
+
+#endif // BA_SESSION_H
@@ -0,0 +1,89 @@
+#ifndef BA_STATS_H
+#define BA_STATS_H
+
+// timings and costs of one SolveBA run, filled in the same way by both backends
+
+#include <chrono>
+#include <functional>
+#include <vector>
+
+inline double WallTimeInSeconds() {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct IterationStats {
+    int iteration = 0;
+    double cost = 0; // 0.5 * sum of the robustified squared errors, as ceres
+    double time = 0; // this iteration
+    double cumulative_time = 0; // since the optimizer started, setup excluded
+};
+
+/**
+ * What a backend reports to BAOptions::iteration_callback after every
+ * iteration (iteration 0: the initial state), accepted or not.
+ */
+struct IterationProgress {
+    int iteration = 0;
+    double cost = 0;
+    double cost_change = 0; // decrease of the cost by this iteration, 0 for a rejected step
+    double step_norm = 0; // |dx| of the step tried
+    double time = 0; // this iteration
+    double cumulative_time = 0; // since the optimizer started
+    bool step_accepted = false;
+};
+
+/**
+ * Called by the solver thread of a backend; return false to cancel the solve,
+ * which then ends after this iteration with the parameters of the last
+ * accepted step. With --components the solves run concurrently, so the
+ * callback has to be thread safe.
+ */
+typedef std::function<bool(const IterationProgress &)> IterationCallback;
+
+struct SolveStats {
+    double setup_time = 0; // building the problem / graph, ceres preprocessing
+    double solve_time = 0; // optimizer run
+    double residual_evaluation_time = 0;
+    double jacobian_evaluation_time = 0;
+    double linear_solver_time = 0; // Schur complement and reduced system
+    double initial_cost = 0;
+    double final_cost = 0;
+    std::vector<IterationStats> iterations; // iteration 0 is the initial state
+
+    /**
+     * Continue with the iterations of a second solve started from the result
+     * of this one (the double precision refinement of --precision=float).
+     */
+    void Append(const SolveStats &next) {
+        setup_time += next.setup_time;
+        solve_time += next.solve_time;
+        residual_evaluation_time += next.residual_evaluation_time;
+        jacobian_evaluation_time += next.jacobian_evaluation_time;
+        linear_solver_time += next.linear_solver_time;
+        final_cost = next.final_cost;
+        const int first = iterations.empty() ? 1 : iterations.back().iteration + 1;
+        const double offset = iterations.empty() ? 0.0 : iterations.back().cumulative_time;
+        for (size_t i = 1; i < next.iterations.size(); ++i) {
+            IterationStats it = next.iterations[i];
+            it.iteration = first + static_cast<int>(i) - 1;
+            it.cumulative_time += offset;
+            iterations.push_back(it);
+        }
+    }
+
+    /**
+     * Seconds from the start of SolveBA until the cost first reaches
+     * threshold, setup included. -1 if it never does.
+     */
+    double TimeToCost(double threshold) const {
+        for (size_t i = 0; i < iterations.size(); ++i) {
+            if (iterations[i].cost <= threshold) {
+                return setup_time + iterations[i].cumulative_time;
+            }
+        }
+        return -1.0;
+    }
+};
+
+#endif // BA_STATS_H
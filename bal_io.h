@@ -0,0 +1,398 @@
+#ifndef BAL_IO_H
+#define BAL_IO_H
+
+// low level helpers used by BALProblem to load and save BAL data quickly
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Whole-file memory mapping.
+ *
+ * The mapping is private (copy-on-write), so the mapped arrays can be modified
+ * in place (Normalize, Perturb, ...) without touching the file on disk.
+ */
+class MappedFile {
+public:
+    MappedFile() : data_(NULL), size_(0) {}
+
+    ~MappedFile() {  Unmap();  }
+
+    bool Map(const std::string &filename) {
+        Unmap();
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            return false;
+        }
+
+        void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd); // the mapping keeps its own reference to the file
+        if (addr == MAP_FAILED) {
+            return false;
+        }
+
+        madvise(addr, st.st_size, MADV_SEQUENTIAL);
+        data_ = static_cast<char *>(addr);
+        size_ = static_cast<size_t>(st.st_size);
+        return true;
+    }
+
+    void Unmap() {
+        if (data_ != NULL) {
+            munmap(data_, size_);
+        }
+        data_ = NULL;
+        size_ = 0;
+    }
+
+    char *data() const {  return data_;  }
+
+    size_t size() const {  return size_;  }
+
+    // whether ptr points into the mapped region (i.e. must not be delete[]'d)
+    bool contains(const void *ptr) const {
+        const char *p = static_cast<const char *>(ptr);
+        return data_ != NULL && p >= data_ && p < data_ + size_;
+    }
+
+private:
+    MappedFile(const MappedFile &);
+    MappedFile &operator=(const MappedFile &);
+
+    char *data_;
+    size_t size_;
+};
+
+// sequential stream of bytes
+class ByteSource {
+public:
+    virtual ~ByteSource() {}
+
+    // fill up to size bytes, return number of bytes read, 0 at the end, -1 on error
+    virtual long Read(char *buffer, size_t size) = 0;
+};
+
+/**
+ * Tokenizer for the whitespace separated BAL text format.
+ *
+ * Numbers are parsed by hand instead of one fscanf() call per token.
+ * Doubles with at most 15 significant digits and a small decimal exponent
+ * (the observations, and most of the parameters) are exactly representable
+ * as mantissa * 10^exp, so a single multiplication or division gives the
+ * correctly rounded result. Anything else falls back to strtod() on the
+ * token, so the result is always identical to what fscanf("%lf") returns.
+ *
+ * The input is either a complete buffer (e.g. a mapped file) or a ByteSource
+ * that is consumed chunk by chunk, keeping at least kLookahead bytes
+ * buffered so that a token never straddles two chunks.
+ */
+class BALTextScanner {
+public:
+    BALTextScanner(const char *begin, const char *end)
+            : cur_(begin), end_(end), source_(NULL), failed_(false) {}
+
+    explicit BALTextScanner(ByteSource *source, size_t chunk_size = 1 << 20)
+            : cur_(NULL), end_(NULL), source_(source), failed_(false),
+              buffer_(chunk_size + kLookahead) {}
+
+    bool ReadInt(int *value) {
+        SkipSpace();
+        const char *p = cur_;
+        bool negative = false;
+        if (p < end_ && (*p == '-' || *p == '+')) {
+            negative = (*p == '-');
+            ++p;
+        }
+        if (p == end_ || !IsDigit(*p)) {
+            return false;
+        }
+        long long v = 0;
+        while (p < end_ && IsDigit(*p)) {
+            v = v * 10 + (*p - '0');
+            ++p;
+        }
+        *value = static_cast<int>(negative ? -v : v);
+        cur_ = p;
+        return true;
+    }
+
+    bool ReadDouble(double *value) {
+        SkipSpace();
+        const char *p = cur_;
+        bool negative = false;
+        if (p < end_ && (*p == '-' || *p == '+')) {
+            negative = (*p == '-');
+            ++p;
+        }
+
+        // mantissa, ignoring leading zeros
+        uint64_t mantissa = 0;
+        int num_digits = 0;
+        int exponent = 0;
+        bool any_digit = false;
+        while (p < end_ && IsDigit(*p)) {
+            any_digit = true;
+            if (mantissa != 0 || *p != '0') {
+                if (num_digits < 19) {
+                    mantissa = mantissa * 10 + (*p - '0');
+                } else {
+                    ++exponent;
+                }
+                ++num_digits;
+            }
+            ++p;
+        }
+        if (p < end_ && *p == '.') {
+            ++p;
+            while (p < end_ && IsDigit(*p)) {
+                any_digit = true;
+                if (mantissa != 0 || *p != '0') {
+                    if (num_digits < 19) {
+                        mantissa = mantissa * 10 + (*p - '0');
+                        --exponent;
+                    }
+                    ++num_digits;
+                } else {
+                    --exponent;
+                }
+                ++p;
+            }
+        }
+        if (!any_digit) {
+            return SlowReadDouble(value); // nan, inf, garbage
+        }
+        if (p < end_ && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool exp_negative = false;
+            if (q < end_ && (*q == '-' || *q == '+')) {
+                exp_negative = (*q == '-');
+                ++q;
+            }
+            if (q < end_ && IsDigit(*q)) {
+                int e = 0;
+                while (q < end_ && IsDigit(*q)) {
+                    if (e < 100000) e = e * 10 + (*q - '0');
+                    ++q;
+                }
+                exponent += exp_negative ? -e : e;
+                p = q;
+            }
+        }
+
+        // fast path: both mantissa and 10^|exponent| are exact doubles
+        static const double kPow10[] = {
+                1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+                1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+                1e21, 1e22};
+        if (num_digits <= 15 && exponent >= -22 && exponent <= 22) {
+            double v = static_cast<double>(mantissa);
+            v = exponent < 0 ? v / kPow10[-exponent] : v * kPow10[exponent];
+            *value = negative ? -v : v;
+            cur_ = p;
+            return true;
+        }
+        return SlowReadDouble(value);
+    }
+
+    bool AtEnd() {
+        SkipSpace();
+        return cur_ == end_;
+    }
+
+    // whether the underlying source reported an error
+    bool failed() const {  return failed_;  }
+
+private:
+    // longer than any number in a BAL file
+    static const long kLookahead = 128;
+
+    static bool IsDigit(char c) {  return c >= '0' && c <= '9';  }
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    void SkipSpace() {
+        for (;;) {
+            while (cur_ < end_ && IsSpace(*cur_)) ++cur_;
+            if (end_ - cur_ >= kLookahead || !Refill()) return;
+        }
+    }
+
+    // move the unread tail to the front of the buffer and append the next chunk
+    bool Refill() {
+        if (source_ == NULL) return false;
+        const size_t remaining = end_ - cur_;
+        if (remaining > 0 && cur_ != buffer_.data()) {
+            memmove(buffer_.data(), cur_, remaining);
+        }
+        long n = source_->Read(buffer_.data() + remaining, buffer_.size() - remaining);
+        if (n <= 0) {
+            failed_ = failed_ || n < 0;
+            source_ = NULL; // never ask again
+            n = 0;
+        }
+        cur_ = buffer_.data();
+        end_ = cur_ + remaining + n;
+        return n > 0;
+    }
+
+    // strtod() needs a terminated string, the mapped file is not
+    bool SlowReadDouble(double *value) {
+        char token[128];
+        size_t n = 0;
+        while (cur_ + n < end_ && !IsSpace(cur_[n]) && n + 1 < sizeof(token)) {
+            token[n] = cur_[n];
+            ++n;
+        }
+        token[n] = '\0';
+        char *token_end = NULL;
+        *value = strtod(token, &token_end);
+        if (n == 0 || token_end != token + n) {
+            return false;
+        }
+        cur_ += n;
+        return true;
+    }
+
+    const char *cur_;
+    const char *end_;
+    ByteSource *source_;
+    bool failed_;
+    std::vector<char> buffer_;
+};
+
+/**
+ * Compact binary BAL format (.balb), always little endian and angle-axis.
+ *
+ * [BALBinaryHeader]                         32 bytes
+ * [camera_index] int32 x num_observations
+ * [point_index]  int32 x num_observations
+ * [padding]      0 or 4 bytes, so that the doubles are 8 byte aligned
+ * [observations] double x 2 * num_observations
+ * [parameters]   double x (9 * num_cameras + 3 * num_points)
+ *
+ * The arrays are laid out exactly as BALProblem stores them in memory, so a
+ * loaded file is used through mmap directly, without any parsing or copying.
+ */
+struct BALBinaryHeader {
+    char magic[4]; // "BALB"
+    int32_t version;
+    int32_t num_cameras;
+    int32_t num_points;
+    int32_t num_observations;
+    int32_t num_parameters;
+    int32_t reserved[2];
+};
+
+static const char kBALBinaryMagic[4] = {'B', 'A', 'L', 'B'};
+static const int32_t kBALBinaryVersion = 1;
+
+// byte offsets of each array inside a .balb file
+struct BALBinaryLayout {
+    explicit BALBinaryLayout(const BALBinaryHeader &header) {
+        const size_t n = static_cast<size_t>(header.num_observations);
+        camera_index = sizeof(BALBinaryHeader);
+        point_index = camera_index + n * sizeof(int32_t);
+        observations = point_index + n * sizeof(int32_t);
+        observations = (observations + 7) & ~static_cast<size_t>(7);
+        parameters = observations + 2 * n * sizeof(double);
+        total_size = parameters + static_cast<size_t>(header.num_parameters) * sizeof(double);
+    }
+
+    size_t camera_index;
+    size_t point_index;
+    size_t observations;
+    size_t parameters;
+    size_t total_size;
+};
+
+/**
+ * Point major BAL file (.balp) of the out-of-core solver (ba_out_of_core.h),
+ * little endian and angle-axis. Observations are grouped by point, so a range
+ * of points and all their observations are contiguous on disk.
+ *
+ * [BALPointFileHeader]                      32 bytes
+ * [point_offsets] int64 x (num_points + 1), first observation of every point
+ * [camera_index]  int32 x num_observations
+ * [padding]       0 or 4 bytes
+ * [observations]  double x 2 * num_observations
+ * [cameras]       double x 9 * num_cameras
+ * [points]        double x 2 x 3 * num_points
+ *
+ * The points are stored twice: the solver writes the points of a trial step
+ * into the slot which is not the current one (point_slot), so the file holds
+ * a consistent state until the step is accepted.
+ */
+struct BALPointFileHeader {
+    char magic[4]; // "BALP"
+    int32_t version;
+    int32_t num_cameras;
+    int32_t num_points;
+    int32_t num_observations;
+    int32_t point_slot;
+    int32_t reserved[2];
+};
+
+static const char kBALPointFileMagic[4] = {'B', 'A', 'L', 'P'};
+static const int32_t kBALPointFileVersion = 1;
+
+// byte offsets of each array inside a .balp file
+struct BALPointFileLayout {
+    explicit BALPointFileLayout(const BALPointFileHeader &header) {
+        const size_t n = static_cast<size_t>(header.num_observations);
+        point_offsets = sizeof(BALPointFileHeader);
+        camera_index = point_offsets + (static_cast<size_t>(header.num_points) + 1) * sizeof(int64_t);
+        observations = camera_index + n * sizeof(int32_t);
+        observations = (observations + 7) & ~static_cast<size_t>(7);
+        cameras = observations + 2 * n * sizeof(double);
+        points[0] = cameras + 9 * static_cast<size_t>(header.num_cameras) * sizeof(double);
+        points[1] = points[0] + 3 * static_cast<size_t>(header.num_points) * sizeof(double);
+        total_size = points[1] + 3 * static_cast<size_t>(header.num_points) * sizeof(double);
+    }
+
+    size_t point_offsets;
+    size_t camera_index;
+    size_t observations;
+    size_t cameras;
+    size_t points[2];
+    size_t total_size;
+};
+
+inline bool HasSuffix(const std::string &str, const std::string &suffix) {
+    return str.size() >= suffix.size() &&
+           str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// read a whole (non mappable) file, e.g. a pipe
+inline bool ReadWholeFile(const std::string &filename, std::vector<char> *buffer) {
+    FILE *fptr = fopen(filename.c_str(), "rb");
+    if (fptr == NULL) {
+        return false;
+    }
+    buffer->clear();
+    char chunk[1 << 16];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fptr)) > 0) {
+        buffer->insert(buffer->end(), chunk, chunk + n);
+    }
+    fclose(fptr);
+    return true;
+}
+
+#endif // BAL_IO_H
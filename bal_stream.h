@@ -0,0 +1,291 @@
+#ifndef BAL_STREAM_H
+#define BAL_STREAM_H
+
+// streaming (compressed) input for BALProblem, so .bz2/.gz/.zst files
+// are parsed while they are being decompressed
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bal_io.h"
+
+#ifdef BAL_WITH_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef BAL_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef BAL_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef BAL_WITH_BZIP2
+class Bzip2Source : public ByteSource {
+public:
+    explicit Bzip2Source(FILE *fptr) : fptr_(fptr), bzfile_(NULL), done_(false) {
+        int bzerror;
+        bzfile_ = BZ2_bzReadOpen(&bzerror, fptr_, 0, 0, NULL, 0);
+        if (bzerror != BZ_OK) {
+            bzfile_ = NULL;
+        }
+    }
+
+    ~Bzip2Source() {
+        int bzerror;
+        if (bzfile_ != NULL) BZ2_bzReadClose(&bzerror, bzfile_);
+        fclose(fptr_);
+    }
+
+    long Read(char *buffer, size_t size) override {
+        if (done_) return 0;
+        if (bzfile_ == NULL) return -1;
+        long total = 0;
+        while (!done_ && total < static_cast<long>(size)) {
+            int bzerror;
+            int n = BZ2_bzRead(&bzerror, bzfile_, buffer + total, static_cast<int>(size - total));
+            if (bzerror != BZ_OK && bzerror != BZ_STREAM_END) {
+                return -1;
+            }
+            total += n;
+            if (bzerror == BZ_STREAM_END && !NextStream()) {
+                done_ = true;
+            }
+        }
+        return total;
+    }
+
+private:
+    // parallel compressors (pbzip2, lbzip2) write several concatenated streams
+    bool NextStream() {
+        int bzerror;
+        void *unused;
+        int num_unused;
+        BZ2_bzReadGetUnused(&bzerror, bzfile_, &unused, &num_unused);
+        if (bzerror != BZ_OK) return false;
+        std::vector<char> pending(static_cast<char *>(unused),
+                                  static_cast<char *>(unused) + num_unused);
+        BZ2_bzReadClose(&bzerror, bzfile_);
+        bzfile_ = NULL;
+        if (pending.empty()) {
+            int c = fgetc(fptr_);
+            if (c == EOF) return false;
+            pending.push_back(static_cast<char>(c));
+        }
+        bzfile_ = BZ2_bzReadOpen(&bzerror, fptr_, 0, 0,
+                                 pending.data(), static_cast<int>(pending.size()));
+        if (bzerror != BZ_OK) {
+            bzfile_ = NULL;
+            return false;
+        }
+        return true;
+    }
+
+    FILE *fptr_;
+    BZFILE *bzfile_;
+    bool done_;
+};
+#endif // BAL_WITH_BZIP2
+
+#ifdef BAL_WITH_ZLIB
+// gzread() also handles concatenated members
+class GzipSource : public ByteSource {
+public:
+    explicit GzipSource(const std::string &filename) {
+        gzfile_ = gzopen(filename.c_str(), "rb");
+        if (gzfile_ != NULL) gzbuffer(gzfile_, 1 << 17);
+    }
+
+    ~GzipSource() {
+        if (gzfile_ != NULL) gzclose(gzfile_);
+    }
+
+    long Read(char *buffer, size_t size) override {
+        if (gzfile_ == NULL) return -1;
+        int n = gzread(gzfile_, buffer, static_cast<unsigned>(size));
+        return n < 0 ? -1 : n;
+    }
+
+private:
+    gzFile gzfile_;
+};
+#endif // BAL_WITH_ZLIB
+
+#ifdef BAL_WITH_ZSTD
+class ZstdSource : public ByteSource {
+public:
+    explicit ZstdSource(FILE *fptr) : fptr_(fptr), input_(ZSTD_DStreamInSize()), eof_(false) {
+        stream_ = ZSTD_createDStream();
+        ZSTD_initDStream(stream_);
+        in_.src = input_.data();
+        in_.size = 0;
+        in_.pos = 0;
+    }
+
+    ~ZstdSource() {
+        ZSTD_freeDStream(stream_);
+        fclose(fptr_);
+    }
+
+    long Read(char *buffer, size_t size) override {
+        ZSTD_outBuffer out = {buffer, size, 0};
+        while (out.pos < out.size) {
+            if (in_.pos == in_.size) {
+                if (eof_) break;
+                in_.size = fread(input_.data(), 1, input_.size(), fptr_);
+                in_.pos = 0;
+                if (in_.size == 0) {
+                    eof_ = true;
+                    if (ferror(fptr_)) return -1;
+                    break;
+                }
+            }
+            size_t ret = ZSTD_decompressStream(stream_, &out, &in_);
+            if (ZSTD_isError(ret)) return -1;
+        }
+        return static_cast<long>(out.pos);
+    }
+
+private:
+    FILE *fptr_;
+    ZSTD_DStream *stream_;
+    std::vector<char> input_;
+    ZSTD_inBuffer in_;
+    bool eof_;
+};
+#endif // BAL_WITH_ZSTD
+
+/**
+ * Runs another source on a background thread and hands over its output in
+ * chunks through a small bounded queue, so decompression of the next chunks
+ * overlaps with parsing the current one.
+ */
+class PrefetchSource : public ByteSource {
+public:
+    explicit PrefetchSource(ByteSource *source,
+                            size_t chunk_size = 1 << 20,
+                            size_t max_chunks = 4)
+            : source_(source), chunk_size_(chunk_size), max_chunks_(max_chunks),
+              finished_(false), failed_(false), stop_(false), offset_(0) {
+        worker_ = std::thread(&PrefetchSource::Produce, this);
+    }
+
+    ~PrefetchSource() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        not_full_.notify_all();
+        worker_.join();
+    }
+
+    long Read(char *buffer, size_t size) override {
+        long total = 0;
+        while (total < static_cast<long>(size)) {
+            if (current_.size() == offset_) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                not_empty_.wait(lock, [this] {  return !queue_.empty() || finished_;  });
+                if (queue_.empty()) {
+                    return (failed_ && total == 0) ? -1 : total;
+                }
+                current_.swap(queue_.front());
+                queue_.pop_front();
+                offset_ = 0;
+                not_full_.notify_one();
+            }
+            size_t n = std::min(size - total, current_.size() - offset_);
+            memcpy(buffer + total, current_.data() + offset_, n);
+            offset_ += n;
+            total += n;
+        }
+        return total;
+    }
+
+private:
+    void Produce() {
+        for (;;) {
+            std::vector<char> chunk(chunk_size_);
+            long n = source_->Read(chunk.data(), chunk.size());
+            std::unique_lock<std::mutex> lock(mutex_);
+            if (n <= 0) {
+                failed_ = (n < 0);
+                finished_ = true;
+                not_empty_.notify_all();
+                return;
+            }
+            chunk.resize(n);
+            not_full_.wait(lock, [this] {  return queue_.size() < max_chunks_ || stop_;  });
+            if (stop_) {
+                finished_ = true;
+                return;
+            }
+            queue_.push_back(std::vector<char>());
+            queue_.back().swap(chunk);
+            not_empty_.notify_one();
+        }
+    }
+
+    ByteSource *source_;
+    size_t chunk_size_;
+    size_t max_chunks_;
+
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<std::vector<char> > queue_;
+    bool finished_;
+    bool failed_;
+    bool stop_;
+
+    std::vector<char> current_; // consumer side only
+    size_t offset_;
+
+    std::thread worker_;
+};
+
+inline bool IsCompressedBALFile(const std::string &filename) {
+    return HasSuffix(filename, ".bz2") || HasSuffix(filename, ".gz") || HasSuffix(filename, ".zst");
+}
+
+// decoder for a compressed file, NULL if the format is unsupported in this build
+inline ByteSource *OpenCompressedSource(const std::string &filename) {
+    if (HasSuffix(filename, ".gz")) {
+#ifdef BAL_WITH_ZLIB
+        return new GzipSource(filename);
+#else
+        std::cerr << "Error: built without zlib, cannot read " << filename << std::endl;
+        return NULL;
+#endif
+    }
+
+    FILE *fptr = fopen(filename.c_str(), "rb");
+    if (fptr == NULL) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return NULL;
+    }
+    if (HasSuffix(filename, ".bz2")) {
+#ifdef BAL_WITH_BZIP2
+        return new Bzip2Source(fptr);
+#else
+        std::cerr << "Error: built without bzip2, cannot read " << filename << std::endl;
+#endif
+    } else if (HasSuffix(filename, ".zst")) {
+#ifdef BAL_WITH_ZSTD
+        return new ZstdSource(fptr);
+#else
+        std::cerr << "Error: built without zstd, cannot read " << filename << std::endl;
+#endif
+    }
+    fclose(fptr);
+    return NULL;
+}
+
+#endif // BAL_STREAM_H
@@ -0,0 +1,182 @@
+#ifndef BAL_WRITER_H
+#define BAL_WRITER_H
+
+// output helpers of BALProblem: binary / ASCII PLY, parallel text formatting and a background writer
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "parallel.h"
+
+// what a PLY file shows of a problem: camera centers (green) and points (white)
+struct PointCloud {
+    std::vector<double> centers; // 3 x num_cameras
+    std::vector<double> points; // 3 x num_points
+};
+
+/**
+ * Write cloud as PLY, binary_little_endian (15 bytes a vertex, one fwrite)
+ * or ASCII. On a big endian machine the binary file is written big endian.
+ */
+inline bool WritePLYFile(const std::string &filename, const PointCloud &cloud, bool binary) {
+    FILE *fptr = fopen(filename.c_str(), binary ? "wb" : "w");
+    if (fptr == NULL) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return false;
+    }
+    const size_t num_cameras = cloud.centers.size() / 3;
+    const size_t num_points = cloud.points.size() / 3;
+    uint16_t endian_probe = 1;
+    const bool little_endian = *reinterpret_cast<const char *>(&endian_probe) == 1;
+    fprintf(fptr, "ply\nformat %s 1.0\nelement vertex %zu\n"
+                  "property float x\nproperty float y\nproperty float z\n"
+                  "property uchar red\nproperty uchar green\nproperty uchar blue\nend_header\n",
+            !binary ? "ascii" : (little_endian ? "binary_little_endian" : "binary_big_endian"),
+            num_cameras + num_points);
+
+    bool ok = true;
+    if (binary) {
+        const size_t vertex_size = 3 * sizeof(float) + 3;
+        std::vector<char> buffer((num_cameras + num_points) * vertex_size);
+        char *out = buffer.data();
+        for (size_t v = 0; v < num_cameras + num_points; ++v, out += vertex_size) {
+            const bool camera = v < num_cameras;
+            const double *x = camera ? &cloud.centers[3 * v] : &cloud.points[3 * (v - num_cameras)];
+            const float xyz[3] = {static_cast<float>(x[0]), static_cast<float>(x[1]), static_cast<float>(x[2])};
+            const unsigned char rgb[3] = {static_cast<unsigned char>(camera ? 0 : 255), 255,
+                                          static_cast<unsigned char>(camera ? 0 : 255)};
+            memcpy(out, xyz, sizeof(xyz));
+            memcpy(out + sizeof(xyz), rgb, 3);
+        }
+        ok = fwrite(buffer.data(), 1, buffer.size(), fptr) == buffer.size();
+    } else {
+        for (size_t c = 0; ok && c < num_cameras; ++c) {
+            const double *x = &cloud.centers[3 * c];
+            ok = fprintf(fptr, "%g %g %g 0 255 0\n", x[0], x[1], x[2]) > 0;
+        }
+        for (size_t j = 0; ok && j < num_points; ++j) {
+            const double *x = &cloud.points[3 * j];
+            ok = fprintf(fptr, "%g %g %g 255 255 255\n", x[0], x[1], x[2]) > 0;
+        }
+    }
+    ok = fclose(fptr) == 0 && ok;
+    if (!ok) {
+        std::cerr << "Error: unable to write " << filename << std::endl;
+    }
+    return ok;
+}
+
+// append printf formatted text of at most 63 characters
+template<typename... Args>
+inline void AppendFormatted(std::string *text, const char *format, Args... args) {
+    char buffer[64];
+    const int n = snprintf(buffer, sizeof(buffer), format, args...);
+    text->append(buffer, n < 0 ? 0 : std::min<int>(n, sizeof(buffer) - 1));
+}
+
+/**
+ * Write the text of the items [0, n), format(i, &text) appending item i, to
+ * fptr in order. snprintf is most of the time of a text file, so blocks of
+ * 4096 items are formatted on the thread pool, a few blocks per thread in
+ * memory at a time.
+ */
+inline bool WriteFormattedParallel(FILE *fptr, int n, const std::function<void(int, std::string *)> &format,
+                                   ThreadPool *pool) {
+    const int block_size = 4096;
+    const int num_blocks = (n + block_size - 1) / block_size;
+    const int batch_size = 4 * pool->num_threads();
+    std::vector<std::string> texts(batch_size);
+    for (int first = 0; first < num_blocks; first += batch_size) {
+        const int batch = std::min(batch_size, num_blocks - first);
+        pool->ParallelFor(batch, [&](int begin, int end) {
+            for (int b = begin; b < end; ++b) {
+                texts[b].clear();
+                const int item_end = std::min(n, (first + b + 1) * block_size);
+                for (int i = (first + b) * block_size; i < item_end; ++i) {
+                    format(i, &texts[b]);
+                }
+            }
+        }, 1);
+        for (int b = 0; b < batch; ++b) {
+            if (fwrite(texts[b].data(), 1, texts[b].size(), fptr) != texts[b].size()) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * One background thread running the submitted tasks (writing snapshots,
+ * results) in order, so the caller does not wait for the disk. At most
+ * max_pending tasks wait at a time, Submit() blocks beyond that so the
+ * snapshots they hold do not pile up. The destructor finishes all tasks.
+ */
+class AsyncWriter {
+public:
+    explicit AsyncWriter(int max_pending = 2)
+            : max_pending_(max_pending), busy_(false), stop_(false), thread_(&AsyncWriter::Loop, this) {}
+
+    ~AsyncWriter() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        changed_.notify_all();
+        thread_.join();
+    }
+
+    void Submit(const std::function<void()> &task) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] {  return static_cast<int>(tasks_.size()) < max_pending_;  });
+        tasks_.push_back(task);
+        changed_.notify_all();
+    }
+
+    // until every submitted task is done
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        changed_.wait(lock, [this] {  return tasks_.empty() && !busy_;  });
+    }
+
+private:
+    AsyncWriter(const AsyncWriter &);
+    AsyncWriter &operator=(const AsyncWriter &);
+
+    void Loop() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            changed_.wait(lock, [this] {  return stop_ || !tasks_.empty();  });
+            if (tasks_.empty()) return; // stopped and drained
+            std::function<void()> task = tasks_.front();
+            tasks_.pop_front();
+            busy_ = true;
+            changed_.notify_all();
+            lock.unlock();
+            task();
+            lock.lock();
+            busy_ = false;
+            changed_.notify_all();
+        }
+    }
+
+    const int max_pending_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::function<void()> > tasks_;
+    bool busy_;
+    bool stop_;
+    std::thread thread_; // last, starts after the rest is set up
+};
+
+#endif // BAL_WRITER_H
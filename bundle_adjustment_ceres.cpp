@@ -1,87 +1,227 @@
+#include <algorithm>
+#include <deque>
 #include <iostream>
-#include <ceres/ceres.h>
+#include <vector>
+#include "ba_batch.h"
+#include "ba_ceres.h"
+#include "ba_graph.h"
+#include "ba_native.h"
+#include "ba_options.h"
+#include "ba_session.h"
 #include "common.h"
-#include "SnavelyReprojectionError.h"
+#include "profiler.h"
+#include "projection_kernel.h"
 
-std::string file_name = "../data/problem-16-22106-pre.txt";
-
-void SolveBA(BALProblem &bal_problem);
+/**
+ * Feed bal_problem into a BASession step by step, --incremental_cameras
+ * cameras with their observations at a time (points join when first
+ * observed), and re-solve after every step. The first camera is kept
+ * constant. The result is written back to bal_problem.
+ *
+ * With --window_cameras only the newest cameras and the points they observe
+ * are optimized, older cameras are held constant or, with --marginalize,
+ * marginalized into a prior.
+ */
+// camera leaves the sliding window of session
+static void SlideWindow(BASession *session, int camera, bool marginalize) {
+    if (marginalize) {
+        session->MarginalizeCamera(camera);
+        return;
+    }
+    session->SetCameraConstant(camera, true);
 
-int main (int argc, char** argv) {
+    // and so do its points which no camera in the window observes
+    const std::vector<int> &camera_observations = session->camera_observations(camera);
+    for (size_t i = 0; i < camera_observations.size(); ++i) {
+        const int point = session->observation_point(camera_observations[i]);
+        const std::vector<int> &point_observations = session->point_observations(point);
+        bool observed = false;
+        for (size_t j = 0; j < point_observations.size(); ++j) {
+            observed = observed || !session->camera_constant(session->observation_camera(point_observations[j]));
+        }
+        if (!observed) {
+            session->SetPointConstant(point, true);
+        }
+    }
+}
 
-    BALProblem bal_problem(file_name);
-    std::cout << "done 1" << std::endl;
-    bal_problem.Normalize();
-    bal_problem.Perturb(0.1, 0.5, 0.5);
-    bal_problem.WriteToPLYFile("../results/initial_ceres.ply"); // data with noise as initial data
-    SolveBA(bal_problem); // optimization
-    bal_problem.WriteToPLYFile("../results/final_ceres.ply"); // estimated data
+static void SolveIncrementally(BALProblem &bal_problem, const BAOptions &ba_options) {
+    BAOptions session_options = ba_options;
+    session_options.verbose = false;
+    BASession session(session_options);
 
-    return 0;
-}
+    // observations of every camera
+    std::vector<std::vector<int> > camera_observations(bal_problem.num_cameras());
+    for (int i = 0; i < bal_problem.num_observations(); ++i) {
+        camera_observations[bal_problem.camera_index()[i]].push_back(i);
+    }
+    std::vector<int> point_ids(bal_problem.num_points(), -1);
+    std::deque<int> window;
 
-void SolveBA(BALProblem &bal_problem) {
-    const int point_block_size = bal_problem.point_block_size();
     const int camera_block_size = bal_problem.camera_block_size();
-    double *points = bal_problem.mutable_points();
-    double *cameras = bal_problem.mutable_cameras();
-
-    /**
-     * Observations is 2 * num_observations long array observations
-     * [u_1, u_2, ..., u_n], where each u_i is two dimensional, the x
-     * and y position of the observation.
-     */
+    const int point_block_size = bal_problem.point_block_size();
     const double *observations = bal_problem.observations();
-    ceres::Problem problem;
+    for (int begin = 0; begin < bal_problem.num_cameras(); begin += ba_options.incremental_cameras) {
+        const double step_start = WallTimeInSeconds();
+        const int end = std::min(begin + ba_options.incremental_cameras, bal_problem.num_cameras());
+        for (int camera = begin; camera < end; ++camera) {
+            // the camera ids of the session are the BAL camera indices
+            session.AddCamera(bal_problem.cameras() + camera_block_size * camera);
+            for (size_t k = 0; k < camera_observations[camera].size(); ++k) {
+                const int i = camera_observations[camera][k];
+                const int point = bal_problem.point_index()[i];
+                if (point_ids[point] < 0) {
+                    point_ids[point] = session.AddPoint(bal_problem.points() + point_block_size * point);
+                } else if (!session.point_active(point_ids[point])) {
+                    // seen again after it was marginalized, starts over from its last estimate
+                    point_ids[point] = session.AddPoint(session.point(point_ids[point]));
+                } else if (session.point_constant(point_ids[point])) {
+                    session.SetPointConstant(point_ids[point], false);
+                }
+                session.AddObservation(camera, point_ids[point], observations[2 * i + 0], observations[2 * i + 1]);
+            }
+        }
+        if (begin == 0) {
+            session.SetCameraConstant(0, true);
+        }
+        for (int camera = begin; camera < end; ++camera) {
+            window.push_back(camera);
+        }
+        while (ba_options.window_cameras > 0 && static_cast<int>(window.size()) > ba_options.window_cameras) {
+            SlideWindow(&session, window.front(), ba_options.marginalize);
+            window.pop_front();
+        }
 
-    for (int i = 0; i < bal_problem.num_observations(); ++i) {
-        ceres::CostFunction *cost_function;
+        SolveStats stats;
+        if (!session.Solve(&stats)) {
+            std::cerr << "Error: the solve of step " << begin / ba_options.incremental_cameras << " failed"
+                      << std::endl;
+        }
+        // the initial evaluation is the first record, a failed solve has none
+        const int iterations = std::max(0, static_cast<int>(stats.iterations.size()) - 1);
+        std::cout << "step " << begin / ba_options.incremental_cameras << ": " << session.num_cameras()
+                  << " cameras, " << session.num_points() << " points, " << session.num_observations()
+                  << " observations, cost " << stats.initial_cost << " -> " << stats.final_cost
+                  << " in " << iterations << " iterations, "
+                  << WallTimeInSeconds() - step_start << " s" << std::endl;
+    }
 
-        // step 1: define parameter blocks (P137)
-        double *camera = cameras + camera_block_size * bal_problem.camera_index()[i];
-        double *point = points + point_block_size * bal_problem.point_index()[i];
+    for (int camera = 0; camera < bal_problem.num_cameras(); ++camera) {
+        std::copy(session.camera(camera), session.camera(camera) + camera_block_size,
+                  bal_problem.mutable_cameras() + camera_block_size * camera);
+    }
+    for (int point = 0; point < bal_problem.num_points(); ++point) {
+        if (point_ids[point] >= 0) {
+            std::copy(session.point(point_ids[point]), session.point(point_ids[point]) + point_block_size,
+                      bal_problem.mutable_points() + point_block_size * point);
+        }
+    }
+}
 
-        /**
-         * step 2: define cost function (residual block computing method, P137)
-         *
-         * Each Residual block (Cost function) takes a point and a camera as input
-         * and outputs a 2-dimensional Residual
-         *
-         * AutoDiffCostFunction<>()
-         */
-        cost_function = SnavelyReprojectionError::Create(observations[2 * i + 0],
-                                                         observations[2 * i + 1]);
+int main (int argc, char** argv) {
+    BAOptions ba_options;
+    ba_options.initial_ply = "../results/initial_ceres.ply";
+    ba_options.final_ply = "../results/final_ceres.ply";
+    if (!ParseBAOptions(argc, argv, &ba_options)) {
+        return 1;
+    }
+    if (ba_options.jacobian == "numeric") {
+        std::cerr << "Error: --jacobian=numeric is only available in bundle_adjustment_g2o" << std::endl;
+        return 1;
+    }
+    if (ba_options.quaternions && ba_options.incremental_cameras > 0) {
+        std::cerr << "Error: --incremental_cameras only has angle-axis cameras, not --quaternions" << std::endl;
+        return 1;
+    }
+    if (ba_options.quaternions && ba_options.covariance) {
+        std::cerr << "Error: --covariance only has angle-axis cameras, not --quaternions" << std::endl;
+        return 1;
+    }
+    if (ba_options.precision != "double" && ba_options.sparse_library != "AUTO" &&
+        ba_options.sparse_library != "EIGEN_SPARSE" &&
+        (ba_options.linear_solver == "AUTO" || ba_options.linear_solver == "SPARSE_SCHUR")) {
+        // the mixed precision solves of SPARSE_SCHUR only factorize with EIGEN_SPARSE (SetSolverOptions)
+        std::cerr << "Error: --precision=" << ba_options.precision
+                  << " factorizes with EIGEN_SPARSE, not --sparse_library=" << ba_options.sparse_library << std::endl;
+        return 1;
+    }
+    if (!ba_options.manifest.empty() && ba_options.incremental_cameras > 0) {
+        std::cerr << "Error: --manifest solves every problem in one batch, not with --incremental_cameras"
+                  << std::endl;
+        return 1;
+    }
 
-        /**
-         * step 3: define loss function (kernel function, P137 -> details in P251)
-         * If enabled use Huber's loss function
-         */
-        ceres::LossFunction *loss_function = new ceres::HuberLoss(1.0);
+    const bool profiling = !ba_options.profile.empty() || !ba_options.trace.empty();
+    if (profiling) {
+        Profiler::Get().Enable(!ba_options.trace.empty());
+    }
 
-        /**
-         * step 4: add residual block to the problems (P137)
-         *
-         * Each observation corresponds to a pair of a camera and a point
-         * which are identidied by camera_index()[i] and point_index[i] respectively
-         */
-        problem.AddResidualBlock(cost_function,
-                                 loss_function,
-                                 camera, point // estimated parameters
-                                 );
+    if (!ba_options.manifest.empty()) {
+        const int status = RunBatch(ba_options, SolveBACeres);
+        if (!ba_options.profile.empty()) {
+            Profiler::Get().WriteReport(ba_options.profile);
+        }
+        if (!ba_options.trace.empty()) {
+            Profiler::Get().WriteTrace(ba_options.trace);
+        }
+        return status;
     }
 
-    // show some information here
-    std::cout << "bal problem file loaded..." << std::endl;
-    std::cout << "bal problem have " << bal_problem.num_cameras() << " cameras and "
-              << bal_problem.num_points() << " points. " << std::endl;
-    std::cout << "Forming " << bal_problem.num_observations() << " observations. " << std::endl;
+    AsyncWriter writer;
+    AsyncWriter *output_writer = ba_options.async_output ? &writer : NULL;
+    BALProblem bal_problem(ba_options.input, ba_options.quaternions);
+    if (bal_problem.num_observations() == 0) {
+        return 1;
+    }
+    std::cout << "done 1" << std::endl;
+    bal_problem.Normalize(ba_options.num_threads);
+    bal_problem.Perturb(ba_options.rotation_sigma, ba_options.translation_sigma, ba_options.point_sigma, 1,
+                        ba_options.num_threads);
+    if (!ba_options.initial_ply.empty()) {
+        // data with noise as initial data
+        WriteToPLYFileAsync(bal_problem, ba_options.initial_ply, ba_options.binary_ply, output_writer);
+    }
+    std::cout << "initial RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+    if (ba_options.graph_stats) {
+        PrintGraphStats(ComputeGraphStats(bal_problem, ba_options.num_threads), std::cout);
+    }
+    if (ba_options.reorder) {
+        bal_problem.Reorder(); // camera sorted observations for the solve
+    }
+    if (ba_options.incremental_cameras > 0) {
+        SolveIncrementally(bal_problem, ba_options);
+    } else if (ba_options.components) {
+        SolveStats stats;
+        SolveBAComponents(bal_problem, ba_options, SolveBACeres, profiling ? &stats : NULL);
+        Profiler::Get().AddSolveStats(stats);
+    } else {
+        SolveStats stats;
+        if (!SolveBACeres(bal_problem, ba_options, profiling ? &stats : NULL)) { // optimization
+            return 1;
+        }
+        Profiler::Get().AddSolveStats(stats);
+    }
+    bal_problem.RestoreOriginalOrder();
+    std::cout << "final RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+    if (ba_options.covariance && !SaveCovariance(bal_problem, ba_options)) {
+        return 1;
+    }
+    if (!ba_options.final_ply.empty()) {
+        // estimated data
+        WriteToPLYFileAsync(bal_problem, ba_options.final_ply, ba_options.binary_ply, output_writer);
+    }
+    if (HasSuffix(ba_options.output, ".balb")) {
+        bal_problem.WriteToBinaryFile(ba_options.output);
+    } else if (!ba_options.output.empty()) {
+        bal_problem.WriteToFile(ba_options.output, ba_options.num_threads);
+    }
+    writer.Wait(); // the PLY files are in the report
+    if (!ba_options.profile.empty()) {
+        Profiler::Get().WriteReport(ba_options.profile);
+    }
+    if (!ba_options.trace.empty()) {
+        Profiler::Get().WriteTrace(ba_options.trace);
+    }
 
-    // configure solver
-    std::cout << "Solving ceres BA ... " << std::endl;
-    ceres::Solver::Options options; // many options
-    options.linear_solver_type = ceres::LinearSolverType::SPARSE_SCHUR; // how to solve H * dx = g
-    options.minimizer_progress_to_stdout = true; // output to cout
-    ceres::Solver::Summary summary; // optimization information
-    ceres::Solve(options, &problem, &summary); // start optimization
-    std::cout << summary.FullReport() << "\n"; // output result
-}
\ No newline at end of file
+    return 0;
+}
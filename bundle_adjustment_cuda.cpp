@@ -0,0 +1,90 @@
+#include <atomic>
+#include <iostream>
+#include "ba_cuda.h"
+#include "ba_graph.h"
+#include "ba_options.h"
+#include "common.h"
+#include "profiler.h"
+#include "projection_kernel.h"
+
+int main(int argc, char** argv) {
+    BAOptions ba_options;
+    ba_options.initial_ply = "../results/initial_cuda.ply";
+    ba_options.final_ply = "../results/final_cuda.ply";
+    if (!ParseBAOptions(argc, argv, &ba_options)) {
+        return 1;
+    }
+    if (ba_options.jacobian != "analytic" || ba_options.precision != "double") {
+        std::cerr << "Error: bundle_adjustment_cuda only has --jacobian=analytic and --precision=double" << std::endl;
+        return 1;
+    }
+    if (ba_options.quaternions) {
+        std::cerr << "Error: --quaternions is only available in bundle_adjustment_ceres and bundle_adjustment_g2o"
+                  << std::endl;
+        return 1;
+    }
+    if (ba_options.covariance) {
+        std::cerr << "Error: --covariance is only available in bundle_adjustment_ceres, g2o and native" << std::endl;
+        return 1;
+    }
+    if (ba_options.outlier_rounds > 0) {
+        std::cerr << "Error: --outlier_rounds is only available in bundle_adjustment_ceres, g2o and native"
+                  << std::endl;
+        return 1;
+    }
+
+    const bool profiling = !ba_options.profile.empty() || !ba_options.trace.empty();
+    if (profiling) {
+        Profiler::Get().Enable(!ba_options.trace.empty());
+    }
+
+    AsyncWriter writer;
+    AsyncWriter *output_writer = ba_options.async_output ? &writer : NULL;
+    BALProblem bal_problem(ba_options.input);
+    if (bal_problem.num_observations() == 0) {
+        return 1;
+    }
+    bal_problem.Normalize(ba_options.num_threads);
+    bal_problem.Perturb(ba_options.rotation_sigma, ba_options.translation_sigma, ba_options.point_sigma, 1,
+                        ba_options.num_threads);
+    if (!ba_options.initial_ply.empty()) {
+        WriteToPLYFileAsync(bal_problem, ba_options.initial_ply, ba_options.binary_ply, output_writer);
+    }
+    std::cout << "initial RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+    if (ba_options.graph_stats) {
+        PrintGraphStats(ComputeGraphStats(bal_problem, ba_options.num_threads), std::cout);
+    }
+    SolveStats stats;
+    if (ba_options.components) {
+        // SolveFunction has no result, a component which fails on the device fails the run
+        std::atomic<bool> ok(true);
+        SolveBAComponents(bal_problem, ba_options, [&ok](BALProblem &problem, const BAOptions &options,
+                                                         SolveStats *component_stats) {
+            if (!SolveBACuda(problem, options, component_stats)) ok = false;
+        }, profiling ? &stats : NULL);
+        if (!ok) {
+            return 1;
+        }
+    } else if (!SolveBACuda(bal_problem, ba_options, profiling ? &stats : NULL)) {
+        return 1;
+    }
+    Profiler::Get().AddSolveStats(stats);
+    std::cout << "final RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+    if (!ba_options.final_ply.empty()) {
+        WriteToPLYFileAsync(bal_problem, ba_options.final_ply, ba_options.binary_ply, output_writer);
+    }
+    if (HasSuffix(ba_options.output, ".balb")) {
+        bal_problem.WriteToBinaryFile(ba_options.output);
+    } else if (!ba_options.output.empty()) {
+        bal_problem.WriteToFile(ba_options.output, ba_options.num_threads);
+    }
+    writer.Wait(); // the PLY files are in the report
+    if (!ba_options.profile.empty()) {
+        Profiler::Get().WriteReport(ba_options.profile);
+    }
+    if (!ba_options.trace.empty()) {
+        Profiler::Get().WriteTrace(ba_options.trace);
+    }
+
+    return 0;
+}
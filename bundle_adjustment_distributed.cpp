@@ -0,0 +1,111 @@
+#include <algorithm>
+#include <iostream>
+#include "ba_distributed.h"
+#include "ba_options.h"
+#include "common.h"
+#include "communicator.h"
+#include "profiler.h"
+#include "projection_kernel.h"
+
+/**
+ * ADMM bundle adjustment over camera partitions. Started by mpirun (built
+ * with MPI) every process is one partition of world; otherwise, world NULL,
+ * --partitions threads of this process play the ranks. Every rank loads and
+ * perturbs the problem the same way (the same Perturb seed), rank 0 reports
+ * and writes the result. Returns the exit code.
+ */
+static int RunDistributed(int argc, char** argv, Communicator *world) {
+    BAOptions ba_options;
+    ba_options.initial_ply = "../results/initial_distributed.ply";
+    ba_options.final_ply = "../results/final_distributed.ply";
+    if (!ParseBAOptions(argc, argv, &ba_options)) {
+        return 1;
+    }
+    if (ba_options.jacobian == "numeric") {
+        std::cerr << "Error: --jacobian=numeric is only available in bundle_adjustment_g2o" << std::endl;
+        return 1;
+    }
+    if (ba_options.quaternions) {
+        std::cerr << "Error: --quaternions is only available in bundle_adjustment_ceres and bundle_adjustment_g2o"
+                  << std::endl;
+        return 1;
+    }
+    if (ba_options.covariance) {
+        std::cerr << "Error: --covariance is only available in bundle_adjustment_ceres, g2o and native" << std::endl;
+        return 1;
+    }
+
+    const bool use_mpi = world != NULL && world->size() > 1;
+    const bool root = world == NULL || world->rank() == 0;
+    const bool profiling = root && (!ba_options.profile.empty() || !ba_options.trace.empty());
+    if (profiling) {
+        Profiler::Get().Enable(!ba_options.trace.empty());
+    }
+
+    AsyncWriter writer;
+    AsyncWriter *output_writer = ba_options.async_output ? &writer : NULL;
+    BALProblem bal_problem(ba_options.input);
+    if (bal_problem.num_observations() == 0) {
+        return 1;
+    }
+    bal_problem.Normalize(ba_options.num_threads);
+    bal_problem.Perturb(ba_options.rotation_sigma, ba_options.translation_sigma, ba_options.point_sigma, 1,
+                        ba_options.num_threads);
+    if (root && !ba_options.initial_ply.empty()) {
+        // data with noise as initial data
+        WriteToPLYFileAsync(bal_problem, ba_options.initial_ply, ba_options.binary_ply, output_writer);
+    }
+    if (root) {
+        std::cout << "initial RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+    }
+
+    SolveStats stats;
+    if (use_mpi) {
+        SolveBADistributed(bal_problem, ba_options, world, root ? &stats : NULL);
+    } else {
+        // the ranks share the cores of this machine
+        BAOptions rank_options = ba_options;
+        rank_options.num_threads = std::max(1, ba_options.num_threads / ba_options.partitions);
+        ThreadCommunicator::Run(ba_options.partitions, [&](Communicator *communicator) {
+            SolveBADistributed(bal_problem, rank_options, communicator, communicator->rank() == 0 ? &stats : NULL);
+        });
+    }
+    Profiler::Get().AddSolveStats(stats);
+
+    if (root) {
+        std::cout << "final RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+        if (!ba_options.final_ply.empty()) {
+            // estimated data
+            WriteToPLYFileAsync(bal_problem, ba_options.final_ply, ba_options.binary_ply, output_writer);
+        }
+        if (HasSuffix(ba_options.output, ".balb")) {
+            bal_problem.WriteToBinaryFile(ba_options.output);
+        } else if (!ba_options.output.empty()) {
+            bal_problem.WriteToFile(ba_options.output, ba_options.num_threads);
+        }
+        writer.Wait(); // the PLY files are in the report
+        if (!ba_options.profile.empty()) {
+            Profiler::Get().WriteReport(ba_options.profile);
+        }
+        if (!ba_options.trace.empty()) {
+            Profiler::Get().WriteTrace(ba_options.trace);
+        }
+    }
+    return 0;
+}
+
+// every exit of the ranks passes MPI_Finalize()
+int main (int argc, char** argv) {
+#ifdef BA_WITH_MPI
+    MPI_Init(&argc, &argv);
+    int rc;
+    {
+        MpiCommunicator world;
+        rc = RunDistributed(argc, argv, &world);
+    }
+    MPI_Finalize();
+    return rc;
+#else
+    return RunDistributed(argc, argv, NULL);
+#endif
+}
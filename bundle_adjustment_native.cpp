@@ -0,0 +1,150 @@
+#include <iostream>
+#include "ba_batch.h"
+#include "ba_native.h"
+#include "ba_graph.h"
+#include "ba_options.h"
+#include "ba_out_of_core.h"
+#include "common.h"
+#include "profiler.h"
+#include "projection_kernel.h"
+
+/**
+ * Solve a .balp file in place without loading it, e.g. one written by an
+ * earlier --point_chunk run (--point_file) on a machine with more memory.
+ */
+static int SolvePointFile(const BAOptions &ba_options) {
+    const bool profiling = !ba_options.profile.empty() || !ba_options.trace.empty();
+    if (ba_options.covariance) {
+        std::cerr << "Error: --covariance needs the problem in memory, not a .balp file" << std::endl;
+        return 1;
+    }
+    PointFile file;
+    if (!file.Open(ba_options.input)) {
+        return 1;
+    }
+    BAOptions options = ba_options;
+    if (options.point_chunk == 0) {
+        options.point_chunk = 1 << 16;
+    }
+    OutOfCoreBASolver solver(&file, options);
+    std::cout << "initial RMS reprojection error: " << solver.RMSReprojectionError() << std::endl;
+    SolveStats stats;
+    if (!solver.Solve(profiling ? &stats : NULL)) {
+        return 1;
+    }
+    Profiler::Get().AddSolveStats(stats);
+    std::cout << "final RMS reprojection error: " << solver.RMSReprojectionError() << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    BAOptions ba_options;
+    ba_options.initial_ply = "../results/initial_native.ply";
+    ba_options.final_ply = "../results/final_native.ply";
+    if (!ParseBAOptions(argc, argv, &ba_options)) {
+        return 1;
+    }
+    if (ba_options.jacobian != "analytic") {
+        std::cerr << "Error: bundle_adjustment_native only has --jacobian=analytic" << std::endl;
+        return 1;
+    }
+    if (ba_options.quaternions) {
+        std::cerr << "Error: --quaternions is only available in bundle_adjustment_ceres and bundle_adjustment_g2o"
+                  << std::endl;
+        return 1;
+    }
+    if (!ba_options.manifest.empty() && ba_options.point_chunk > 0) {
+        std::cerr << "Error: --manifest solves the problems in memory, not with --point_chunk" << std::endl;
+        return 1;
+    }
+    if (ba_options.outlier_rounds > 0 && (ba_options.point_chunk > 0 || HasSuffix(ba_options.input, ".balp"))) {
+        std::cerr << "Error: --outlier_rounds needs the problem in memory, not --point_chunk or a .balp file"
+                  << std::endl;
+        return 1;
+    }
+
+    const bool profiling = !ba_options.profile.empty() || !ba_options.trace.empty();
+    if (profiling) {
+        Profiler::Get().Enable(!ba_options.trace.empty());
+    }
+
+    if (HasSuffix(ba_options.input, ".balp")) {
+        const int status = SolvePointFile(ba_options);
+        if (status == 0 && !ba_options.profile.empty()) {
+            Profiler::Get().WriteReport(ba_options.profile);
+        }
+        if (status == 0 && !ba_options.trace.empty()) {
+            Profiler::Get().WriteTrace(ba_options.trace);
+        }
+        return status;
+    }
+
+    if (!ba_options.manifest.empty()) {
+        const int status = RunBatch(ba_options, SolveBANative);
+        if (!ba_options.profile.empty()) {
+            Profiler::Get().WriteReport(ba_options.profile);
+        }
+        if (!ba_options.trace.empty()) {
+            Profiler::Get().WriteTrace(ba_options.trace);
+        }
+        return status;
+    }
+
+    AsyncWriter writer;
+    AsyncWriter *output_writer = ba_options.async_output ? &writer : NULL;
+    BALProblem bal_problem(ba_options.input);
+    if (bal_problem.num_observations() == 0) {
+        return 1;
+    }
+    bal_problem.Normalize(ba_options.num_threads);
+    bal_problem.Perturb(ba_options.rotation_sigma, ba_options.translation_sigma, ba_options.point_sigma, 1,
+                        ba_options.num_threads);
+    if (!ba_options.initial_ply.empty()) {
+        WriteToPLYFileAsync(bal_problem, ba_options.initial_ply, ba_options.binary_ply, output_writer);
+    }
+    std::cout << "initial RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+    if (ba_options.graph_stats) {
+        PrintGraphStats(ComputeGraphStats(bal_problem, ba_options.num_threads), std::cout);
+    }
+    if (ba_options.reorder) {
+        bal_problem.Reorder(); // camera sorted observations for the solve
+    }
+    SolveStats stats;
+    if (ba_options.point_chunk > 0) {
+        // the point file also serves as a starting point for later SolvePointFile() runs
+        const std::string point_file = ba_options.point_file.empty() ? ba_options.input + ".balp"
+                                                                     : ba_options.point_file;
+        if (!WritePointFile(bal_problem, point_file) ||
+            !SolveBAOutOfCore(point_file, ba_options, profiling ? &stats : NULL) ||
+            !ReadPointFileParameters(point_file, &bal_problem)) {
+            return 1;
+        }
+    } else if (ba_options.components) {
+        SolveBAComponents(bal_problem, ba_options, SolveBANative, profiling ? &stats : NULL);
+    } else if (!SolveBANative(bal_problem, ba_options, profiling ? &stats : NULL)) {
+        return 1;
+    }
+    Profiler::Get().AddSolveStats(stats);
+    bal_problem.RestoreOriginalOrder();
+    std::cout << "final RMS reprojection error: " << RMSReprojectionError(bal_problem) << std::endl;
+    if (ba_options.covariance && !SaveCovariance(bal_problem, ba_options)) {
+        return 1;
+    }
+    if (!ba_options.final_ply.empty()) {
+        WriteToPLYFileAsync(bal_problem, ba_options.final_ply, ba_options.binary_ply, output_writer);
+    }
+    if (HasSuffix(ba_options.output, ".balb")) {
+        bal_problem.WriteToBinaryFile(ba_options.output);
+    } else if (!ba_options.output.empty()) {
+        bal_problem.WriteToFile(ba_options.output, ba_options.num_threads);
+    }
+    writer.Wait(); // the PLY files are in the report
+    if (!ba_options.profile.empty()) {
+        Profiler::Get().WriteReport(ba_options.profile);
+    }
+    if (!ba_options.trace.empty()) {
+        Profiler::Get().WriteTrace(ba_options.trace);
+    }
+
+    return 0;
+}
@@ -4,14 +4,22 @@
 #define COMMON_H
 
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 #include <Eigen/Core>
 #include <Eigen/Dense>
 
 #include "common.h"
+#include "bal_io.h"
+#include "bal_stream.h"
+#include "bal_writer.h"
+#include "parallel.h"
+#include "profiler.h"
 #include "rotation.h"
 #include "random.h"
 
@@ -21,27 +29,70 @@ typedef Eigen::Map<const Eigen::VectorXd> ConstVectorRef;
 // read file from BAL dataset
 class BALProblem {
 public:
-    // load bal data from text file
+    // load bal data from text file, or from binary file if it ends with .balb
     explicit BALProblem(const std::string &filename, bool use_quaternions = false);
 
+    /**
+     * Copy of the given observations of problem, with only the given cameras
+     * and points: every observation has to be of one of them. cameras and
+     * points are sorted, camera cameras[k] is camera k of the copy.
+     */
+    BALProblem(const BALProblem &problem, const std::vector<int> &observations,
+               const std::vector<int> &cameras, const std::vector<int> &points);
+
     ~BALProblem() {
-        delete[] point_index_;
-        delete[] camera_index_;
-        delete[] observations_;
-        delete[] parameters_;
+        FreeArray(point_index_);
+        FreeArray(camera_index_);
+        FreeArray(observations_);
+        FreeArray(parameters_);
     }
 
-    // save results to text file
-    void WriteToFile(const std::string &filename) const;
+    // save results to text file, formatted on num_threads threads
+    void WriteToFile(const std::string &filename, int num_threads = DefaultNumThreads()) const;
+
+    // save results to binary .balb file, which loads much faster than text
+    void WriteToBinaryFile(const std::string &filename) const;
 
-    // save results to ply pointcloud
-    void WriteToPLYFile(const std::string &filename) const;
+    // save results to ply pointcloud, binary_little_endian or ASCII
+    void WriteToPLYFile(const std::string &filename, bool binary = false) const;
 
-    void Normalize();
+    // camera centers and points, what the PLY file shows
+    void ToPointCloud(PointCloud *cloud) const;
 
+    // center the points on their median and scale their median absolute deviation to 100, on num_threads threads
+    void Normalize(int num_threads = DefaultNumThreads());
+
+    /**
+     * Add normal noise, drawn from the Philox streams of seed: the result only
+     * depends on seed, not on num_threads.
+     */
     void Perturb(const double rotation_sigma,
             const double translation_sigma,
-            const double point_sigma);
+            const double point_sigma,
+            unsigned seed = 1,
+            int num_threads = DefaultNumThreads());
+
+    /**
+     * Sort the observations by camera and renumber the points in the order they
+     * are first observed, so that loops over the observations walk the camera and
+     * point blocks of parameters_ (almost) sequentially.
+     * The permutation is kept, see RestoreOriginalOrder().
+     */
+    void Reorder();
+
+    // undo Reorder(), observations and points are in file order again
+    void RestoreOriginalOrder();
+
+    bool reordered() const {  return !observation_permutation_.empty();  }
+
+    // index in the input file of observation i / point j
+    int original_observation_index(int i) const {
+        return reordered() ? observation_permutation_[i] : i;
+    }
+
+    int original_point_index(int j) const {
+        return reordered() ? point_permutation_[j] : j;
+    }
 
     /**
      * 10: R = [q_0, q_1, q_2, q_3]
@@ -94,6 +145,18 @@ public:
 
 
 private:
+    bool LoadTextFile(const std::string &filename);
+
+    bool ParseText(BALTextScanner *scanner, const std::string &filename);
+
+    bool LoadBinaryFile(const std::string &filename);
+
+    // arrays either come from new[] or point into mapping_
+    template<typename T>
+    void FreeArray(T *array) {
+        if (!mapping_.contains(array)) delete[] array;
+    }
+
     void CameraToAngleAxisAndCenter(const double *camera,
             double *angle_axis,
             double *center) const;
@@ -113,20 +176,12 @@ private:
     double *observations_;
     double *parameters_;
 
-};
-
-template<typename T>
-void FscanfOrDie(FILE *fptr, const char *format, T *value) {
-    int num_scanned = fscanf(fptr, format, value);
-    if (num_scanned != 1)
-        std::cerr << "Invalid UW data file. ";
-}
+    MappedFile mapping_; // backing storage of a .balb file
 
-void PerturbPoint3(const double sigma, double *point) {
-    for (int i = 0; i < 3; ++i) {
-        point[i] += RandNormal() * sigma;
-    }
-}
+    // current index -> index in file order, empty unless reordered
+    std::vector<int> observation_permutation_;
+    std::vector<int> point_permutation_;
+};
 
 double Median(std::vector<double> *data) {
     int n = data->size();
@@ -135,14 +190,180 @@ double Median(std::vector<double> *data) {
     return *mid_point;
 }
 
-BALProblem::BALProblem(const std::string &filename, bool use_quaternion) {
-    FILE *fptr = fopen(filename.c_str(), "r");
+/**
+ * The same element as Median(&data), but data is not reordered and the work is
+ * parallel: a histogram of 4096 buckets between min and max finds the bucket
+ * of the median, and only the values of that bucket go to nth_element.
+ * Blocks do not depend on the number of threads, the result is exact.
+ */
+double ParallelMedian(const std::vector<double> &data, ThreadPool *pool) {
+    const int n = data.size();
+    const int block_size = 1 << 16;
+    const int num_blocks = (n + block_size - 1) / block_size;
+    if (num_blocks <= 1 || pool->num_threads() == 1) {
+        std::vector<double> tmp(data);
+        return Median(&tmp);
+    }
 
-    if (fptr == NULL) {
-        std::cerr << "Error: unable to open file." << filename;
+    std::vector<double> block_min(num_blocks), block_max(num_blocks);
+    pool->ParallelFor(num_blocks, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b) {
+            const std::vector<double>::const_iterator first = data.begin() + b * block_size;
+            const std::vector<double>::const_iterator last = data.begin() + std::min(n, (b + 1) * block_size);
+            block_min[b] = *std::min_element(first, last);
+            block_max[b] = *std::max_element(first, last);
+        }
+    }, 1);
+    const double min = *std::min_element(block_min.begin(), block_min.end());
+    const double max = *std::max_element(block_max.begin(), block_max.end());
+    if (!(min < max)) return min;
+
+    const int num_buckets = 4096;
+    const double bucket_scale = num_buckets / (max - min);
+    auto bucket_of = [&](double x) {  return std::min(num_buckets - 1, static_cast<int>((x - min) * bucket_scale));  };
+    std::vector<int> counts(num_blocks * num_buckets, 0);
+    pool->ParallelFor(num_blocks, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b) {
+            int *block_counts = &counts[b * num_buckets];
+            for (int i = b * block_size; i < std::min(n, (b + 1) * block_size); ++i) {
+                ++block_counts[bucket_of(data[i])];
+            }
+        }
+    }, 1);
+
+    // the bucket holding rank n / 2, and the rank inside it
+    int rank = n / 2;
+    int bucket = 0;
+    for (;; ++bucket) {
+        int count = 0;
+        for (int b = 0; b < num_blocks; ++b) {
+            count += counts[b * num_buckets + bucket];
+        }
+        if (rank < count) break;
+        rank -= count;
+    }
+
+    std::vector<int> offsets(num_blocks + 1, 0);
+    for (int b = 0; b < num_blocks; ++b) {
+        offsets[b + 1] = offsets[b] + counts[b * num_buckets + bucket];
+    }
+    std::vector<double> candidates(offsets[num_blocks]);
+    pool->ParallelFor(num_blocks, [&](int begin, int end) {
+        for (int b = begin; b < end; ++b) {
+            int next = offsets[b];
+            for (int i = b * block_size; i < std::min(n, (b + 1) * block_size); ++i) {
+                if (bucket_of(data[i]) == bucket) candidates[next++] = data[i];
+            }
+        }
+    }, 1);
+    std::nth_element(candidates.begin(), candidates.begin() + rank, candidates.end());
+    return candidates[rank];
+}
+
+BALProblem::BALProblem(const std::string &filename, bool use_quaternion)
+        : num_cameras_(0), num_points_(0), num_observations_(0), num_parameters_(0),
+          use_quaternions_(false),
+          point_index_(NULL), camera_index_(NULL), observations_(NULL), parameters_(NULL) {
+    ScopedTimer timer("load");
+    bool loaded = HasSuffix(filename, ".balb") ? LoadBinaryFile(filename)
+                                               : LoadTextFile(filename);
+    if (!loaded) {
+        FreeArray(point_index_);
+        FreeArray(camera_index_);
+        FreeArray(observations_);
+        FreeArray(parameters_);
+        point_index_ = camera_index_ = NULL;
+        observations_ = parameters_ = NULL;
+        num_cameras_ = num_points_ = num_observations_ = num_parameters_ = 0;
+        mapping_.Unmap();
         return;
-    };
+    }
 
+    use_quaternions_ = use_quaternion;
+    if (use_quaternion) {
+        // Switch the angle-axis rotations to quaternions
+        num_parameters_ = 10 * num_cameras_ + 3 * num_points_;
+        double *quaternion_parameters = new double[num_parameters_];
+        double *original_cursor = parameters_; // the first line of angle-axis
+        double *quaternion_cursor = quaternion_parameters;
+        for (int i = 0; i < num_cameras_; ++i) {
+            AngleAxisToQuaternion(original_cursor, quaternion_cursor);
+            quaternion_cursor += 4;
+            original_cursor += 3;
+
+            // t(3), f, k1, k2
+            for (int j = 0; j < 6; ++j) {
+                *quaternion_cursor++ = *original_cursor++;
+            }
+        }
+        // Copy the rest of points
+        for (int i = 0; i < 3 * num_points_; ++i) {
+            *quaternion_cursor++ = *original_cursor++;
+        }
+
+        // Swap in the quaternion parameters
+        FreeArray(parameters_);
+        parameters_ = quaternion_parameters;
+    }
+}
+
+BALProblem::BALProblem(const BALProblem &problem, const std::vector<int> &observations,
+                       const std::vector<int> &cameras, const std::vector<int> &points)
+        : num_cameras_(cameras.size()), num_points_(points.size()), num_observations_(observations.size()),
+          num_parameters_(0), use_quaternions_(problem.use_quaternions_) {
+    const int camera_size = camera_block_size();
+    num_parameters_ = camera_size * num_cameras_ + 3 * num_points_;
+    point_index_ = new int[num_observations_];
+    camera_index_ = new int[num_observations_];
+    observations_ = new double[2 * num_observations_];
+    parameters_ = new double[num_parameters_];
+    for (int i = 0; i < num_observations_; ++i) {
+        const int o = observations[i];
+        camera_index_[i] = std::lower_bound(cameras.begin(), cameras.end(), problem.camera_index_[o]) - cameras.begin();
+        point_index_[i] = std::lower_bound(points.begin(), points.end(), problem.point_index_[o]) - points.begin();
+        observations_[2 * i + 0] = problem.observations_[2 * o + 0];
+        observations_[2 * i + 1] = problem.observations_[2 * o + 1];
+    }
+    for (int k = 0; k < num_cameras_; ++k) {
+        std::copy(problem.cameras() + camera_size * cameras[k], problem.cameras() + camera_size * (cameras[k] + 1),
+                  mutable_cameras() + camera_size * k);
+    }
+    for (int k = 0; k < num_points_; ++k) {
+        std::copy(problem.points() + 3 * points[k], problem.points() + 3 * (points[k] + 1), mutable_points() + 3 * k);
+    }
+}
+
+bool BALProblem::LoadTextFile(const std::string &filename) {
+    // compressed files are decoded on a background thread while being parsed
+    if (IsCompressedBALFile(filename)) {
+        std::unique_ptr<ByteSource> decoder(OpenCompressedSource(filename));
+        if (!decoder) {
+            return false;
+        }
+        PrefetchSource prefetch(decoder.get());
+        BALTextScanner scanner(&prefetch);
+        return ParseText(&scanner, filename);
+    }
+
+    // parse straight from the page cache, fall back to reading pipes etc. into memory
+    MappedFile file;
+    std::vector<char> buffer;
+    const char *begin, *end;
+    if (file.Map(filename)) {
+        begin = file.data();
+        end = file.data() + file.size();
+    } else if (ReadWholeFile(filename, &buffer)) {
+        begin = buffer.data();
+        end = buffer.data() + buffer.size();
+    } else {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return false;
+    }
+    BALTextScanner scanner(begin, end);
+    return ParseText(&scanner, filename);
+}
+
+bool BALProblem::ParseText(BALTextScanner *scanner, const std::string &filename) {
     /**
      * https://grail.cs.washington.edu/projects/bal/
      *
@@ -183,10 +404,11 @@ BALProblem::BALProblem(const std::string &filename, bool use_quaternion) {
      * Where, there camera and point indices start from 0. Each camera is a set of
      * 9 parameters - R,t,f,k1 and k2. The rotation R is specified as a Rodrigues' vector.
      */
-
-    // This will die horribly on invalid files. Them's the breaks.
-    FscanfOrDie(fptr, "%d", &num_cameras_); // 16 cameras, index
-    FscanfOrDie(fptr, "%d", &num_points_); // 22106 points, index
+    if (!scanner->ReadInt(&num_cameras_) || // 16 cameras, index
+        !scanner->ReadInt(&num_points_)) { // 22106 points, index
+        std::cerr << "Invalid UW data file. " << filename << std::endl;
+        return false;
+    }
     /**
      * There are totally 83718 observed point coordinates for each camera as the ground truth, z[x_1, y_1].
      * e.g.
@@ -219,7 +441,11 @@ BALProblem::BALProblem(const std::string &filename, bool use_quaternion) {
      * they are different in different camera.
      *
      */
-    FscanfOrDie(fptr, "%d", &num_observations_);
+    if (!scanner->ReadInt(&num_observations_) ||
+        num_cameras_ < 0 || num_points_ < 0 || num_observations_ < 0) {
+        std::cerr << "Invalid UW data file. " << filename << std::endl;
+        return false;
+    }
 
     std::cout << "Header: " << num_cameras_
               << " " << num_points_
@@ -235,147 +461,178 @@ BALProblem::BALProblem(const std::string &filename, bool use_quaternion) {
     num_parameters_ = 9 * num_cameras_ + 3 * num_points_;
     parameters_ = new double[num_parameters_];
 
-    // If the data is read previously, it will never read this time,
-    // so it will skip the first line.
     // [camera_i, point_, z_ij_x, z_ij_y]
-    for (int i = 0; i < num_observations_; ++i) {
-        FscanfOrDie(fptr, "%d", camera_index_ + i);
-        FscanfOrDie(fptr, "%d", point_index_ + i);
-        for (int j = 0; j < 2; ++j) {
-            FscanfOrDie(fptr, "%lf", observations_ + 2 * i + j);
-        }
+    bool ok = true;
+    for (int i = 0; ok && i < num_observations_; ++i) {
+        ok = scanner->ReadInt(camera_index_ + i) &&
+             scanner->ReadInt(point_index_ + i) &&
+             scanner->ReadDouble(observations_ + 2 * i + 0) &&
+             scanner->ReadDouble(observations_ + 2 * i + 1);
     }
 
     // optimizing variables
-    for (int k = 0; k < num_parameters_; ++k) {
-        FscanfOrDie(fptr, "%lf", parameters_ + k);
+    for (int k = 0; ok && k < num_parameters_; ++k) {
+        ok = scanner->ReadDouble(parameters_ + k);
     }
 
-    fclose(fptr);
+    if (!ok || scanner->failed()) {
+        std::cerr << "Invalid UW data file. " << filename << std::endl;
+        return false;
+    }
+    return true;
+}
 
-    use_quaternions_ = use_quaternion;
-    if (use_quaternion) {
-        // Switch the angle-axis rotations to quaternions
-        num_parameters_ = 10 * num_cameras_ + 3 * num_points_;
-        double *quaternion_parameters = new double[num_parameters_];
-        double *original_cursor = parameters_; // the first line of angle-axis
-        double *quaternion_cursor = quaternion_parameters;
-        for (int i = 0; i < num_cameras_; ++i) {
-            AngleAxisToQuaternion(original_cursor, quaternion_cursor);
-            quaternion_cursor += 4;
-            original_cursor += 3;
+bool BALProblem::LoadBinaryFile(const std::string &filename) {
+    if (!mapping_.Map(filename)) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return false;
+    }
 
-            for (int j = 0; j < 10; ++j) {
-                *quaternion_cursor++ = *original_cursor++;
-            }
-        }
-        // Copy the rest of points
-        for (int i = 0; i < 3 * num_points_; ++i) {
-            *quaternion_cursor++ = *original_cursor++;
-        }
+    BALBinaryHeader header;
+    if (mapping_.size() < sizeof(header)) {
+        std::cerr << "Invalid BAL binary file. " << filename << std::endl;
+        return false;
+    }
+    memcpy(&header, mapping_.data(), sizeof(header));
+    if (memcmp(header.magic, kBALBinaryMagic, 4) != 0 || header.version != kBALBinaryVersion ||
+        header.num_cameras < 0 || header.num_points < 0 || header.num_observations < 0 ||
+        header.num_parameters != 9 * header.num_cameras + 3 * header.num_points) {
+        std::cerr << "Invalid BAL binary file. " << filename << std::endl;
+        return false;
+    }
 
-        // Swap in the quaternion parameters
-        delete[] parameters_;
-        parameters_ = quaternion_parameters;
+    const BALBinaryLayout layout(header);
+    if (mapping_.size() < layout.total_size) {
+        std::cerr << "Truncated BAL binary file. " << filename << std::endl;
+        return false;
     }
+
+    num_cameras_ = header.num_cameras;
+    num_points_ = header.num_points;
+    num_observations_ = header.num_observations;
+    num_parameters_ = header.num_parameters;
+    std::cout << "Header: " << num_cameras_
+              << " " << num_points_
+              << " " << num_observations_ << std::endl;
+
+    // zero copy, the arrays live in the (copy-on-write) mapping
+    char *base = mapping_.data();
+    camera_index_ = reinterpret_cast<int *>(base + layout.camera_index);
+    point_index_ = reinterpret_cast<int *>(base + layout.point_index);
+    observations_ = reinterpret_cast<double *>(base + layout.observations);
+    parameters_ = reinterpret_cast<double *>(base + layout.parameters);
+    return true;
 }
 
-void BALProblem::WriteToFile(const std::string &filename) const {
+void BALProblem::WriteToFile(const std::string &filename, int num_threads) const {
+    ScopedTimer timer("write bal");
     FILE *fptr = fopen(filename.c_str(), "w");
 
     if (fptr == NULL) {
-        std::cerr << "Error: unable to open file " << filename;
+        std::cerr << "Error: unable to open file " << filename << std::endl;
         return;
     }
 
-    fprintf(fptr, "%d %d %d %d\n", num_cameras_, num_cameras_, num_points_, num_observations_);
-
-    for (int i = 0; i < num_observations_; ++i) {
-        fprintf(fptr, "%d %d", camera_index_[i], point_index_[i]);
-        for (int j = 0; j < 2; ++j) {
-            fprintf(fptr, " %g", observations_[2 * i + j]);
-        }
-        fprintf(fptr, "\n");
-    }
-
-    for (int i = 0; i < num_cameras_; ++i) {
+    ThreadPool pool(num_threads);
+    bool ok = fprintf(fptr, "%d %d %d\n", num_cameras_, num_points_, num_observations_) > 0;
+    ok = ok && WriteFormattedParallel(fptr, num_observations_, [this](int i, std::string *text) {
+        AppendFormatted(text, "%d %d %g %g\n", camera_index_[i], point_index_[i],
+                        observations_[2 * i + 0], observations_[2 * i + 1]);
+    }, &pool);
+    ok = ok && WriteFormattedParallel(fptr, num_cameras_, [this](int i, std::string *text) {
         double angleaxis[9];
         if (use_quaternions_) {
             // Output in angle-axis format.
             QuaternionToAngleAxis(parameters_ + 10 * i, angleaxis);
-            memcpy(angleaxis + 3, parameters_ + 10 * i + 4, 6 * sizeof(double ));
+            memcpy(angleaxis + 3, parameters_ + 10 * i + 4, 6 * sizeof(double));
         } else {
             memcpy(angleaxis, parameters_ + 9 * i, 9 * sizeof(double));
         }
-        for (int j = 0; j < 9; ++i) {
-            fprintf(fptr, "%.16g\n", angleaxis[j]);
+        for (int j = 0; j < 9; ++j) {
+            AppendFormatted(text, "%.16g\n", angleaxis[j]);
+        }
+    }, &pool);
+    const double *points = parameters_ + camera_block_size() * num_cameras_;
+    ok = ok && WriteFormattedParallel(fptr, num_points_, [points](int i, std::string *text) {
+        for (int j = 0; j < 3; ++j) {
+            AppendFormatted(text, "%.16g\n", points[3 * i + j]);
         }
+    }, &pool);
+    ok = fclose(fptr) == 0 && ok;
+    if (!ok) {
+        std::cerr << "Error: unable to write " << filename << std::endl;
     }
+}
 
-    const double *points = parameters_ + camera_block_size() * num_cameras_;
-    for (int i = 0; i < num_points(); ++i) {
-        const double *point = points + i * point_block_size();
-        for (int j = 0; j < point_block_size(); ++j) {
-            fprintf(fptr, "%.16g\n", point[j]);
+void BALProblem::WriteToBinaryFile(const std::string &filename) const {
+    ScopedTimer timer("write balb");
+    FILE *fptr = fopen(filename.c_str(), "wb");
+
+    if (fptr == NULL) {
+        std::cerr << "Error: unable to open file " << filename << std::endl;
+        return;
+    }
+
+    BALBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kBALBinaryMagic, 4);
+    header.version = kBALBinaryVersion;
+    header.num_cameras = num_cameras_;
+    header.num_points = num_points_;
+    header.num_observations = num_observations_;
+    header.num_parameters = 9 * num_cameras_ + 3 * num_points_;
+    const BALBinaryLayout layout(header);
+
+    const size_t n = static_cast<size_t>(num_observations_);
+    const size_t padding_size = layout.observations - (layout.point_index + n * sizeof(int));
+    const char padding[8] = {0};
+    bool ok = fwrite(&header, sizeof(header), 1, fptr) == 1 &&
+              fwrite(camera_index_, sizeof(int), n, fptr) == n &&
+              fwrite(point_index_, sizeof(int), n, fptr) == n &&
+              fwrite(padding, 1, padding_size, fptr) == padding_size &&
+              fwrite(observations_, sizeof(double), 2 * n, fptr) == 2 * n;
+
+    // always stored in angle-axis format, as the text file
+    if (use_quaternions_) {
+        for (int i = 0; ok && i < num_cameras_; ++i) {
+            double angleaxis[9];
+            QuaternionToAngleAxis(parameters_ + 10 * i, angleaxis);
+            memcpy(angleaxis + 3, parameters_ + 10 * i + 4, 6 * sizeof(double));
+            ok = fwrite(angleaxis, sizeof(double), 9, fptr) == 9;
         }
+    } else {
+        ok = ok && fwrite(parameters_, sizeof(double), 9 * static_cast<size_t>(num_cameras_), fptr) ==
+                   9 * static_cast<size_t>(num_cameras_);
+    }
+    ok = ok && fwrite(points(), sizeof(double), 3 * static_cast<size_t>(num_points_), fptr) ==
+               3 * static_cast<size_t>(num_points_);
+    ok = fclose(fptr) == 0 && ok;
+    if (!ok) {
+        std::cerr << "Error: unable to write " << filename << std::endl;
     }
-    fclose(fptr);
 }
 
 // Write the problem to a PLY file for inspection in Meshlab or CloudCompare
-void BALProblem::WriteToPLYFile(const std::string &filename) const {
-    std::ofstream of(filename.c_str(), std::ofstream::out);
-
-    of << "ply"
-       << '\n' << "format ascii 1.0"
-       << '\n' << "element vertex " << num_cameras_ + num_points_ // 16 + 22106
-       << '\n' << "property float x"
-       << '\n' << "property float y"
-       << '\n' << "property float z"
-       << '\n' << "property uchar red"
-       << '\n' << "property uchar green"
-       << '\n' << "property uchar blue"
-       << '\n' << "end_header"
-       << std::endl;
+void BALProblem::WriteToPLYFile(const std::string &filename, bool binary) const {
+    ScopedTimer timer("write ply");
+    PointCloud cloud;
+    ToPointCloud(&cloud);
+    WritePLYFile(filename, cloud, binary);
+}
 
-    /**
-     * Export extrinsic data (i.e. camera centers in global coordinate) as green (0, 255, 0) points
-     * 16 lines/cameras
-     * -21.5216 -0.397644 169.909 0 255 0
-     * -7.25499 0.560957 168.728 0 255 0
-     * -81.9097 -37.8807 150.347 0 255 0
-     * -93.391 -39.4746 153.356 0 255 0
-     * -41.1762 -10.3846 162.287 0 255 0
-     * ...
-     */
+/**
+ * Extrinsic data (i.e. camera centers in global coordinate), shown as green
+ * (0, 255, 0) points, and the structure (i.e. 3D Points in global coordinate)
+ * shown white.
+ */
+void BALProblem::ToPointCloud(PointCloud *cloud) const {
+    cloud->centers.resize(3 * num_cameras_);
     double angle_axis[3];
-    double center[3];
     for (int i = 0; i < num_cameras_; ++i) {
         const double *camera = cameras() + camera_block_size() * i;
-        CameraToAngleAxisAndCenter(camera, angle_axis, center);
-        of << center[0] << ' ' << center[1] << ' ' << center[2] << " 0 255 0" << '\n';
-    }
-
-    /**
-     * Export the structure (i.e. 3D Points in global coordinate) as white points.
-     * -67.5344 41.6483 -52.4505  255 255 255
-     * 24.4465 -12.7628 24.3263  255 255 255
-     * 60.0435 3.10939 -5.03598  255 255 255
-     * 60.3161 1.78752 -5.38407  255 255 255
-     * 58.0433 84.0872 -103.763  255 255 255
-     * -13.3213 -1.45887 31.9879  255 255 255
-     * 27.2705 40.5469 -89.6207  255 255 255
-     * ...
-     */
-    const double *points = parameters_ + camera_block_size() * num_cameras_; // 9 * 16 = 144
-    for (int i = 0; i < num_points(); ++i) {
-        const double *point = points + i * point_block_size();
-        for (int j = 0; j < point_block_size(); ++j) { // point_block_size = 3
-            of << point[j] << ' ';
-        }
-        of << " 255 255 255\n";
+        CameraToAngleAxisAndCenter(camera, angle_axis, &cloud->centers[3 * i]);
     }
-    of.close();
+    cloud->points.assign(points(), points() + 3 * num_points_);
 }
 
 void BALProblem::CameraToAngleAxisAndCenter(const double *camera,
@@ -425,7 +682,9 @@ void BALProblem::AngleAxisAndCenterToCamera(const double *angle_axis,
     VectorRef(camera + camera_block_size() - 6, 3) *= -1.0;
 }
 
-void BALProblem::Normalize() {
+void BALProblem::Normalize(int num_threads) {
+    ScopedTimer timer("normalize");
+    ThreadPool pool(num_threads);
     // compute the maginal median of the geometry
     std::vector<double> tmp(num_points_); // number of landmarks
     Eigen::Vector3d median;
@@ -433,74 +692,230 @@ void BALProblem::Normalize() {
     // for each column, [X, Y, Z]
     for (int i = 0; i < 3; ++i) {
         // read all data for each column
-        for (int j = 0; j < num_points_; ++j) {
-            tmp[j] = points[3 * j + i];
-        }
-        median(i) = Median(&tmp); // get median for each column
+        pool.ParallelFor(num_points_, [&](int begin, int end) {
+            for (int j = begin; j < end; ++j) {
+                tmp[j] = points[3 * j + i];
+            }
+        }, 4096);
+        median(i) = ParallelMedian(tmp, &pool); // get median for each column
     }
 
-    for (int i = 0; i < num_points_; ++i) {
-        VectorRef point(points + 3 * i, 3);
-        // sum all absolute value
-        tmp[i] = (point - median).lpNorm<1>();
-    }
+    pool.ParallelFor(num_points_, [&](int begin, int end) {
+        for (int j = begin; j < end; ++j) {
+            VectorRef point(points + 3 * j, 3);
+            // sum all absolute value
+            tmp[j] = (point - median).lpNorm<1>();
+        }
+    }, 4096);
 
-    const double median_absolute_deviation = Median(&tmp);
+    const double median_absolute_deviation = ParallelMedian(tmp, &pool);
 
     // Scale so that the median absolute deviation of
     // the resulting reconstruction is 100
     const double scale = 100.0 / median_absolute_deviation;
 
     // X = scale * (X - median)
-    for (int i = 0; i < num_points_; ++i) {
-        VectorRef point(points + 3 * i, 3);
-        point = scale * (point - median);
-    }
+    pool.ParallelFor(num_points_, [&](int begin, int end) {
+        for (int j = begin; j < end; ++j) {
+            VectorRef point(points + 3 * j, 3);
+            point = scale * (point - median);
+        }
+    }, 4096);
     // finishing the processing landmarks
 
     //
     double *cameras = mutable_cameras();
-    double angle_axis[3];
-    double center[3];
-    for (int i = 0; i < num_cameras_; ++i) {
-        double *camera = cameras + camera_block_size() * i;
-        CameraToAngleAxisAndCenter(camera, angle_axis, center);
-        // center = scale * (center - median)
-        VectorRef (center, 3) = scale * (VectorRef(center, 3) - median);
-        AngleAxisAndCenterToCamera(angle_axis, center, camera);
-    }
+    pool.ParallelFor(num_cameras_, [&](int begin, int end) {
+        double angle_axis[3];
+        double center[3];
+        for (int i = begin; i < end; ++i) {
+            double *camera = cameras + camera_block_size() * i;
+            CameraToAngleAxisAndCenter(camera, angle_axis, center);
+            // center = scale * (center - median)
+            VectorRef (center, 3) = scale * (VectorRef(center, 3) - median);
+            AngleAxisAndCenterToCamera(angle_axis, center, camera);
+        }
+    });
 }
 
 // add random noise for [rotation, translation, point]
 void BALProblem::Perturb(const double rotation_sigma,
                          const double translation_sigma,
-                         const double point_sigma) {
+                         const double point_sigma,
+                         unsigned seed,
+                         int num_threads) {
+    ScopedTimer timer("perturb");
     assert(point_sigma >= 0.0);
     assert(rotation_sigma >= 0.0);
     assert(translation_sigma >= 0.0);
+    ThreadPool pool(num_threads);
+    // one stream of normal numbers each, the noise of parameter k of point / camera i is number 3 * i + k
+    enum { kPointStream = 0, kRotationStream = 1, kTranslationStream = 2 };
 
     double *points = mutable_points();
     if (point_sigma > 0) {
-        for (int i = 0; i < num_points_; ++i) {
-            PerturbPoint3(point_sigma, points + 3 * i);
-        }
+        pool.ParallelFor(num_points_, [&](int begin, int end) {
+            std::vector<double> noise(3 * (end - begin));
+            CounterNormals(seed, kPointStream, 3 * static_cast<int64_t>(begin), noise.size(), noise.data());
+            VectorRef(points + 3 * begin, noise.size()) += point_sigma * VectorRef(noise.data(), noise.size());
+        }, 4096);
     }
 
-    for (int i = 0; i < num_cameras_; ++i) {
-        double *camera = mutable_cameras() + camera_block_size() * i;
+    pool.ParallelFor(num_cameras_, [&](int begin, int end) {
+        const int n = 3 * (end - begin);
+        std::vector<double> rotation_noise(n), translation_noise(n);
+        CounterNormals(seed, kRotationStream, 3 * begin, n, rotation_noise.data());
+        CounterNormals(seed, kTranslationStream, 3 * begin, n, translation_noise.data());
+        for (int i = begin; i < end; ++i) {
+            double *camera = mutable_cameras() + camera_block_size() * i;
+
+            double angle_axis[3];
+            double center[3];
+            // Perturb in the rotation of the camera in the angle-axis representation
+            CameraToAngleAxisAndCenter(camera, angle_axis, center);
+            if (rotation_sigma > 0.0) {
+                VectorRef(angle_axis, 3) += rotation_sigma * VectorRef(&rotation_noise[3 * (i - begin)], 3);
+            }
+            AngleAxisAndCenterToCamera(angle_axis, center, camera);
 
-        double angle_axis[3];
-        double center[3];
-        // Perturb in the rotation of the camera in the angle-axis representation
-        CameraToAngleAxisAndCenter(camera, angle_axis, center);
-        if (rotation_sigma > 0.0) {
-            PerturbPoint3(rotation_sigma, angle_axis);
+            if (translation_sigma > 0.0)
+                VectorRef(camera + camera_block_size() - 6, 3) +=
+                        translation_sigma * VectorRef(&translation_noise[3 * (i - begin)], 3);
+        }
+    });
+}
+
+void BALProblem::Reorder() {
+    ScopedTimer timer("reorder");
+    // counting sort of the observations by camera
+    std::vector<int> offsets(num_cameras_ + 1, 0);
+    for (int i = 0; i < num_observations_; ++i) {
+        ++offsets[camera_index_[i] + 1];
+    }
+    for (int c = 0; c < num_cameras_; ++c) {
+        offsets[c + 1] += offsets[c];
+    }
+    std::vector<int> order(num_observations_);
+    {
+        std::vector<int> next(offsets.begin(), offsets.end() - 1);
+        for (int i = 0; i < num_observations_; ++i) {
+            order[next[camera_index_[i]]++] = i;
         }
-        AngleAxisAndCenterToCamera(angle_axis, center, camera);
+    }
 
-        if (translation_sigma > 0.0)
-            PerturbPoint3(translation_sigma, camera + camera_block_size() - 6);
+    // renumber the points by first observing camera
+    std::vector<int> new_point(num_points_, -1);
+    std::vector<int> point_order;
+    point_order.reserve(num_points_);
+    for (int k = 0; k < num_observations_; ++k) {
+        int &p = new_point[point_index_[order[k]]];
+        if (p < 0) {
+            p = static_cast<int>(point_order.size());
+            point_order.push_back(point_index_[order[k]]);
+        }
+    }
+    // points which are never observed go last
+    for (int j = 0; j < num_points_; ++j) {
+        if (new_point[j] < 0) {
+            new_point[j] = static_cast<int>(point_order.size());
+            point_order.push_back(j);
+        }
+    }
+
+    // inside a camera, visit its points in increasing (new) order
+    for (int c = 0; c < num_cameras_; ++c) {
+        std::stable_sort(order.begin() + offsets[c], order.begin() + offsets[c + 1],
+                         [&](int a, int b) {
+                             return new_point[point_index_[a]] < new_point[point_index_[b]];
+                         });
+    }
+
+    int *camera_index = new int[num_observations_];
+    int *point_index = new int[num_observations_];
+    double *observations = new double[2 * num_observations_];
+    for (int k = 0; k < num_observations_; ++k) {
+        const int i = order[k];
+        camera_index[k] = camera_index_[i];
+        point_index[k] = new_point[point_index_[i]];
+        observations[2 * k + 0] = observations_[2 * i + 0];
+        observations[2 * k + 1] = observations_[2 * i + 1];
+    }
+    FreeArray(camera_index_);
+    FreeArray(point_index_);
+    FreeArray(observations_);
+    camera_index_ = camera_index;
+    point_index_ = point_index;
+    observations_ = observations;
+
+    double *points = mutable_points();
+    std::vector<double> old_points(points, points + 3 * num_points_);
+    for (int j = 0; j < num_points_; ++j) {
+        memcpy(points + 3 * j, &old_points[3 * point_order[j]], 3 * sizeof(double));
+    }
+
+    // compose with a previous reordering, so the permutations always refer to the file
+    std::vector<int> observation_permutation(num_observations_);
+    std::vector<int> point_permutation(num_points_);
+    for (int k = 0; k < num_observations_; ++k) {
+        observation_permutation[k] = original_observation_index(order[k]);
+    }
+    for (int j = 0; j < num_points_; ++j) {
+        point_permutation[j] = original_point_index(point_order[j]);
+    }
+    observation_permutation_.swap(observation_permutation);
+    point_permutation_.swap(point_permutation);
+}
+
+void BALProblem::RestoreOriginalOrder() {
+    if (!reordered()) {
+        return;
+    }
+    ScopedTimer timer("restore order");
+
+    int *camera_index = new int[num_observations_];
+    int *point_index = new int[num_observations_];
+    double *observations = new double[2 * num_observations_];
+    for (int k = 0; k < num_observations_; ++k) {
+        const int i = observation_permutation_[k];
+        camera_index[i] = camera_index_[k];
+        point_index[i] = point_permutation_[point_index_[k]];
+        observations[2 * i + 0] = observations_[2 * k + 0];
+        observations[2 * i + 1] = observations_[2 * k + 1];
+    }
+    FreeArray(camera_index_);
+    FreeArray(point_index_);
+    FreeArray(observations_);
+    camera_index_ = camera_index;
+    point_index_ = point_index;
+    observations_ = observations;
+
+    double *points = mutable_points();
+    std::vector<double> old_points(points, points + 3 * num_points_);
+    for (int j = 0; j < num_points_; ++j) {
+        memcpy(points + 3 * point_permutation_[j], &old_points[3 * j], 3 * sizeof(double));
+    }
+
+    observation_permutation_.clear();
+    point_permutation_.clear();
+}
+
+/**
+ * Write the PLY file of bal_problem as it is now on writer's thread, or right
+ * away when writer is NULL. The point cloud is copied, so the problem may
+ * change in the meantime.
+ */
+inline void WriteToPLYFileAsync(const BALProblem &bal_problem, const std::string &filename, bool binary,
+                                AsyncWriter *writer) {
+    if (writer == NULL) {
+        bal_problem.WriteToPLYFile(filename, binary);
+        return;
     }
+    std::shared_ptr<PointCloud> cloud(new PointCloud);
+    bal_problem.ToPointCloud(cloud.get());
+    writer->Submit([cloud, filename, binary] {
+        ScopedTimer timer("write ply");
+        WritePLYFile(filename, *cloud, binary);
+    });
 }
 
 #endif //COMMON_H
\ No newline at end of file
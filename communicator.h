@@ -0,0 +1,139 @@
+#ifndef COMMUNICATOR_H
+#define COMMUNICATOR_H
+
+// collective operations between the nodes of a distributed solve, in process (threads) or over MPI
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#ifdef BA_WITH_MPI
+#include <mpi.h>
+#endif
+
+/**
+ * The few collectives the ADMM solver needs. Every rank has to make the same
+ * calls in the same order.
+ */
+class Communicator {
+public:
+    virtual ~Communicator() {}
+
+    virtual int rank() const = 0;
+
+    virtual int size() const = 0;
+
+    // element wise sum of data[0, n) over all ranks, in place, every rank gets the result
+    virtual void AllReduceSum(double *data, int n) = 0;
+
+    virtual void Barrier() = 0;
+};
+
+/**
+ * Ranks which are threads of one process, for running the distributed
+ * solver on a single machine. The sums run in rank order, so the result is
+ * the same on every rank and in every run.
+ */
+class ThreadCommunicator : public Communicator {
+public:
+    /**
+     * Run f(communicator) on size threads, one rank each, and wait for all of
+     * them.
+     */
+    static void Run(int size, const std::function<void(Communicator *)> &f) {
+        std::shared_ptr<Shared> shared(new Shared(size));
+        std::vector<std::thread> threads;
+        for (int rank = 1; rank < size; ++rank) {
+            threads.push_back(std::thread([shared, rank, &f] {
+                ThreadCommunicator communicator(shared, rank);
+                f(&communicator);
+            }));
+        }
+        ThreadCommunicator communicator(shared, 0);
+        f(&communicator);
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i].join();
+        }
+    }
+
+    virtual int rank() const {  return rank_;  }
+
+    virtual int size() const {  return shared_->size;  }
+
+    virtual void AllReduceSum(double *data, int n) {
+        shared_->data[rank_] = data;
+        Barrier();
+        std::vector<double> sum(n, 0.0);
+        for (int r = 0; r < shared_->size; ++r) {
+            const double *other = shared_->data[r];
+            for (int i = 0; i < n; ++i) {
+                sum[i] += other[i];
+            }
+        }
+        // nobody may change its data before all ranks have read it
+        Barrier();
+        std::copy(sum.begin(), sum.end(), data);
+    }
+
+    virtual void Barrier() {
+        std::unique_lock<std::mutex> lock(shared_->mutex);
+        const long generation = shared_->generation;
+        if (++shared_->waiting == shared_->size) {
+            shared_->waiting = 0;
+            ++shared_->generation;
+            shared_->released.notify_all();
+        } else {
+            shared_->released.wait(lock, [&] {  return shared_->generation != generation;  });
+        }
+    }
+
+private:
+    struct Shared {
+        explicit Shared(int num_ranks) : size(num_ranks), waiting(0), generation(0), data(num_ranks) {}
+
+        const int size;
+        std::mutex mutex;
+        std::condition_variable released;
+        int waiting;
+        long generation;
+        std::vector<const double *> data; // buffers of the AllReduceSum in progress
+    };
+
+    ThreadCommunicator(const std::shared_ptr<Shared> &shared, int rank) : shared_(shared), rank_(rank) {}
+
+    std::shared_ptr<Shared> shared_;
+    int rank_;
+};
+
+#ifdef BA_WITH_MPI
+// one rank per MPI process, MPI_Init is up to the caller
+class MpiCommunicator : public Communicator {
+public:
+    explicit MpiCommunicator(MPI_Comm comm = MPI_COMM_WORLD) : comm_(comm) {
+        MPI_Comm_rank(comm_, &rank_);
+        MPI_Comm_size(comm_, &size_);
+    }
+
+    virtual int rank() const {  return rank_;  }
+
+    virtual int size() const {  return size_;  }
+
+    virtual void AllReduceSum(double *data, int n) {
+        MPI_Allreduce(MPI_IN_PLACE, data, n, MPI_DOUBLE, MPI_SUM, comm_);
+    }
+
+    virtual void Barrier() {
+        MPI_Barrier(comm_);
+    }
+
+private:
+    MPI_Comm comm_;
+    int rank_;
+    int size_;
+};
+#endif
+
+#endif // COMMUNICATOR_H
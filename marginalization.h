@@ -0,0 +1,104 @@
+#ifndef MARGINALIZATION_H
+#define MARGINALIZATION_H
+
+// Schur complement marginalization of parameter blocks into a linear prior, used by BASession
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <ceres/ceres.h>
+
+typedef Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMajorMatrix;
+
+/**
+ * Gaussian prior left behind by marginalized blocks, linearized at x0:
+ * r = r0 + J * (x - x0), over the concatenation x of its parameter blocks.
+ * The cost 0.5 * |r|^2 is the information the removed residuals had about
+ * the blocks which stay in the problem.
+ */
+class LinearPrior : public ceres::CostFunction {
+public:
+    LinearPrior(const std::vector<int> &block_sizes, const Eigen::VectorXd &x0,
+                const RowMajorMatrix &J, const Eigen::VectorXd &r0)
+            : x0_(x0), J_(J), r0_(r0) {
+        *mutable_parameter_block_sizes() = block_sizes;
+        set_num_residuals(static_cast<int>(r0.size()));
+    }
+
+    virtual bool Evaluate(double const *const *parameters, double *residuals, double **jacobians) const {
+        const std::vector<int> &block_sizes = parameter_block_sizes();
+        Eigen::Map<Eigen::VectorXd> r(residuals, num_residuals());
+        r = r0_;
+        int offset = 0;
+        for (size_t b = 0; b < block_sizes.size(); ++b) {
+            const int size = block_sizes[b];
+            const Eigen::Map<const Eigen::VectorXd> x(parameters[b], size);
+            r += J_.middleCols(offset, size) * (x - x0_.segment(offset, size));
+            if (jacobians != NULL && jacobians[b] != NULL) {
+                Eigen::Map<RowMajorMatrix>(jacobians[b], num_residuals(), size) = J_.middleCols(offset, size);
+            }
+            offset += size;
+        }
+        return true;
+    }
+
+private:
+    Eigen::VectorXd x0_;
+    RowMajorMatrix J_;
+    Eigen::VectorXd r0_;
+};
+
+/**
+ * Marginalize the first m variables out of the Gauss-Newton system H dx = -g
+ * and factorize the Schur complement as J^T J, J^T r0, so that it can be
+ * added to the problem as a LinearPrior over the remaining variables.
+ *
+ * H_kk' = H_kk - H_km H_mm^-1 H_mk,  g_k' = g_k - H_km H_mm^-1 g_m
+ *
+ * Both inverses are pseudo inverses, directions with an eigenvalue below
+ * epsilon (relative to the largest) carry no information, e.g. the gauge
+ * freedom. Returns false if nothing is left.
+ */
+inline bool MarginalizeLinearSystem(const Eigen::MatrixXd &H, const Eigen::VectorXd &g, int m,
+                                    RowMajorMatrix *J, Eigen::VectorXd *r0, double epsilon = 1e-8) {
+    const int k = static_cast<int>(H.rows()) - m;
+    if (k <= 0) return false;
+
+    Eigen::MatrixXd H_kk = H.bottomRightCorner(k, k);
+    Eigen::VectorXd g_k = g.tail(k);
+    if (m > 0) {
+        Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_mm(H.topLeftCorner(m, m));
+        const Eigen::VectorXd &lambda = eigen_mm.eigenvalues();
+        const double threshold = epsilon * std::max(lambda.cwiseAbs().maxCoeff(), 1.0);
+        const Eigen::VectorXd lambda_inv = (lambda.array() > threshold).select(lambda.cwiseInverse(), 0.0);
+        const Eigen::MatrixXd H_mm_inv = eigen_mm.eigenvectors() * lambda_inv.asDiagonal() *
+                                         eigen_mm.eigenvectors().transpose();
+        const Eigen::MatrixXd H_km = H.bottomLeftCorner(k, m);
+        H_kk -= H_km * H_mm_inv * H_km.transpose();
+        g_k -= H_km * H_mm_inv * g.head(m);
+    }
+
+    // H_kk = V S V^T = J^T J with J = S^1/2 V^T, and g_k = J^T r0
+    Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> eigen_kk(0.5 * (H_kk + H_kk.transpose()));
+    const Eigen::VectorXd &lambda = eigen_kk.eigenvalues();
+    const double threshold = epsilon * std::max(lambda.cwiseAbs().maxCoeff(), 1.0);
+    std::vector<int> kept;
+    for (int i = 0; i < k; ++i) {
+        if (lambda[i] > threshold) kept.push_back(i);
+    }
+    if (kept.empty()) return false;
+
+    J->resize(kept.size(), k);
+    r0->resize(kept.size());
+    for (size_t i = 0; i < kept.size(); ++i) {
+        const double sqrt_lambda = std::sqrt(lambda[kept[i]]);
+        const Eigen::VectorXd v = eigen_kk.eigenvectors().col(kept[i]);
+        J->row(i) = sqrt_lambda * v.transpose();
+        (*r0)[i] = v.dot(g_k) / sqrt_lambda;
+    }
+    return true;
+}
+
+#endif // MARGINALIZATION_H
@@ -0,0 +1,260 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+// minimal thread pool for data parallel loops over observations, edges and points,
+// and a work stealing pool for independent tasks (--manifest)
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+inline int DefaultNumThreads() {
+    const unsigned n = std::thread::hardware_concurrency();
+    return n == 0 ? 1 : static_cast<int>(n);
+}
+
+/**
+ * Fixed set of worker threads running one ParallelFor at a time.
+ *
+ * The calling thread takes part in the loop, so a pool of num_threads uses
+ * num_threads - 1 workers. The range is cut into small chunks which are
+ * handed out through an atomic counter, so uneven chunks balance out.
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(int num_threads = DefaultNumThreads())
+            : num_threads_(std::max(1, num_threads)), generation_(0), stop_(false),
+              busy_workers_(0) {
+        for (int i = 1; i < num_threads_; ++i) {
+            workers_.push_back(std::thread(&ThreadPool::WorkerLoop, this));
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        start_.notify_all();
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            workers_[i].join();
+        }
+    }
+
+    int num_threads() const {  return num_threads_;  }
+
+    // run f(begin, end) over disjoint sub ranges covering [0, n), blocks until done
+    void ParallelFor(int n, const std::function<void(int, int)> &f, int min_chunk = 64) {
+        if (n <= 0) return;
+        if (num_threads_ == 1 || n <= min_chunk) {
+            f(0, n);
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            task_ = &f;
+            size_ = n;
+            chunk_ = std::max(min_chunk, n / (8 * num_threads_) + 1);
+            next_ = 0;
+            busy_workers_ = static_cast<int>(workers_.size());
+            ++generation_;
+        }
+        start_.notify_all();
+
+        RunChunks(f);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] {  return busy_workers_ == 0;  });
+        task_ = NULL;
+    }
+
+private:
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator=(const ThreadPool &);
+
+    void RunChunks(const std::function<void(int, int)> &f) {
+        for (;;) {
+            const int begin = next_.fetch_add(chunk_);
+            if (begin >= size_) return;
+            f(begin, std::min(size_, begin + chunk_));
+        }
+    }
+
+    void WorkerLoop() {
+        long seen = 0;
+        for (;;) {
+            const std::function<void(int, int)> *task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                start_.wait(lock, [&] {  return stop_ || generation_ != seen;  });
+                if (stop_) return;
+                seen = generation_;
+                task = task_;
+            }
+            RunChunks(*task);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --busy_workers_;
+            }
+            done_.notify_one();
+        }
+    }
+
+    int num_threads_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    long generation_;
+    bool stop_;
+    int busy_workers_;
+
+    const std::function<void(int, int)> *task_ = NULL;
+    int size_ = 0;
+    int chunk_ = 1;
+    std::atomic<int> next_{0};
+};
+
+/**
+ * Worker threads running independent tasks, one deque of tasks per worker.
+ *
+ * A task submitted from a worker of the pool goes to the back of that
+ * worker's deque and is the next one it runs, so a continuation (solve after
+ * load, write after solve) stays on the thread whose caches hold its data.
+ * Idle workers steal from the front of the other deques, the oldest tasks.
+ * Other threads submit round robin. Unlike ThreadPool the calling thread does
+ * not take part, Wait() only blocks; it must not be called from a task.
+ */
+class WorkStealingPool {
+public:
+    typedef std::function<void()> Task;
+
+    explicit WorkStealingPool(int num_threads = DefaultNumThreads())
+            : queues_(std::max(1, num_threads)), stop_(false), queued_(0), unfinished_(0), next_queue_(0) {
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            workers_.push_back(std::thread(&WorkStealingPool::WorkerLoop, this, static_cast<int>(i)));
+        }
+    }
+
+    // finishes all tasks first
+    ~WorkStealingPool() {
+        Wait();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (size_t i = 0; i < workers_.size(); ++i) {
+            workers_[i].join();
+        }
+    }
+
+    int num_threads() const {  return static_cast<int>(queues_.size());  }
+
+    void Submit(Task task) {
+        const WorkerSlot &slot = CurrentWorker();
+        int queue = slot.index;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (slot.pool != this) queue = next_queue_++ % num_threads();
+            // counted before it can be popped, so the counts never go below the truth
+            ++queued_;
+            ++unfinished_;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues_[queue].mutex);
+            queues_[queue].tasks.push_back(std::move(task));
+        }
+        wake_.notify_one();
+    }
+
+    // blocks until every submitted task, and every task those submitted, has run
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_.wait(lock, [this] {  return unfinished_ == 0;  });
+    }
+
+private:
+    WorkStealingPool(const WorkStealingPool &);
+    WorkStealingPool &operator=(const WorkStealingPool &);
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    // the pool and index of the worker running on this thread, if any
+    struct WorkerSlot {
+        const WorkStealingPool *pool;
+        int index;
+    };
+
+    static WorkerSlot &CurrentWorker() {
+        static thread_local WorkerSlot slot = {NULL, -1};
+        return slot;
+    }
+
+    // the newest task of worker's own deque, else the oldest of another one
+    bool Pop(int worker, Task *task) {
+        for (int k = 0; k < num_threads(); ++k) {
+            Queue &queue = queues_[(worker + k) % num_threads()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty()) continue;
+            if (k == 0) {
+                *task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                *task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void WorkerLoop(int worker) {
+        CurrentWorker().pool = this;
+        CurrentWorker().index = worker;
+        for (;;) {
+            Task task;
+            if (!Pop(worker, &task)) {
+                // a task counted in queued_ may still be on its way into a deque, then look again
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [this] {  return stop_ || queued_ > 0;  });
+                if (stop_ && queued_ == 0) return;
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                --queued_;
+            }
+            task();
+            bool finished;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                finished = --unfinished_ == 0;
+            }
+            if (finished) done_.notify_all();
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    bool stop_;
+    int queued_; // tasks in the deques
+    int unfinished_; // tasks submitted and not finished
+    int next_queue_;
+};
+
+#endif // PARALLEL_H
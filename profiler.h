@@ -0,0 +1,300 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+// scoped phase timers and event counters, written as a JSON report and as a
+// Chrome trace (chrome://tracing, https://ui.perfetto.dev)
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "ba_stats.h"
+
+#if defined(BA_PROFILE_ALLOCATIONS) && defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+enum ProfileCounter {
+    kResidualEvaluations = 0,
+    kJacobianEvaluations,
+    kNumProfileCounters
+};
+
+static const char *const kProfileCounterNames[kNumProfileCounters] = {
+        "residual_evaluations",
+        "jacobian_evaluations"
+};
+
+// filled by the malloc family below when built with BA_PROFILE_ALLOCATIONS
+static std::atomic<long> profile_allocations(0);
+static std::atomic<long> profile_allocated_bytes(0);
+
+/**
+ * Process wide collection of phase times and counters.
+ *
+ * Counters are per thread, so counting from inside the residual and Jacobian
+ * loops of the solvers costs one thread local add. Timers are meant for coarse
+ * phases (load, setup, solve, ...) and go through a mutex. Nothing is recorded
+ * by the timers until Enable() is called.
+ */
+class Profiler {
+public:
+    static Profiler &Get() {
+        static Profiler profiler;
+        return profiler;
+    }
+
+    // call before starting threads, trace also keeps every timed interval
+    void Enable(bool trace) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        enabled_ = true;
+        trace_ = trace;
+        start_ = WallTimeInSeconds();
+    }
+
+    bool enabled() const {  return enabled_;  }
+
+    static void Count(ProfileCounter counter, long n = 1) {
+        std::atomic<long> &value = Local().values[counter];
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // sum over all threads, running and finished
+    long counter(ProfileCounter counter) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        long sum = retired_[counter];
+        for (size_t i = 0; i < threads_.size(); ++i) {
+            sum += threads_[i]->values[counter].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    // timed interval of the calling thread, see ScopedTimer
+    void Record(const char *name, double begin, double end) {
+        if (!enabled_) return;
+        const int thread_id = Local().id;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Accumulate(name, end - begin);
+        if (trace_) {
+            TraceEvent event = {name, thread_id, begin, end - begin};
+            events_.push_back(event);
+        }
+    }
+
+    // time measured elsewhere, e.g. the linear solver time reported by ceres / g2o
+    void AddTime(const char *name, double seconds) {
+        if (!enabled_) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        Accumulate(name, seconds);
+    }
+
+    void AddSolveStats(const SolveStats &stats) {
+        AddTime("residual evaluation", stats.residual_evaluation_time);
+        AddTime("jacobian evaluation", stats.jacobian_evaluation_time);
+        AddTime("linear solver", stats.linear_solver_time);
+    }
+
+    bool WriteReport(const std::string &filename) {
+        FILE *fptr = fopen(filename.c_str(), "w");
+        if (fptr == NULL) {
+            std::fprintf(stderr, "Error: unable to open file %s\n", filename.c_str());
+            return false;
+        }
+        long counters[kNumProfileCounters];
+        for (int c = 0; c < kNumProfileCounters; ++c) {
+            counters[c] = counter(static_cast<ProfileCounter>(c));
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        fprintf(fptr, "{\n  \"wall_time\": %.9g,\n  \"phases\": [", WallTimeInSeconds() - start_);
+        for (size_t i = 0; i < phases_.size(); ++i) {
+            const Phase &phase = phases_[i];
+            fprintf(fptr, "%s\n    {\"name\": \"%s\", \"count\": %ld, \"total\": %.9g, \"min\": %.9g, \"max\": %.9g}",
+                    i == 0 ? "" : ",", phase.name.c_str(), phase.count, phase.total, phase.min, phase.max);
+        }
+        fprintf(fptr, "\n  ],\n  \"counters\": {");
+        for (int c = 0; c < kNumProfileCounters; ++c) {
+            fprintf(fptr, "%s\"%s\": %ld", c == 0 ? "" : ", ", kProfileCounterNames[c], counters[c]);
+        }
+#if defined(BA_PROFILE_ALLOCATIONS) && defined(__GLIBC__)
+        fprintf(fptr, ", \"allocations\": %ld, \"allocated_bytes\": %ld",
+                profile_allocations.load(), profile_allocated_bytes.load());
+#endif
+        fprintf(fptr, "}\n}\n");
+        fclose(fptr);
+        return true;
+    }
+
+    // complete ("X") events in microseconds, one track per thread
+    bool WriteTrace(const std::string &filename) {
+        FILE *fptr = fopen(filename.c_str(), "w");
+        if (fptr == NULL) {
+            std::fprintf(stderr, "Error: unable to open file %s\n", filename.c_str());
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        fprintf(fptr, "{\"traceEvents\": [");
+        for (size_t i = 0; i < events_.size(); ++i) {
+            const TraceEvent &event = events_[i];
+            fprintf(fptr, "%s\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    i == 0 ? "" : ",", event.name, event.thread_id,
+                    (event.begin - start_) * 1e6, event.duration * 1e6);
+        }
+        fprintf(fptr, "\n], \"displayTimeUnit\": \"ms\"}\n");
+        fclose(fptr);
+        return true;
+    }
+
+private:
+    struct ThreadCounters {
+        ThreadCounters() {
+            for (int c = 0; c < kNumProfileCounters; ++c) values[c] = 0;
+            id = Get().Register(this);
+        }
+
+        ~ThreadCounters() {  Get().Unregister(this);  }
+
+        std::atomic<long> values[kNumProfileCounters];
+        int id;
+    };
+
+    struct Phase {
+        std::string name;
+        long count;
+        double total, min, max;
+    };
+
+    struct TraceEvent {
+        const char *name;
+        int thread_id;
+        double begin, duration;
+    };
+
+    Profiler() : enabled_(false), trace_(false), start_(WallTimeInSeconds()), next_thread_id_(0) {
+        for (int c = 0; c < kNumProfileCounters; ++c) retired_[c] = 0;
+    }
+
+    static ThreadCounters &Local() {
+        static thread_local ThreadCounters counters;
+        return counters;
+    }
+
+    int Register(ThreadCounters *counters) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads_.push_back(counters);
+        return next_thread_id_++;
+    }
+
+    // counts of finished threads (pool workers) are kept
+    void Unregister(ThreadCounters *counters) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (int c = 0; c < kNumProfileCounters; ++c) {
+            retired_[c] += counters->values[c].load(std::memory_order_relaxed);
+        }
+        threads_.erase(std::remove(threads_.begin(), threads_.end(), counters), threads_.end());
+    }
+
+    // phases are reported in the order they first ran
+    void Accumulate(const char *name, double seconds) {
+        for (size_t i = 0; i < phases_.size(); ++i) {
+            Phase &phase = phases_[i];
+            if (phase.name == name) {
+                ++phase.count;
+                phase.total += seconds;
+                phase.min = std::min(phase.min, seconds);
+                phase.max = std::max(phase.max, seconds);
+                return;
+            }
+        }
+        Phase phase = {name, 1, seconds, seconds, seconds};
+        phases_.push_back(phase);
+    }
+
+    std::mutex mutex_;
+    bool enabled_;
+    bool trace_;
+    double start_;
+    std::vector<Phase> phases_;
+    std::vector<TraceEvent> events_;
+
+    int next_thread_id_;
+    std::vector<ThreadCounters *> threads_;
+    long retired_[kNumProfileCounters];
+};
+
+// times the enclosing scope as phase name (a string literal)
+class ScopedTimer {
+public:
+    explicit ScopedTimer(const char *name)
+            : name_(name), active_(Profiler::Get().enabled()),
+              start_(active_ ? WallTimeInSeconds() : 0.0) {}
+
+    ~ScopedTimer() {
+        if (active_) Profiler::Get().Record(name_, start_, WallTimeInSeconds());
+    }
+
+private:
+    ScopedTimer(const ScopedTimer &);
+    ScopedTimer &operator=(const ScopedTimer &);
+
+    const char *name_;
+    bool active_;
+    double start_;
+};
+
+#if defined(BA_PROFILE_ALLOCATIONS) && defined(__GLIBC__)
+/**
+ * Counting wrappers of the glibc allocator. Overriding malloc rather than
+ * operator new also catches EIGEN_MAKE_ALIGNED_OPERATOR_NEW and the C
+ * allocations inside ceres / g2o / CSparse. Defined here like the rest of the
+ * header, so include it from one translation unit only.
+ */
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+inline void CountAllocation(size_t size) {
+    profile_allocations.fetch_add(1, std::memory_order_relaxed);
+    profile_allocated_bytes.fetch_add(static_cast<long>(size), std::memory_order_relaxed);
+}
+
+void *malloc(size_t size) {
+    CountAllocation(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    CountAllocation(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    CountAllocation(size);
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    CountAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    CountAllocation(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    CountAllocation(size);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr == NULL ? ENOMEM : 0;
+}
+}
+#endif // BA_PROFILE_ALLOCATIONS
+
+#endif // PROFILER_H
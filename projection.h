@@ -0,0 +1,322 @@
+#ifndef PROJECTION_H
+#define PROJECTION_H
+
+// closed form derivatives of the BAL camera model, see SnavelyReprojectionError.h
+
+#include "rotation.h"
+
+// arithmetic of residual and Jacobian evaluations, see --precision
+enum EvaluationPrecision {
+    kDoublePrecision = 0,
+    kMixedPrecision, // Jacobians in float, residuals in double
+    kSinglePrecision // both in float
+};
+
+/**
+ * Perspective division and radial distortion of a point in camera coordinates
+ * p  = -P / P.z
+ * p' = f * (1 + k1 * |p|^2 + k2 * |p|^4) * p
+ *
+ * P: point in camera coordinates
+ * intrinsics: [f, k1, k2]
+ * predictions: p'(2)
+ * J_P: 2x3 row major d(p') / d(P), may be NULL
+ * J_intrinsics: 2x3 row major d(p') / d(f, k1, k2), may be NULL
+ */
+template<typename T>
+BA_HOST_DEVICE inline void DistortedProjectionJacobian(const T *P,
+                                                       const T *intrinsics,
+                                                       T *predictions,
+                                                       T *J_P,
+                                                       T *J_intrinsics) {
+    const T inv_z = T(1.0) / P[2];
+    const T xp = -P[0] * inv_z;
+    const T yp = -P[1] * inv_z;
+
+    const T &focal = intrinsics[0];
+    const T &l1 = intrinsics[1];
+    const T &l2 = intrinsics[2];
+    const T r2 = xp * xp + yp * yp;
+    const T distortion = T(1.0) + r2 * (l1 + l2 * r2);
+
+    predictions[0] = focal * distortion * xp;
+    predictions[1] = focal * distortion * yp;
+
+    if (J_P != NULL) {
+        // d(p') / d(p), 2x2
+        const T dd_dr2 = l1 + T(2.0) * l2 * r2;
+        const T a00 = focal * (distortion + T(2.0) * xp * xp * dd_dr2);
+        const T a01 = focal * T(2.0) * xp * yp * dd_dr2;
+        const T a11 = focal * (distortion + T(2.0) * yp * yp * dd_dr2);
+
+        // d(p') / d(P) = d(p') / d(p) * d(p) / d(P)
+        // d(p) / d(P) = [-1/z,    0, -xp/z]
+        //               [   0, -1/z, -yp/z]
+        J_P[0] = -a00 * inv_z;
+        J_P[1] = -a01 * inv_z;
+        J_P[2] = -(a00 * xp + a01 * yp) * inv_z;
+        J_P[3] = -a01 * inv_z;
+        J_P[4] = -a11 * inv_z;
+        J_P[5] = -(a01 * xp + a11 * yp) * inv_z;
+    }
+
+    if (J_intrinsics != NULL) {
+        J_intrinsics[0] = distortion * xp;
+        J_intrinsics[1] = focal * r2 * xp;
+        J_intrinsics[2] = focal * r2 * r2 * xp;
+        J_intrinsics[3] = distortion * yp;
+        J_intrinsics[4] = focal * r2 * yp;
+        J_intrinsics[5] = focal * r2 * r2 * yp;
+    }
+}
+
+/**
+ * Projection with analytic Jacobians
+ *
+ * Same model as SnavelyReprojectionError::CamProjectionWithDistortion
+ * P  = R(w) * X + t
+ * p' = DistortedProjection(P)
+ *
+ * camera: [w(3), t(3), f, k1, k2]
+ * point: X(3)
+ * predictions: p'(2)
+ * J_camera: 2x9 row major d(p') / d(camera), may be NULL
+ * J_point: 2x3 row major d(p') / d(X), may be NULL
+ */
+template<typename T>
+BA_HOST_DEVICE inline void CamProjectionWithDistortionJacobian(const T *camera,
+                                                               const T *point,
+                                                               T *predictions,
+                                                               T *J_camera,
+                                                               T *J_point) {
+    T R[9];
+    AngleAxisToRotationMatrix(camera, R);
+
+    // P = RX + t, RX is kept for the rotation derivative below
+    const T RX[3] = {R[0] * point[0] + R[1] * point[1] + R[2] * point[2],
+                     R[3] * point[0] + R[4] * point[1] + R[5] * point[2],
+                     R[6] * point[0] + R[7] * point[1] + R[8] * point[2]};
+    const T P[3] = {RX[0] + camera[3], RX[1] + camera[4], RX[2] + camera[5]};
+
+    if (J_camera == NULL && J_point == NULL) {
+        DistortedProjectionJacobian(P, camera + 6, predictions, (T *) NULL, (T *) NULL);
+        return;
+    }
+
+    T JP[6];
+    T J_intrinsics[6];
+    DistortedProjectionJacobian(P, camera + 6, predictions, JP,
+                                J_camera != NULL ? J_intrinsics : (T *) NULL);
+
+    if (J_point != NULL) {
+        // d(P) / d(X) = R
+        for (int r = 0; r < 2; ++r) {
+            for (int c = 0; c < 3; ++c) {
+                J_point[3 * r + c] = JP[3 * r + 0] * R[c] +
+                                     JP[3 * r + 1] * R[3 + c] +
+                                     JP[3 * r + 2] * R[6 + c];
+            }
+        }
+    }
+
+    if (J_camera != NULL) {
+        // d(P) / d(w) = -hat(RX) J_l(w)
+        T Jl[9];
+        AngleAxisLeftJacobian(camera, Jl);
+        const T minus_hat[9] = {T(0.0), RX[2], -RX[1],
+                                -RX[2], T(0.0), RX[0],
+                                RX[1], -RX[0], T(0.0)};
+        T dP_dw[9];
+        for (int r = 0; r < 3; ++r) {
+            for (int c = 0; c < 3; ++c) {
+                dP_dw[3 * r + c] = minus_hat[3 * r + 0] * Jl[c] +
+                                   minus_hat[3 * r + 1] * Jl[3 + c] +
+                                   minus_hat[3 * r + 2] * Jl[6 + c];
+            }
+        }
+
+        for (int r = 0; r < 2; ++r) {
+            T *row = J_camera + 9 * r;
+            const T *jp = JP + 3 * r;
+            // rotation
+            for (int c = 0; c < 3; ++c) {
+                row[c] = jp[0] * dP_dw[c] + jp[1] * dP_dw[3 + c] + jp[2] * dP_dw[6 + c];
+            }
+            // translation, d(P) / d(t) = I
+            row[3] = jp[0];
+            row[4] = jp[1];
+            row[5] = jp[2];
+            // intrinsics
+            row[6] = J_intrinsics[3 * r + 0];
+            row[7] = J_intrinsics[3 * r + 1];
+            row[8] = J_intrinsics[3 * r + 2];
+        }
+    }
+}
+
+/**
+ * Projection with analytic Jacobians of a quaternion camera
+ *
+ * Same model with the rotation as a quaternion q = [w, v], normalized first
+ * (QuaternionRotatePoint), so R(q) costs no trigonometric functions.
+ * P  = R(q) * X + t
+ * p' = DistortedProjection(P)
+ *
+ * camera: [q(4), t(3), f, k1, k2]
+ * point: X(3)
+ * predictions: p'(2)
+ * J_camera: 2x10 row major d(p') / d(camera), may be NULL
+ * J_point: 2x3 row major d(p') / d(X), may be NULL
+ *
+ * J_camera is the derivative in the 10 parameters, the solver multiplies it
+ * with the Jacobian of its quaternion update (a manifold in ceres).
+ */
+template<typename T>
+BA_HOST_DEVICE inline void QuaternionCamProjectionWithDistortionJacobian(const T *camera,
+                                                                         const T *point,
+                                                                         T *predictions,
+                                                                         T *J_camera,
+                                                                         T *J_point) {
+    T R[9];
+    QuaternionToRotationMatrix(camera, R);
+
+    const T RX[3] = {R[0] * point[0] + R[1] * point[1] + R[2] * point[2],
+                     R[3] * point[0] + R[4] * point[1] + R[5] * point[2],
+                     R[6] * point[0] + R[7] * point[1] + R[8] * point[2]};
+    const T P[3] = {RX[0] + camera[4], RX[1] + camera[5], RX[2] + camera[6]};
+
+    if (J_camera == NULL && J_point == NULL) {
+        DistortedProjectionJacobian(P, camera + 7, predictions, (T *) NULL, (T *) NULL);
+        return;
+    }
+
+    T JP[6];
+    T J_intrinsics[6];
+    DistortedProjectionJacobian(P, camera + 7, predictions, JP,
+                                J_camera != NULL ? J_intrinsics : (T *) NULL);
+
+    if (J_point != NULL) {
+        // d(P) / d(X) = R
+        for (int r = 0; r < 2; ++r) {
+            for (int c = 0; c < 3; ++c) {
+                J_point[3 * r + c] = JP[3 * r + 0] * R[c] +
+                                     JP[3 * r + 1] * R[3 + c] +
+                                     JP[3 * r + 2] * R[6 + c];
+            }
+        }
+    }
+
+    if (J_camera != NULL) {
+        /**
+         * For a unit quaternion [w, v]
+         *   R X = X + 2 w (v x X) + 2 (v (v.X) - X |v|^2)
+         *   d(RX) / d(w) = 2 (v x X)
+         *   d(RX) / d(v) = 2 (-w hat(X) + (v.X) I + v X' - 2 X v')
+         * and the normalization q / |q| projects out the direction of q:
+         *   d(RX) / d(q) = d(RX) / d(q / |q|) (I - u u') / |q|,  u = q / |q|
+         */
+        const T inv_norm = T(1.0) / sqrt(camera[0] * camera[0] + camera[1] * camera[1] +
+                                         camera[2] * camera[2] + camera[3] * camera[3]);
+        const T u[4] = {camera[0] * inv_norm, camera[1] * inv_norm, camera[2] * inv_norm, camera[3] * inv_norm};
+        const T &w = u[0];
+        const T *v = u + 1;
+        const T vX = DotProduct(v, point);
+        T v_cross_X[3];
+        CrossProduct(v, point, v_cross_X);
+
+        // row major 3x4
+        T dP_du[12];
+        for (int r = 0; r < 3; ++r) {
+            dP_du[4 * r] = T(2.0) * v_cross_X[r];
+            for (int c = 0; c < 3; ++c) {
+                dP_du[4 * r + 1 + c] = T(2.0) * (v[r] * point[c] - T(2.0) * point[r] * v[c]);
+            }
+            dP_du[4 * r + 1 + r] += T(2.0) * vX;
+        }
+        // -w hat(X)
+        dP_du[4 * 0 + 2] += T(2.0) * w * point[2];
+        dP_du[4 * 0 + 3] -= T(2.0) * w * point[1];
+        dP_du[4 * 1 + 1] -= T(2.0) * w * point[2];
+        dP_du[4 * 1 + 3] += T(2.0) * w * point[0];
+        dP_du[4 * 2 + 1] += T(2.0) * w * point[1];
+        dP_du[4 * 2 + 2] -= T(2.0) * w * point[0];
+
+        T dP_dq[12];
+        for (int r = 0; r < 3; ++r) {
+            const T *row = dP_du + 4 * r;
+            const T radial = row[0] * u[0] + row[1] * u[1] + row[2] * u[2] + row[3] * u[3];
+            for (int c = 0; c < 4; ++c) {
+                dP_dq[4 * r + c] = (row[c] - radial * u[c]) * inv_norm;
+            }
+        }
+
+        for (int r = 0; r < 2; ++r) {
+            T *row = J_camera + 10 * r;
+            const T *jp = JP + 3 * r;
+            // rotation
+            for (int c = 0; c < 4; ++c) {
+                row[c] = jp[0] * dP_dq[c] + jp[1] * dP_dq[4 + c] + jp[2] * dP_dq[8 + c];
+            }
+            // translation, d(P) / d(t) = I
+            row[4] = jp[0];
+            row[5] = jp[1];
+            row[6] = jp[2];
+            // intrinsics
+            row[7] = J_intrinsics[3 * r + 0];
+            row[8] = J_intrinsics[3 * r + 1];
+            row[9] = J_intrinsics[3 * r + 2];
+        }
+    }
+}
+
+/**
+ * The projection with Jacobians of a camera block of kCameraSize
+ * parameters: 9 (angle-axis, CamProjectionWithDistortionJacobian) or 10
+ * (quaternion, QuaternionCamProjectionWithDistortionJacobian).
+ */
+template<int kCameraSize>
+struct CameraProjection;
+
+template<>
+struct CameraProjection<9> {
+    template<typename T>
+    BA_HOST_DEVICE static void Evaluate(const T *camera, const T *point, T *predictions, T *J_camera, T *J_point) {
+        CamProjectionWithDistortionJacobian(camera, point, predictions, J_camera, J_point);
+    }
+};
+
+template<>
+struct CameraProjection<10> {
+    template<typename T>
+    BA_HOST_DEVICE static void Evaluate(const T *camera, const T *point, T *predictions, T *J_camera, T *J_point) {
+        QuaternionCamProjectionWithDistortionJacobian(camera, point, predictions, J_camera, J_point);
+    }
+};
+
+/**
+ * CameraProjection<kCameraSize> evaluated in Scalar (float) on double
+ * parameters, the results are converted back to double.
+ */
+template<typename Scalar, int kCameraSize = 9>
+inline void CastCamProjectionWithDistortionJacobian(const double *camera,
+                                                    const double *point,
+                                                    double *predictions,
+                                                    double *J_camera,
+                                                    double *J_point) {
+    Scalar camera_s[kCameraSize], point_s[3], predictions_s[2], J_camera_s[2 * kCameraSize], J_point_s[6];
+    for (int i = 0; i < kCameraSize; ++i) camera_s[i] = static_cast<Scalar>(camera[i]);
+    for (int i = 0; i < 3; ++i) point_s[i] = static_cast<Scalar>(point[i]);
+    CameraProjection<kCameraSize>::Evaluate(camera_s, point_s, predictions_s,
+                                            J_camera != NULL ? J_camera_s : (Scalar *) NULL,
+                                            J_point != NULL ? J_point_s : (Scalar *) NULL);
+    predictions[0] = predictions_s[0];
+    predictions[1] = predictions_s[1];
+    if (J_camera != NULL) {
+        for (int i = 0; i < 2 * kCameraSize; ++i) J_camera[i] = J_camera_s[i];
+    }
+    if (J_point != NULL) {
+        for (int i = 0; i < 6; ++i) J_point[i] = J_point_s[i];
+    }
+}
+
+#endif // PROJECTION_H
@@ -0,0 +1,257 @@
+#ifndef PROJECTION_KERNEL_H
+#define PROJECTION_KERNEL_H
+
+// batched evaluation of the BAL camera model, many observations of one camera at once
+
+#include <cmath>
+#include <vector>
+#include <Eigen/Core>
+
+#include "common.h"
+#include "rotation.h"
+
+typedef Eigen::Map<Eigen::ArrayXd> ArrayRef;
+typedef Eigen::Map<const Eigen::ArrayXd> ConstArrayRef;
+
+/**
+ * Residuals of n observations of the same camera, structure of arrays.
+ *
+ * R is computed once by the caller, so everything left is element wise
+ * arithmetic on contiguous arrays, which Eigen maps to SSE/AVX/NEON packets
+ * (and AVX2/AVX-512 with BA_NATIVE_ARCH).
+ *
+ * R: row major rotation, t: translation, intrinsics: [f, k1, k2]
+ * X, Y, Z: points in world coordinates
+ * u, v: observations
+ * ru, rv: residuals, prediction - observation (as SnavelyReprojectionError)
+ */
+inline void ProjectBatch(const double *R, const double *t, const double *intrinsics,
+                         int n,
+                         const double *X, const double *Y, const double *Z,
+                         const double *u, const double *v,
+                         double *ru, double *rv) {
+    ConstArrayRef x(X, n), y(Y, n), z(Z, n);
+
+    // P = RX + t, p = -P / P.z
+    const Eigen::ArrayXd inv_z = -1.0 / (R[6] * x + R[7] * y + R[8] * z + t[2]);
+    const Eigen::ArrayXd xp = (R[0] * x + R[1] * y + R[2] * z + t[0]) * inv_z;
+    const Eigen::ArrayXd yp = (R[3] * x + R[4] * y + R[5] * z + t[1]) * inv_z;
+
+    // f * (1 + k1 * r^2 + k2 * r^4)
+    const Eigen::ArrayXd r2 = xp.square() + yp.square();
+    const Eigen::ArrayXd scale = intrinsics[0] * (1.0 + r2 * (intrinsics[1] + intrinsics[2] * r2));
+
+    ArrayRef(ru, n) = scale * xp - ConstArrayRef(u, n);
+    ArrayRef(rv, n) = scale * yp - ConstArrayRef(v, n);
+}
+
+// entries of the Jacobians of one observation in ProjectBatchJacobians: 2x9 camera, then 2x3 point, row major
+static const int kNumJacobianEntries = 24;
+
+/**
+ * ProjectBatch of angle-axis cameras with the analytic Jacobians of
+ * CamProjectionWithDistortionJacobian, structure of arrays: entry e of
+ * observation k is J[e * stride + k], the 2x9 camera block (angle axis, t,
+ * f, k1, k2) in entries 0-17 and the 2x3 point block in 18-23.
+ *
+ * Jl: row major left Jacobian of the rotation, d(RX) / d(w) = -hat(RX) Jl,
+ * computed once per camera with R.
+ */
+inline void ProjectBatchJacobians(const double *R, const double *Jl, const double *t, const double *intrinsics,
+                                  int n,
+                                  const double *X, const double *Y, const double *Z,
+                                  const double *u, const double *v,
+                                  double *ru, double *rv, double *J, int stride) {
+    ConstArrayRef x(X, n), y(Y, n), z(Z, n);
+    const double focal = intrinsics[0], l1 = intrinsics[1], l2 = intrinsics[2];
+
+    // RX, P = RX + t, p = -P / P.z
+    const Eigen::ArrayXd RX0 = R[0] * x + R[1] * y + R[2] * z;
+    const Eigen::ArrayXd RX1 = R[3] * x + R[4] * y + R[5] * z;
+    const Eigen::ArrayXd RX2 = R[6] * x + R[7] * y + R[8] * z;
+    const Eigen::ArrayXd inv_z = 1.0 / (RX2 + t[2]);
+    const Eigen::ArrayXd xp = -(RX0 + t[0]) * inv_z;
+    const Eigen::ArrayXd yp = -(RX1 + t[1]) * inv_z;
+    const Eigen::ArrayXd r2 = xp.square() + yp.square();
+    const Eigen::ArrayXd distortion = 1.0 + r2 * (l1 + l2 * r2);
+    ArrayRef(ru, n) = focal * distortion * xp - ConstArrayRef(u, n);
+    ArrayRef(rv, n) = focal * distortion * yp - ConstArrayRef(v, n);
+
+    // d(p') / d(P), as DistortedProjectionJacobian
+    const Eigen::ArrayXd dd_dr2 = l1 + 2.0 * l2 * r2;
+    const Eigen::ArrayXd a00 = focal * (distortion + 2.0 * xp.square() * dd_dr2);
+    const Eigen::ArrayXd a01 = 2.0 * focal * xp * yp * dd_dr2;
+    const Eigen::ArrayXd a11 = focal * (distortion + 2.0 * yp.square() * dd_dr2);
+    const Eigen::ArrayXd JP[2][3] = {{-a00 * inv_z, -a01 * inv_z, -(a00 * xp + a01 * yp) * inv_z},
+                                     {-a01 * inv_z, -a11 * inv_z, -(a01 * xp + a11 * yp) * inv_z}};
+
+    for (int r = 0; r < 2; ++r) {
+        const Eigen::ArrayXd &pr = r == 0 ? xp : yp;
+        double *row = J + 9 * r * stride;
+        for (int c = 0; c < 3; ++c) {
+            // rotation: JP (-hat(RX) Jl), column c
+            ArrayRef(row + c * stride, n) = JP[r][0] * (RX2 * Jl[3 + c] - RX1 * Jl[6 + c]) +
+                                            JP[r][1] * (RX0 * Jl[6 + c] - RX2 * Jl[c]) +
+                                            JP[r][2] * (RX1 * Jl[c] - RX0 * Jl[3 + c]);
+            // translation, d(P) / d(t) = I
+            ArrayRef(row + (3 + c) * stride, n) = JP[r][c];
+            // point, d(P) / d(X) = R
+            ArrayRef(J + (18 + 3 * r + c) * stride, n) = JP[r][0] * R[c] + JP[r][1] * R[3 + c] + JP[r][2] * R[6 + c];
+        }
+        ArrayRef(row + 6 * stride, n) = distortion * pr;
+        ArrayRef(row + 7 * stride, n) = focal * r2 * pr;
+        ArrayRef(row + 8 * stride, n) = focal * r2.square() * pr;
+    }
+}
+
+/**
+ * Observations of a BALProblem regrouped by camera, structure of arrays.
+ *
+ * Observation k of camera c is observation order()[offset(c) + k] of the
+ * problem. The observed pixels never change, the point coordinates are
+ * gathered again by Evaluate() from the current parameters, those of the
+ * problem or any other array of the same layout (e.g. a trial step).
+ */
+class ObservationBlocks {
+public:
+    explicit ObservationBlocks(const BALProblem &problem)
+            : num_cameras_(problem.num_cameras()), camera_block_size_(problem.camera_block_size()),
+              offsets_(problem.num_cameras() + 1, 0),
+              order_(problem.num_observations()), position_(problem.num_observations()),
+              point_index_(problem.num_observations()),
+              u_(problem.num_observations()), v_(problem.num_observations()),
+              x_(problem.num_observations()), y_(problem.num_observations()),
+              z_(problem.num_observations()),
+              ru_(problem.num_observations()), rv_(problem.num_observations()) {
+        // counting sort by camera, stable so file order is kept inside a block
+        const int *camera_index = problem.camera_index();
+        for (int i = 0; i < problem.num_observations(); ++i) {
+            ++offsets_[camera_index[i] + 1];
+        }
+        for (int c = 0; c < num_cameras_; ++c) {
+            offsets_[c + 1] += offsets_[c];
+        }
+        std::vector<int> next(offsets_.begin(), offsets_.end() - 1);
+        const double *observations = problem.observations();
+        for (int i = 0; i < problem.num_observations(); ++i) {
+            const int k = next[camera_index[i]]++;
+            order_[k] = i;
+            position_[i] = k;
+            point_index_[k] = problem.point_index()[i];
+            u_[k] = observations[2 * i + 0];
+            v_[k] = observations[2 * i + 1];
+        }
+    }
+
+    int num_cameras() const {  return num_cameras_;  }
+
+    int offset(int camera) const {  return offsets_[camera];  }
+
+    int size(int camera) const {  return offsets_[camera + 1] - offsets_[camera];  }
+
+    const std::vector<int> &order() const {  return order_;  }
+
+    // block order index of observation i of the problem
+    int position(int i) const {  return position_[i];  }
+
+    // residuals (in block order) at the current parameters of problem
+    void Evaluate(const BALProblem &problem) {
+        for (int c = 0; c < num_cameras_; ++c) {
+            EvaluateCamera(problem, c);
+        }
+    }
+
+    void EvaluateCamera(const BALProblem &problem, int c) {
+        EvaluateCamera(problem.cameras(), problem.points(), c, false);
+    }
+
+    /**
+     * Residuals of camera c at the parameters cameras, points (laid out as
+     * those of the problem), with jacobians also the Jacobians of
+     * ProjectBatchJacobians, angle-axis cameras only.
+     */
+    void EvaluateCamera(const double *cameras, const double *points, int c, bool jacobians) {
+        const int begin = offsets_[c];
+        const int n = offsets_[c + 1] - begin;
+        if (n == 0) return;
+
+        for (int k = begin; k < begin + n; ++k) {
+            const double *point = points + 3 * point_index_[k];
+            x_[k] = point[0];
+            y_[k] = point[1];
+            z_[k] = point[2];
+        }
+
+        // [rotation, t(3), f, k1, k2], rotation is angle-axis or quaternion
+        const double *camera = cameras + camera_block_size_ * c;
+        const double *t = camera + camera_block_size_ - 6;
+        double R[9];
+        if (camera_block_size_ == 10) {
+            QuaternionToRotationMatrix(camera, R);
+        } else {
+            AngleAxisToRotationMatrix(camera, R);
+        }
+
+        if (jacobians) {
+            double Jl[9];
+            AngleAxisLeftJacobian(camera, Jl);
+            ProjectBatchJacobians(R, Jl, t, t + 3, n,
+                                  &x_[begin], &y_[begin], &z_[begin], &u_[begin], &v_[begin],
+                                  &ru_[begin], &rv_[begin], &jacobians_[begin], static_cast<int>(order_.size()));
+            return;
+        }
+        ProjectBatch(R, t, t + 3, n,
+                     &x_[begin], &y_[begin], &z_[begin], &u_[begin], &v_[begin],
+                     &ru_[begin], &rv_[begin]);
+    }
+
+    // storage of the Jacobians, before the first EvaluateCamera() with jacobians
+    void AllocateJacobians() {
+        jacobians_.resize(kNumJacobianEntries * order_.size());
+    }
+
+    // residuals of the last Evaluate(), block order
+    const double *residuals_u() const {  return ru_.data();  }
+
+    const double *residuals_v() const {  return rv_.data();  }
+
+    // entry e (see ProjectBatchJacobians) of the Jacobians of the last evaluation with jacobians, block order
+    const double *jacobian(int e) const {  return jacobians_.data() + e * order_.size();  }
+
+    // squared reprojection error of observation i of the problem
+    void SquaredErrors(std::vector<double> *squared_errors) const {
+        squared_errors->resize(order_.size());
+        for (size_t k = 0; k < order_.size(); ++k) {
+            (*squared_errors)[order_[k]] = ru_[k] * ru_[k] + rv_[k] * rv_[k];
+        }
+    }
+
+    // sqrt(mean(|e|^2)) of the last Evaluate()
+    double RMS() const {
+        if (order_.empty()) return 0.0;
+        const double sum = ConstArrayRef(ru_.data(), ru_.size()).square().sum() +
+                           ConstArrayRef(rv_.data(), rv_.size()).square().sum();
+        return std::sqrt(sum / order_.size());
+    }
+
+private:
+    int num_cameras_;
+    int camera_block_size_;
+    std::vector<int> offsets_;
+    std::vector<int> order_;
+    std::vector<int> position_;
+    std::vector<int> point_index_; // block order
+    std::vector<double> u_, v_;
+    std::vector<double> x_, y_, z_;
+    std::vector<double> ru_, rv_;
+    std::vector<double> jacobians_; // kNumJacobianEntries arrays of the observations, block order
+};
+
+// RMS reprojection error in pixels at the current parameters
+inline double RMSReprojectionError(const BALProblem &problem) {
+    ObservationBlocks blocks(problem);
+    blocks.Evaluate(problem);
+    return blocks.RMS();
+}
+
+#endif // PROJECTION_KERNEL_H
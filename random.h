@@ -3,6 +3,9 @@
 
 #include <math.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <algorithm>
+#include <Eigen/Core>
 
 /**
  * rand()
@@ -28,4 +31,61 @@ inline double RandNormal() {
     return x1 * w;
 }
 
+/**
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3"),
+ * a counter based generator: out is a function of (counter, key) only, so any
+ * thread can draw number i of a stream without the numbers before it.
+ */
+inline void Philox4x32(const uint32_t counter[4], const uint32_t key[2], uint32_t out[4]) {
+    uint32_t x[4] = {counter[0], counter[1], counter[2], counter[3]};
+    uint32_t k[2] = {key[0], key[1]};
+    for (int round = 0; round < 10; ++round) {
+        const uint64_t p0 = static_cast<uint64_t>(0xD2511F53u) * x[0];
+        const uint64_t p1 = static_cast<uint64_t>(0xCD9E8D57u) * x[2];
+        const uint32_t y[4] = {static_cast<uint32_t>(p1 >> 32) ^ x[1] ^ k[0], static_cast<uint32_t>(p1),
+                               static_cast<uint32_t>(p0 >> 32) ^ x[3] ^ k[1], static_cast<uint32_t>(p0)};
+        std::copy(y, y + 4, x);
+        k[0] += 0x9E3779B9u;
+        k[1] += 0xBB67AE85u;
+    }
+    std::copy(x, x + 4, out);
+}
+
+/**
+ * Normal numbers [first, first + n) of stream of seed into out. Number pairs
+ * (2m, 2m + 1) are one Box-Muller transform of Philox(counter m), done on
+ * Eigen arrays of 256 pairs so that log / sqrt / sin / cos vectorize. The
+ * arrays are aligned to multiples of 256 pairs and always full, so every
+ * number goes down the same (SIMD or scalar) path and the values do not
+ * depend on how a range is split, e.g. between threads.
+ */
+inline void CounterNormals(uint64_t seed, uint32_t stream, int64_t first, int64_t n, double *out) {
+    const int block = 256; // pairs
+    const uint32_t key[2] = {static_cast<uint32_t>(seed), static_cast<uint32_t>(seed >> 32)};
+    Eigen::Array<double, block, 1> u1, u2;
+    const int64_t end = first + n;
+    for (int64_t pair = first / 2 / block * block; 2 * pair < end; pair += block) {
+        for (int m = 0; m < block; ++m) {
+            const uint64_t c = static_cast<uint64_t>(pair + m);
+            const uint32_t counter[4] = {static_cast<uint32_t>(c), static_cast<uint32_t>(c >> 32), stream, 0};
+            uint32_t bits[4];
+            Philox4x32(counter, key, bits);
+            // 53 bit uniforms, u1 in (0, 1] for the log, u2 in [0, 1)
+            const uint64_t b1 = (static_cast<uint64_t>(bits[0]) << 21) ^ (bits[1] >> 11);
+            const uint64_t b2 = (static_cast<uint64_t>(bits[2]) << 21) ^ (bits[3] >> 11);
+            u1(m) = (b1 + 1) * (1.0 / 9007199254740992.0);
+            u2(m) = b2 * (1.0 / 9007199254740992.0);
+        }
+        const Eigen::Array<double, block, 1> radius = (-2.0 * u1.log()).sqrt();
+        const Eigen::Array<double, block, 1> angle = (2.0 * M_PI) * u2;
+        const Eigen::Array<double, block, 1> normal0 = radius * angle.cos();
+        const Eigen::Array<double, block, 1> normal1 = radius * angle.sin();
+        for (int m = 0; m < block; ++m) {
+            const int64_t i = 2 * (pair + m);
+            if (i >= first && i < end) out[i - first] = normal0(m);
+            if (i + 1 >= first && i + 1 < end) out[i + 1 - first] = normal1(m);
+        }
+    }
+}
+
 #endif //RANDOM_H
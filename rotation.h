@@ -5,17 +5,24 @@
 #include <cmath>
 #include <limits>
 
+// the model below is also compiled into the device kernels of ba_cuda.cu
+#ifdef __CUDACC__
+#define BA_HOST_DEVICE __host__ __device__
+#else
+#define BA_HOST_DEVICE
+#endif
+
 // math functions needed for rotation conversion
 
 // dot production
 template<typename T>
-inline T DotProduct(const T x[3], const T y[3]) {
+BA_HOST_DEVICE inline T DotProduct(const T x[3], const T y[3]) {
     return (x[0] * y[0] + x[1] * y[1] + x[2] * y[2]);
 }
 
 // cross production
 template<typename T>
-inline void CrossProduct(const T x[3], const T y[3], T result[3]) {
+BA_HOST_DEVICE inline void CrossProduct(const T x[3], const T y[3], T result[3]) {
     result[0] = x[1] * y[2] - x[2] * y[1];
     result[1] = x[2] * y[0] - x[0] * y[2];
     result[2] = x[0] * y[1] - x[1] * y[0];
@@ -35,6 +42,8 @@ inline void AngleAxisToQuaternion(const T *angle_axis, T *quaternion) {
         const T k = sin(half_theta) / theta; // sin(theta/2) / theta
         quaternion[0] = cos(half_theta); // q0 = cos(theta/2)
         quaternion[1] = a0 * k;
+        quaternion[2] = a1 * k;
+        quaternion[3] = a2 * k;
     } else { // in case if theta_squared is zero
         const T k(0.5);
         quaternion[0] = T(1.0);
@@ -86,6 +95,68 @@ inline void QuaternionToAngleAxis(const T *quaternion, T *angle_axis) {
     }
 }
 
+// z = x * y, quaternions [q0, q1, q2, q3] with q0 = cos(theta/2) as above
+template<typename T>
+BA_HOST_DEVICE inline void QuaternionProduct(const T x[4], const T y[4], T z[4]) {
+    z[0] = x[0] * y[0] - x[1] * y[1] - x[2] * y[2] - x[3] * y[3];
+    z[1] = x[0] * y[1] + x[1] * y[0] + x[2] * y[3] - x[3] * y[2];
+    z[2] = x[0] * y[2] - x[1] * y[3] + x[2] * y[0] + x[3] * y[1];
+    z[3] = x[0] * y[3] + x[1] * y[2] - x[2] * y[1] + x[3] * y[0];
+}
+
+/**
+ * Rotate pt by the quaternion q, which need not be of unit norm, it is
+ * normalized first. No trigonometric functions and no small angle branch,
+ * unlike AngleAxisRotatePoint:
+ *
+ *   result = pt + 2 w (v x pt) + 2 v x (v x pt),  q / |q| = [w, v]
+ */
+template<typename T>
+BA_HOST_DEVICE inline void QuaternionRotatePoint(const T q[4], const T pt[3], T result[3]) {
+    const T scale = T(1.0) / sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    const T w = q[0] * scale;
+    const T v[3] = {q[1] * scale, q[2] * scale, q[3] * scale};
+
+    // uv = 2 (v x pt), result = pt + w uv + v x uv
+    T uv[3];
+    CrossProduct(v, pt, uv);
+    uv[0] += uv[0];
+    uv[1] += uv[1];
+    uv[2] += uv[2];
+    T v_cross_uv[3];
+    CrossProduct(v, uv, v_cross_uv);
+
+    result[0] = pt[0] + w * uv[0] + v_cross_uv[0];
+    result[1] = pt[1] + w * uv[1] + v_cross_uv[1];
+    result[2] = pt[2] + w * uv[2] + v_cross_uv[2];
+}
+
+// row major rotation matrix of the quaternion q, normalized first, consistent with QuaternionRotatePoint
+template<typename T>
+BA_HOST_DEVICE inline void QuaternionToRotationMatrix(const T q[4], T R[9]) {
+    const T aa = q[0] * q[0];
+    const T ab = q[0] * q[1];
+    const T ac = q[0] * q[2];
+    const T ad = q[0] * q[3];
+    const T bb = q[1] * q[1];
+    const T bc = q[1] * q[2];
+    const T bd = q[1] * q[3];
+    const T cc = q[2] * q[2];
+    const T cd = q[2] * q[3];
+    const T dd = q[3] * q[3];
+    const T scale = T(1.0) / (aa + bb + cc + dd);
+
+    R[0] = (aa + bb - cc - dd) * scale;
+    R[1] = T(2.0) * (bc - ad) * scale;
+    R[2] = T(2.0) * (ac + bd) * scale;
+    R[3] = T(2.0) * (ad + bc) * scale;
+    R[4] = (aa - bb + cc - dd) * scale;
+    R[5] = T(2.0) * (cd - ab) * scale;
+    R[6] = T(2.0) * (bd - ac) * scale;
+    R[7] = T(2.0) * (ab + cd) * scale;
+    R[8] = (aa - bb - cc + dd) * scale;
+}
+
 // Convert Axis-Angle to Rotation Matrix
 // Rodrigues's formula (P53)
 template<typename T>
@@ -162,4 +233,76 @@ inline void AngleAxisRotatePoint(const T angle_axis[3], const T pt[3], T result[
     }
 }
 
+// Convert Axis-Angle to a row major Rotation Matrix, consistent with AngleAxisRotatePoint
+template<typename T>
+BA_HOST_DEVICE inline void AngleAxisToRotationMatrix(const T angle_axis[3], T R[9]) {
+    const T theta2 = DotProduct(angle_axis, angle_axis);
+    if (theta2 > T(std::numeric_limits<double>::epsilon())) {
+        // R = cos(theta) I + (1 - cos(theta)) w w' + sin(theta) hat(w)
+        const T theta = sqrt(theta2);
+        const T wx = angle_axis[0] / theta;
+        const T wy = angle_axis[1] / theta;
+        const T wz = angle_axis[2] / theta;
+        const T costheta = cos(theta);
+        const T sintheta = sin(theta);
+        const T c1 = T(1.0) - costheta;
+
+        R[0] = costheta + wx * wx * c1;
+        R[1] = wx * wy * c1 - wz * sintheta;
+        R[2] = wy * sintheta + wx * wz * c1;
+        R[3] = wz * sintheta + wx * wy * c1;
+        R[4] = costheta + wy * wy * c1;
+        R[5] = -wx * sintheta + wy * wz * c1;
+        R[6] = -wy * sintheta + wx * wz * c1;
+        R[7] = wx * sintheta + wy * wz * c1;
+        R[8] = costheta + wz * wz * c1;
+    } else {
+        // Near zero, R = I + hat(w)
+        R[0] = T(1.0);
+        R[1] = -angle_axis[2];
+        R[2] = angle_axis[1];
+        R[3] = angle_axis[2];
+        R[4] = T(1.0);
+        R[5] = -angle_axis[0];
+        R[6] = -angle_axis[1];
+        R[7] = angle_axis[0];
+        R[8] = T(1.0);
+    }
+}
+
+/**
+ * Left Jacobian of SO(3), row major
+ * J_l(w) = I + (1 - cos(theta)) / theta^2 hat(w) + (theta - sin(theta)) / theta^3 hat(w)^2
+ *
+ * exp(w + dw) ~= exp(J_l(w) dw) exp(w), so d(R(w) p) / dw = -hat(R(w) p) J_l(w)
+ */
+template<typename T>
+BA_HOST_DEVICE inline void AngleAxisLeftJacobian(const T angle_axis[3], T J[9]) {
+    const T theta2 = DotProduct(angle_axis, angle_axis);
+    T a, b;
+    if (theta2 > T(std::numeric_limits<double>::epsilon())) {
+        const T theta = sqrt(theta2);
+        a = (T(1.0) - cos(theta)) / theta2;
+        b = (theta - sin(theta)) / (theta2 * theta);
+    } else {
+        // Taylor expansion near zero
+        a = T(0.5);
+        b = T(1.0 / 6.0);
+    }
+    const T &x = angle_axis[0];
+    const T &y = angle_axis[1];
+    const T &z = angle_axis[2];
+
+    // hat(w)^2 = w w' - theta^2 I
+    J[0] = T(1.0) + b * (x * x - theta2);
+    J[1] = -a * z + b * x * y;
+    J[2] = a * y + b * x * z;
+    J[3] = a * z + b * x * y;
+    J[4] = T(1.0) + b * (y * y - theta2);
+    J[5] = -a * x + b * y * z;
+    J[6] = -a * y + b * x * z;
+    J[7] = a * x + b * y * z;
+    J[8] = T(1.0) + b * (z * z - theta2);
+}
+
 #endif // ROTATION_H
@@ -0,0 +1,115 @@
+// the analytic Jacobians (AnalyticReprojectionError, the batched kernel) against ceres autodiff of the same residual
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <ceres/ceres.h>
+#include "SnavelyReprojectionError.h"
+#include "projection_kernel.h"
+#include "rotation.h"
+
+static const int kNumSamples = 200;
+static const double kTolerance = 1e-10; // relative to max(1, |autodiff entry|)
+
+// largest difference of the residuals and Jacobians of analytic and autodiff at camera, point
+template<int kCameraSize>
+static double MaxDifference(const ceres::CostFunction &analytic, const ceres::CostFunction &autodiff,
+                            const double *camera, const double *point) {
+    const double *parameters[2] = {camera, point};
+    double residuals[2][2];
+    double J_camera[2][2 * kCameraSize], J_point[2][2 * 3];
+    double *jacobians[2][2] = {{J_camera[0], J_point[0]}, {J_camera[1], J_point[1]}};
+    if (!analytic.Evaluate(parameters, residuals[0], jacobians[0]) ||
+        !autodiff.Evaluate(parameters, residuals[1], jacobians[1])) {
+        return HUGE_VAL;
+    }
+    double difference = 0;
+    for (int i = 0; i < 2; ++i) {
+        difference = std::max(difference, std::abs(residuals[0][i] - residuals[1][i]) /
+                                          std::max(1.0, std::abs(residuals[1][i])));
+    }
+    for (int i = 0; i < 2 * kCameraSize; ++i) {
+        difference = std::max(difference, std::abs(J_camera[0][i] - J_camera[1][i]) /
+                                          std::max(1.0, std::abs(J_camera[1][i])));
+    }
+    for (int i = 0; i < 2 * 3; ++i) {
+        difference = std::max(difference, std::abs(J_point[0][i] - J_point[1][i]) /
+                                          std::max(1.0, std::abs(J_point[1][i])));
+    }
+    return difference;
+}
+
+// the same for ProjectBatchJacobians, one observation of an angle-axis camera
+static double MaxBatchDifference(const ceres::CostFunction &autodiff, const double *camera, const double *point,
+                                 double observed_x, double observed_y) {
+    const double *parameters[2] = {camera, point};
+    double residuals[2], J_camera[2 * 9], J_point[2 * 3];
+    double *jacobians[2] = {J_camera, J_point};
+    if (!autodiff.Evaluate(parameters, residuals, jacobians)) {
+        return HUGE_VAL;
+    }
+    double R[9], Jl[9];
+    AngleAxisToRotationMatrix(camera, R);
+    AngleAxisLeftJacobian(camera, Jl);
+    double ru, rv, J[kNumJacobianEntries];
+    ProjectBatchJacobians(R, Jl, camera + 3, camera + 6, 1, point, point + 1, point + 2, &observed_x, &observed_y,
+                          &ru, &rv, J, 1);
+    const double batch_residuals[2] = {ru, rv};
+    double difference = 0;
+    for (int i = 0; i < 2; ++i) {
+        difference = std::max(difference, std::abs(batch_residuals[i] - residuals[i]) /
+                                          std::max(1.0, std::abs(residuals[i])));
+    }
+    for (int e = 0; e < kNumJacobianEntries; ++e) {
+        const double expected = e < 18 ? J_camera[e] : J_point[e - 18];
+        difference = std::max(difference, std::abs(J[e] - expected) / std::max(1.0, std::abs(expected)));
+    }
+    return difference;
+}
+
+int main() {
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    double worst[3] = {0, 0, 0}; // angle axis, quaternion, batched angle axis
+    for (int sample = 0; sample < kNumSamples; ++sample) {
+        // a BAL camera [angle_axis(3), t(3), f, k1, k2] looking down -z at a point in front of it, every tenth
+        // with a rotation in the small angle branch, whose first order rotation differs by about f |w| |X|
+        double camera[9], point[3];
+        const double angle = sample % 10 == 0 ? 1e-14 : 0.5;
+        for (int k = 0; k < 3; ++k) {
+            camera[k] = angle * uniform(rng);
+            camera[3 + k] = 0.5 * uniform(rng);
+            point[k] = uniform(rng);
+        }
+        camera[5] -= 5.0;
+        camera[6] = 500.0 + 100.0 * uniform(rng);
+        camera[7] = 0.1 * uniform(rng);
+        camera[8] = 0.01 * uniform(rng);
+        const double observed_x = 10.0 * uniform(rng), observed_y = 10.0 * uniform(rng);
+
+        AnalyticSnavelyReprojectionError analytic(observed_x, observed_y);
+        ceres::AutoDiffCostFunction<SnavelyReprojectionError, 2, 9, 3> autodiff(
+                new SnavelyReprojectionError(observed_x, observed_y));
+        worst[0] = std::max(worst[0], MaxDifference<9>(analytic, autodiff, camera, point));
+        worst[2] = std::max(worst[2], MaxBatchDifference(autodiff, camera, point, observed_x, observed_y));
+
+        // the same camera as [q(4), t(3), f, k1, k2]
+        double quaternion_camera[10];
+        AngleAxisToQuaternion(camera, quaternion_camera);
+        std::copy(camera + 3, camera + 9, quaternion_camera + 4);
+        AnalyticQuaternionReprojectionError quaternion_analytic(observed_x, observed_y);
+        AutoDiffQuaternionCostFunction quaternion_autodiff(
+                new SnavelyQuaternionReprojectionError(observed_x, observed_y));
+        worst[1] = std::max(worst[1], MaxDifference<10>(quaternion_analytic, quaternion_autodiff,
+                                                        quaternion_camera, point));
+    }
+
+    printf("analytic - autodiff, largest relative difference: angle axis %g, quaternion %g, batched %g\n",
+           worst[0], worst[1], worst[2]);
+    if (!(worst[0] <= kTolerance && worst[1] <= kTolerance && worst[2] <= kTolerance)) {
+        fprintf(stderr, "Error: the analytic Jacobians differ from autodiff by more than %g\n", kTolerance);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+// BASession solves after MarginalizeCamera with every Schur type linear solver
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+#include <ceres/ceres.h>
+#include "ba_session.h"
+#include "rotation.h"
+
+static const int kNumCameras = 6;
+static const int kNumPoints = 100;
+
+// the BAL projection of point by camera, as SnavelyReprojectionError
+static void Project(const double *camera, const double *point, double *x, double *y) {
+    double p[3];
+    AngleAxisRotatePoint(camera, point, p);
+    p[0] += camera[3];
+    p[1] += camera[4];
+    p[2] += camera[5];
+    const double xp = -p[0] / p[2], yp = -p[1] / p[2];
+    const double r2 = xp * xp + yp * yp;
+    const double distortion = 1.0 + r2 * (camera[7] + camera[8] * r2);
+    *x = camera[6] * distortion * xp;
+    *y = camera[6] * distortion * yp;
+}
+
+struct Scene {
+    std::vector<double> cameras; // 9 per camera
+    std::vector<double> points; // 3 per point
+};
+
+// cameras looking down -z at points in front of them, every camera sees every point
+static Scene MakeScene(std::mt19937 *rng, int num_cameras, int num_points) {
+    std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+    Scene scene;
+    for (int i = 0; i < num_cameras; ++i) {
+        const double camera[9] = {0.1 * uniform(*rng), 0.1 * uniform(*rng), 0.1 * uniform(*rng),
+                                  0.5 * uniform(*rng), 0.5 * uniform(*rng), -5.0 + 0.5 * uniform(*rng),
+                                  500.0, 0.0, 0.0};
+        scene.cameras.insert(scene.cameras.end(), camera, camera + 9);
+    }
+    for (int j = 0; j < 3 * num_points; ++j) {
+        scene.points.push_back(uniform(*rng));
+    }
+    return scene;
+}
+
+// camera i of scene, perturbed by sigma in rotation and translation, observing the first num_observed points
+static int AddCamera(BASession *session, const Scene &scene, int i, const std::vector<int> &point_ids,
+                     int num_observed, std::mt19937 *rng, double sigma) {
+    std::normal_distribution<double> normal(0.0, 1.0);
+    double camera[9];
+    for (int k = 0; k < 9; ++k) {
+        camera[k] = scene.cameras[9 * i + k] + (k < 6 ? sigma * normal(*rng) : 0.0);
+    }
+    const int camera_id = session->AddCamera(camera);
+    for (int j = 0; j < num_observed; ++j) {
+        double x, y;
+        Project(&scene.cameras[9 * i], &scene.points[3 * j], &x, &y);
+        session->AddObservation(camera_id, point_ids[j], x, y);
+    }
+    return camera_id;
+}
+
+// false if the solve failed or did not lower the cost
+static bool SolveLowersCost(BASession *session, const std::string &linear_solver, const char *step) {
+    SolveStats stats;
+    const bool ok = session->Solve(&stats);
+    printf("%s, %s: cost %g -> %g\n", linear_solver.c_str(), step, stats.initial_cost, stats.final_cost);
+    if (!ok || !(stats.final_cost < stats.initial_cost)) {
+        fprintf(stderr, "Error: %s solve %s %s\n", linear_solver.c_str(), step,
+                ok ? "did not lower the cost" : "failed");
+        return false;
+    }
+    return true;
+}
+
+static bool TestMarginalization(const std::string &linear_solver) {
+    std::mt19937 rng(1);
+    const Scene scene = MakeScene(&rng, kNumCameras + 1, kNumPoints);
+    BAOptions ba_options;
+    ba_options.linear_solver = linear_solver;
+    ba_options.num_threads = 1;
+    ba_options.verbose = false;
+    BASession session(ba_options);
+
+    std::normal_distribution<double> normal(0.0, 0.05);
+    std::vector<int> point_ids;
+    for (int j = 0; j < kNumPoints; ++j) {
+        const double point[3] = {scene.points[3 * j] + normal(rng), scene.points[3 * j + 1] + normal(rng),
+                                 scene.points[3 * j + 2] + normal(rng)};
+        point_ids.push_back(session.AddPoint(point));
+    }
+    // cameras 0 and 2 see the first half of the points, which their priors couple
+    for (int i = 0; i < kNumCameras; ++i) {
+        AddCamera(&session, scene, i, point_ids, i == 0 || i == 2 ? kNumPoints / 2 : kNumPoints, &rng,
+                  i == 1 ? 0.0 : 0.01);
+    }
+    session.SetCameraConstant(1, true); // the gauge
+
+    session.MarginalizeCamera(0);
+    if (!SolveLowersCost(&session, linear_solver, "after the first marginalization")) {
+        return false;
+    }
+    AddCamera(&session, scene, kNumCameras, point_ids, kNumPoints, &rng, 0.01);
+    session.MarginalizeCamera(2);
+    return SolveLowersCost(&session, linear_solver, "after the second marginalization");
+}
+
+int main() {
+    const char *linear_solvers[] = {"SPARSE_SCHUR", "DENSE_SCHUR", "ITERATIVE_SCHUR"};
+    bool ok = true;
+    for (int i = 0; i < 3; ++i) {
+        ok = TestMarginalization(linear_solvers[i]) && ok;
+    }
+    return ok ? 0 : 1;
+}